@@ -0,0 +1,253 @@
+/*
+ * Copyright 2008 Evenflow, Inc.
+ *
+ * dropbox-client-util-benchmark.c
+ * Times the reply parsers against each other.
+ *
+ * This file is part of nemo-dropbox.
+ *
+ * nemo-dropbox is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * nemo-dropbox is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with nemo-dropbox.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <string.h>
+#include <unistd.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include "dropbox-client-util.h"
+
+/*
+  dropbox-client-util-benchmark [--replies 2000] [--paths 64] [--runs 5]
+
+  writes the answers to that many get_emblems batches to a temporary
+  file and reads them back, once line by line through a GIOChannel into
+  a hash table like the client used to, once through
+  DropboxClientUtilStream, looking up every path in both cases.
+  built with -Dbenchmarks=true, not installed
+*/
+
+static gint num_replies = 2000;
+static gint num_paths = 64;
+static gint runs = 5;
+
+static GOptionEntry entries[] = {
+  { "replies", 0, 0, G_OPTION_ARG_INT, &num_replies, "Write N replies, 2000 by default", "N" },
+  { "paths", 0, 0, G_OPTION_ARG_INT, &num_paths, "Answer N paths in every reply, 64 by default", "N" },
+  { "runs", 0, 0, G_OPTION_ARG_INT, &runs, "Read everything N times and keep the fastest, 5 by default", "N" },
+  { NULL }
+};
+
+static gchar **
+make_paths(void) {
+  gchar **paths = g_new(gchar *, num_paths + 1);
+  gint i;
+
+  /* one name in eight needs escaping */
+  for (i = 0; i < num_paths; i++) {
+    paths[i] = g_strdup_printf(i % 8 == 0
+			       ? "/home/user/Dropbox/Camera Uploads/IMG\t%04d.jpg"
+			       : "/home/user/Dropbox/Camera Uploads/IMG_%04d.jpg",
+			       i);
+  }
+  paths[i] = NULL;
+
+  return paths;
+}
+
+static gboolean
+write_replies(int fd, gchar **paths, gsize *size) {
+  GString *reply = g_string_new("ok\n");
+  gboolean ret = TRUE;
+  gint i;
+
+  for (i = 0; paths[i] != NULL; i++) {
+    gchar *sanitized = dropbox_client_util_sanitize(paths[i]);
+    g_string_append_printf(reply, "%s\t%s\n", sanitized,
+			   i % 4 == 0 ? "syncing\tshared" : "up to date");
+    g_free(sanitized);
+  }
+  g_string_append(reply, "done\n");
+
+  *size = reply->len * num_replies;
+
+  for (i = 0; i < num_replies && ret; i++) {
+    ret = write(fd, reply->str, reply->len) == (gssize) reply->len;
+  }
+
+  g_string_free(reply, TRUE);
+
+  return ret;
+}
+
+/* the number of paths found, or -1 if the replies didn't parse */
+static gint
+read_with_channel(int fd, gchar **paths) {
+  GIOChannel *chan;
+  gint found = 0, r, i;
+
+  lseek(fd, 0, SEEK_SET);
+  chan = g_io_channel_unix_new(fd);
+
+  for (r = 0; r < num_replies && found >= 0; r++) {
+    GHashTable *table;
+    gchar *line;
+    gsize term_pos;
+
+    if (g_io_channel_read_line(chan, &line, NULL, &term_pos, NULL) != G_IO_STATUS_NORMAL) {
+      found = -1;
+      break;
+    }
+    g_free(line);
+
+    table = g_hash_table_new_full((GHashFunc) g_str_hash,
+				  (GEqualFunc) g_str_equal,
+				  (GDestroyNotify) g_free,
+				  (GDestroyNotify) g_strfreev);
+
+    while (1) {
+      if (g_io_channel_read_line(chan, &line, NULL, &term_pos, NULL) != G_IO_STATUS_NORMAL) {
+	found = -1;
+	break;
+      }
+
+      line[term_pos] = '\0';
+
+      if (strcmp(line, "done") == 0) {
+	g_free(line);
+	break;
+      }
+
+      if (!dropbox_client_util_command_parse_arg(line, table)) {
+	found = -1;
+      }
+      g_free(line);
+    }
+
+    for (i = 0; paths[i] != NULL && found >= 0; i++) {
+      if (g_hash_table_lookup(table, paths[i]) != NULL) {
+	found++;
+      }
+    }
+
+    g_hash_table_destroy(table);
+  }
+
+  g_io_channel_unref(chan);
+
+  return found;
+}
+
+static gint
+read_with_stream(int fd, gchar **paths) {
+  DropboxClientUtilStream stream;
+  gint found = 0, r, i;
+
+  lseek(fd, 0, SEEK_SET);
+  dropbox_client_util_stream_init(&stream, fd);
+
+  for (r = 0; r < num_replies; r++) {
+    gboolean ok;
+
+    if (!dropbox_client_util_stream_read_response(&stream, num_paths + 20, &ok, NULL) ||
+	!ok) {
+      found = -1;
+      break;
+    }
+
+    for (i = 0; paths[i] != NULL; i++) {
+      if (dropbox_client_util_stream_lookup(&stream, paths[i]) != NULL) {
+	found++;
+      }
+    }
+  }
+
+  dropbox_client_util_stream_clear(&stream);
+
+  return found;
+}
+
+static void
+run_parser(const gchar *name, gint (*read_replies)(int, gchar **),
+	   int fd, gchar **paths, gsize size) {
+  gint64 best = G_MAXINT64;
+  gint i;
+
+  for (i = 0; i < runs; i++) {
+    gint64 start = g_get_monotonic_time();
+
+    if (read_replies(fd, paths) != num_replies * num_paths) {
+      g_printerr("%s: the replies didn't parse\n", name);
+      return;
+    }
+
+    best = MIN(best, g_get_monotonic_time() - start);
+  }
+
+  g_print("%-8s %10.1f %10.1f %12.2f\n", name,
+	  best / 1000.0,
+	  size / (best / (gdouble) G_USEC_PER_SEC) / (1024 * 1024),
+	  best / (gdouble) num_replies);
+}
+
+int
+main(int argc, char *argv[]) {
+  GOptionContext *context;
+  GError *error = NULL;
+  gchar **paths, *tmp_path;
+  gsize size;
+  int fd;
+
+  context = g_option_context_new("- compare the dropbox reply parsers");
+  g_option_context_add_main_entries(context, entries, NULL);
+
+  if (!g_option_context_parse(context, &argc, &argv, &error)) {
+    g_printerr("%s\n", error->message);
+    return 2;
+  }
+
+  if (num_replies < 1 || num_paths < 1 || runs < 1) {
+    g_printerr("%s", g_option_context_get_help(context, TRUE, NULL));
+    return 2;
+  }
+
+  fd = g_file_open_tmp("dropbox-client-util-benchmark-XXXXXX", &tmp_path, &error);
+  if (fd < 0) {
+    g_printerr("%s\n", error->message);
+    return 1;
+  }
+  g_unlink(tmp_path);
+  g_free(tmp_path);
+
+  paths = make_paths();
+
+  if (!write_replies(fd, paths, &size)) {
+    g_printerr("can't write the replies\n");
+    return 1;
+  }
+
+  g_print("%d replies of %d paths, %.1f MiB\n",
+	  num_replies, num_paths, size / (1024.0 * 1024));
+  g_print("%-8s %10s %10s %12s\n", "parser", "ms", "MiB/s", "us/reply");
+
+  run_parser("channel", read_with_channel, fd, paths, size);
+  run_parser("stream", read_with_stream, fd, paths, size);
+
+  close(fd);
+  g_strfreev(paths);
+  g_option_context_free(context);
+
+  return 0;
+}
@@ -21,8 +21,29 @@
  *
  */
 
+#include <errno.h>
+#include <unistd.h>
+#include <string.h>
+
 #include <glib.h>
 
+#include "dropbox-client-util.h"
+
+#define STREAM_BUFFER_SIZE 4096
+#define STREAM_ARENA_BLOCK_SIZE 16384
+/* nobody sends us lines this long, unless they are up to something */
+#define STREAM_MAX_LINE (1024 * 1024)
+/* replies with more args than this are looked up through a hash table,
+   batch replies are looked up once for every path they answer */
+#define STREAM_INDEX_MIN_ARGS 32
+
+struct _DropboxClientUtilArenaBlock {
+  DropboxClientUtilArenaBlock *next;
+  gsize size;
+  gsize used;
+  gchar data[];
+};
+
 static gchar chars_not_to_escape[] = {
   1, 2, 3, 4, 5, 6, 7, 8, 11, 12,
   13, 14, 15, 16, 17, 18, 19, 20, 21, 22,
@@ -89,3 +110,425 @@ dropbox_client_util_command_parse_arg(const gchar *line, GHashTable *return_tabl
   return retval;
 }
 
+
+void
+dropbox_client_util_stream_init(DropboxClientUtilStream *stream, int fd) {
+  stream->fd = fd;
+  stream->rbuf_size = STREAM_BUFFER_SIZE;
+  stream->rbuf = g_malloc(stream->rbuf_size);
+  stream->rstart = stream->rend = 0;
+  stream->wbuf_size = STREAM_BUFFER_SIZE;
+  stream->wbuf = g_malloc(stream->wbuf_size);
+  stream->wlen = 0;
+  stream->wtotal = 0;
+  stream->blocks = stream->cur = NULL;
+  stream->args = NULL;
+  stream->numargs = stream->args_size = 0;
+  stream->index = NULL;
+  stream->indexed = FALSE;
+}
+
+/* frees the buffers, the fd belongs to the caller */
+void
+dropbox_client_util_stream_clear(DropboxClientUtilStream *stream) {
+  DropboxClientUtilArenaBlock *block, *next;
+
+  for (block = stream->blocks; block != NULL; block = next) {
+    next = block->next;
+    g_free(block);
+  }
+
+  g_free(stream->rbuf);
+  g_free(stream->wbuf);
+  g_free(stream->args);
+  if (stream->index != NULL) {
+    g_hash_table_destroy(stream->index);
+  }
+  stream->index = NULL;
+  stream->rbuf = stream->wbuf = NULL;
+  stream->args = NULL;
+  stream->blocks = stream->cur = NULL;
+  stream->fd = -1;
+}
+
+/* blocks are kept around across replies, so this only
+   allocates until the arena has grown to the biggest reply */
+static gpointer
+arena_alloc(DropboxClientUtilStream *stream, gsize size) {
+  size = (size + 7) & ~((gsize) 7);
+
+  while (1) {
+    DropboxClientUtilArenaBlock *block = stream->cur;
+
+    if (block != NULL && block->used + size <= block->size) {
+      gpointer ret = block->data + block->used;
+      block->used += size;
+      return ret;
+    }
+
+    if (block != NULL && block->next != NULL && block->next->size >= size) {
+      stream->cur = block->next;
+      stream->cur->used = 0;
+      continue;
+    }
+
+    {
+      DropboxClientUtilArenaBlock *nb;
+      gsize nb_size = MAX(size, STREAM_ARENA_BLOCK_SIZE);
+
+      nb = g_malloc(sizeof(DropboxClientUtilArenaBlock) + nb_size);
+      nb->size = nb_size;
+      nb->used = 0;
+      if (block == NULL) {
+	nb->next = NULL;
+	stream->blocks = nb;
+      }
+      else {
+	nb->next = block->next;
+	block->next = nb;
+      }
+      stream->cur = nb;
+    }
+  }
+}
+
+static void
+arena_reset(DropboxClientUtilStream *stream) {
+  stream->cur = stream->blocks;
+  if (stream->cur != NULL) {
+    stream->cur->used = 0;
+  }
+  stream->numargs = 0;
+  stream->indexed = FALSE;
+}
+
+static void
+set_errno_error(GError **err, int errsv) {
+  if (errsv == EAGAIN || errsv == EWOULDBLOCK) {
+    g_set_error(err,
+		g_quark_from_static_string("dropbox command connection timed out"),
+		0,
+		"dropbox command connection timed out");
+  }
+  else {
+    g_set_error(err,
+		g_quark_from_static_string("dropbox command connection error"),
+		errsv, "%s", g_strerror(errsv));
+  }
+}
+
+gboolean
+dropbox_client_util_stream_flush(DropboxClientUtilStream *stream, GError **err) {
+  gsize off = 0;
+
+  while (off < stream->wlen) {
+    ssize_t n = write(stream->fd, stream->wbuf + off, stream->wlen - off);
+    if (n < 0) {
+      if (errno == EINTR) {
+	continue;
+      }
+      set_errno_error(err, errno);
+      return FALSE;
+    }
+    off += n;
+  }
+
+  stream->wlen = 0;
+  return TRUE;
+}
+
+gboolean
+dropbox_client_util_stream_write(DropboxClientUtilStream *stream,
+				 const gchar *data, gsize len, GError **err) {
+  while (len > 0) {
+    gsize n;
+
+    if (stream->wlen == stream->wbuf_size &&
+	!dropbox_client_util_stream_flush(stream, err)) {
+      return FALSE;
+    }
+
+    n = MIN(len, stream->wbuf_size - stream->wlen);
+    memcpy(stream->wbuf + stream->wlen, data, n);
+    stream->wlen += n;
+    stream->wtotal += n;
+    data += n;
+    len -= n;
+  }
+
+  return TRUE;
+}
+
+/* same escaping as dropbox_client_util_sanitize, straight into the buffer */
+gboolean
+dropbox_client_util_stream_write_sanitized(DropboxClientUtilStream *stream,
+					   const gchar *str, GError **err) {
+  const gchar *run = str;
+
+  for (; *str != '\0'; str++) {
+    const gchar *esc;
+
+    switch (*str) {
+    case '\\': esc = "\\\\"; break;
+    case '\n': esc = "\\n"; break;
+    case '\t': esc = "\\t"; break;
+    default: continue;
+    }
+
+    if (!dropbox_client_util_stream_write(stream, run, str - run, err) ||
+	!dropbox_client_util_stream_write(stream, esc, 2, err)) {
+      return FALSE;
+    }
+    run = str + 1;
+  }
+
+  return dropbox_client_util_stream_write(stream, run, str - run, err);
+}
+
+/* anything sitting here while we aren't waiting for a reply
+   was sent without us asking for it */
+gboolean
+dropbox_client_util_stream_has_buffered_input(DropboxClientUtilStream *stream) {
+  return stream->rend > stream->rstart;
+}
+
+/* returns a line inside the read buffer, without its terminator.
+   it is only valid until the next call */
+static gchar *
+stream_read_line(DropboxClientUtilStream *stream, gsize *len, GError **err) {
+  gsize scanned = 0;
+
+  while (1) {
+    gchar *line = stream->rbuf + stream->rstart;
+    gchar *nl = memchr(line + scanned, '\n', stream->rend - stream->rstart - scanned);
+    ssize_t n;
+
+    if (nl != NULL) {
+      *len = nl - line;
+      stream->rstart += *len + 1;
+      return line;
+    }
+    scanned = stream->rend - stream->rstart;
+
+    /* make room */
+    if (stream->rstart > 0) {
+      memmove(stream->rbuf, line, scanned);
+      stream->rstart = 0;
+      stream->rend = scanned;
+    }
+
+    if (stream->rend == stream->rbuf_size) {
+      if (stream->rbuf_size >= STREAM_MAX_LINE) {
+	g_set_error(err,
+		    g_quark_from_static_string("malicious connection"),
+		    0, "malicious connection");
+	return NULL;
+      }
+      stream->rbuf_size *= 2;
+      stream->rbuf = g_realloc(stream->rbuf, stream->rbuf_size);
+    }
+
+    n = read(stream->fd, stream->rbuf + stream->rend,
+	     stream->rbuf_size - stream->rend);
+    if (n < 0) {
+      if (errno == EINTR) {
+	continue;
+      }
+      set_errno_error(err, errno);
+      return NULL;
+    }
+    else if (n == 0) {
+      g_set_error(err,
+		  g_quark_from_static_string("dropbox command connection closed"),
+		  0,
+		  "dropbox command connection closed");
+      return NULL;
+    }
+
+    stream->rend += n;
+  }
+}
+
+/* in place version of dropbox_client_util_desanitize */
+static void
+desanitize_in_place(gchar *str) {
+  gchar *out = str;
+
+  while (*str != '\0') {
+    if (*str != '\\' || str[1] == '\0') {
+      *out++ = *str++;
+      continue;
+    }
+
+    str++;
+    switch (*str) {
+    case 'b': *out++ = '\b'; str++; break;
+    case 'f': *out++ = '\f'; str++; break;
+    case 'n': *out++ = '\n'; str++; break;
+    case 'r': *out++ = '\r'; str++; break;
+    case 't': *out++ = '\t'; str++; break;
+    case 'v': *out++ = '\v'; str++; break;
+    case '0': case '1': case '2': case '3':
+    case '4': case '5': case '6': case '7': {
+      int i, val = 0;
+      for (i = 0; i < 3 && *str >= '0' && *str <= '7'; i++, str++) {
+	val = val * 8 + (*str - '0');
+      }
+      *out++ = (gchar) val;
+    }
+      break;
+    default: *out++ = *str++; break;
+    }
+  }
+
+  *out = '\0';
+}
+
+static gboolean
+stream_parse_arg(DropboxClientUtilStream *stream, const gchar *line, gsize len) {
+  DropboxClientUtilArg *arg;
+  gchar *copy, *p;
+  guint numfields = 1, i;
+
+  for (i = 0; i < len; i++) {
+    if (line[i] == '\t') {
+      numfields++;
+    }
+  }
+
+  if (numfields < 2) {
+    return FALSE;
+  }
+
+  copy = arena_alloc(stream, len + 1);
+  memcpy(copy, line, len);
+  copy[len] = '\0';
+
+  if (stream->numargs == stream->args_size) {
+    stream->args_size = MAX(16, stream->args_size * 2);
+    stream->args = g_renew(DropboxClientUtilArg, stream->args, stream->args_size);
+  }
+  arg = &(stream->args[stream->numargs++]);
+  arg->values = arena_alloc(stream, numfields * sizeof(gchar *));
+
+  /* split on tabs */
+  arg->key = copy;
+  for (p = copy, i = 0; (p = strchr(p, '\t')) != NULL; i++) {
+    *p++ = '\0';
+    arg->values[i] = p;
+  }
+  arg->values[i] = NULL;
+
+  desanitize_in_place(arg->key);
+  for (i = 0; arg->values[i] != NULL; i++) {
+    desanitize_in_place(arg->values[i]);
+  }
+
+  return TRUE;
+}
+
+/*
+  reads one reply, everything up to "done". ok tells whether the
+  server accepted the command, only then are the arguments kept.
+  the previous reply is forgotten.
+*/
+gboolean
+dropbox_client_util_stream_read_response(DropboxClientUtilStream *stream,
+					 guint max_args, gboolean *ok,
+					 GError **err) {
+  gchar *line;
+  gsize len;
+
+  arena_reset(stream);
+
+  if ((line = stream_read_line(stream, &len, err)) == NULL) {
+    return FALSE;
+  }
+  *ok = (len == 2 && strncmp(line, "ok", 2) == 0);
+
+  while (1) {
+    if ((line = stream_read_line(stream, &len, err)) == NULL) {
+      return FALSE;
+    }
+
+    if (len == 4 && strncmp(line, "done", 4) == 0) {
+      return TRUE;
+    }
+
+    /* read errors off until we get done */
+    if (*ok == FALSE) {
+      continue;
+    }
+
+    /* if we are getting too many args, connection could be malicious */
+    if (stream->numargs >= max_args) {
+      g_set_error(err,
+		  g_quark_from_static_string("malicious connection"),
+		  0, "malicious connection");
+      return FALSE;
+    }
+
+    if (!stream_parse_arg(stream, line, len)) {
+      g_set_error(err,
+		  g_quark_from_static_string("parse error"),
+		  0, "parse error");
+      return FALSE;
+    }
+  }
+}
+
+/* the values for key in the last reply, owned by the stream */
+gchar **
+dropbox_client_util_stream_lookup(DropboxClientUtilStream *stream,
+				  const gchar *key) {
+  guint i;
+
+  if (stream->numargs > STREAM_INDEX_MIN_ARGS) {
+    if (!stream->indexed) {
+      if (stream->index == NULL) {
+	stream->index = g_hash_table_new((GHashFunc) g_str_hash,
+					 (GEqualFunc) g_str_equal);
+      }
+      else {
+	g_hash_table_remove_all(stream->index);
+      }
+
+      /* in order, so the last one wins */
+      for (i = 0; i < stream->numargs; i++) {
+	g_hash_table_insert(stream->index, stream->args[i].key,
+			    stream->args[i].values);
+      }
+      stream->indexed = TRUE;
+    }
+
+    return g_hash_table_lookup(stream->index, key);
+  }
+
+  /* the last one wins, like it would in a hash table */
+  for (i = stream->numargs; i > 0; i--) {
+    if (strcmp(stream->args[i - 1].key, key) == 0) {
+      return stream->args[i - 1].values;
+    }
+  }
+
+  return NULL;
+}
+
+/* copies the last reply into a hash table that outlives it */
+GHashTable *
+dropbox_client_util_stream_to_hash(DropboxClientUtilStream *stream) {
+  GHashTable *return_table;
+  guint i;
+
+  return_table = g_hash_table_new_full((GHashFunc) g_str_hash,
+				       (GEqualFunc) g_str_equal,
+				       (GDestroyNotify) g_free,
+				       (GDestroyNotify) g_strfreev);
+  for (i = 0; i < stream->numargs; i++) {
+    g_hash_table_insert(return_table,
+			g_strdup(stream->args[i].key),
+			g_strdupv(stream->args[i].values));
+  }
+
+  return return_table;
+}
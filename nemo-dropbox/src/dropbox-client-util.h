@@ -34,6 +34,71 @@ gchar *dropbox_client_util_desanitize(const gchar *a);
 gboolean
 dropbox_client_util_command_parse_arg(const gchar *line, GHashTable *return_table);
 
+/*
+  buffered reader/writer speaking the line protocol over a raw fd.
+  replies are unescaped in place into an arena owned by the stream,
+  so they only stay valid until the next reply is read.
+*/
+typedef struct _DropboxClientUtilArenaBlock DropboxClientUtilArenaBlock;
+
+typedef struct {
+  gchar *key;
+  gchar **values;
+} DropboxClientUtilArg;
+
+typedef struct {
+  int fd;
+  gchar *rbuf;
+  gsize rbuf_size;
+  gsize rstart;
+  gsize rend;
+  gchar *wbuf;
+  gsize wbuf_size;
+  gsize wlen;
+  /* bytes written since the stream was set up, flushed or not */
+  guint64 wtotal;
+  DropboxClientUtilArenaBlock *blocks;
+  DropboxClientUtilArenaBlock *cur;
+  DropboxClientUtilArg *args;
+  guint numargs;
+  guint args_size;
+  /* key to values for long replies, built on the first lookup */
+  GHashTable *index;
+  gboolean indexed;
+} DropboxClientUtilStream;
+
+void
+dropbox_client_util_stream_init(DropboxClientUtilStream *stream, int fd);
+
+void
+dropbox_client_util_stream_clear(DropboxClientUtilStream *stream);
+
+gboolean
+dropbox_client_util_stream_write(DropboxClientUtilStream *stream,
+				 const gchar *data, gsize len, GError **err);
+
+gboolean
+dropbox_client_util_stream_write_sanitized(DropboxClientUtilStream *stream,
+					   const gchar *str, GError **err);
+
+gboolean
+dropbox_client_util_stream_flush(DropboxClientUtilStream *stream, GError **err);
+
+gboolean
+dropbox_client_util_stream_has_buffered_input(DropboxClientUtilStream *stream);
+
+gboolean
+dropbox_client_util_stream_read_response(DropboxClientUtilStream *stream,
+					 guint max_args, gboolean *ok,
+					 GError **err);
+
+gchar **
+dropbox_client_util_stream_lookup(DropboxClientUtilStream *stream,
+				  const gchar *key);
+
+GHashTable *
+dropbox_client_util_stream_to_hash(DropboxClientUtilStream *stream);
+
 G_END_DECLS
 
 #endif
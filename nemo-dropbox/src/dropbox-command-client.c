@@ -22,13 +22,13 @@
  */
 
 #include <sys/types.h>
-#include <sys/socket.h>
-#include <sys/un.h>
+#include <sys/eventfd.h>
 #include <errno.h>
 #include <unistd.h>
-#include <fcntl.h>
+#include <poll.h>
 
 #include <stdarg.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include <glib.h>
@@ -36,11 +36,10 @@
 #include "g-util.h"
 #include "dropbox-client-util.h"
 #include "dropbox-command-client.h"
+#include "dropbox-command-connection.h"
 #include "nemo-dropbox.h"
 #include "nemo-dropbox-hooks.h"
 
-/* TODO: make this asynchronous ;) */
-
 /*
   this is a tiny hack, necessitated by the fact that
   finish_file info command is in nemo_dropbox,
@@ -64,6 +63,34 @@ typedef struct {
   GHashTable *response;
 } DropboxGeneralCommandResponse;
 
+/* a thread serving one of the client's queues over its own connection */
+struct _DropboxCommandWorker {
+  DropboxCommandClient *dcc;
+  GAsyncQueue *queue;
+  /* eventfd poked whenever queue gets a new command or a reset
+     is requested */
+  int wakeup_fd;
+  /* the priority worker owns the client's connection state and hooks */
+  gboolean priority;
+  gint generation;
+  gboolean batch_unsupported;
+  DropboxCommandConnection conn;
+};
+
+/* if we are getting more args than this, connection could be malicious */
+#define DROPBOX_COMMAND_MAX_ARGS 20
+
+/* how many commands we write before reading any of the answers */
+#define DROPBOX_COMMAND_PIPELINE_DEPTH 8
+
+/* how many bytes of commands dropbox may still owe us answers for
+   before we stop writing and read some of them. dropbox answers a
+   command once it has read all of it, and its answers are about as
+   long as the commands, so keeping this well under the socket buffers
+   means it never blocks writing answers while we block writing the
+   rest of a round */
+#define DROPBOX_COMMAND_PIPELINE_MAX_BYTES (16 * 1024)
+
 static gboolean
 on_connect(DropboxCommandClient *dcc) {
   g_hook_list_invoke(&(dcc->onconnect_hooklist), FALSE);
@@ -91,333 +118,234 @@ on_connection_attempt(ConnectionAttempt *ca) {
   return FALSE;
 }
 
-static gboolean
-receive_args_until_done(GIOChannel *chan, GHashTable *return_table,
-			GError **err) {
-  GIOStatus iostat;
-  GError *tmp_error = NULL;
-  guint numargs = 0;
-
-  while (1) {
-    gchar *line;
-    gsize term_pos;
-
-    /* if we are getting too many args, connection could be malicious */
-    if (numargs >= 20) {
-      g_set_error(err,
-		  g_quark_from_static_string("malicious connection"),
-		  0, "malicious connection");
-      return FALSE;
-    }
-    
-    /* get the string */
-    iostat = g_io_channel_read_line(chan, &line, NULL,
-				    &term_pos, &tmp_error);
-    if (iostat == G_IO_STATUS_ERROR || tmp_error != NULL) {
-      g_free(line);
-      if (tmp_error != NULL) {
-	g_propagate_error(err, tmp_error);
-      }
-      return FALSE;
-    }
-    else if (iostat == G_IO_STATUS_EOF) {
-      g_free(line);
-      g_set_error(err,
-		  g_quark_from_static_string("connection closed"),
-		  0, "connection closed");
-      return FALSE;
-    }
+typedef struct {
+  DropboxClientUtilStream *stream;
+  GError *error;
+} WriteArgsContext;
 
-    *(line+term_pos) = '\0';
+static void
+write_arg(const gchar *key, gchar **value, WriteArgsContext *ctx) {
+  int i;
 
-    if (strcmp("done", line) == 0) {
-      g_free(line);
-      break;
-    }
-    else {
-      gboolean parse_result;
+  if (ctx->error != NULL) {
+    return;
+  }
 
-      parse_result = dropbox_client_util_command_parse_arg(line, return_table);
-      g_free(line);
+  if (!dropbox_client_util_stream_write_sanitized(ctx->stream, key, &(ctx->error))) {
+    return;
+  }
 
-      if (FALSE == parse_result) {
-	g_set_error(err,
-		    g_quark_from_static_string("parse error"),
-		    0, "parse error");
-	return FALSE;
-      }
+  for (i = 0; value[i] != NULL; i++) {
+    if (!dropbox_client_util_stream_write(ctx->stream, "\t", 1, &(ctx->error)) ||
+	!dropbox_client_util_stream_write_sanitized(ctx->stream, value[i],
+						    &(ctx->error))) {
+      return;
     }
-    
-    numargs += 1;
   }
 
-  return TRUE;
-}
-
-static void my_g_hash_table_get_keys_helper(gpointer key,
-					    gpointer value,
-					    GList **ud) {
-  *ud = g_list_append(*ud, key);
-}
-
-static GList *my_g_hash_table_get_keys(GHashTable *ght) {
-  GList *list = NULL;
-  g_hash_table_foreach(ght, (GHFunc) 
-		       my_g_hash_table_get_keys_helper, &list);
-  return list;
+  dropbox_client_util_stream_write(ctx->stream, "\n", 1, &(ctx->error));
 }
 
 /*
-  sends a command to the dropbox server
-  returns an hash of the return values
+  writes a command for the dropbox server into the stream's buffer,
+  the caller has to flush it and read the answer with read_response_from_db
 
   in theory, this should disconnection errors
   but it doesn't matter right now, any error is a sufficient
   condition to disconnect
 */
-static GHashTable *
-send_command_to_db(GIOChannel *chan, const gchar *command_name,
-		   GHashTable *args, GError **err) {
-  GError *tmp_error = NULL;
-  GIOStatus iostat;
-  gsize bytes_trans;
-  gchar *line;
-
-  g_assert(chan != NULL);
+static gboolean
+write_command_to_db(DropboxClientUtilStream *stream, const gchar *command_name,
+		    GHashTable *args, GError **err) {
+  WriteArgsContext ctx = { stream, NULL };
+
+  g_assert(stream != NULL);
   g_assert(command_name != NULL);
-  
 
-#define WRITE_OR_DIE_SANI(s,l) {					\
-    gchar *sani_s;							\
-    sani_s = dropbox_client_util_sanitize(s);				\
-    iostat = g_io_channel_write_chars(chan, sani_s,l, &bytes_trans,	\
-				      &tmp_error);			\
-    g_free(sani_s);							\
-    if (iostat == G_IO_STATUS_ERROR ||					\
-	iostat == G_IO_STATUS_AGAIN) {					\
-      if (tmp_error != NULL) {						\
-	g_propagate_error(err, tmp_error);				\
-      }									\
-      return NULL;							\
-    }									\
-  }
-  
-#define WRITE_OR_DIE(s,l) {						\
-    iostat = g_io_channel_write_chars(chan, s,l, &bytes_trans,		\
-				      &tmp_error);			\
-    if (iostat == G_IO_STATUS_ERROR ||					\
-	iostat == G_IO_STATUS_AGAIN) {					\
-      if (tmp_error != NULL) {						\
-	g_propagate_error(err, tmp_error);				\
-      }									\
-      return NULL;							\
-    }									\
-  }
-  
   /* send command to server */
-  WRITE_OR_DIE_SANI(command_name, -1);
-  WRITE_OR_DIE("\n", -1);
-
-  if (args != NULL) {
-    GList *keys, *li;
-
-    /* oh god */
-    keys = glib_check_version(2, 14, 0)
-      ? my_g_hash_table_get_keys(args)
-      : g_hash_table_get_keys(args);
-
-    for (li = keys; li != NULL; li = g_list_next(li)) {
-      int i;
-      gchar **value;
-      
-      WRITE_OR_DIE_SANI((gchar *) li->data, -1);
-      
-      value = g_hash_table_lookup(args, li->data);
-      for (i = 0; value[i] != NULL; i++) {
-	WRITE_OR_DIE("\t", -1);
-	WRITE_OR_DIE_SANI(value[i], -1);
-      }
-      WRITE_OR_DIE("\n", -1);
+  if (dropbox_client_util_stream_write_sanitized(stream, command_name, &(ctx.error)) &&
+      dropbox_client_util_stream_write(stream, "\n", 1, &(ctx.error))) {
+    if (args != NULL) {
+      g_hash_table_foreach(args, (GHFunc) write_arg, &ctx);
     }
 
-    g_list_free(keys);
+    if (ctx.error == NULL) {
+      dropbox_client_util_stream_write(stream, "done\n", 5, &(ctx.error));
+    }
   }
 
-  WRITE_OR_DIE("done\n", -1);
+  if (ctx.error != NULL) {
+    g_propagate_error(err, ctx.error);
+    return FALSE;
+  }
 
-#undef WRITE_OR_DIE
-#undef WRITE_OR_DIE_SANI
+  return TRUE;
+}
 
-  g_io_channel_flush(chan, &tmp_error);
-  if (tmp_error != NULL) {
-    g_propagate_error(err, tmp_error);
-    return NULL;
-  }
+/*
+  reads the answer to a command written with write_command_to_db
+  returns an hash of the return values, at most max_args of them,
+  or NULL if the server refused the command or err is set
+*/
+static GHashTable *
+read_response_from_db(DropboxClientUtilStream *stream, guint max_args, GError **err) {
+  gboolean ok;
 
-  /* now we have to read the data */
-  iostat = g_io_channel_read_line(chan, &line, NULL,
-				  NULL, &tmp_error);
-  if (iostat == G_IO_STATUS_ERROR) {
-    g_assert(line == NULL);
-    g_propagate_error(err, tmp_error);
-    return NULL;
-  }
-  else if (iostat == G_IO_STATUS_AGAIN) {
-    g_assert(line == NULL);
-    g_set_error(err,
-		g_quark_from_static_string("dropbox command connection timed out"),
-		0,
-		"dropbox command connection timed out");
+  if (!dropbox_client_util_stream_read_response(stream, max_args, &ok, err)) {
     return NULL;
   }
-  else if (iostat == G_IO_STATUS_EOF) {
-    g_assert(line == NULL);
-    g_set_error(err,
-		g_quark_from_static_string("dropbox command connection closed"),
-		0,
-		"dropbox command connection closed");
+
+  return ok ? dropbox_client_util_stream_to_hash(stream) : NULL;
+}
+
+/*
+  sends a command to the dropbox server and waits for the answer
+  returns an hash of the return values, at most max_args of them
+*/
+static GHashTable *
+send_command_to_db(DropboxClientUtilStream *stream, const gchar *command_name,
+		   GHashTable *args, guint max_args, GError **err) {
+  if (!write_command_to_db(stream, command_name, args, err) ||
+      !dropbox_client_util_stream_flush(stream, err)) {
     return NULL;
   }
 
-  /* if the response was okay */
-  if (strncmp(line, "ok\n", 3) == 0) {
-    GHashTable *return_table = 
-      g_hash_table_new_full((GHashFunc) g_str_hash,
-			    (GEqualFunc) g_str_equal,
-			    (GDestroyNotify) g_free,
-			    (GDestroyNotify) g_strfreev);
-    
-    g_free(line);
-    line = NULL;
+  return read_response_from_db(stream, max_args, err);
+}
 
-    receive_args_until_done(chan, return_table, &tmp_error);
-    if (tmp_error != NULL) {
-      g_hash_table_destroy(return_table);
-      g_propagate_error(err, tmp_error);
-      return NULL;
+static gchar *
+file_info_command_get_filename(DropboxFileInfoCommand *dfic) {
+  gchar *filename = NULL;
+  gchar *filename_un, *uri;
+
+  uri = nemo_file_info_get_uri(dfic->file);
+  filename_un = uri ? g_filename_from_uri(uri, NULL, NULL): NULL;
+  g_free(uri);
+  if (filename_un) {
+    filename = g_filename_to_utf8(filename_un, -1, NULL, NULL, NULL);
+    if (filename == NULL) {
+      /* oooh, filename wasn't correctly encoded. mark as  */
+      debug("file wasn't correctly encoded %s", filename_un);
     }
-      
-    return return_table;
+    g_free(filename_un);
   }
-  /* otherwise */
-  else {
-    /* read errors off until we get done */
-    do {
-      g_free(line);
-      line = NULL;
-      
-      /* clear string */
-      iostat = g_io_channel_read_line(chan, &line, NULL,
-				      NULL, &tmp_error);
-      if (iostat == G_IO_STATUS_ERROR) {
-	g_assert(line == NULL);
-	g_propagate_error(err, tmp_error);
-	return NULL;
-      }
-      else if (iostat == G_IO_STATUS_AGAIN) {
-	g_assert(line == NULL);
-	g_set_error(err,
-		    g_quark_from_static_string("dropbox command connection timed out"),
-		    0,
-		    "dropbox command connection timed out");
-	return NULL;
-	
-      }
-      else if (iostat == G_IO_STATUS_EOF) {
-	g_assert(line == NULL);
-	g_set_error(err,
-		    g_quark_from_static_string("dropbox command connection closed"),
-		    0,
-		    "dropbox command connection closed");
-	return NULL;
-      }
-
-      /* we got our line */
-    } while (strncmp(line, "done\n", 5) != 0);
 
-    g_free(line);
-    return NULL;
-  }
+  return filename;
 }
 
+/* hands the responses over to nemo_dropbox in the glib main loop,
+   takes ownership of the response tables */
 static void
-do_file_info_command(GIOChannel *chan, DropboxFileInfoCommand *dfic, GError **gerr) {
-  /* we need to send two requests to dropbox:
-     file status, and folder_tags */
-  GError *tmp_gerr = NULL;
+queue_file_info_response(DropboxFileInfoCommand *dfic,
+			 GHashTable *file_status_response,
+			 GHashTable *folder_tag_response,
+			 GHashTable *emblems_response) {
   DropboxFileInfoCommandResponse *dficr;
-  GHashTable *file_status_response = NULL, *args, *folder_tag_response = NULL, *emblems_response = NULL;
-  gchar *filename = NULL;
 
-  {
-    gchar *filename_un, *uri;
-    uri = nemo_file_info_get_uri(dfic->file);
-    filename_un = uri ? g_filename_from_uri(uri, NULL, NULL): NULL;
-    g_free(uri);
-    if (filename_un) {
-      filename = g_filename_to_utf8(filename_un, -1, NULL, NULL, NULL);
-      g_free(filename_un);
-      if (filename == NULL) {
-        /* oooh, filename wasn't correctly encoded. mark as  */
-	debug("file wasn't correctly encoded %s", filename_un);
-      }
-    }
-  }
+  dficr = g_new0(DropboxFileInfoCommandResponse, 1);
+  dficr->dfic = dfic;
+  dficr->folder_tag_response = folder_tag_response;
+  dficr->file_status_response = file_status_response;
+  dficr->emblems_response = emblems_response;
+  g_idle_add((GSourceFunc) nemo_dropbox_finish_file_info_command, dficr);
+}
 
-  if (filename == NULL) {
-    /* We couldn't get the filename.  Just return empty. */
-    goto exit;
-  }
+static GHashTable *
+new_path_args(const gchar *key, gchar **paths) {
+  GHashTable *args;
 
   args = g_hash_table_new_full((GHashFunc) g_str_hash,
 			       (GEqualFunc) g_str_equal,
 			       (GDestroyNotify) g_free,
 			       (GDestroyNotify) g_strfreev);
+  g_hash_table_insert(args, g_strdup(key), paths);
+
+  return args;
+}
+
+static gboolean
+finish_general_command(DropboxGeneralCommandResponse *dgcr) {
+  if (dgcr->dgc->handler != NULL) {
+    dgcr->dgc->handler(dgcr->response, dgcr->dgc->handler_ud);
+  }
+  
+  if (dgcr->response != NULL) {
+    g_hash_table_unref(dgcr->response);
+  }
+
+  g_free(dgcr->dgc->command_name);
+  if (dgcr->dgc->command_args != NULL) {
+    g_hash_table_unref(dgcr->dgc->command_args);
+  }
+  g_free(dgcr->dgc);
+  g_free(dgcr);
+  
+  return FALSE;
+}
+
+static void
+end_request(DropboxCommand *dc) {
+  switch (dc->request_type) {
+  case GET_FILE_INFO: {
+    queue_file_info_response((DropboxFileInfoCommand *) dc, NULL, NULL, NULL);
+  }
+    break;
+  case GENERAL_COMMAND: {
+    DropboxGeneralCommand *dgc = (DropboxGeneralCommand *) dc;
+    DropboxGeneralCommandResponse *dgcr = g_new0(DropboxGeneralCommandResponse, 1);
+    dgcr->dgc = dgc;
+    dgcr->response = NULL;
+    finish_general_command(dgcr);
+  }
+    break;
+  default: 
+    g_assert_not_reached();
+    break;
+  }
+}
+
+static void
+end_all_requests(GAsyncQueue *queue) {
+  DropboxCommand *dc;
+
+  while ((dc = g_async_queue_try_pop(queue)) != NULL) {
+    end_request(dc);
+  }
+}
+
+/* the second half of a file info command, for when dropbox
+   didn't give us the emblems straight away */
+static void
+do_file_status_command(DropboxClientUtilStream *stream, DropboxFileInfoCommand *dfic,
+		       const gchar *filename, GError **gerr) {
+  GError *tmp_gerr = NULL;
+  GHashTable *file_status_response = NULL, *args, *folder_tag_response = NULL;
+
   {
     gchar **path_arg;
     path_arg = g_new(gchar *, 2);
     path_arg[0] = g_strdup(filename);
     path_arg[1] = NULL;
-    g_hash_table_insert(args, g_strdup("path"), path_arg);
-  }
-
-  emblems_response = send_command_to_db(chan, "get_emblems", args, NULL);
-  if (emblems_response) {
-      /* Don't need to do the other calls. */
-      g_hash_table_unref(args);
-      goto exit;
+    args = new_path_args("path", path_arg);
   }
 
   /* send status command to server */
-  file_status_response = send_command_to_db(chan, "icon_overlay_file_status",
-					    args, &tmp_gerr);
-  g_hash_table_unref(args);
-  args = NULL;
+  file_status_response = send_command_to_db(stream, "icon_overlay_file_status",
+					    args, DROPBOX_COMMAND_MAX_ARGS,
+					    &tmp_gerr);
   if (tmp_gerr != NULL) {
-    g_free(filename);
+    g_hash_table_unref(args);
     g_assert(file_status_response == NULL);
     g_propagate_error(gerr, tmp_gerr);
     return;
   }
 
   if (nemo_file_info_is_directory(dfic->file)) {
-    args = g_hash_table_new_full((GHashFunc) g_str_hash,
-				 (GEqualFunc) g_str_equal,
-				 (GDestroyNotify) g_free,
-				 (GDestroyNotify) g_strfreev);
-    {
-      gchar **paths_arg;
-      paths_arg = g_new(gchar *, 2);
-      paths_arg[0] = g_strdup(filename);
-      paths_arg[1] = NULL;
-      g_hash_table_insert(args, g_strdup("path"), paths_arg);
-    }
-    
     folder_tag_response =
-      send_command_to_db(chan, "get_folder_tag", args, &tmp_gerr);
-    g_hash_table_unref(args);
-    args = NULL;
+      send_command_to_db(stream, "get_folder_tag", args,
+			 DROPBOX_COMMAND_MAX_ARGS, &tmp_gerr);
     if (tmp_gerr != NULL) {
+      g_hash_table_unref(args);
       if (file_status_response != NULL)
 	g_hash_table_destroy(file_status_response);
       g_assert(folder_tag_response == NULL);
@@ -425,225 +353,527 @@ do_file_info_command(GIOChannel *chan, DropboxFileInfoCommand *dfic, GError **ge
       return;
     }
   }
+  g_hash_table_unref(args);
   
   /* great server responded perfectly,
      now let's get this request done,
      ...in the glib main loop */
-exit:
-  dficr = g_new0(DropboxFileInfoCommandResponse, 1);
-  dficr->dfic = dfic;
-  dficr->folder_tag_response = folder_tag_response;
-  dficr->file_status_response = file_status_response;
-  dficr->emblems_response = emblems_response;
-  g_idle_add((GSourceFunc) nemo_dropbox_finish_file_info_command, dficr);
+  queue_file_info_response(dfic, file_status_response,
+			   folder_tag_response, NULL);
+}
+
+static void
+do_file_info_command(DropboxClientUtilStream *stream, DropboxFileInfoCommand *dfic, GError **gerr) {
+  /* we need to send two requests to dropbox:
+     file status, and folder_tags */
+  GHashTable *args, *emblems_response;
+  gchar *filename;
+
+  filename = file_info_command_get_filename(dfic);
+  if (filename == NULL) {
+    /* We couldn't get the filename.  Just return empty. */
+    queue_file_info_response(dfic, NULL, NULL, NULL);
+    return;
+  }
+
+  {
+    gchar **path_arg;
+    path_arg = g_new(gchar *, 2);
+    path_arg[0] = g_strdup(filename);
+    path_arg[1] = NULL;
+    args = new_path_args("path", path_arg);
+  }
+
+  emblems_response = send_command_to_db(stream, "get_emblems", args,
+					DROPBOX_COMMAND_MAX_ARGS, NULL);
+  g_hash_table_unref(args);
+
+  if (emblems_response) {
+    /* Don't need to do the other calls. */
+    queue_file_info_response(dfic, NULL, NULL, emblems_response);
+  }
+  else {
+    do_file_status_command(stream, dfic, filename, gerr);
+  }
 
   g_free(filename);
-  
-  return;
 }
 
-static gboolean
-finish_general_command(DropboxGeneralCommandResponse *dgcr) {
-  if (dgcr->dgc->handler != NULL) {
-    dgcr->dgc->handler(dgcr->response, dgcr->dgc->handler_ud);
-  }
-  
-  if (dgcr->response != NULL) {
-    g_hash_table_unref(dgcr->response);
+/*
+  pulls more file info commands off the queue into batch, until the batch
+  is full or the flush deadline passes. any other command that shows up in
+  the meantime ends the batch and is returned so it can be run next
+*/
+static DropboxCommand *
+collect_file_info_batch(DropboxCommandWorker *worker, GPtrArray *batch) {
+  DropboxCommandClient *dcc = worker->dcc;
+  gint64 deadline;
+
+  deadline = g_get_monotonic_time() + (gint64) dcc->batch_deadline_ms * 1000;
+
+  while (batch->len < dcc->batch_size) {
+    DropboxCommand *dc;
+    gint64 remaining;
+
+    remaining = deadline - g_get_monotonic_time();
+    dc = remaining > 0
+      ? g_async_queue_timeout_pop(worker->queue, (guint64) remaining)
+      : g_async_queue_try_pop(worker->queue);
+    if (dc == NULL) {
+      break;
+    }
+
+    if (dc->request_type != GET_FILE_INFO) {
+      return dc;
+    }
+
+    g_ptr_array_add(batch, dc);
   }
 
-  g_free(dgcr->dgc->command_name);
-  if (dgcr->dgc->command_args != NULL) {
-    g_hash_table_unref(dgcr->dgc->command_args);
+  return NULL;
+}
+
+/*
+  an exchange is one command written to the socket whose answer we
+  haven't read yet: either a general command, or a get_emblems for a
+  batch of file info commands.
+
+  a batch of one uses the plain single path request. bigger batches
+  use a multi-path request:
+
+  get_emblems
+  paths\t/path/one\t/path/two
+  done
+
+  a daemon that understands those answers with one line per path,
+  the path followed by its emblems (an empty field if there are none).
+*/
+typedef struct {
+  DropboxGeneralCommand *dgc;
+  GPtrArray *batch;
+  GPtrArray *filenames;
+  /* how many bytes the command took on the wire */
+  gsize size;
+} PipelinedExchange;
+
+/* a file info command that still needs the single path exchanges */
+typedef struct {
+  DropboxFileInfoCommand *dfic;
+  gchar *filename;
+  gboolean emblems_tried;
+} DeferredFileInfo;
+
+static void
+pipelined_exchange_free(PipelinedExchange *pe) {
+  if (pe->batch != NULL) {
+    g_ptr_array_free(pe->batch, TRUE);
   }
-  g_free(dgcr->dgc);
-  g_free(dgcr);
-  
-  return FALSE;
+  if (pe->filenames != NULL) {
+    g_ptr_array_free(pe->filenames, TRUE);
+  }
+  g_free(pe);
 }
 
+/* ends every command of the exchange that hasn't been finished */
 static void
-do_general_command(GIOChannel *chan, DropboxGeneralCommand *dcac,
-		   GError **gerr) {
-  GError *tmp_gerr = NULL;
-  GHashTable *response;
+pipelined_exchange_end(PipelinedExchange *pe) {
+  if (pe->dgc != NULL) {
+    end_request((DropboxCommand *) pe->dgc);
+    pe->dgc = NULL;
+  }
+  if (pe->batch != NULL) {
+    guint i;
+    for (i = 0; i < pe->batch->len; i++) {
+      end_request(g_ptr_array_index(pe->batch, i));
+    }
+    g_ptr_array_set_size(pe->batch, 0);
+  }
+}
 
-  /* send status command to server */
-  response = send_command_to_db(chan, dcac->command_name,
-				dcac->command_args, &tmp_gerr);
-  if (tmp_gerr != NULL) {
-    g_assert(response == NULL);
-    g_propagate_error(gerr, tmp_gerr);
-    return;
+static PipelinedExchange *
+new_file_info_exchange(DropboxCommandWorker *worker, DropboxFileInfoCommand *dfic,
+		       DropboxCommand **next) {
+  PipelinedExchange *pe;
+  GPtrArray *batch;
+  guint i;
+
+  batch = g_ptr_array_sized_new(MAX(worker->dcc->batch_size, 1));
+  g_ptr_array_add(batch, dfic);
+  if (worker->dcc->batch_size > 1 && !worker->batch_unsupported) {
+    *next = collect_file_info_batch(worker, batch);
   }
 
-  /* great, the server did the command perfectly,
-     now call the handler with the response */
-  {
-    DropboxGeneralCommandResponse *dgcr = g_new0(DropboxGeneralCommandResponse, 1);
-    dgcr->dgc = dcac;
-    dgcr->response = response;
-    finish_general_command(dgcr);
+  pe = g_new0(PipelinedExchange, 1);
+  pe->batch = g_ptr_array_sized_new(batch->len);
+  pe->filenames = g_ptr_array_new_with_free_func(g_free);
+
+  for (i = 0; i < batch->len; i++) {
+    DropboxFileInfoCommand *cur = g_ptr_array_index(batch, i);
+    gchar *filename = file_info_command_get_filename(cur);
+
+    if (filename == NULL) {
+      /* We couldn't get the filename.  Just return empty. */
+      queue_file_info_response(cur, NULL, NULL, NULL);
+      continue;
+    }
+
+    g_ptr_array_add(pe->batch, cur);
+    g_ptr_array_add(pe->filenames, filename);
   }
-  
-  return;
+  g_ptr_array_free(batch, TRUE);
+
+  if (pe->batch->len == 0) {
+    pipelined_exchange_free(pe);
+    return NULL;
+  }
+
+  return pe;
 }
 
 static gboolean
-check_connection(GIOChannel *chan) {
-  gchar fake_buf[4096];
-  gsize bytes_read;
-  GError *tmp_error = NULL;
-  GIOFlags flags;
-  GIOStatus ret, iostat;
-
-  flags = g_io_channel_get_flags(chan);
-  
-  /* set non-blocking */
-  ret = g_io_channel_set_flags(chan, flags | G_IO_FLAG_NONBLOCK, NULL);
-  if (ret == G_IO_STATUS_ERROR) {
-    return FALSE;
+write_exchange(DropboxClientUtilStream *stream, PipelinedExchange *pe, GError **gerr) {
+  GHashTable *args;
+  gchar **paths;
+  gboolean ret;
+  guint64 start = stream->wtotal;
+  guint i;
+
+  if (pe->dgc != NULL) {
+    ret = write_command_to_db(stream, pe->dgc->command_name,
+			      pe->dgc->command_args, gerr);
+    pe->size = stream->wtotal - start;
+    return ret;
   }
-  
-  iostat = g_io_channel_read_chars(chan, fake_buf,
-				   sizeof(fake_buf), 
-				   &bytes_read, &tmp_error);
 
-  ret = g_io_channel_set_flags(chan, flags, NULL);
-  if (ret == G_IO_STATUS_ERROR) {
-    return FALSE;
+  paths = g_new(gchar *, pe->filenames->len + 1);
+  for (i = 0; i < pe->filenames->len; i++) {
+    paths[i] = g_strdup(g_ptr_array_index(pe->filenames, i));
   }
+  paths[i] = NULL;
+
+  args = new_path_args(pe->batch->len == 1 ? "path" : "paths", paths);
+  ret = write_command_to_db(stream, "get_emblems", args, gerr);
+  g_hash_table_unref(args);
+  pe->size = stream->wtotal - start;
 
-  /* this makes us disconnect from bad servers
-     (those that send us information without us asking for it) */
-  return iostat == G_IO_STATUS_AGAIN;
+  return ret;
 }
 
-static gpointer
-dropbox_command_client_thread(DropboxCommandClient *data);
+static guint
+exchange_max_args(PipelinedExchange *pe) {
+  return pe->batch != NULL
+    ? pe->batch->len + DROPBOX_COMMAND_MAX_ARGS
+    : DROPBOX_COMMAND_MAX_ARGS;
+}
 
 static void
-end_request(DropboxCommand *dc) {
-  if ((gpointer (*)(DropboxCommandClient *data)) dc != &dropbox_command_client_thread) {
+defer_file_info(GPtrArray *deferred, DropboxFileInfoCommand *dfic,
+		const gchar *filename, gboolean emblems_tried) {
+  DeferredFileInfo *dfi = g_new(DeferredFileInfo, 1);
+  dfi->dfic = dfic;
+  dfi->filename = g_strdup(filename);
+  dfi->emblems_tried = emblems_tried;
+  g_ptr_array_add(deferred, dfi);
+}
+
+/* hands the answer to an exchange, still sitting in the stream,
+   out to its commands. ok tells whether dropbox accepted it */
+static void
+finish_exchange(DropboxCommandWorker *worker, PipelinedExchange *pe,
+		gboolean ok, GPtrArray *deferred) {
+  DropboxClientUtilStream *stream = &(worker->conn.stream);
+  guint i;
+
+  if (pe->dgc != NULL) {
+    /* great, the server did the command perfectly,
+       now call the handler with the response */
+    DropboxGeneralCommandResponse *dgcr = g_new0(DropboxGeneralCommandResponse, 1);
+    dgcr->dgc = pe->dgc;
+    dgcr->response = ok ? dropbox_client_util_stream_to_hash(stream) : NULL;
+    finish_general_command(dgcr);
+    pe->dgc = NULL;
+    return;
+  }
+
+  if (pe->batch->len == 1) {
+    if (ok) {
+      queue_file_info_response(g_ptr_array_index(pe->batch, 0),
+			       NULL, NULL, dropbox_client_util_stream_to_hash(stream));
+    }
+    else {
+      defer_file_info(deferred, g_ptr_array_index(pe->batch, 0),
+		      g_ptr_array_index(pe->filenames, 0), TRUE);
+    }
+    g_ptr_array_set_size(pe->batch, 0);
+    return;
+  }
+
+  for (i = 0; i < pe->batch->len; i++) {
+    DropboxFileInfoCommand *dfic = g_ptr_array_index(pe->batch, i);
+    const gchar *filename = g_ptr_array_index(pe->filenames, i);
+    gchar **emblems = NULL;
+
+    if (ok &&
+	(emblems = dropbox_client_util_stream_lookup(stream, filename)) != NULL) {
+      GHashTable *emblems_response;
+
+      emblems_response = g_hash_table_new_full((GHashFunc) g_str_hash,
+					       (GEqualFunc) g_str_equal,
+					       (GDestroyNotify) g_free,
+					       (GDestroyNotify) g_strfreev);
+      g_hash_table_insert(emblems_response, g_strdup("emblems"),
+			  g_strdupv(emblems));
+      queue_file_info_response(dfic, NULL, NULL, emblems_response);
+    }
+    else {
+      defer_file_info(deferred, dfic, filename, FALSE);
+    }
+  }
+  g_ptr_array_set_size(pe->batch, 0);
+
+  /* an older daemon, stop bothering it with batches until we reconnect.
+     an accepted batch naming none of our paths only means dropbox
+     doesn't know them, new and untracked files are like that */
+  if (!ok) {
+    debug("multi-path requests unsupported, falling back to single paths");
+    worker->batch_unsupported = TRUE;
+  }
+}
+
+/* reads the answer to the oldest exchange dropbox hasn't answered yet */
+static gboolean
+read_exchange(DropboxCommandWorker *worker, PipelinedExchange *pe,
+	      GPtrArray *deferred, GError **gerr) {
+  gboolean ok;
+
+  if (!dropbox_client_util_stream_flush(&(worker->conn.stream), gerr) ||
+      !dropbox_client_util_stream_read_response(&(worker->conn.stream),
+						exchange_max_args(pe),
+						&ok, gerr)) {
+    return FALSE;
+  }
+
+  finish_exchange(worker, pe, ok, deferred);
+  return TRUE;
+}
+
+/*
+  runs one round of pipelined exchanges: pulls up to
+  DROPBOX_COMMAND_PIPELINE_DEPTH exchanges off the queue, writes them,
+  then reads the answers back in order. once the commands written but
+  not answered add up to DROPBOX_COMMAND_PIPELINE_MAX_BYTES, answers are
+  read before the next command is written. file info commands dropbox
+  couldn't answer in one go are run through the single path exchanges
+  once the pipeline has drained.
+
+  every command pulled off the queue is either completed or ended.
+  returns FALSE when the connection broke, the error is set in gerr
+*/
+static gboolean
+do_pipelined_round(DropboxCommandWorker *worker,
+		   DropboxCommand **next, GError **gerr) {
+  DropboxClientUtilStream *stream = &(worker->conn.stream);
+  GError *tmp_gerr = NULL;
+  GPtrArray *exchanges, *deferred;
+  gsize in_flight = 0;
+  guint i, done = 0;
+
+  exchanges = g_ptr_array_new();
+  deferred = g_ptr_array_new();
+
+  while (exchanges->len < DROPBOX_COMMAND_PIPELINE_DEPTH) {
+    DropboxCommand *dc;
+    PipelinedExchange *pe = NULL;
+
+    if (*next != NULL) {
+      dc = *next;
+      *next = NULL;
+    }
+    else if ((dc = g_async_queue_try_pop(worker->queue)) == NULL) {
+      break;
+    }
+
     switch (dc->request_type) {
     case GET_FILE_INFO: {
-      DropboxFileInfoCommand *dfic = (DropboxFileInfoCommand *) dc;
-      DropboxFileInfoCommandResponse *dficr = g_new0(DropboxFileInfoCommandResponse, 1);
-      dficr->dfic = dfic;
-      dficr->file_status_response = NULL;
-      dficr->emblems_response = NULL;
-      g_idle_add((GSourceFunc) nemo_dropbox_finish_file_info_command, dficr);
+      pe = new_file_info_exchange(worker, (DropboxFileInfoCommand *) dc, next);
     }
       break;
     case GENERAL_COMMAND: {
-      DropboxGeneralCommand *dgc = (DropboxGeneralCommand *) dc;
-      DropboxGeneralCommandResponse *dgcr = g_new0(DropboxGeneralCommandResponse, 1);
-      dgcr->dgc = dgc;
-      dgcr->response = NULL;
-      finish_general_command(dgcr);
+      pe = g_new0(PipelinedExchange, 1);
+      pe->dgc = (DropboxGeneralCommand *) dc;
     }
       break;
     default: 
       g_assert_not_reached();
       break;
     }
+
+    if (pe != NULL) {
+      g_ptr_array_add(exchanges, pe);
+    }
+  }
+
+  if (exchanges->len > 0) {
+    debug("pipelining %u exchanges", exchanges->len);
   }
-}
 
+  for (i = 0; i < exchanges->len && tmp_gerr == NULL; i++) {
+    PipelinedExchange *pe = g_ptr_array_index(exchanges, i);
 
-static gpointer
-dropbox_command_client_thread(DropboxCommandClient *dcc) {
-  struct sockaddr_un addr;
-  socklen_t addr_len;
-  int connection_attempts = 1;
+    while (done < i && in_flight >= DROPBOX_COMMAND_PIPELINE_MAX_BYTES &&
+	   tmp_gerr == NULL) {
+      PipelinedExchange *oldest = g_ptr_array_index(exchanges, done);
+
+      if (read_exchange(worker, oldest, deferred, &tmp_gerr)) {
+	in_flight -= oldest->size;
+	done++;
+      }
+    }
+
+    if (tmp_gerr == NULL &&
+	write_exchange(stream, pe, &tmp_gerr) == FALSE &&
+	tmp_gerr == NULL) {
+      g_set_error(&tmp_gerr,
+		  g_quark_from_static_string("dropbox command connection timed out"),
+		  0,
+		  "dropbox command connection timed out");
+    }
+
+    in_flight += pe->size;
+  }
+
+  for (; done < exchanges->len && tmp_gerr == NULL; done++) {
+    read_exchange(worker, g_ptr_array_index(exchanges, done), deferred, &tmp_gerr);
+  }
+
+  for (i = 0; i < deferred->len; i++) {
+    DeferredFileInfo *dfi = g_ptr_array_index(deferred, i);
+
+    if (tmp_gerr != NULL) {
+      /* mark this request as never to be completed */
+      end_request((DropboxCommand *) dfi->dfic);
+    }
+    else if (dfi->emblems_tried) {
+      do_file_status_command(stream, dfi->dfic, dfi->filename, &tmp_gerr);
+    }
+    else {
+      do_file_info_command(stream, dfi->dfic, &tmp_gerr);
+    }
+
+    g_free(dfi->filename);
+    g_free(dfi);
+  }
+  g_ptr_array_free(deferred, TRUE);
 
-  /* intialize address structure */
-  addr.sun_family = AF_UNIX;
-  g_snprintf(addr.sun_path,
-	     sizeof(addr.sun_path),
-	     "%s/.dropbox/command_socket",
-	     g_get_home_dir());
-  addr_len = sizeof(addr) - sizeof(addr.sun_path) + strlen(addr.sun_path);
+  for (i = 0; i < exchanges->len; i++) {
+    PipelinedExchange *pe = g_ptr_array_index(exchanges, i);
+    pipelined_exchange_end(pe);
+    pipelined_exchange_free(pe);
+  }
+  g_ptr_array_free(exchanges, TRUE);
+
+  if (tmp_gerr != NULL) {
+    g_propagate_error(gerr, tmp_gerr);
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+/*
+  sleeps until nemo queues a command or the socket needs attention.
+  returns FALSE if a reset was requested, if the server hung up on us,
+  or if it sent us information without us asking for it, which makes
+  us disconnect from bad servers
+*/
+static gboolean
+wait_for_commands(DropboxCommandWorker *worker) {
+  guint64 count;
+
+  /* anything queued from now on wakes us up */
+  if (worker->wakeup_fd >= 0 &&
+      read(worker->wakeup_fd, &count, sizeof(count)) < 0) {
+    /* nothing was queued since we last looked */
+  }
 
   while (1) {
-    GIOChannel *chan = NULL;
-    GError *gerr = NULL;
-    int sock;
-    gboolean failflag = TRUE;
+    struct pollfd fds[2];
 
-    do {
-      int flags;
+    if (g_atomic_int_get(&(worker->dcc->reset_generation)) != worker->generation) {
+      debug("got a reset request");
+      return FALSE;
+    }
 
-      if (0 > (sock = socket(PF_UNIX, SOCK_STREAM, 0))) {
-	/* WTF */
-	break;
-      }
+    /* we didn't ask for anything yet */
+    if (dropbox_client_util_stream_has_buffered_input(&(worker->conn.stream))) {
+      return FALSE;
+    }
 
-      /* set timeout on socket, to protect against
-	 bad servers */
-      {
-	struct timeval tv = {3, 0};
-	if (0 > setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO,
-			   &tv, sizeof(struct timeval)) ||
-	    0 > setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO,
-			   &tv, sizeof(struct timeval))) {
-	  /* debug("setsockopt failed"); */
-	  break;
-	}
-      }
+    if (g_async_queue_length(worker->queue) > 0) {
+      return TRUE;
+    }
 
-      /* set native non-blocking, for connect timeout */
-      {
-	if ((flags = fcntl(sock, F_GETFL, 0)) < 0 ||
-	    fcntl(sock, F_SETFL, flags | O_NONBLOCK) < 0) {
-	  /* debug("fcntl failed"); */
-	  break;
-	}
+    fds[0].fd = worker->wakeup_fd;
+    fds[0].events = POLLIN;
+    fds[0].revents = 0;
+    fds[1].fd = worker->conn.sock;
+    fds[1].events = POLLIN;
+    fds[1].revents = 0;
+
+    /* without an eventfd we can only poll the queue */
+    if (poll(fds, 2, worker->wakeup_fd >= 0 ? -1 : 100) < 0) {
+      if (errno == EINTR) {
+	continue;
       }
+      return FALSE;
+    }
 
-      /* if there was an error we have to try again later */
-      if (connect(sock, (struct sockaddr *) &addr, addr_len) < 0) {
-	if (errno == EINPROGRESS) {
-	  fd_set writers;
-	  struct timeval tv = {1, 0};
-
-	  FD_ZERO(&writers);
-	  FD_SET(sock, &writers);
-
-	  /* if nothing was ready after 3 seconds, fail out homie */
-	  if (select(sock+1, NULL, &writers, NULL, &tv) == 0) {
-	    /* debug("connection timeout"); */
-	    break;
-	  }
-
-	  if (connect(sock, (struct sockaddr *) &addr, addr_len) < 0) {
-	    /*	    debug("couldn't connect to command server after 1 second"); */
-	    break;
-	  }
-	}
-	/* errno != EINPROGRESS */
-	else {
-	  /*	  debug("bad connection"); */
-	  break;
-	}
-      }
+    if (fds[1].revents != 0) {
+      return FALSE;
+    }
 
-      /* set back to blocking */
-      if (fcntl(sock, F_SETFL, flags) < 0) {
-	/* debug("fcntl2 failed"); */
-	break;
-      }
+    if ((fds[0].revents & POLLIN) &&
+	read(worker->wakeup_fd, &count, sizeof(count)) < 0) {
+      /* spurious, just look at the queue again */
+    }
+  }
+}
 
-      failflag = FALSE;
-    } while (0);
+static void
+wake_worker(DropboxCommandWorker *worker) {
+  if (worker->wakeup_fd >= 0) {
+    guint64 one = 1;
+    if (write(worker->wakeup_fd, &one, sizeof(one)) < 0) {
+      /* the counter is full, the thread is going to wake up anyway */
+    }
+  }
+}
+
+static gpointer
+dropbox_command_client_thread(DropboxCommandWorker *worker) {
+  DropboxCommandClient *dcc = worker->dcc;
+  int connection_attempts = 1;
+
+#define SET_CONNECTED_STATE(s)     {			\
+    g_mutex_lock(dcc->command_connected_mutex);		\
+    dcc->command_connected = s;				\
+    g_mutex_unlock(dcc->command_connected_mutex);	\
+  }
 
-    if (failflag) {
-      ConnectionAttempt *ca = g_new(ConnectionAttempt, 1);
-      ca->dcc = dcc;
-      ca->connect_attempt = connection_attempts;
-      g_idle_add((GSourceFunc) on_connection_attempt, ca);
-      if (sock >= 0) {
-	close(sock);
+  while (1) {
+    GError *gerr = NULL;
+    DropboxCommand *next = NULL;
+
+    if (dropbox_command_connection_open(&(worker->conn)) == FALSE) {
+      if (worker->priority) {
+	ConnectionAttempt *ca = g_new(ConnectionAttempt, 1);
+	ca->dcc = dcc;
+	ca->connect_attempt = connection_attempts;
+	g_idle_add((GSourceFunc) on_connection_attempt, ca);
+      }
+      else if (dropbox_command_client_is_connected(dcc) == FALSE) {
+	/* nobody is going to run these any time soon */
+	end_all_requests(worker->queue);
       }
       g_usleep(G_USEC_PER_SEC);
       connection_attempts++;
@@ -656,92 +886,53 @@ dropbox_command_client_thread(DropboxCommandClient *dcc) {
     /* connected */
     debug("command client connected");
 
-    chan = g_io_channel_unix_new(sock);
-    g_io_channel_set_close_on_unref(chan, TRUE);
-    g_io_channel_set_line_term(chan, "\n", -1);
+    worker->generation = g_atomic_int_get(&(dcc->reset_generation));
 
-#define SET_CONNECTED_STATE(s)     {			\
-      g_mutex_lock(dcc->command_connected_mutex);	\
-      dcc->command_connected = s;			\
-      g_mutex_unlock(dcc->command_connected_mutex);	\
-    }
+    /* the daemon might have been upgraded while we were away */
+    worker->batch_unsupported = FALSE;
 
-    SET_CONNECTED_STATE(TRUE);
+    if (worker->priority) {
+      SET_CONNECTED_STATE(TRUE);
 
-    g_idle_add((GSourceFunc) on_connect, dcc);
+      g_idle_add((GSourceFunc) on_connect, dcc);
+    }
 
     while (1) {
-      DropboxCommand *dc;
-
-      while (1) {
-	GTimeVal gtv;
-
-	g_get_current_time(&gtv);
-	g_time_val_add(&gtv, G_USEC_PER_SEC / 10);
-	/* get a request from nemo */
-	dc = g_async_queue_timed_pop(dcc->command_queue, &gtv);
-	if (dc != NULL) {
-	  break;
-	}
-	else {
-	  if (check_connection(chan) == FALSE) {
-	    goto BADCONNECTION;
-	  }
-	}
-      }
-
-      /* this pointer should be unique */
-      if ((gpointer (*)(DropboxCommandClient *data)) dc == &dropbox_command_client_thread) {
-	debug("got a reset request");
+      /* get requests from nemo */
+      if (next == NULL && wait_for_commands(worker) == FALSE) {
 	goto BADCONNECTION;
       }
 
-      switch (dc->request_type) {
-      case GET_FILE_INFO: {
-	debug("doing file info command");
-	do_file_info_command(chan, (DropboxFileInfoCommand *) dc, &gerr);
-      }
-	break;
-      case GENERAL_COMMAND: {
-	debug("doing general command");
-	do_general_command(chan, (DropboxGeneralCommand *) dc, &gerr);
-      }
-	break;
-      default: 
-	g_assert_not_reached();
-	break;
-      }
-      
-      debug("done.");
-
-      if (gerr != NULL) {
-	//	debug("COMMAND ERROR*****************************");
-	/* mark this request as never to be completed */
-	end_request(dc);
-
+      if (do_pipelined_round(worker, &next, &gerr) == FALSE) {
 	debug("command error: %s", gerr->message);
-	
 	g_error_free(gerr);
+	gerr = NULL;
+
       BADCONNECTION:
-	/* grab all the rest of the data off the async queue and mark it
-	   never to be completed, who knows how long we'll be disconnected */
-	while ((dc = g_async_queue_try_pop(dcc->command_queue)) != NULL) {
-	  end_request(dc);
+	if (next != NULL) {
+	  end_request(next);
+	  next = NULL;
 	}
 
-	g_io_channel_unref(chan);
+	dropbox_command_connection_close(&(worker->conn));
 
-	SET_CONNECTED_STATE(FALSE);
+	if (worker->priority) {
+	  /* grab all the rest of the data off the async queue and mark it
+	     never to be completed, who knows how long we'll be disconnected */
+	  end_all_requests(worker->queue);
 
-	/* call the disconnect handler */
-	g_idle_add((GSourceFunc) on_disconnect, dcc);
+	  SET_CONNECTED_STATE(FALSE);
+
+	  /* call the disconnect handler */
+	  g_idle_add((GSourceFunc) on_disconnect, dcc);
+	}
 
 	break;
       }
     }
-    
-#undef SET_CONNECTED_STATE
   }
+
+#undef SET_CONNECTED_STATE
   
   return NULL;
 }
@@ -761,27 +952,105 @@ dropbox_command_client_is_connected(DropboxCommandClient *dcc) {
 /* thread safe */
 void dropbox_command_client_force_reconnect(DropboxCommandClient *dcc) {
   if (dropbox_command_client_is_connected(dcc) == TRUE) {
+    guint i;
+
     debug("forcing command to reconnect");
-    dropbox_command_client_request(dcc, (DropboxCommand *) &dropbox_command_client_thread);
+    g_atomic_int_inc(&(dcc->reset_generation));
+    for (i = 0; i < dcc->num_workers; i++) {
+      wake_worker(&(dcc->workers[i]));
+    }
   }
 }
 
 /* thread safe */
 void
 dropbox_command_client_request(DropboxCommandClient *dcc, DropboxCommand *dc) {
-  g_async_queue_push(dcc->command_queue, dc);
+  GAsyncQueue *queue;
+  guint i;
+
+  queue = dc->request_type == GET_FILE_INFO
+    ? dcc->command_queue
+    : dcc->priority_queue;
+
+  g_async_queue_push(queue, dc);
+
+  /* wake up whoever serves that queue, the first one
+     to get there runs the command */
+  for (i = 0; i < dcc->num_workers; i++) {
+    if (dcc->workers[i].queue == queue) {
+      wake_worker(&(dcc->workers[i]));
+    }
+  }
+}
+
+/* the value of the environment variable name if it is a number from
+   min to max, fallback otherwise */
+static guint
+env_uint(const gchar *name, guint min, guint max, guint fallback) {
+  const gchar *value = g_getenv(name);
+  guint64 n;
+
+  if (value == NULL) {
+    return fallback;
+  }
+
+  if (!g_ascii_string_to_unsigned(value, 10, min, max, &n, NULL)) {
+    g_warning("ignoring %s=%s, expected a number from %u to %u",
+	      name, value, min, max);
+    return fallback;
+  }
+
+  return (guint) n;
 }
 
 /* should only be called once on initialization */
 void
 dropbox_command_client_setup(DropboxCommandClient *dcc) {
   dcc->command_queue = g_async_queue_new();
+  dcc->priority_queue = g_async_queue_new();
   dcc->command_connected_mutex = g_mutex_new();
   dcc->command_connected = FALSE;
   dcc->ca_hooklist = NULL;
+  dcc->num_workers = 0;
+  dcc->workers = NULL;
+  dcc->reset_generation = 0;
 
   g_hook_list_init(&(dcc->ondisconnect_hooklist), sizeof(GHook));
   g_hook_list_init(&(dcc->onconnect_hooklist), sizeof(GHook));
+
+  dropbox_command_client_set_batching(dcc,
+				      env_uint("NEMO_DROPBOX_BATCH_SIZE",
+					       1, DROPBOX_COMMAND_CLIENT_MAX_BATCH_SIZE,
+					       DROPBOX_COMMAND_CLIENT_DEFAULT_BATCH_SIZE),
+				      env_uint("NEMO_DROPBOX_BATCH_DEADLINE_MS",
+					       0, DROPBOX_COMMAND_CLIENT_MAX_BATCH_DEADLINE_MS,
+					       DROPBOX_COMMAND_CLIENT_DEFAULT_BATCH_DEADLINE_MS));
+
+  dropbox_command_client_set_connections(dcc,
+					 env_uint("NEMO_DROPBOX_CONNECTIONS",
+						  1, DROPBOX_COMMAND_CLIENT_MAX_CONNECTIONS,
+						  DROPBOX_COMMAND_CLIENT_DEFAULT_CONNECTIONS));
+}
+
+/* should only be called before the command thread is started,
+   a batch size of 1 disables batching */
+void
+dropbox_command_client_set_batching(DropboxCommandClient *dcc,
+				    guint batch_size,
+				    guint batch_deadline_ms) {
+  dcc->batch_size = CLAMP(batch_size, 1, DROPBOX_COMMAND_CLIENT_MAX_BATCH_SIZE);
+  dcc->batch_deadline_ms = MIN(batch_deadline_ms,
+			       DROPBOX_COMMAND_CLIENT_MAX_BATCH_DEADLINE_MS);
+}
+
+/* should only be called before the command threads are started, this
+   is the number of connections for file info commands, general commands
+   always get one more */
+void
+dropbox_command_client_set_connections(DropboxCommandClient *dcc,
+				       guint num_connections) {
+  dcc->num_connections = CLAMP(num_connections, 1,
+			       DROPBOX_COMMAND_CLIENT_MAX_CONNECTIONS);
 }
 
 void
@@ -828,10 +1097,34 @@ dropbox_command_client_add_connection_attempt_hook(DropboxCommandClient *dcc,
 /* should only be called once on initialization */
 void
 dropbox_command_client_start(DropboxCommandClient *dcc) {
-  /* setup the connect to the command server */
-  debug("starting command thread");
-  g_thread_create((gpointer (*)(gpointer data)) dropbox_command_client_thread,
-		  dcc, FALSE, NULL);
+  DropboxCommandWorker *workers;
+  guint i, num_workers;
+
+  /* setup the connections to the command server,
+     the first one is the priority lane */
+  debug("starting %u command threads", dcc->num_connections + 1);
+
+  num_workers = dcc->num_connections + 1;
+  workers = g_new0(DropboxCommandWorker, num_workers);
+  for (i = 0; i < num_workers; i++) {
+    DropboxCommandWorker *worker = &(workers[i]);
+
+    worker->dcc = dcc;
+    worker->priority = (i == 0);
+    worker->queue = worker->priority ? dcc->priority_queue : dcc->command_queue;
+    worker->wakeup_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    worker->generation = 0;
+    worker->batch_unsupported = FALSE;
+    dropbox_command_connection_init(&(worker->conn));
+  }
+
+  dcc->workers = workers;
+  dcc->num_workers = num_workers;
+
+  for (i = 0; i < num_workers; i++) {
+    g_thread_create((gpointer (*)(gpointer data)) dropbox_command_client_thread,
+		    &(workers[i]), FALSE, NULL);
+  }
 }
 
 /* thread safe */
@@ -27,6 +27,8 @@
 #include <libnemo-extension/nemo-info-provider.h>
 #include <libnemo-extension/nemo-file-info.h>
 
+#include "dropbox-path-table.h"
+
 G_BEGIN_DECLS
 
 /* command structs */
@@ -41,6 +43,10 @@ typedef struct {
   NemoInfoProvider *provider;
   GClosure *update_complete;
   NemoFileInfo *file;
+  /* the path the reply is cached under, and its generation when the
+     request was queued; NULL for untracked files */
+  DropboxPath *path;
+  guint path_generation;
   gboolean cancelled;
 } DropboxFileInfoCommand;
 
@@ -64,13 +70,40 @@ typedef struct {
 typedef void (*DropboxCommandClientConnectionAttemptHook)(guint, gpointer);
 typedef GHookFunc DropboxCommandClientConnectHook;
 
+/* file info commands are sent to dropbox in batches of at most
+   batch_size paths, waiting at most batch_deadline_ms for the batch
+   to fill up. both can be overridden with the NEMO_DROPBOX_BATCH_SIZE
+   and NEMO_DROPBOX_BATCH_DEADLINE_MS environment variables */
+#define DROPBOX_COMMAND_CLIENT_DEFAULT_BATCH_SIZE 64
+#define DROPBOX_COMMAND_CLIENT_MAX_BATCH_SIZE 1024
+#define DROPBOX_COMMAND_CLIENT_DEFAULT_BATCH_DEADLINE_MS 5
+#define DROPBOX_COMMAND_CLIENT_MAX_BATCH_DEADLINE_MS 1000
+
+/* file info commands are spread over this many connections, each with
+   its own thread. overridden by the NEMO_DROPBOX_CONNECTIONS environment
+   variable */
+#define DROPBOX_COMMAND_CLIENT_DEFAULT_CONNECTIONS 3
+#define DROPBOX_COMMAND_CLIENT_MAX_CONNECTIONS 16
+
+typedef struct _DropboxCommandWorker DropboxCommandWorker;
+
 typedef struct {
   GMutex *command_connected_mutex;
   gboolean command_connected;
+  /* file info commands, shared by the bulk connections */
   GAsyncQueue *command_queue; 
+  /* menu and general commands, they get a connection of their own
+     so they never wait behind file info traffic */
+  GAsyncQueue *priority_queue;
+  guint num_connections;
+  guint num_workers;
+  DropboxCommandWorker *workers;
+  gint reset_generation;
   GList *ca_hooklist;
   GHookList onconnect_hooklist;
   GHookList ondisconnect_hooklist;
+  guint batch_size;
+  guint batch_deadline_ms;
 } DropboxCommandClient;
 
 gboolean dropbox_command_client_is_connected(DropboxCommandClient *dcc);
@@ -86,6 +119,15 @@ dropbox_command_client_setup(DropboxCommandClient *dcc);
 void
 dropbox_command_client_start(DropboxCommandClient *dcc);
 
+void
+dropbox_command_client_set_batching(DropboxCommandClient *dcc,
+				    guint batch_size,
+				    guint batch_deadline_ms);
+
+void
+dropbox_command_client_set_connections(DropboxCommandClient *dcc,
+				       guint num_connections);
+
 void dropbox_command_client_send_simple_command(DropboxCommandClient *dcc,
 						const char *command);
 
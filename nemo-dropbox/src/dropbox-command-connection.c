@@ -0,0 +1,154 @@
+/*
+ * Copyright 2008 Evenflow, Inc.
+ *
+ * dropbox-command-connection.c
+ * Implements a single connection to the Dropbox command socket.
+ *
+ * This file is part of nemo-dropbox.
+ *
+ * nemo-dropbox is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * nemo-dropbox is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with nemo-dropbox.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <sys/un.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include <string.h>
+
+#include <glib.h>
+
+#include "g-util.h"
+#include "dropbox-command-connection.h"
+
+void
+dropbox_command_connection_init(DropboxCommandConnection *conn) {
+  conn->sock = -1;
+}
+
+/* blocks for at most a second, returns FALSE if dropbox isn't there */
+gboolean
+dropbox_command_connection_open(DropboxCommandConnection *conn) {
+  struct sockaddr_un addr;
+  socklen_t addr_len;
+  int sock;
+  gboolean failflag = TRUE;
+
+  g_assert(conn->sock < 0);
+
+  /* intialize address structure */
+  addr.sun_family = AF_UNIX;
+  g_snprintf(addr.sun_path,
+	     sizeof(addr.sun_path),
+	     "%s/.dropbox/command_socket",
+	     g_get_home_dir());
+  addr_len = sizeof(addr) - sizeof(addr.sun_path) + strlen(addr.sun_path);
+
+  do {
+    int flags;
+
+    if (0 > (sock = socket(PF_UNIX, SOCK_STREAM, 0))) {
+      /* WTF */
+      break;
+    }
+
+    /* set timeout on socket, to protect against
+       bad servers */
+    {
+      struct timeval tv = {3, 0};
+      if (0 > setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO,
+			 &tv, sizeof(struct timeval)) ||
+	  0 > setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO,
+			 &tv, sizeof(struct timeval))) {
+	/* debug("setsockopt failed"); */
+	break;
+      }
+    }
+
+    /* set native non-blocking, for connect timeout */
+    {
+      if ((flags = fcntl(sock, F_GETFL, 0)) < 0 ||
+	  fcntl(sock, F_SETFL, flags | O_NONBLOCK) < 0) {
+	/* debug("fcntl failed"); */
+	break;
+      }
+    }
+
+    /* if there was an error we have to try again later */
+    if (connect(sock, (struct sockaddr *) &addr, addr_len) < 0) {
+      if (errno == EINPROGRESS) {
+	fd_set writers;
+	struct timeval tv = {1, 0};
+
+	FD_ZERO(&writers);
+	FD_SET(sock, &writers);
+
+	/* if nothing was ready after 3 seconds, fail out homie */
+	if (select(sock+1, NULL, &writers, NULL, &tv) == 0) {
+	  /* debug("connection timeout"); */
+	  break;
+	}
+
+	if (connect(sock, (struct sockaddr *) &addr, addr_len) < 0) {
+	  /*	    debug("couldn't connect to command server after 1 second"); */
+	  break;
+	}
+      }
+      /* errno != EINPROGRESS */
+      else {
+	/*	  debug("bad connection"); */
+	break;
+      }
+    }
+
+    /* set back to blocking */
+    if (fcntl(sock, F_SETFL, flags) < 0) {
+      /* debug("fcntl2 failed"); */
+      break;
+    }
+
+    failflag = FALSE;
+  } while (0);
+
+  if (failflag) {
+    if (sock >= 0) {
+      close(sock);
+    }
+    return FALSE;
+  }
+
+  conn->sock = sock;
+  dropbox_client_util_stream_init(&(conn->stream), sock);
+
+  return TRUE;
+}
+
+gboolean
+dropbox_command_connection_is_open(DropboxCommandConnection *conn) {
+  return conn->sock >= 0;
+}
+
+void
+dropbox_command_connection_close(DropboxCommandConnection *conn) {
+  if (conn->sock >= 0) {
+    dropbox_client_util_stream_clear(&(conn->stream));
+    close(conn->sock);
+  }
+
+  conn->sock = -1;
+}
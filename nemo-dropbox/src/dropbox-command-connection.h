@@ -0,0 +1,53 @@
+/*
+ * Copyright 2008 Evenflow, Inc.
+ *
+ * dropbox-command-connection.h
+ * Header file for dropbox-command-connection.c
+ *
+ * This file is part of nemo-dropbox.
+ *
+ * nemo-dropbox is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * nemo-dropbox is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with nemo-dropbox.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef DROPBOX_COMMAND_CONNECTION_H
+#define DROPBOX_COMMAND_CONNECTION_H
+
+#include <glib.h>
+
+#include "dropbox-client-util.h"
+
+G_BEGIN_DECLS
+
+/* one socket to ~/.dropbox/command_socket */
+typedef struct {
+  int sock;
+  DropboxClientUtilStream stream;
+} DropboxCommandConnection;
+
+void
+dropbox_command_connection_init(DropboxCommandConnection *conn);
+
+gboolean
+dropbox_command_connection_open(DropboxCommandConnection *conn);
+
+gboolean
+dropbox_command_connection_is_open(DropboxCommandConnection *conn);
+
+void
+dropbox_command_connection_close(DropboxCommandConnection *conn);
+
+G_END_DECLS
+
+#endif
@@ -0,0 +1,322 @@
+/*
+ * Copyright 2008 Evenflow, Inc.
+ *
+ * dropbox-path-table.c
+ * Interned, prefix-shared storage for the paths we track.
+ *
+ * This file is part of nemo-dropbox.
+ *
+ * nemo-dropbox is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * nemo-dropbox is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with nemo-dropbox.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <string.h>
+
+#include <glib.h>
+
+#include "dropbox-path-table.h"
+
+/*
+  Paths handed to us are already canonical: absolute, no '.' or '..'
+  and no empty components, so splitting on '/' is all the parsing
+  we need.  A node is keyed by (parent, name) which makes lookups
+  walk the components without allocating anything.
+*/
+
+static guint
+component_hash(DropboxPath *parent, const gchar *name, guint len) {
+  guint h = g_direct_hash(parent);
+  guint i;
+
+  for (i = 0; i < len; i++) {
+    h = (h << 5) + h + (guchar) name[i];
+  }
+
+  return h;
+}
+
+static guint
+node_hash(gconstpointer key) {
+  return ((const DropboxPath *) key)->hash;
+}
+
+static gboolean
+node_equal(gconstpointer a, gconstpointer b) {
+  const DropboxPath *na = a, *nb = b;
+
+  return (na->parent == nb->parent &&
+	  na->name_len == nb->name_len &&
+	  memcmp(na->name, nb->name, na->name_len) == 0);
+}
+
+static gsize
+node_size(guint name_len) {
+  return sizeof(DropboxPath) + name_len + 1;
+}
+
+static DropboxPath *
+find_component(DropboxPathTable *table, DropboxPath *parent,
+	       const gchar *name, guint len) {
+  DropboxPath probe;
+
+  probe.parent = parent;
+  probe.name = name;
+  probe.name_len = len;
+  probe.hash = component_hash(parent, name, len);
+
+  return g_hash_table_lookup(table->nodes, &probe);
+}
+
+/* returns a new reference */
+static DropboxPath *
+intern_component(DropboxPathTable *table, DropboxPath *parent,
+		 const gchar *name, guint len) {
+  DropboxPath *node;
+  gchar *storage;
+
+  node = find_component(table, parent, name, len);
+  if (node != NULL) {
+    return dropbox_path_ref(node);
+  }
+
+  /* the name lives right behind the node, one allocation per component */
+  node = g_malloc(node_size(len));
+  storage = (gchar *) (node + 1);
+  memcpy(storage, name, len);
+  storage[len] = '\0';
+
+  node->parent = parent != NULL ? dropbox_path_ref(parent) : NULL;
+  node->name = storage;
+  node->name_len = len;
+  node->hash = component_hash(parent, name, len);
+  node->refcount = 1;
+  node->generation = 0;
+  node->file = NULL;
+
+  g_hash_table_insert(table->nodes, node, node);
+  table->bytes += node_size(len);
+
+  return node;
+}
+
+/* finds the node for path, with create missing components are added
+   and a reference is returned */
+static DropboxPath *
+walk_path(DropboxPathTable *table, const gchar *path, gboolean create) {
+  DropboxPath *node;
+  const gchar *p = path;
+
+  g_assert(path[0] == '/');
+
+  node = create
+    ? intern_component(table, NULL, "", 0)
+    : find_component(table, NULL, "", 0);
+
+  while (node != NULL && *p != '\0') {
+    const gchar *end;
+    DropboxPath *child;
+
+    while (*p == '/') {
+      p++;
+    }
+    if (*p == '\0') {
+      break;
+    }
+
+    end = strchr(p, '/');
+    if (end == NULL) {
+      end = p + strlen(p);
+    }
+
+    if (create) {
+      child = intern_component(table, node, p, end - p);
+      /* the child holds its own reference on node */
+      dropbox_path_unref(table, node);
+    }
+    else {
+      child = find_component(table, node, p, end - p);
+    }
+
+    node = child;
+    p = end;
+  }
+
+  return node;
+}
+
+void
+dropbox_path_table_init(DropboxPathTable *table) {
+  table->nodes = g_hash_table_new(node_hash, node_equal);
+  table->bytes = 0;
+}
+
+void
+dropbox_path_table_clear(DropboxPathTable *table) {
+  GHashTableIter iter;
+  gpointer node;
+
+  /* every reference is about to become invalid, free without unwinding */
+  g_hash_table_iter_init(&iter, table->nodes);
+  while (g_hash_table_iter_next(&iter, &node, NULL)) {
+    g_free(node);
+  }
+
+  g_hash_table_destroy(table->nodes);
+  table->nodes = NULL;
+  table->bytes = 0;
+}
+
+/*
+  Returns a reference to the node for path, creating it and any
+  missing parents.  path must be canonical.
+*/
+DropboxPath *
+dropbox_path_table_intern(DropboxPathTable *table, const gchar *path) {
+  return walk_path(table, path, TRUE);
+}
+
+/* Returns the node for path or NULL, does not add a reference. */
+DropboxPath *
+dropbox_path_table_lookup(DropboxPathTable *table, const gchar *path) {
+  return walk_path(table, path, FALSE);
+}
+
+guint
+dropbox_path_table_size(DropboxPathTable *table) {
+  return g_hash_table_size(table->nodes);
+}
+
+/* bytes held by the nodes themselves, not counting the hash table */
+gsize
+dropbox_path_table_memory(DropboxPathTable *table) {
+  return table->bytes;
+}
+
+DropboxPath *
+dropbox_path_ref(DropboxPath *path) {
+  path->refcount++;
+  return path;
+}
+
+void
+dropbox_path_unref(DropboxPathTable *table, DropboxPath *path) {
+  /* a node holds a reference on its parent, so release upwards */
+  while (path != NULL && --path->refcount == 0) {
+    DropboxPath *parent = path->parent;
+
+    g_hash_table_remove(table->nodes, path);
+    table->bytes -= node_size(path->name_len);
+    g_free(path);
+
+    path = parent;
+  }
+}
+
+/* the character before *p in a uri, unescaped, moving *p back over it.
+   '%' only ever starts an escape in a uri, so going backwards is not
+   ambiguous */
+static gboolean
+uri_prev_char(const gchar *start, const gchar **p, gchar *c) {
+  const gchar *q = *p;
+
+  if (q == start) {
+    return FALSE;
+  }
+
+  if (q - start >= 3 && q[-3] == '%') {
+    gint hi = g_ascii_xdigit_value(q[-2]);
+    gint lo = g_ascii_xdigit_value(q[-1]);
+
+    /* an escaped '/' is not a separator, and file uris don't have one */
+    if (hi < 0 || lo < 0 || (hi << 4 | lo) == '/') {
+      return FALSE;
+    }
+    *c = (gchar) (hi << 4 | lo);
+    *p = q - 3;
+    return TRUE;
+  }
+
+  if (q[-1] == '%') {
+    return FALSE;
+  }
+
+  *c = q[-1];
+  *p = q - 1;
+  return TRUE;
+}
+
+/*
+  TRUE if uri is a local file uri spelling exactly path, without
+  building either string. FALSE only means the uri has to be
+  canonicalized to tell, it may still end up at path.
+*/
+gboolean
+dropbox_path_matches_uri(DropboxPath *path, const gchar *uri) {
+  const gchar *start, *p;
+  DropboxPath *node;
+  gchar c;
+
+  if (strncmp(uri, "file:///", 8) != 0) {
+    return FALSE;
+  }
+
+  start = uri + 7;
+  p = start + strlen(start);
+
+  if (path->parent == NULL) {
+    return p == start + 1;
+  }
+
+  for (node = path; node->parent != NULL; node = node->parent) {
+    guint i = node->name_len;
+
+    while (i > 0) {
+      if (!uri_prev_char(start, &p, &c) || c != node->name[--i]) {
+        return FALSE;
+      }
+    }
+
+    if (!uri_prev_char(start, &p, &c) || c != '/') {
+      return FALSE;
+    }
+  }
+
+  return p == start;
+}
+
+gchar *
+dropbox_path_to_string(DropboxPath *path) {
+  DropboxPath *node;
+  gsize len = 0;
+  gchar *toret, *p;
+
+  if (path->parent == NULL) {
+    return g_strdup("/");
+  }
+
+  for (node = path; node->parent != NULL; node = node->parent) {
+    len += node->name_len + 1;
+  }
+
+  toret = g_malloc(len + 1);
+  p = toret + len;
+  *p = '\0';
+  for (node = path; node->parent != NULL; node = node->parent) {
+    p -= node->name_len;
+    memcpy(p, node->name, node->name_len);
+    *--p = '/';
+  }
+
+  return toret;
+}
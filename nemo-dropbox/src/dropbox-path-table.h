@@ -0,0 +1,85 @@
+/*
+ * Copyright 2008 Evenflow, Inc.
+ *
+ * dropbox-path-table.h
+ * Header file for dropbox-path-table.c
+ *
+ * This file is part of nemo-dropbox.
+ *
+ * nemo-dropbox is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * nemo-dropbox is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with nemo-dropbox.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef DROPBOX_PATH_TABLE_H
+#define DROPBOX_PATH_TABLE_H
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+typedef struct _DropboxPath DropboxPath;
+
+/* one node per path component, a path is its node plus its parents,
+   so every directory name is stored once no matter how many files
+   under it we track */
+struct _DropboxPath {
+  DropboxPath *parent;
+  const gchar *name;
+  guint name_len;
+  guint hash;
+  guint refcount;
+  /* bumped whenever the emblems cached for this path are invalidated */
+  guint generation;
+  /* the file object nemo gave us for this path, not reffed */
+  gpointer file;
+};
+
+typedef struct {
+  GHashTable *nodes;
+  gsize bytes;
+} DropboxPathTable;
+
+void
+dropbox_path_table_init(DropboxPathTable *table);
+
+void
+dropbox_path_table_clear(DropboxPathTable *table);
+
+DropboxPath *
+dropbox_path_table_intern(DropboxPathTable *table, const gchar *path);
+
+DropboxPath *
+dropbox_path_table_lookup(DropboxPathTable *table, const gchar *path);
+
+guint
+dropbox_path_table_size(DropboxPathTable *table);
+
+gsize
+dropbox_path_table_memory(DropboxPathTable *table);
+
+DropboxPath *
+dropbox_path_ref(DropboxPath *path);
+
+void
+dropbox_path_unref(DropboxPathTable *table, DropboxPath *path);
+
+gchar *
+dropbox_path_to_string(DropboxPath *path);
+
+gboolean
+dropbox_path_matches_uri(DropboxPath *path, const gchar *uri);
+
+G_END_DECLS
+
+#endif
@@ -56,6 +56,9 @@ gboolean dropbox_use_operation_in_progress_workaround;
 
 static GType dropbox_type = 0;
 
+/* drop the whole emblem cache once it tracks this many paths */
+#define EMBLEM_CACHE_MAX_ENTRIES 100000
+
 /* for old versions of glib */
 #if 0  // Silence Warnings.
 static void my_g_hash_table_get_keys_helper(gpointer key,
@@ -125,96 +128,298 @@ reset_file(NemoFileInfo *file) {
   nemo_file_info_invalidate_extension_info(file);
 }
 
+/*
+  A tracked file remembers which path it was filed under. As long as
+  nemo hands us a uri that spells that path, we don't canonicalize
+  again.
+*/
+typedef struct {
+  DropboxPath *path;
+} TrackedFile;
+
+static void
+tracked_file_free(TrackedFile *tf) {
+  g_free(tf);
+}
+
+static void
+when_file_dies(NemoDropbox *cvs, NemoFileInfo *address);
+
+static void
+changed_cb(NemoFileInfo *file, NemoDropbox *cvs);
+
+/* returns the canonical path for uri, NULL with *invalid unset when
+   the file isn't local */
+static gchar *
+filename_from_uri(const gchar *uri, gboolean *invalid) {
+  gchar *pfilename, *filename;
+
+  *invalid = FALSE;
+
+  pfilename = g_filename_from_uri(uri, NULL, NULL);
+  if (pfilename == NULL) {
+    return NULL;
+  }
+
+  filename = canonicalize_path(pfilename);
+  g_free(pfilename);
+
+  /* Canonicalization will only null-out a non-null filename if it is invalid */
+  *invalid = filename == NULL;
+
+  return filename;
+}
+
+static void
+forget_file(NemoDropbox *cvs, NemoFileInfo *file, TrackedFile *tf) {
+  if (tf->path->file == file) {
+    tf->path->file = NULL;
+  }
+  dropbox_path_unref(&(cvs->paths), tf->path);
+  g_hash_table_remove(cvs->tracked_files, file);
+}
+
+static void
+untrack_file(NemoDropbox *cvs, NemoFileInfo *file) {
+  TrackedFile *tf;
+
+  tf = g_hash_table_lookup(cvs->tracked_files, file);
+  if (tf == NULL) {
+    return;
+  }
+
+  g_object_weak_unref(G_OBJECT(file), (GWeakNotify) when_file_dies, cvs);
+  g_signal_handlers_disconnect_by_func(file, G_CALLBACK(changed_cb), cvs);
+  forget_file(cvs, file, tf);
+}
+
+/* files file under path, takes over the reference on path */
+static void
+track_file(NemoDropbox *cvs, NemoFileInfo *file, DropboxPath *path) {
+  TrackedFile *tf;
+
+  if (path->file != NULL && path->file != file) {
+    /* this happens when nemo allocates another file object for a
+       filename without first deleting the original file object
+
+       just remove the association to the older file object, it's obsolete
+    */
+    untrack_file(cvs, path->file);
+  }
+
+  tf = g_new(TrackedFile, 1);
+  tf->path = path;
+  path->file = file;
+
+  /* too chatty */
+  /* debug("adding %s <-> 0x%p", filename, file);*/
+  g_hash_table_insert(cvs->tracked_files, file, tf);
+  g_object_weak_ref(G_OBJECT(file), (GWeakNotify) when_file_dies, cvs);
+  g_signal_connect(file, "changed", G_CALLBACK(changed_cb), cvs);
+}
+
+/* moves an already tracked file to path, takes over the reference on
+   path */
+static void
+retrack_file(NemoDropbox *cvs, NemoFileInfo *file, TrackedFile *tf,
+	     DropboxPath *path) {
+  DropboxPath *old = tf->path;
+
+  if (old->file == file) {
+    old->file = NULL;
+  }
+
+  /* we shouldn't have another mapping from path to an object,
+     lets fix it if it's true */
+  if (path->file != NULL && path->file != file) {
+    untrack_file(cvs, path->file);
+  }
+
+  path->file = file;
+  tf->path = path;
+
+  dropbox_path_unref(&(cvs->paths), old);
+}
+
+/*
+  The emblem cache remembers the emblems dropbox handed out for a path,
+  so that revisiting a directory doesn't go to the daemon again. Entries
+  only go away when dropbox tells us the path changed (shell_touch), when
+  nemo tells us a file object moved (changed_cb), or when the connection
+  comes or goes.
+*/
+static void
+emblem_cache_clear(NemoDropbox *cvs) {
+  GHashTableIter iter;
+  gpointer path;
+
+  g_hash_table_iter_init(&iter, cvs->emblem_cache);
+  while (g_hash_table_iter_next(&iter, &path, NULL)) {
+    g_hash_table_iter_remove(&iter);
+    dropbox_path_unref(&(cvs->paths), path);
+  }
+}
+
+static void
+emblem_cache_invalidate(NemoDropbox *cvs, DropboxPath *path) {
+  /* replies to requests queued before this must not be cached */
+  path->generation++;
+
+  if (g_hash_table_remove(cvs->emblem_cache, path)) {
+    dropbox_path_unref(&(cvs->paths), path);
+  }
+}
+
+static void
+emblem_cache_insert(NemoDropbox *cvs, DropboxPath *path, GPtrArray *file_emblems) {
+  gchar **cached;
+  guint i;
+
+  if (g_hash_table_size(cvs->emblem_cache) >= EMBLEM_CACHE_MAX_ENTRIES) {
+    debug("emblem cache full, dropping it");
+    emblem_cache_clear(cvs);
+  }
+
+  cached = g_new(gchar *, file_emblems->len + 1);
+  for (i = 0; i < file_emblems->len; i++) {
+    cached[i] = g_strdup(g_ptr_array_index(file_emblems, i));
+  }
+  cached[i] = NULL;
+
+  /* an existing entry already holds its reference */
+  if (g_hash_table_lookup(cvs->emblem_cache, path) == NULL) {
+    dropbox_path_ref(path);
+  }
+  g_hash_table_insert(cvs->emblem_cache, path, cached);
+}
+
+/* adds the cached emblems to file, returns FALSE on a cache miss */
+static gboolean
+emblem_cache_apply(NemoDropbox *cvs, DropboxPath *path, NemoFileInfo *file) {
+  gchar **cached;
+  gboolean hit;
+
+  cached = g_hash_table_lookup(cvs->emblem_cache, path);
+  hit = cached != NULL;
+
+  if (hit) {
+    int i;
+    for (i = 0; cached[i] != NULL; i++) {
+      nemo_file_info_add_emblem(file, cached[i]);
+    }
+    cvs->emblem_cache_hits++;
+  }
+  else {
+    cvs->emblem_cache_misses++;
+  }
+
+  if (((cvs->emblem_cache_hits + cvs->emblem_cache_misses) % 1024) == 0) {
+    guint tracked = g_hash_table_size(cvs->tracked_files);
+    /* the nodes, the TrackedFile and its slot in tracked_files
+       (key, value and hash) */
+    gsize bytes = dropbox_path_table_memory(&(cvs->paths)) +
+      tracked * (sizeof(TrackedFile) + 2 * sizeof(gpointer) + sizeof(guint));
+
+    debug("emblem cache: %u hits, %u misses, %u entries",
+	  cvs->emblem_cache_hits, cvs->emblem_cache_misses,
+	  g_hash_table_size(cvs->emblem_cache));
+    debug("path table: %u files, %u paths, %lu bytes per file",
+	  tracked, dropbox_path_table_size(&(cvs->paths)),
+	  (unsigned long) (tracked > 0 ? bytes / tracked : 0));
+  }
+
+  return hit;
+}
+
 gboolean
 reset_all_files(NemoDropbox *cvs) {
   /* Only run this on the main loop or you'll cause problems. */
 
   /* this works because you can call a function pointer with
      more arguments than it takes */
-  g_hash_table_foreach(cvs->obj2filename, (GHFunc) reset_file, NULL);
+  g_hash_table_foreach(cvs->tracked_files, (GHFunc) reset_file, NULL);
   return FALSE;
 }
 
 
 static void
 when_file_dies(NemoDropbox *cvs, NemoFileInfo *address) {
-  gchar *filename;
+  TrackedFile *tf;
+
+  tf = g_hash_table_lookup(cvs->tracked_files, address);
 
-  filename = g_hash_table_lookup(cvs->obj2filename, address);
-  
   /* we never got a change to view this file */
-  if (filename == NULL) {
+  if (tf == NULL) {
     return;
   }
 
   /* too chatty */
   /*  debug("removing %s <-> 0x%p", filename, address); */
 
-  g_hash_table_remove(cvs->filename2obj, filename);
-  g_hash_table_remove(cvs->obj2filename, address);
+  forget_file(cvs, address, tf);
 }
 
 static void
 changed_cb(NemoFileInfo *file, NemoDropbox *cvs) {
   /* check if this file's path has changed, if so update the hash and invalidate
      the file */
-  gchar *filename, *pfilename;
-  gchar *filename2;
+  TrackedFile *tf;
+  DropboxPath *path;
+  gchar *filename;
   gchar *uri;
+  gboolean invalid;
 
-  uri = nemo_file_info_get_uri(file);
-  pfilename = g_filename_from_uri(uri, NULL, NULL);
-  filename = pfilename ? canonicalize_path(pfilename) : NULL;
-
-  /* Canonicalization will only null-out a non-null filename if it is invalid */
-  g_assert((pfilename == NULL && filename == NULL) || (pfilename != NULL && filename != NULL));
-
-  filename2 =  g_hash_table_lookup(cvs->obj2filename, file);
+  tf = g_hash_table_lookup(cvs->tracked_files, file);
 
-  g_free(pfilename);
-  g_free(uri);
+  /* if tf is NULL we've never seen this file in update_file_info */
+  if (tf == NULL) {
+    return;
+  }
 
-  /* if filename2 is NULL we've never seen this file in update_file_info */
-  if (filename2 == NULL) {
-    g_free(filename);
+  uri = nemo_file_info_get_uri(file);
+  if (dropbox_path_matches_uri(tf->path, uri)) {
+    g_free(uri);
     return;
   }
 
+  filename = filename_from_uri(uri, &invalid);
+  g_assert(!invalid);
+
   if (filename == NULL) {
+      g_free(uri);
       /* A file has moved to offline storage. Lets remove it from our tables. */
-      g_object_weak_unref(G_OBJECT(file), (GWeakNotify) when_file_dies, cvs);
-      g_hash_table_remove(cvs->filename2obj, filename2);
-      g_hash_table_remove(cvs->obj2filename, file);
-      g_signal_handlers_disconnect_by_func(file, G_CALLBACK(changed_cb), cvs);
+      emblem_cache_invalidate(cvs, tf->path);
+      untrack_file(cvs, file);
       reset_file(file);
       return;
   }
 
+  path = dropbox_path_table_intern(&(cvs->paths), filename);
+
+  g_free(uri);
+
+  /* same place, nemo just spelled the uri differently */
+  if (path == tf->path) {
+    dropbox_path_unref(&(cvs->paths), path);
+    g_free(filename);
+    return;
+  }
+
   /* this is a hack, because nemo doesn't do this for us, for some reason
      the file's path has changed */
-  if (strcmp(filename, filename2) != 0) {
+  {
+    gchar *filename2 = dropbox_path_to_string(tf->path);
     debug("shifty old: %s, new %s", filename2, filename);
+    g_free(filename2);
+  }
 
-    /* gotta do this first, the call after this frees filename2 */
-    g_hash_table_remove(cvs->filename2obj, filename2);
-
-    g_hash_table_replace(cvs->obj2filename, file, g_strdup(filename));
+  /* whatever we knew about either path is stale now */
+  emblem_cache_invalidate(cvs, tf->path);
+  emblem_cache_invalidate(cvs, path);
 
-    {
-      NemoFileInfo *f2;
-      /* we shouldn't have another mapping from filename to an object */
-      f2 = g_hash_table_lookup(cvs->filename2obj, filename);
-      if (f2 != NULL) {
-	/* lets fix it if it's true, just remove the mapping */
-	g_hash_table_remove(cvs->filename2obj, filename);
-	g_hash_table_remove(cvs->obj2filename, f2);
-      }
-    }
+  retrack_file(cvs, file, tf, path);
+  reset_file(file);
 
-    g_hash_table_insert(cvs->filename2obj, g_strdup(filename), file);
-    reset_file(file);
-  }
-  
   g_free(filename);
 }
 
@@ -224,74 +429,50 @@ nemo_dropbox_update_file_info(NemoInfoProvider     *provider,
                                   GClosure                 *update_complete,
                                   NemoOperationHandle **handle) {
   NemoDropbox *cvs;
+  DropboxPath *path;
 
   cvs = NEMO_DROPBOX(provider);
 
-  /* this code adds this file object to our two-way hash of file objects
-     so we can shell touch these files later */
+  /* this code adds this file object to our two-way map of file objects
+     so we can shell touch these files later, the path is only worked
+     out again if the uri changed since we last saw the object */
   {
-    gchar *pfilename, *uri;
+    TrackedFile *tf;
+    gchar *uri;
 
     uri = nemo_file_info_get_uri(file);
-    pfilename = g_filename_from_uri(uri, NULL, NULL);
-    g_free(uri);
-    if (pfilename == NULL) {
-      return NEMO_OPERATION_COMPLETE;
+    tf = g_hash_table_lookup(cvs->tracked_files, file);
+
+    if (tf != NULL && dropbox_path_matches_uri(tf->path, uri)) {
+      g_free(uri);
+      path = tf->path;
     }
     else {
-      int cmp = 0;
-      gchar *stored_filename;
       gchar *filename;
-      
-      filename = canonicalize_path(pfilename);
-      g_free(pfilename);
+      gboolean invalid;
+
+      filename = filename_from_uri(uri, &invalid);
       if (filename == NULL) {
+        g_free(uri);
         /* pfilename path was invalid if canonicalize operation nulled it out */
-        return NEMO_OPERATION_FAILED;
-      }
-      stored_filename = g_hash_table_lookup(cvs->obj2filename, file);
-
-      /* don't worry about the dup checks, gcc is smart enough to optimize this
-	 GCSE ftw */
-      if ((stored_filename != NULL && (cmp = strcmp(stored_filename, filename)) != 0) ||
-	  stored_filename == NULL) {
-	
-	if (stored_filename != NULL && cmp != 0) {
-	  /* this happens when the filename changes name on a file obj 
-	     but changed_cb isn't called */
-	  g_object_weak_unref(G_OBJECT(file), (GWeakNotify) when_file_dies, cvs);
-	  g_hash_table_remove(cvs->obj2filename, file);
-	  g_hash_table_remove(cvs->filename2obj, stored_filename);
-	  g_signal_handlers_disconnect_by_func(file, G_CALLBACK(changed_cb), cvs);
-	}
-	else if (stored_filename == NULL) {
-	  NemoFileInfo *f2;
-
-	  if ((f2 = g_hash_table_lookup(cvs->filename2obj, filename)) != NULL) {
-	    /* if the filename exists in the filename2obj hash
-	       but the file obj doesn't exist in the obj2filename hash:
-	       
-	       this happens when nemo allocates another file object
-	       for a filename without first deleting the original file object
-	       
-	       just remove the association to the older file object, it's obsolete
-	    */
-	    g_object_weak_unref(G_OBJECT(f2), (GWeakNotify) when_file_dies, cvs);
-	    g_signal_handlers_disconnect_by_func(f2, G_CALLBACK(changed_cb), cvs);
-	    g_hash_table_remove(cvs->filename2obj, filename);
-	    g_hash_table_remove(cvs->obj2filename, f2);
-	  }
-	}
-
-	/* too chatty */
-	/* debug("adding %s <-> 0x%p", filename, file);*/
-	g_object_weak_ref(G_OBJECT(file), (GWeakNotify) when_file_dies, cvs);
-	g_hash_table_insert(cvs->filename2obj, g_strdup(filename), file);
-	g_hash_table_insert(cvs->obj2filename, file, g_strdup(filename));
-	g_signal_connect(file, "changed", G_CALLBACK(changed_cb), cvs);
+        return invalid ? NEMO_OPERATION_FAILED : NEMO_OPERATION_COMPLETE;
       }
 
+      path = dropbox_path_table_intern(&(cvs->paths), filename);
       g_free(filename);
+      g_free(uri);
+
+      if (tf != NULL && tf->path == path) {
+        dropbox_path_unref(&(cvs->paths), path);
+      }
+      else {
+        if (tf != NULL) {
+          /* this happens when the filename changes name on a file obj
+             but changed_cb isn't called */
+          untrack_file(cvs, file);
+        }
+        track_file(cvs, file, path);
+      }
     }
   }
 
@@ -300,6 +481,11 @@ nemo_dropbox_update_file_info(NemoInfoProvider     *provider,
     return NEMO_OPERATION_COMPLETE;
   }
 
+  /* nothing changed since we last asked dropbox */
+  if (emblem_cache_apply(cvs, path, file)) {
+    return NEMO_OPERATION_COMPLETE;
+  }
+
   {
     DropboxFileInfoCommand *dfic = g_new0(DropboxFileInfoCommand, 1);
 
@@ -308,6 +494,8 @@ nemo_dropbox_update_file_info(NemoInfoProvider     *provider,
     dfic->dc.request_type = GET_FILE_INFO;
     dfic->update_complete = g_closure_ref(update_complete);
     dfic->file = g_object_ref(file);
+    dfic->path = dropbox_path_ref(path);
+    dfic->path_generation = path->generation;
     
     dropbox_command_client_request(&(cvs->dc.dcc), (DropboxCommand *) dfic);
     
@@ -327,18 +515,24 @@ handle_shell_touch(GHashTable *args, NemoDropbox *cvs) {
 
   if ((path = g_hash_table_lookup(args, "path")) != NULL &&
       path[0][0] == '/') {
-    NemoFileInfo *file;
+    DropboxPath *node;
     gchar *filename;
 
     filename = canonicalize_path(path[0]);
     if (filename != NULL) {
       debug("shell touch for %s", filename);
 
-      file = g_hash_table_lookup(cvs->filename2obj, filename);
+      /* paths we never interned have nothing to invalidate */
+      node = dropbox_path_table_lookup(&(cvs->paths), filename);
+      if (node != NULL) {
+        NemoFileInfo *file = node->file;
 
-      if (file != NULL) {
-        debug("gonna reset %s", filename);
-        reset_file(file);
+        emblem_cache_invalidate(cvs, node);
+
+        if (file != NULL) {
+          debug("gonna reset %s", filename);
+          reset_file(file);
+        }
       }
       g_free(filename);
     }
@@ -356,6 +550,7 @@ nemo_dropbox_finish_file_info_command(DropboxFileInfoCommandResponse *dficr) {
   if (!dficr->dfic->cancelled) {
     gchar **status = NULL;
     gboolean isdir;
+    GPtrArray *file_emblems = g_ptr_array_new();
 
     isdir = nemo_file_info_is_directory(dficr->dfic->file) ;
 
@@ -365,7 +560,7 @@ nemo_dropbox_finish_file_info_command(DropboxFileInfoCommandResponse *dficr) {
       int i;
       for ( i = 0; status[i] != NULL; i++) {
 	  if (status[i][0])
-	    nemo_file_info_add_emblem(dficr->dfic->file, status[i]);
+	    g_ptr_array_add(file_emblems, status[i]);
       }
       result = NEMO_OPERATION_COMPLETE;
     }
@@ -381,16 +576,16 @@ nemo_dropbox_finish_file_info_command(DropboxFileInfoCommandResponse *dficr) {
       if (isdir &&
 	  (tag = g_hash_table_lookup(dficr->folder_tag_response, "tag")) != NULL) {
 	if (strcmp("public", tag[0]) == 0) {
-	  nemo_file_info_add_emblem(dficr->dfic->file, "web");
+	  g_ptr_array_add(file_emblems, "web");
 	}
 	else if (strcmp("shared", tag[0]) == 0) {
-	  nemo_file_info_add_emblem(dficr->dfic->file, "people");
+	  g_ptr_array_add(file_emblems, "people");
 	}
 	else if (strcmp("photos", tag[0]) == 0) {
-	  nemo_file_info_add_emblem(dficr->dfic->file, "photos");
+	  g_ptr_array_add(file_emblems, "photos");
 	}
 	else if (strcmp("sandbox", tag[0]) == 0) {
-	  nemo_file_info_add_emblem(dficr->dfic->file, "star");
+	  g_ptr_array_add(file_emblems, "star");
 	}
       }
 
@@ -414,11 +609,33 @@ nemo_dropbox_finish_file_info_command(DropboxFileInfoCommandResponse *dficr) {
 	    g_filename_from_uri(nemo_file_info_get_uri(dficr->dfic->file),
 	    NULL, NULL));
 	  */
-	  nemo_file_info_add_emblem(dficr->dfic->file, emblems[emblem_code-1]);
+	  g_ptr_array_add(file_emblems, emblems[emblem_code-1]);
 	}
       }
       result = NEMO_OPERATION_COMPLETE;
     }
+
+    if (result == NEMO_OPERATION_COMPLETE) {
+      NemoDropbox *cvs = NEMO_DROPBOX(dficr->dfic->provider);
+      TrackedFile *tf;
+      guint i;
+
+      for (i = 0; i < file_emblems->len; i++) {
+	nemo_file_info_add_emblem(dficr->dfic->file,
+				  g_ptr_array_index(file_emblems, i));
+      }
+
+      /* only remember files we are tracking, otherwise nothing
+	 would ever invalidate the entry, and only if nothing
+	 invalidated it while the request was out */
+      tf = g_hash_table_lookup(cvs->tracked_files, dficr->dfic->file);
+      if (tf != NULL && tf->path == dficr->dfic->path &&
+	  tf->path->generation == dficr->dfic->path_generation) {
+	emblem_cache_insert(cvs, tf->path, file_emblems);
+      }
+    }
+
+    g_ptr_array_free(file_emblems, TRUE);
   }
 
   /* complete the info request */
@@ -440,6 +657,8 @@ nemo_dropbox_finish_file_info_command(DropboxFileInfoCommandResponse *dficr) {
   /* unref the objects we didn't create */
   g_closure_unref(dficr->dfic->update_complete);
   g_object_unref(dficr->dfic->file);
+  dropbox_path_unref(&(NEMO_DROPBOX(dficr->dfic->provider)->paths),
+		     dficr->dfic->path);
 
   /* now free the structs */
   g_free(dficr->dfic);
@@ -885,6 +1104,7 @@ void get_emblem_paths_cb(GHashTable *emblem_paths_response, NemoDropbox *cvs)
 
 static void
 on_connect(NemoDropbox *cvs) {
+  emblem_cache_clear(cvs);
   reset_all_files(cvs);
 
   dropbox_command_client_send_command(&(cvs->dc.dcc),
@@ -894,6 +1114,7 @@ on_connect(NemoDropbox *cvs) {
 
 static void
 on_disconnect(NemoDropbox *cvs) {
+  emblem_cache_clear(cvs);
   reset_all_files(cvs);
 
   g_mutex_lock(cvs->emblem_paths_mutex);
@@ -924,16 +1145,19 @@ nemo_dropbox_nd_provider_iface_init (NemoNameAndDescProviderIface *iface) {
 
 static void
 nemo_dropbox_instance_init (NemoDropbox *cvs) {
-  cvs->filename2obj = g_hash_table_new_full((GHashFunc) g_str_hash,
-					    (GEqualFunc) g_str_equal,
-					    (GDestroyNotify) g_free,
-					    (GDestroyNotify) NULL);
-  cvs->obj2filename = g_hash_table_new_full((GHashFunc) g_direct_hash,
-					    (GEqualFunc) g_direct_equal,
-					    (GDestroyNotify) NULL,
-					    (GDestroyNotify) g_free);
+  dropbox_path_table_init(&(cvs->paths));
+  cvs->tracked_files = g_hash_table_new_full((GHashFunc) g_direct_hash,
+					     (GEqualFunc) g_direct_equal,
+					     (GDestroyNotify) NULL,
+					     (GDestroyNotify) tracked_file_free);
   cvs->emblem_paths_mutex = g_mutex_new();
   cvs->emblem_paths = NULL;
+  cvs->emblem_cache = g_hash_table_new_full((GHashFunc) g_direct_hash,
+					    (GEqualFunc) g_direct_equal,
+					    (GDestroyNotify) NULL,
+					    (GDestroyNotify) g_strfreev);
+  cvs->emblem_cache_hits = 0;
+  cvs->emblem_cache_misses = 0;
 
   /* setup the connection obj*/
   dropbox_client_setup(&(cvs->dc));
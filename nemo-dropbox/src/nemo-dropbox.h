@@ -32,6 +32,7 @@
 #include "dropbox-command-client.h"
 #include "nemo-dropbox-hooks.h"
 #include "dropbox-client.h"
+#include "dropbox-path-table.h"
 
 G_BEGIN_DECLS
 
@@ -47,10 +48,17 @@ typedef struct _NemoDropboxClass NemoDropboxClass;
 
 struct _NemoDropbox {
   GObject parent_slot;
-  GHashTable *filename2obj;
-  GHashTable *obj2filename;
+  /* every path we track, a path's file field is its file object */
+  DropboxPathTable paths;
+  /* file object -> the path we track it under */
+  GHashTable *tracked_files;
   GMutex *emblem_paths_mutex;
   GHashTable *emblem_paths;
+  /* DropboxPath -> emblems dropbox gave us for it, holds a reference
+     on the path, main loop only */
+  GHashTable *emblem_cache;
+  guint emblem_cache_hits;
+  guint emblem_cache_misses;
   DropboxClient dc;
 };
 
@@ -0,0 +1,339 @@
+/*
+ *  nemo-image-batch.c
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public
+ *  License along with this library; if not, write to the Free
+ *  Software Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+ #include <config.h>
+#endif
+
+#include "nemo-image-batch.h"
+
+#include <glib/gi18n-lib.h>
+#include <string.h>
+
+struct _NemoImageBatch {
+	NemoImageBatchOperation operation;
+	gchar *argument;
+	gchar *suffix;
+
+	NemoImageBatchFuncs funcs;
+	gpointer user_data;
+
+	GPtrArray *files;
+	GPtrArray *errors;
+
+	NemoImageJob *job;
+	int max_workers;
+	int in_process;
+
+	int done;
+	gboolean finished;
+	gboolean cancelled;
+};
+
+static void
+batch_error_free (NemoImageBatchError *error)
+{
+	g_free (error->path);
+	g_free (error->message);
+	g_free (error);
+}
+
+static void
+batch_report (NemoImageBatch *batch, GFile *file, const gchar *message)
+{
+	NemoImageBatchError *error = g_new (NemoImageBatchError, 1);
+
+	error->path = g_file_get_parse_name (file);
+	error->message = g_strdup (message);
+	g_ptr_array_add (batch->errors, error);
+}
+
+static GFile *
+batch_transform_filename (NemoImageBatch *batch, GFile *orig_file)
+{
+	GFile *parent_file, *new_file;
+	char *basename, *extension, *new_basename;
+
+	parent_file = g_file_get_parent (orig_file);
+
+	basename = g_file_get_basename (orig_file);
+
+	extension = g_strdup (strrchr (basename, '.'));
+	if (extension != NULL)
+		basename[strlen (basename) - strlen (extension)] = '\0';
+
+	new_basename = g_strdup_printf ("%s%s%s", basename,
+		batch->suffix == NULL ? ".tmp" : batch->suffix,
+		extension == NULL ? "" : extension);
+	g_free (basename);
+	g_free (extension);
+
+	new_file = g_file_get_child (parent_file, new_basename);
+
+	g_object_unref (parent_file);
+	g_free (new_basename);
+
+	return new_file;
+}
+
+static gchar **
+batch_build_argv (gpointer item, gpointer user_data)
+{
+	NemoImageBatch *batch = user_data;
+	GFile *orig_location = G_FILE (item);
+	GFile *new_location = batch_transform_filename (batch, orig_location);
+	GPtrArray *argv = g_ptr_array_new ();
+
+	/* FIXME: check whether new_uri already exists and provide "Replace _All", "_Skip", and "_Replace" options */
+
+	g_ptr_array_add (argv, g_strdup ("/usr/bin/convert"));
+	g_ptr_array_add (argv, g_file_get_path (orig_location));
+
+	switch (batch->operation) {
+	case NEMO_IMAGE_BATCH_RESIZE:
+		g_ptr_array_add (argv, g_strdup ("-resize"));
+		g_ptr_array_add (argv, g_strdup (batch->argument));
+		break;
+	case NEMO_IMAGE_BATCH_ROTATE:
+		g_ptr_array_add (argv, g_strdup ("-auto-orient"));
+		g_ptr_array_add (argv, g_strdup ("-rotate"));
+		g_ptr_array_add (argv, g_strdup (batch->argument));
+		g_ptr_array_add (argv, g_strdup ("-orient"));
+		g_ptr_array_add (argv, g_strdup ("TopLeft"));
+		break;
+	}
+
+	g_ptr_array_add (argv, g_file_get_path (new_location));
+	g_ptr_array_add (argv, NULL);
+
+	g_object_unref (new_location);
+
+	return (gchar **) g_ptr_array_free (argv, FALSE);
+}
+
+static void
+batch_item_done (gpointer item, gpointer user_data)
+{
+	NemoImageBatch *batch = user_data;
+	GFile *orig_location = G_FILE (item);
+	GError *error = NULL;
+
+	batch->done++;
+
+	if (batch->suffix == NULL) {
+		/* convert image in place */
+		GFile *new_location = batch_transform_filename (batch, orig_location);
+		if (!g_file_move (new_location, orig_location, G_FILE_COPY_OVERWRITE, NULL, NULL, NULL, &error)) {
+			batch_report (batch, orig_location, error->message);
+			g_error_free (error);
+		}
+		g_object_unref (new_location);
+	}
+}
+
+static NemoImageJobResponse
+batch_item_failed (gpointer item, const GError *error, gpointer user_data)
+{
+	NemoImageBatch *batch = user_data;
+	NemoImageJobResponse response = NEMO_IMAGE_JOB_SKIP;
+
+	if (batch->funcs.failed != NULL)
+		response = batch->funcs.failed (batch, G_FILE (item), error, batch->user_data);
+
+	if (response == NEMO_IMAGE_JOB_SKIP) {
+		batch->done++;
+		batch_report (batch, G_FILE (item), error->message);
+	}
+
+	return response;
+}
+
+static void
+batch_item_cancelled (gpointer item, gpointer user_data)
+{
+	NemoImageBatch *batch = user_data;
+
+	/* don't leave half written images behind */
+	GFile *new_location = batch_transform_filename (batch, G_FILE (item));
+	g_file_delete (new_location, NULL, NULL);
+	g_object_unref (new_location);
+}
+
+static void
+batch_progress (gpointer item, int done, int total, gpointer user_data)
+{
+	NemoImageBatch *batch = user_data;
+
+	if (batch->funcs.progress != NULL)
+		batch->funcs.progress (batch, item, batch->user_data);
+}
+
+static void
+batch_finished (gboolean cancelled, gpointer user_data)
+{
+	NemoImageBatch *batch = user_data;
+
+	batch->job = NULL;
+	batch->finished = TRUE;
+	batch->cancelled = cancelled;
+
+	if (batch->funcs.finished != NULL)
+		batch->funcs.finished (batch, batch->user_data);
+}
+
+static const NemoImageJobFuncs batch_job_funcs = {
+	batch_build_argv,
+	batch_item_done,
+	batch_item_failed,
+	batch_item_cancelled,
+	batch_progress,
+	batch_finished
+};
+
+NemoImageBatch *
+nemo_image_batch_new (NemoImageBatchOperation operation,
+		      const gchar *argument,
+		      const gchar *suffix)
+{
+	NemoImageBatch *batch = g_new0 (NemoImageBatch, 1);
+
+	batch->operation = operation;
+	batch->argument = g_strdup (argument);
+	batch->suffix = g_strdup (suffix);
+
+	batch->files = g_ptr_array_new_with_free_func (g_object_unref);
+	batch->errors = g_ptr_array_new_with_free_func ((GDestroyNotify) batch_error_free);
+
+	batch->max_workers = 0;
+	batch->in_process = -1;
+
+	return batch;
+}
+
+/* a running batch has to be cancelled and finished first */
+void
+nemo_image_batch_free (NemoImageBatch *batch)
+{
+	g_return_if_fail (batch->job == NULL);
+
+	g_ptr_array_free (batch->files, TRUE);
+	g_ptr_array_free (batch->errors, TRUE);
+	g_free (batch->argument);
+	g_free (batch->suffix);
+	g_free (batch);
+}
+
+void
+nemo_image_batch_add_file (NemoImageBatch *batch, GFile *file)
+{
+	g_return_if_fail (batch->job == NULL && !batch->finished);
+
+	/* convert only deals with local files */
+	if (!g_file_is_native (file)) {
+		batch_report (batch, file, _("Not a local file"));
+		return;
+	}
+
+	g_ptr_array_add (batch->files, g_object_ref (file));
+}
+
+void
+nemo_image_batch_set_funcs (NemoImageBatch *batch, const NemoImageBatchFuncs *funcs, gpointer user_data)
+{
+	batch->funcs = *funcs;
+	batch->user_data = user_data;
+}
+
+void
+nemo_image_batch_set_max_workers (NemoImageBatch *batch, int max_workers)
+{
+	batch->max_workers = max_workers;
+}
+
+void
+nemo_image_batch_set_in_process (NemoImageBatch *batch, gboolean in_process)
+{
+	batch->in_process = in_process;
+}
+
+void
+nemo_image_batch_start (NemoImageBatch *batch)
+{
+	GList *items = NULL;
+	guint i;
+
+	g_return_if_fail (batch->job == NULL && !batch->finished);
+
+	for (i = batch->files->len; i > 0; i--)
+		items = g_list_prepend (items, g_ptr_array_index (batch->files, i - 1));
+
+	batch->job = nemo_image_job_new (items, &batch_job_funcs, batch);
+	g_list_free (items);
+
+	if (batch->max_workers > 0)
+		nemo_image_job_set_max_workers (batch->job, batch->max_workers);
+	if (batch->in_process >= 0)
+		nemo_image_job_set_in_process (batch->job, batch->in_process);
+
+	nemo_image_job_start (batch->job);
+}
+
+void
+nemo_image_batch_cancel (NemoImageBatch *batch)
+{
+	if (batch->job != NULL)
+		nemo_image_job_cancel (batch->job);
+}
+
+int
+nemo_image_batch_get_done (NemoImageBatch *batch)
+{
+	return batch->done;
+}
+
+int
+nemo_image_batch_get_total (NemoImageBatch *batch)
+{
+	return batch->files->len;
+}
+
+gboolean
+nemo_image_batch_is_running (NemoImageBatch *batch)
+{
+	return batch->job != NULL;
+}
+
+gboolean
+nemo_image_batch_is_finished (NemoImageBatch *batch)
+{
+	return batch->finished;
+}
+
+gboolean
+nemo_image_batch_was_cancelled (NemoImageBatch *batch)
+{
+	return batch->cancelled;
+}
+
+/* NemoImageBatchError for every image that could not be converted */
+GPtrArray *
+nemo_image_batch_get_errors (NemoImageBatch *batch)
+{
+	return batch->errors;
+}
@@ -0,0 +1,79 @@
+/*
+ *  nemo-image-batch.h
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public
+ *  License along with this library; if not, write to the Free
+ *  Software Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+#ifndef NEMO_IMAGE_BATCH_H
+#define NEMO_IMAGE_BATCH_H
+
+#include <gio/gio.h>
+
+#include "nemo-image-job.h"
+
+G_BEGIN_DECLS
+
+/*
+ * A batch of images to resize or rotate, without any UI.  Used by the
+ * nemo extension dialogs as well as by nemo-image-convert, which runs
+ * batches from the command line or for other processes over D-Bus.
+ */
+
+typedef struct _NemoImageBatch NemoImageBatch;
+
+typedef enum {
+	NEMO_IMAGE_BATCH_RESIZE,
+	NEMO_IMAGE_BATCH_ROTATE
+} NemoImageBatchOperation;
+
+typedef struct {
+	gchar *path;
+	gchar *message;
+} NemoImageBatchError;
+
+typedef struct {
+	/* may be NULL, failed images are then skipped and only reported */
+	NemoImageJobResponse (*failed) (NemoImageBatch *batch, GFile *file, const GError *error, gpointer user_data);
+	/* may be NULL, file is NULL when nothing new was started */
+	void (*progress) (NemoImageBatch *batch, GFile *file, gpointer user_data);
+	/* may be NULL */
+	void (*finished) (NemoImageBatch *batch, gpointer user_data);
+} NemoImageBatchFuncs;
+
+/* argument is the convert geometry or angle, a NULL suffix converts in place */
+NemoImageBatch *nemo_image_batch_new (NemoImageBatchOperation operation,
+				      const gchar *argument,
+				      const gchar *suffix);
+void nemo_image_batch_free (NemoImageBatch *batch);
+
+void nemo_image_batch_add_file (NemoImageBatch *batch, GFile *file);
+void nemo_image_batch_set_funcs (NemoImageBatch *batch, const NemoImageBatchFuncs *funcs, gpointer user_data);
+void nemo_image_batch_set_max_workers (NemoImageBatch *batch, int max_workers);
+void nemo_image_batch_set_in_process (NemoImageBatch *batch, gboolean in_process);
+
+void nemo_image_batch_start (NemoImageBatch *batch);
+void nemo_image_batch_cancel (NemoImageBatch *batch);
+
+int nemo_image_batch_get_done (NemoImageBatch *batch);
+int nemo_image_batch_get_total (NemoImageBatch *batch);
+gboolean nemo_image_batch_is_running (NemoImageBatch *batch);
+gboolean nemo_image_batch_is_finished (NemoImageBatch *batch);
+gboolean nemo_image_batch_was_cancelled (NemoImageBatch *batch);
+GPtrArray *nemo_image_batch_get_errors (NemoImageBatch *batch);
+
+G_END_DECLS
+
+#endif /* NEMO_IMAGE_BATCH_H */
@@ -0,0 +1,230 @@
+/*
+ *  nemo-image-convert-benchmark.c
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public
+ *  License along with this library; if not, write to the Free
+ *  Software Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+ #include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <gio/gio.h>
+#include <glib/gstdio.h>
+
+#include "nemo-image-pixbuf.h"
+
+/*
+ * Times the in-process backend against spawning convert on the same
+ * files, one file at a time, for a resize and a rotation:
+ *
+ *   nemo-image-convert-benchmark [--resize 25%] [--runs 3] photo*.jpg
+ *
+ * Files the in-process backend hands to convert, like TIFFs or PNGs
+ * with metadata, are counted but left out of both timings.
+ * Built with -Dbenchmarks=true, not installed.
+ */
+
+static gchar *resize_geometry = NULL;
+static gint runs = 3;
+static gchar **filenames = NULL;
+
+static GOptionEntry entries[] = {
+	{ "resize", 0, 0, G_OPTION_ARG_STRING, &resize_geometry, "Resize to GEOMETRY, 25% by default", "GEOMETRY" },
+	{ "runs", 0, 0, G_OPTION_ARG_INT, &runs, "Convert every file N times and keep the fastest, 3 by default", "N" },
+	{ G_OPTION_REMAINING, 0, 0, G_OPTION_ARG_FILENAME_ARRAY, &filenames, NULL, "FILE…" },
+	{ NULL }
+};
+
+typedef struct {
+	const gchar *name;
+	gdouble in_process;
+	gdouble spawned;
+	guint files;
+	guint fallbacks;
+} Result;
+
+static gchar **
+build_argv (const gchar *op, const gchar *src, const gchar *dest)
+{
+	GPtrArray *argv = g_ptr_array_new ();
+
+	g_ptr_array_add (argv, g_strdup ("/usr/bin/convert"));
+	g_ptr_array_add (argv, g_strdup (src));
+
+	if (strcmp (op, "rotate") == 0) {
+		g_ptr_array_add (argv, g_strdup ("-auto-orient"));
+		g_ptr_array_add (argv, g_strdup ("-rotate"));
+		g_ptr_array_add (argv, g_strdup ("90"));
+		g_ptr_array_add (argv, g_strdup ("-orient"));
+		g_ptr_array_add (argv, g_strdup ("TopLeft"));
+	} else {
+		g_ptr_array_add (argv, g_strdup ("-resize"));
+		g_ptr_array_add (argv, g_strdup (resize_geometry));
+	}
+
+	g_ptr_array_add (argv, g_strdup (dest));
+	g_ptr_array_add (argv, NULL);
+
+	return (gchar **) g_ptr_array_free (argv, FALSE);
+}
+
+/* the fastest of runs, in seconds, or a negative value on failure */
+static gdouble
+time_in_process (gchar **argv, gboolean *fallback)
+{
+	gdouble best = G_MAXDOUBLE;
+	gint i;
+
+	for (i = 0; i < runs; i++) {
+		GError *error = NULL;
+		gint64 start = g_get_monotonic_time ();
+
+		if (!nemo_image_pixbuf_convert (argv, &error)) {
+			*fallback = g_error_matches (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED);
+			if (!*fallback)
+				g_printerr ("%s: %s\n", argv[1], error->message);
+			g_error_free (error);
+			return -1;
+		}
+
+		best = MIN (best, (g_get_monotonic_time () - start) / (gdouble) G_USEC_PER_SEC);
+	}
+
+	return best;
+}
+
+static gdouble
+time_spawned (gchar **argv)
+{
+	gdouble best = G_MAXDOUBLE;
+	gint i;
+
+	for (i = 0; i < runs; i++) {
+		GError *error = NULL;
+		gint64 start = g_get_monotonic_time ();
+		gint status;
+
+		if (!g_spawn_sync (NULL, argv, NULL,
+				   G_SPAWN_STDOUT_TO_DEV_NULL | G_SPAWN_STDERR_TO_DEV_NULL,
+				   NULL, NULL, NULL, NULL, &status, &error) ||
+		    !g_spawn_check_wait_status (status, &error)) {
+			g_printerr ("%s: %s\n", argv[1], error->message);
+			g_error_free (error);
+			return -1;
+		}
+
+		best = MIN (best, (g_get_monotonic_time () - start) / (gdouble) G_USEC_PER_SEC);
+	}
+
+	return best;
+}
+
+static void
+run_operation (Result *result, const gchar *tmp_dir)
+{
+	gint i;
+
+	for (i = 0; filenames[i] != NULL; i++) {
+		gchar *basename, *dest;
+		gchar **argv;
+		gboolean fallback = FALSE;
+		gdouble in_process, spawned;
+
+		basename = g_path_get_basename (filenames[i]);
+		dest = g_build_filename (tmp_dir, basename, NULL);
+		argv = build_argv (result->name, filenames[i], dest);
+
+		in_process = time_in_process (argv, &fallback);
+		if (in_process < 0) {
+			if (fallback)
+				result->fallbacks++;
+		} else if ((spawned = time_spawned (argv)) >= 0) {
+			result->in_process += in_process;
+			result->spawned += spawned;
+			result->files++;
+		}
+
+		g_unlink (dest);
+		g_strfreev (argv);
+		g_free (dest);
+		g_free (basename);
+	}
+}
+
+int
+main (int argc, char *argv[])
+{
+	GOptionContext *context;
+	GError *error = NULL;
+	Result results[] = {
+		{ "resize", 0, 0, 0, 0 },
+		{ "rotate", 0, 0, 0, 0 },
+	};
+	gchar *tmp_dir;
+	guint i;
+
+	context = g_option_context_new ("- compare the in-process and convert backends");
+	g_option_context_add_main_entries (context, entries, NULL);
+
+	if (!g_option_context_parse (context, &argc, &argv, &error)) {
+		g_printerr ("%s\n", error->message);
+		return 2;
+	}
+
+	if (filenames == NULL || runs < 1) {
+		g_printerr ("%s", g_option_context_get_help (context, TRUE, NULL));
+		return 2;
+	}
+
+	if (resize_geometry == NULL)
+		resize_geometry = g_strdup ("25%");
+
+	tmp_dir = g_dir_make_tmp ("nemo-image-convert-benchmark-XXXXXX", &error);
+	if (tmp_dir == NULL) {
+		g_printerr ("%s\n", error->message);
+		return 1;
+	}
+
+	g_print ("%-8s %6s %10s %14s %12s %8s\n",
+		 "op", "files", "fallbacks", "in-process ms", "convert ms", "speedup");
+
+	for (i = 0; i < G_N_ELEMENTS (results); i++) {
+		Result *result = &results[i];
+
+		run_operation (result, tmp_dir);
+
+		if (result->files == 0) {
+			g_print ("%-8s %6u %10u %14s %12s %8s\n",
+				 result->name, 0, result->fallbacks, "-", "-", "-");
+			continue;
+		}
+
+		g_print ("%-8s %6u %10u %14.1f %12.1f %7.1fx\n",
+			 result->name, result->files, result->fallbacks,
+			 1000 * result->in_process / result->files,
+			 1000 * result->spawned / result->files,
+			 result->spawned / result->in_process);
+	}
+
+	g_rmdir (tmp_dir);
+	g_free (tmp_dir);
+	g_option_context_free (context);
+
+	return 0;
+}
@@ -0,0 +1,511 @@
+/*
+ *  nemo-image-convert.c
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public
+ *  License along with this library; if not, write to the Free
+ *  Software Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+ #include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <gio/gio.h>
+
+#include "nemo-image-batch.h"
+
+/*
+ * Runs image batches without nemo.  Either converts the files given on
+ * the command line, or with --service owns org.nemo.ImageConverter on
+ * the session bus and runs the batches other processes queue there,
+ * one after the other.
+ */
+
+#define SERVICE_NAME "org.nemo.ImageConverter"
+#define SERVICE_PATH "/org/nemo/ImageConverter"
+
+/* the service goes away when it had nothing to do for this long */
+#define SERVICE_IDLE_TIMEOUT 300
+
+static const gchar introspection_xml[] =
+	"<node>"
+	"  <interface name='org.nemo.ImageConverter'>"
+	"    <method name='Resize'>"
+	"      <arg type='as' name='files' direction='in'/>"
+	"      <arg type='s' name='geometry' direction='in'/>"
+	"      <arg type='s' name='suffix' direction='in'/>"
+	"      <arg type='u' name='job' direction='out'/>"
+	"    </method>"
+	"    <method name='Rotate'>"
+	"      <arg type='as' name='files' direction='in'/>"
+	"      <arg type='s' name='angle' direction='in'/>"
+	"      <arg type='s' name='suffix' direction='in'/>"
+	"      <arg type='u' name='job' direction='out'/>"
+	"    </method>"
+	"    <method name='GetProgress'>"
+	"      <arg type='u' name='job' direction='in'/>"
+	"      <arg type='u' name='done' direction='out'/>"
+	"      <arg type='u' name='total' direction='out'/>"
+	"      <arg type='b' name='finished' direction='out'/>"
+	"    </method>"
+	"    <method name='GetReport'>"
+	"      <arg type='u' name='job' direction='in'/>"
+	"      <arg type='a(ss)' name='errors' direction='out'/>"
+	"    </method>"
+	"    <method name='Cancel'>"
+	"      <arg type='u' name='job' direction='in'/>"
+	"    </method>"
+	"    <method name='Forget'>"
+	"      <arg type='u' name='job' direction='in'/>"
+	"    </method>"
+	"    <signal name='JobFinished'>"
+	"      <arg type='u' name='job'/>"
+	"      <arg type='b' name='cancelled'/>"
+	"      <arg type='u' name='errors'/>"
+	"    </signal>"
+	"  </interface>"
+	"</node>";
+
+static gchar *resize_geometry = NULL;
+static gchar *rotate_angle = NULL;
+static gchar *suffix = NULL;
+static gint max_workers = 0;
+static gchar *backend = NULL;
+static gboolean run_service = FALSE;
+static gboolean quiet = FALSE;
+static gchar **filenames = NULL;
+
+static GOptionEntry entries[] = {
+	{ "resize", 0, 0, G_OPTION_ARG_STRING, &resize_geometry, "Resize to GEOMETRY, like 50% or 640x480", "GEOMETRY" },
+	{ "rotate", 0, 0, G_OPTION_ARG_STRING, &rotate_angle, "Rotate clockwise by ANGLE degrees", "ANGLE" },
+	{ "suffix", 0, 0, G_OPTION_ARG_STRING, &suffix, "Write next to the original with SUFFIX appended instead of in place", "SUFFIX" },
+	{ "jobs", 'j', 0, G_OPTION_ARG_INT, &max_workers, "Convert N images at a time, the number of CPUs by default", "N" },
+	{ "backend", 0, 0, G_OPTION_ARG_STRING, &backend, "auto, or convert to always spawn ImageMagick", "BACKEND" },
+	{ "service", 0, 0, G_OPTION_ARG_NONE, &run_service, "Run the " SERVICE_NAME " session service", NULL },
+	{ "quiet", 'q', 0, G_OPTION_ARG_NONE, &quiet, "Don't show progress", NULL },
+	{ G_OPTION_REMAINING, 0, 0, G_OPTION_ARG_FILENAME_ARRAY, &filenames, NULL, "FILE…" },
+	{ NULL }
+};
+
+static GMainLoop *loop;
+
+static void
+configure_batch (NemoImageBatch *batch)
+{
+	if (max_workers > 0)
+		nemo_image_batch_set_max_workers (batch, max_workers);
+	if (backend != NULL)
+		nemo_image_batch_set_in_process (batch, strcmp (backend, "convert") != 0);
+}
+
+/* command line */
+
+static void
+cli_progress (NemoImageBatch *batch, GFile *file, gpointer user_data)
+{
+	if (quiet || !isatty (STDOUT_FILENO))
+		return;
+
+	g_print ("\r%d/%d", nemo_image_batch_get_done (batch), nemo_image_batch_get_total (batch));
+}
+
+static void
+cli_finished (NemoImageBatch *batch, gpointer user_data)
+{
+	g_main_loop_quit (loop);
+}
+
+static const NemoImageBatchFuncs cli_funcs = {
+	NULL,
+	cli_progress,
+	cli_finished
+};
+
+static int
+run_batch (NemoImageBatchOperation operation, const gchar *argument)
+{
+	NemoImageBatch *batch;
+	GPtrArray *errors;
+	guint i;
+	int status;
+
+	batch = nemo_image_batch_new (operation, argument, suffix);
+	for (i = 0; filenames[i] != NULL; i++) {
+		GFile *file = g_file_new_for_commandline_arg (filenames[i]);
+		nemo_image_batch_add_file (batch, file);
+		g_object_unref (file);
+	}
+
+	configure_batch (batch);
+	nemo_image_batch_set_funcs (batch, &cli_funcs, NULL);
+	nemo_image_batch_start (batch);
+
+	if (nemo_image_batch_is_running (batch))
+		g_main_loop_run (loop);
+
+	if (!quiet && isatty (STDOUT_FILENO))
+		g_print ("\n");
+
+	/* the report */
+	errors = nemo_image_batch_get_errors (batch);
+	for (i = 0; i < errors->len; i++) {
+		NemoImageBatchError *error = g_ptr_array_index (errors, i);
+		g_printerr ("%s: %s\n", error->path, error->message);
+	}
+
+	status = errors->len > 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+	nemo_image_batch_free (batch);
+
+	return status;
+}
+
+/* service */
+
+typedef struct {
+	GDBusConnection *connection;
+	GHashTable *jobs;
+	GQueue *queue;
+	NemoImageBatch *current;
+	guint32 next_id;
+	guint idle_id;
+	/* the main loop has quit, only the running batch is waited for */
+	gboolean shutting_down;
+} Service;
+
+static void service_run_next (Service *service);
+
+/* the service is held while a batch runs or waits, so nobody loses the
+ * report of a batch they queued */
+static gboolean
+service_is_busy (Service *service)
+{
+	return service->current != NULL || !g_queue_is_empty (service->queue);
+}
+
+static gboolean
+service_idle_timeout (gpointer user_data)
+{
+	Service *service = user_data;
+
+	service->idle_id = 0;
+	if (!service_is_busy (service))
+		g_main_loop_quit (loop);
+
+	return FALSE;
+}
+
+/* any call keeps the service alive, the timer only runs while nothing is
+ * running or queued; it restarts when the last batch finishes, so its
+ * report stays available for SERVICE_IDLE_TIMEOUT */
+static void
+service_touch (Service *service)
+{
+	if (service->idle_id != 0) {
+		g_source_remove (service->idle_id);
+		service->idle_id = 0;
+	}
+
+	if (!service_is_busy (service))
+		service->idle_id = g_timeout_add_seconds (SERVICE_IDLE_TIMEOUT, service_idle_timeout, service);
+}
+
+static guint32
+service_find_id (Service *service, NemoImageBatch *batch)
+{
+	GHashTableIter iter;
+	gpointer key, value;
+
+	g_hash_table_iter_init (&iter, service->jobs);
+	while (g_hash_table_iter_next (&iter, &key, &value)) {
+		if (value == batch)
+			return GPOINTER_TO_UINT (key);
+	}
+
+	return 0;
+}
+
+static void
+service_finished (NemoImageBatch *batch, gpointer user_data)
+{
+	Service *service = user_data;
+
+	g_dbus_connection_emit_signal (service->connection, NULL,
+				       SERVICE_PATH, SERVICE_NAME, "JobFinished",
+				       g_variant_new ("(ubu)",
+						      service_find_id (service, batch),
+						      nemo_image_batch_was_cancelled (batch),
+						      nemo_image_batch_get_errors (batch)->len),
+				       NULL);
+
+	service->current = NULL;
+
+	if (service->shutting_down) {
+		g_main_loop_quit (loop);
+		return;
+	}
+
+	service_run_next (service);
+}
+
+static const NemoImageBatchFuncs service_funcs = {
+	NULL,
+	NULL,
+	service_finished
+};
+
+static void
+service_run_next (Service *service)
+{
+	while (service->current == NULL && !g_queue_is_empty (service->queue)) {
+		service->current = g_queue_pop_head (service->queue);
+		/* may finish right away when there is nothing to convert */
+		nemo_image_batch_start (service->current);
+	}
+
+	service_touch (service);
+}
+
+/* Callers don't share our working directory, so relative paths would
+ * resolve against the wrong one; only URIs and absolute paths are taken.
+ * Returns 0 with @error set if any file is neither.
+ */
+static guint32
+service_queue (Service *service, NemoImageBatchOperation operation, GVariant *parameters, GError **error)
+{
+	NemoImageBatch *batch;
+	const gchar **files;
+	const gchar *argument, *batch_suffix;
+	gchar *scheme;
+	guint32 id;
+	gsize i;
+
+	g_variant_get (parameters, "(^a&s&s&s)", &files, &argument, &batch_suffix);
+
+	for (i = 0; files[i] != NULL; i++) {
+		scheme = g_uri_parse_scheme (files[i]);
+		g_free (scheme);
+
+		if (scheme == NULL && !g_path_is_absolute (files[i])) {
+			g_set_error (error, G_DBUS_ERROR, G_DBUS_ERROR_INVALID_ARGS,
+				     "Not a URI or an absolute path: %s", files[i]);
+			g_free (files);
+			return 0;
+		}
+	}
+
+	batch = nemo_image_batch_new (operation, argument,
+				      batch_suffix[0] == '\0' ? NULL : batch_suffix);
+	for (i = 0; files[i] != NULL; i++) {
+		GFile *file = g_file_new_for_commandline_arg (files[i]);
+		nemo_image_batch_add_file (batch, file);
+		g_object_unref (file);
+	}
+	g_free (files);
+
+	configure_batch (batch);
+	nemo_image_batch_set_funcs (batch, &service_funcs, service);
+
+	id = ++service->next_id;
+	g_hash_table_insert (service->jobs, GUINT_TO_POINTER (id), batch);
+	g_queue_push_tail (service->queue, batch);
+
+	return id;
+}
+
+static void
+service_method_call (GDBusConnection *connection,
+		     const gchar *sender,
+		     const gchar *object_path,
+		     const gchar *interface_name,
+		     const gchar *method_name,
+		     GVariant *parameters,
+		     GDBusMethodInvocation *invocation,
+		     gpointer user_data)
+{
+	Service *service = user_data;
+	NemoImageBatch *batch = NULL;
+	GError *error = NULL;
+	guint32 id = 0;
+
+	if (strcmp (method_name, "Resize") == 0 || strcmp (method_name, "Rotate") == 0) {
+		id = service_queue (service,
+				    strcmp (method_name, "Resize") == 0 ? NEMO_IMAGE_BATCH_RESIZE : NEMO_IMAGE_BATCH_ROTATE,
+				    parameters, &error);
+		if (id == 0) {
+			g_dbus_method_invocation_take_error (invocation, error);
+			service_touch (service);
+			return;
+		}
+
+		g_dbus_method_invocation_return_value (invocation, g_variant_new ("(u)", id));
+		service_run_next (service);
+		return;
+	}
+
+	g_variant_get (parameters, "(u)", &id);
+	batch = g_hash_table_lookup (service->jobs, GUINT_TO_POINTER (id));
+	if (batch == NULL) {
+		g_dbus_method_invocation_return_error (invocation, G_DBUS_ERROR, G_DBUS_ERROR_INVALID_ARGS,
+						       "No such job %u", id);
+		return;
+	}
+
+	if (strcmp (method_name, "GetProgress") == 0) {
+		g_dbus_method_invocation_return_value (invocation,
+			g_variant_new ("(uub)",
+				       nemo_image_batch_get_done (batch),
+				       nemo_image_batch_get_total (batch),
+				       nemo_image_batch_is_finished (batch)));
+	} else if (strcmp (method_name, "GetReport") == 0) {
+		GPtrArray *errors = nemo_image_batch_get_errors (batch);
+		GVariantBuilder builder;
+		guint i;
+
+		g_variant_builder_init (&builder, G_VARIANT_TYPE ("a(ss)"));
+		for (i = 0; i < errors->len; i++) {
+			NemoImageBatchError *error = g_ptr_array_index (errors, i);
+			g_variant_builder_add (&builder, "(ss)", error->path, error->message);
+		}
+		g_dbus_method_invocation_return_value (invocation, g_variant_new ("(a(ss))", &builder));
+	} else if (strcmp (method_name, "Cancel") == 0) {
+		if (nemo_image_batch_is_running (batch)) {
+			nemo_image_batch_cancel (batch);
+		} else if (g_queue_remove (service->queue, batch)) {
+			/* never started, nothing to kill */
+			g_hash_table_remove (service->jobs, GUINT_TO_POINTER (id));
+		}
+		g_dbus_method_invocation_return_value (invocation, NULL);
+	} else if (strcmp (method_name, "Forget") == 0) {
+		/* running and queued batches stay, Cancel them first */
+		if (nemo_image_batch_is_finished (batch))
+			g_hash_table_remove (service->jobs, GUINT_TO_POINTER (id));
+		g_dbus_method_invocation_return_value (invocation, NULL);
+	}
+
+	service_touch (service);
+}
+
+static const GDBusInterfaceVTable service_vtable = {
+	service_method_call,
+	NULL,
+	NULL
+};
+
+static void
+on_bus_acquired (GDBusConnection *connection, const gchar *name, gpointer user_data)
+{
+	Service *service = user_data;
+	GDBusNodeInfo *introspection_data;
+	GError *error = NULL;
+
+	service->connection = connection;
+
+	introspection_data = g_dbus_node_info_new_for_xml (introspection_xml, NULL);
+	if (g_dbus_connection_register_object (connection, SERVICE_PATH,
+					       introspection_data->interfaces[0],
+					       &service_vtable, service, NULL, &error) == 0) {
+		g_warning ("%s", error->message);
+		g_error_free (error);
+		g_main_loop_quit (loop);
+	}
+	g_dbus_node_info_unref (introspection_data);
+}
+
+static void
+on_name_lost (GDBusConnection *connection, const gchar *name, gpointer user_data)
+{
+	g_printerr ("Could not own %s on the session bus\n", name);
+	g_main_loop_quit (loop);
+}
+
+static int
+run_service_loop (void)
+{
+	Service service = { NULL, };
+	guint owner_id;
+
+	service.jobs = g_hash_table_new_full (g_direct_hash, g_direct_equal,
+					      NULL, (GDestroyNotify) nemo_image_batch_free);
+	service.queue = g_queue_new ();
+
+	owner_id = g_bus_own_name (G_BUS_TYPE_SESSION, SERVICE_NAME, G_BUS_NAME_OWNER_FLAGS_NONE,
+				   on_bus_acquired, NULL, on_name_lost, &service, NULL);
+
+	service_touch (&service);
+	g_main_loop_run (loop);
+
+	g_bus_unown_name (owner_id);
+
+	/* when the name is lost, batches may still be queued or running;
+	 * the queued ones never start, the running one is cancelled and
+	 * waited for, its workers and children still refer to it */
+	service.shutting_down = TRUE;
+	g_queue_clear (service.queue);
+
+	if (service.current != NULL && nemo_image_batch_is_running (service.current)) {
+		nemo_image_batch_cancel (service.current);
+
+		/* service_finished quits the loop again */
+		if (service.current != NULL)
+			g_main_loop_run (loop);
+	}
+
+	if (service.idle_id != 0)
+		g_source_remove (service.idle_id);
+
+	g_queue_free (service.queue);
+	g_hash_table_destroy (service.jobs);
+
+	return EXIT_SUCCESS;
+}
+
+int
+main (int argc, char **argv)
+{
+	GOptionContext *context;
+	GError *error = NULL;
+	int status;
+
+	context = g_option_context_new (NULL);
+	g_option_context_set_summary (context, "Resize or rotate images in bulk.");
+	g_option_context_add_main_entries (context, entries, NULL);
+	if (!g_option_context_parse (context, &argc, &argv, &error)) {
+		g_printerr ("%s\n", error->message);
+		g_error_free (error);
+		return 2;
+	}
+	g_option_context_free (context);
+
+	loop = g_main_loop_new (NULL, FALSE);
+
+	if (run_service) {
+		status = run_service_loop ();
+	} else if ((resize_geometry == NULL) == (rotate_angle == NULL) || filenames == NULL) {
+		g_printerr ("Give either --resize or --rotate, and some files\n");
+		status = 2;
+	} else if (resize_geometry != NULL) {
+		status = run_batch (NEMO_IMAGE_BATCH_RESIZE, resize_geometry);
+	} else {
+		status = run_batch (NEMO_IMAGE_BATCH_ROTATE, rotate_angle);
+	}
+
+	g_main_loop_unref (loop);
+
+	return status;
+}
@@ -0,0 +1,330 @@
+/*
+ *  nemo-image-job.c
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public
+ *  License along with this library; if not, write to the Free
+ *  Software Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+ #include <config.h>
+#endif
+
+#include "nemo-image-job.h"
+#include "nemo-image-pixbuf.h"
+
+#include <signal.h>
+#include <sys/types.h>
+
+#include <gio/gio.h>
+
+/*
+ * Runs one conversion per item, up to max_workers at a time.
+ * Results are always handled on the main loop: children are reaped
+ * through g_child_watch_add, in-process conversions come back from
+ * the thread pool through an idle, and the next item is started from
+ * there.
+ *
+ * Unless NEMO_IMAGE_CONVERTER_BACKEND=convert is set, a command line
+ * is first run in-process with GdkPixbuf and only spawned when that
+ * can't handle it.
+ */
+
+typedef struct {
+	NemoImageJob *job;
+	gpointer item;
+	gchar **argv;
+	GPid pid;
+	GError *error;
+} NemoImageJobWorker;
+
+typedef struct {
+	gpointer item;
+	GError *error;
+} NemoImageJobFailure;
+
+struct _NemoImageJob {
+	NemoImageJobFuncs funcs;
+	gpointer user_data;
+
+	GQueue *pending;
+	GQueue *failures;
+	GPtrArray *running;
+	GThreadPool *pool;
+
+	int max_workers;
+	int done;
+	int total;
+
+	gboolean in_process;
+	gboolean pumping;
+	gboolean cancelled;
+};
+
+static void job_pump (NemoImageJob *job);
+static void job_kill (NemoImageJob *job);
+
+static void
+job_free (NemoImageJob *job)
+{
+	if (job->pool != NULL)
+		g_thread_pool_free (job->pool, TRUE, FALSE);
+	g_queue_free (job->pending);
+	g_queue_free (job->failures);
+	g_ptr_array_free (job->running, TRUE);
+	g_free (job);
+}
+
+static void
+job_fail (NemoImageJob *job, gpointer item, GError *error)
+{
+	NemoImageJobFailure *failure = g_new (NemoImageJobFailure, 1);
+
+	failure->item = item;
+	failure->error = error;
+	g_queue_push_tail (job->failures, failure);
+}
+
+/* takes error, NULL when item was converted */
+static void
+worker_finish (NemoImageJobWorker *worker, GError *error)
+{
+	NemoImageJob *job = worker->job;
+
+	g_ptr_array_remove_fast (job->running, worker);
+
+	if (job->cancelled) {
+		if (job->funcs.item_cancelled != NULL)
+			job->funcs.item_cancelled (worker->item, job->user_data);
+		g_clear_error (&error);
+	} else if (error == NULL) {
+		job->done++;
+		job->funcs.item_done (worker->item, job->user_data);
+		job->funcs.progress (NULL, job->done, job->total, job->user_data);
+	} else {
+		job_fail (job, worker->item, error);
+	}
+
+	g_strfreev (worker->argv);
+	g_free (worker);
+
+	job_pump (job);
+}
+
+static void
+worker_exited (GPid pid, gint status, gpointer data)
+{
+	NemoImageJobWorker *worker = data;
+	GError *error = NULL;
+
+	g_spawn_close_pid (pid);
+	worker->pid = 0;
+
+	g_spawn_check_wait_status (status, &error);
+	worker_finish (worker, error);
+}
+
+static void
+worker_spawn (NemoImageJobWorker *worker)
+{
+	GError *error = NULL;
+
+	if (!g_spawn_async (NULL, worker->argv, NULL, G_SPAWN_DO_NOT_REAP_CHILD,
+			    NULL, NULL, &worker->pid, &error)) {
+		worker_finish (worker, error);
+		return;
+	}
+
+	g_child_watch_add (worker->pid, worker_exited, worker);
+}
+
+static gboolean
+worker_converted (gpointer data)
+{
+	NemoImageJobWorker *worker = data;
+	GError *error = worker->error;
+
+	worker->error = NULL;
+
+	/* formats and options we can't do ourselves go to convert */
+	if (!worker->job->cancelled &&
+	    g_error_matches (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED)) {
+		g_error_free (error);
+		worker_spawn (worker);
+		return FALSE;
+	}
+
+	worker_finish (worker, error);
+
+	return FALSE;
+}
+
+/* runs in the thread pool */
+static void
+worker_convert (gpointer data, gpointer user_data)
+{
+	NemoImageJobWorker *worker = data;
+
+	nemo_image_pixbuf_convert (worker->argv, &worker->error);
+	g_idle_add (worker_converted, worker);
+}
+
+static void
+job_start_item (NemoImageJob *job, gpointer item)
+{
+	NemoImageJobWorker *worker;
+
+	worker = g_new0 (NemoImageJobWorker, 1);
+	worker->job = job;
+	worker->item = item;
+	worker->argv = job->funcs.build_argv (item, job->user_data);
+	g_ptr_array_add (job->running, worker);
+
+	job->funcs.progress (item, job->done, job->total, job->user_data);
+
+	if (job->in_process) {
+		if (job->pool == NULL)
+			job->pool = g_thread_pool_new (worker_convert, NULL, job->max_workers, FALSE, NULL);
+		g_thread_pool_push (job->pool, worker, NULL);
+	} else {
+		worker_spawn (worker);
+	}
+}
+
+static void
+job_pump (NemoImageJob *job)
+{
+	/* item_failed may run a dialog, workers finishing meanwhile
+	 * land here and are dealt with once it returns */
+	if (job->pumping)
+		return;
+	job->pumping = TRUE;
+
+	do {
+		while (!job->cancelled && !g_queue_is_empty (job->failures)) {
+			NemoImageJobFailure *failure = g_queue_pop_head (job->failures);
+			NemoImageJobResponse response;
+
+			response = job->funcs.item_failed (failure->item, failure->error, job->user_data);
+
+			switch (response) {
+			case NEMO_IMAGE_JOB_RETRY:
+				g_queue_push_head (job->pending, failure->item);
+				break;
+			case NEMO_IMAGE_JOB_SKIP:
+				job->done++;
+				job->funcs.progress (NULL, job->done, job->total, job->user_data);
+				break;
+			case NEMO_IMAGE_JOB_CANCEL:
+				job_kill (job);
+				break;
+			}
+
+			g_clear_error (&failure->error);
+			g_free (failure);
+		}
+
+		while (!job->cancelled &&
+		       (int) job->running->len < job->max_workers &&
+		       !g_queue_is_empty (job->pending)) {
+			job_start_item (job, g_queue_pop_head (job->pending));
+		}
+
+		/* spawning can fail straight away */
+	} while (!job->cancelled && !g_queue_is_empty (job->failures));
+
+	job->pumping = FALSE;
+
+	if (job->running->len == 0 &&
+	    (job->cancelled || g_queue_is_empty (job->pending))) {
+		job->funcs.finished (job->cancelled, job->user_data);
+		job_free (job);
+	}
+}
+
+NemoImageJob *
+nemo_image_job_new (GList *items, const NemoImageJobFuncs *funcs, gpointer user_data)
+{
+	NemoImageJob *job = g_new0 (NemoImageJob, 1);
+	GList *l;
+
+	job->funcs = *funcs;
+	job->user_data = user_data;
+
+	job->pending = g_queue_new ();
+	job->failures = g_queue_new ();
+	job->running = g_ptr_array_new ();
+
+	for (l = items; l != NULL; l = l->next)
+		g_queue_push_tail (job->pending, l->data);
+	job->total = g_queue_get_length (job->pending);
+
+	/* convert is single threaded for most operations, keep every core busy */
+	job->max_workers = g_get_num_processors ();
+
+	job->in_process = g_strcmp0 (g_getenv ("NEMO_IMAGE_CONVERTER_BACKEND"), "convert") != 0;
+
+	return job;
+}
+
+void
+nemo_image_job_set_max_workers (NemoImageJob *job, int max_workers)
+{
+	job->max_workers = MAX (max_workers, 1);
+}
+
+void
+nemo_image_job_set_in_process (NemoImageJob *job, gboolean in_process)
+{
+	job->in_process = in_process;
+}
+
+void
+nemo_image_job_start (NemoImageJob *job)
+{
+	job_pump (job);
+}
+
+static void
+job_kill (NemoImageJob *job)
+{
+	guint i;
+
+	job->cancelled = TRUE;
+
+	/* in-process conversions can't be interrupted, they are waited for */
+	for (i = 0; i < job->running->len; i++) {
+		NemoImageJobWorker *worker = g_ptr_array_index (job->running, i);
+		if (worker->pid != 0)
+			kill (worker->pid, SIGTERM);
+	}
+
+	while (!g_queue_is_empty (job->failures)) {
+		NemoImageJobFailure *failure = g_queue_pop_head (job->failures);
+		g_clear_error (&failure->error);
+		g_free (failure);
+	}
+	g_queue_clear (job->pending);
+}
+
+/* kills every child, finished is called once they have all been reaped */
+void
+nemo_image_job_cancel (NemoImageJob *job)
+{
+	if (job->cancelled)
+		return;
+
+	job_kill (job);
+	job_pump (job);
+}
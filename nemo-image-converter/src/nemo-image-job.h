@@ -0,0 +1,58 @@
+/*
+ *  nemo-image-job.h
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public
+ *  License along with this library; if not, write to the Free
+ *  Software Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+#ifndef NEMO_IMAGE_JOB_H
+#define NEMO_IMAGE_JOB_H
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+typedef struct _NemoImageJob NemoImageJob;
+
+typedef enum {
+	NEMO_IMAGE_JOB_RETRY,
+	NEMO_IMAGE_JOB_SKIP,
+	NEMO_IMAGE_JOB_CANCEL
+} NemoImageJobResponse;
+
+typedef struct {
+	/* command line converting item, freed by the job */
+	gchar **(*build_argv) (gpointer item, gpointer user_data);
+	/* item was converted */
+	void (*item_done) (gpointer item, gpointer user_data);
+	/* item could not be converted, may run a nested main loop */
+	NemoImageJobResponse (*item_failed) (gpointer item, const GError *error, gpointer user_data);
+	/* item was killed by a cancel, its output is incomplete */
+	void (*item_cancelled) (gpointer item, gpointer user_data);
+	/* item is NULL when nothing new was started */
+	void (*progress) (gpointer item, int done, int total, gpointer user_data);
+	/* no children are left, the job frees itself after this */
+	void (*finished) (gboolean cancelled, gpointer user_data);
+} NemoImageJobFuncs;
+
+NemoImageJob *nemo_image_job_new (GList *items, const NemoImageJobFuncs *funcs, gpointer user_data);
+void nemo_image_job_set_max_workers (NemoImageJob *job, int max_workers);
+void nemo_image_job_set_in_process (NemoImageJob *job, gboolean in_process);
+void nemo_image_job_start (NemoImageJob *job);
+void nemo_image_job_cancel (NemoImageJob *job);
+
+G_END_DECLS
+
+#endif /* NEMO_IMAGE_JOB_H */
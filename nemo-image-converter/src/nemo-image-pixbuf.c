@@ -0,0 +1,489 @@
+/*
+ *  nemo-image-pixbuf.c
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public
+ *  License along with this library; if not, write to the Free
+ *  Software Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+ #include <config.h>
+#endif
+
+#include "nemo-image-pixbuf.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <gio/gio.h>
+#include <glib/gstdio.h>
+#include <gdk-pixbuf/gdk-pixbuf.h>
+
+/*
+ * In-process stand-in for the convert command lines the resizer and
+ * the rotator build.  Anything it doesn't understand, and any image
+ * GdkPixbuf can't read or write, fails with G_IO_ERROR_NOT_SUPPORTED
+ * and is left to convert.
+ *
+ * Loading at the target size lets the jpeg loader scale in the DCT
+ * domain, so a big reduction never decodes the full image.
+ *
+ * GdkPixbuf can't write EXIF, XMP or IPTC, which convert keeps.  Between
+ * JPEGs those segments are copied over as they are, with the orientation
+ * reset; other images carrying metadata go to convert.
+ */
+
+#define JPEG_QUALITY "92"
+
+static gboolean
+not_supported (GError **error, const gchar *what)
+{
+	g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED, "%s", what);
+	return FALSE;
+}
+
+static GdkPixbufFormat *
+find_writable_format (const gchar *filename)
+{
+	GdkPixbufFormat *found = NULL;
+	const gchar *dot;
+	GSList *formats, *l;
+
+	dot = strrchr (filename, '.');
+	if (dot == NULL)
+		return NULL;
+
+	formats = gdk_pixbuf_get_formats ();
+	for (l = formats; l != NULL && found == NULL; l = l->next) {
+		GdkPixbufFormat *format = l->data;
+		gchar **extensions;
+		int i;
+
+		if (!gdk_pixbuf_format_is_writable (format))
+			continue;
+
+		extensions = gdk_pixbuf_format_get_extensions (format);
+		for (i = 0; extensions[i] != NULL; i++) {
+			if (g_ascii_strcasecmp (extensions[i], dot + 1) == 0) {
+				found = format;
+				break;
+			}
+		}
+		g_strfreev (extensions);
+	}
+	g_slist_free (formats);
+
+	return found;
+}
+
+/* "50%" or "640x480" the way convert -resize reads them, aspect ratio kept;
+ * anything more, like "50.5%" or "640x480!", is left to convert */
+static gboolean
+parse_geometry (const gchar *geometry, int width, int height, int *new_width, int *new_height)
+{
+	double scale;
+	long w, h;
+	char *end;
+
+	if (!g_ascii_isdigit (geometry[0]))
+		return FALSE;
+
+	w = strtol (geometry, &end, 10);
+	if (w <= 0 || w > G_MAXINT)
+		return FALSE;
+
+	if (strcmp (end, "%") == 0) {
+		scale = w / 100.0;
+	} else if (*end == 'x' && g_ascii_isdigit (end[1])) {
+		h = strtol (end + 1, &end, 10);
+		if (*end != '\0' || h <= 0 || h > G_MAXINT)
+			return FALSE;
+		scale = MIN ((double) w / width, (double) h / height);
+	} else {
+		return FALSE;
+	}
+
+	*new_width = MAX (1, (int) (width * scale + 0.5));
+	*new_height = MAX (1, (int) (height * scale + 0.5));
+
+	return TRUE;
+}
+
+static guint
+read_uint (const guchar *p, int size, gboolean big_endian)
+{
+	guint val = 0;
+	int i;
+
+	for (i = 0; i < size; i++)
+		val |= (guint) p[big_endian ? i : size - 1 - i] << (8 * (size - 1 - i));
+
+	return val;
+}
+
+/* the pixels get turned instead, so the copy must not turn them again */
+static void
+exif_reset_orientation (guchar *tiff, gsize len)
+{
+	gboolean big_endian;
+	guint offset, count, i;
+
+	if (len < 8)
+		return;
+
+	big_endian = tiff[0] == 'M';
+	offset = read_uint (tiff + 4, 4, big_endian);
+	if (offset > len - 2)
+		return;
+
+	count = read_uint (tiff + offset, 2, big_endian);
+	if (count > (len - offset - 2) / 12)
+		return;
+
+	for (i = 0; i < count; i++) {
+		guchar *entry = tiff + offset + 2 + 12 * i;
+
+		/* a single SHORT, stored in the first half of the value */
+		if (read_uint (entry, 2, big_endian) == 0x0112) {
+			entry[8] = big_endian ? 0 : 1;
+			entry[9] = big_endian ? 1 : 0;
+			return;
+		}
+	}
+}
+
+/* the APP1 (EXIF, XMP) and APP13 (IPTC) segments of a JPEG, markers
+ * included, ready to go into another one; NULL if it has none */
+static GByteArray *
+jpeg_read_metadata (FILE *f)
+{
+	GByteArray *segments = NULL;
+	guchar header[4];
+
+	if (fread (header, 1, 2, f) != 2 || header[0] != 0xff || header[1] != 0xd8)
+		return NULL;
+
+	/* metadata comes in the APPn segments, before the scan */
+	while (fread (header, 1, 4, f) == 4) {
+		guint marker = header[1];
+		guint len = read_uint (header + 2, 2, TRUE);
+		guint old_len;
+
+		if (header[0] != 0xff || len < 2 || marker == 0xda || marker == 0xd9)
+			break;
+
+		if (marker != 0xe1 && marker != 0xed) {
+			if (fseek (f, len - 2, SEEK_CUR) != 0)
+				break;
+			continue;
+		}
+
+		if (segments == NULL)
+			segments = g_byte_array_new ();
+
+		old_len = segments->len;
+		g_byte_array_set_size (segments, old_len + len + 2);
+		memcpy (segments->data + old_len, header, 4);
+
+		if (fread (segments->data + old_len + 4, 1, len - 2, f) != len - 2) {
+			g_byte_array_set_size (segments, old_len);
+			break;
+		}
+
+		if (marker == 0xe1 && len - 2 >= 6 &&
+		    memcmp (segments->data + old_len + 4, "Exif\0\0", 6) == 0)
+			exif_reset_orientation (segments->data + old_len + 10, len - 8);
+	}
+
+	if (segments != NULL && segments->len == 0)
+		g_clear_pointer (&segments, g_byte_array_unref);
+
+	return segments;
+}
+
+static gboolean
+png_has_metadata (FILE *f)
+{
+	guchar header[8];
+
+	if (fread (header, 1, 8, f) != 8 || memcmp (header, "\x89PNG\r\n\x1a\n", 8) != 0)
+		return FALSE;
+
+	while (fread (header, 1, 8, f) == 8) {
+		guint len = read_uint (header, 4, TRUE);
+
+		if (memcmp (header + 4, "eXIf", 4) == 0 || memcmp (header + 4, "iTXt", 4) == 0)
+			return TRUE;
+
+		if (memcmp (header + 4, "IDAT", 4) == 0 || memcmp (header + 4, "IEND", 4) == 0)
+			return FALSE;
+
+		/* the data and its crc */
+		if (fseek (f, (long) len + 4, SEEK_CUR) != 0)
+			return FALSE;
+	}
+
+	return FALSE;
+}
+
+/*
+ * Looks for metadata convert would keep.  JPEG metadata going into a JPEG
+ * is returned in segments, to be copied over by save_pixbuf(); FALSE means
+ * there is metadata we would lose.
+ */
+static gboolean
+read_metadata (const gchar *filename, GdkPixbufFormat *format,
+	       GdkPixbufFormat *dest_format, GByteArray **segments)
+{
+	static const gchar * const plain_formats[] = {
+		"ani", "bmp", "gif", "icns", "ico", "pnm", "qtif", "tga", "xbm", "xpm", NULL
+	};
+	gchar *name, *dest_name;
+	FILE *f;
+	gboolean ret = TRUE;
+
+	*segments = NULL;
+
+	name = gdk_pixbuf_format_get_name (format);
+
+	if (g_strv_contains (plain_formats, name)) {
+		g_free (name);
+		return TRUE;
+	}
+
+	/* tiff, webp and the like can carry metadata we don't look for */
+	if (strcmp (name, "jpeg") != 0 && strcmp (name, "png") != 0) {
+		g_free (name);
+		return FALSE;
+	}
+
+	f = g_fopen (filename, "rb");
+	if (f == NULL) {
+		g_free (name);
+		return TRUE;
+	}
+
+	if (strcmp (name, "jpeg") == 0) {
+		dest_name = gdk_pixbuf_format_get_name (dest_format);
+		*segments = jpeg_read_metadata (f);
+
+		if (*segments != NULL && strcmp (dest_name, "jpeg") != 0) {
+			g_clear_pointer (segments, g_byte_array_unref);
+			ret = FALSE;
+		}
+
+		g_free (dest_name);
+	} else {
+		ret = !png_has_metadata (f);
+	}
+
+	fclose (f);
+	g_free (name);
+
+	return ret;
+}
+
+static gboolean
+parse_angle (const gchar *angle, GdkPixbufRotation *rotation)
+{
+	char *end;
+	long degrees = strtol (angle, &end, 10);
+
+	if (*end != '\0' || degrees % 90 != 0)
+		return FALSE;
+
+	/* convert turns clockwise, gdk-pixbuf counterclockwise */
+	degrees = ((-degrees % 360) + 360) % 360;
+	*rotation = (GdkPixbufRotation) degrees;
+
+	return TRUE;
+}
+
+/* puts segments right after the SOI and JFIF header of a JPEG in buffer */
+static gboolean
+save_jpeg_with_metadata (const gchar *filename, const gchar *buffer, gsize size,
+			 GByteArray *segments, GError **error)
+{
+	GByteArray *jpeg;
+	gsize head = 2;
+	gboolean ret;
+
+	if (size >= 6 && (guchar) buffer[2] == 0xff && (guchar) buffer[3] == 0xe0)
+		head += 2 + read_uint ((const guchar *) buffer + 4, 2, TRUE);
+	head = MIN (head, size);
+
+	jpeg = g_byte_array_sized_new (size + segments->len);
+	g_byte_array_append (jpeg, (const guint8 *) buffer, head);
+	g_byte_array_append (jpeg, segments->data, segments->len);
+	g_byte_array_append (jpeg, (const guint8 *) buffer + head, size - head);
+
+	ret = g_file_set_contents (filename, (const gchar *) jpeg->data, jpeg->len, error);
+	g_byte_array_unref (jpeg);
+
+	return ret;
+}
+
+static gboolean
+save_pixbuf (GdkPixbuf *pixbuf, GdkPixbuf *source, const gchar *filename,
+	     GdkPixbufFormat *format, GByteArray *segments, GError **error)
+{
+	gchar *keys[3] = { NULL, };
+	gchar *values[3] = { NULL, };
+	const gchar *icc_profile;
+	gchar *type, *buffer = NULL;
+	gsize size;
+	gboolean ret;
+	int n = 0;
+
+	type = gdk_pixbuf_format_get_name (format);
+
+	if (strcmp (type, "jpeg") == 0) {
+		keys[n] = "quality";
+		values[n++] = JPEG_QUALITY;
+	}
+
+	/* keep the colours looking the same */
+	icc_profile = gdk_pixbuf_get_option (source, "icc-profile");
+	if (icc_profile != NULL &&
+	    (strcmp (type, "jpeg") == 0 || strcmp (type, "png") == 0 || strcmp (type, "tiff") == 0)) {
+		keys[n] = "icc-profile";
+		values[n++] = (gchar *) icc_profile;
+	}
+
+	if (segments == NULL) {
+		ret = gdk_pixbuf_savev (pixbuf, filename, type, keys, values, error);
+	} else {
+		ret = gdk_pixbuf_save_to_bufferv (pixbuf, &buffer, &size, type, keys, values, error) &&
+			save_jpeg_with_metadata (filename, buffer, size, segments, error);
+		g_free (buffer);
+	}
+
+	g_free (type);
+
+	return ret;
+}
+
+static gboolean
+do_resize (const gchar *src, const gchar *geometry, const gchar *dest,
+	   GdkPixbufFormat *format, GError **error)
+{
+	GdkPixbufFormat *src_format;
+	GdkPixbuf *pixbuf, *oriented;
+	GByteArray *segments;
+	int width, height, new_width, new_height;
+	gboolean ret;
+
+	src_format = gdk_pixbuf_get_file_info (src, &width, &height);
+	if (src_format == NULL)
+		return not_supported (error, "unknown image format");
+
+	if (!parse_geometry (geometry, width, height, &new_width, &new_height))
+		return not_supported (error, "unknown geometry");
+
+	if (!read_metadata (src, src_format, format, &segments))
+		return not_supported (error, "cannot keep the metadata");
+
+	pixbuf = gdk_pixbuf_new_from_file_at_scale (src, new_width, new_height, FALSE, NULL);
+	if (pixbuf == NULL) {
+		g_clear_pointer (&segments, g_byte_array_unref);
+		return not_supported (error, "cannot load image");
+	}
+
+	/* convert keeps the exif orientation, we can't, so turn the pixels instead */
+	oriented = gdk_pixbuf_apply_embedded_orientation (pixbuf);
+
+	ret = save_pixbuf (oriented, pixbuf, dest, format, segments, error);
+
+	g_clear_pointer (&segments, g_byte_array_unref);
+	g_object_unref (oriented);
+	g_object_unref (pixbuf);
+
+	return ret;
+}
+
+static gboolean
+do_rotate (const gchar *src, const gchar *angle, const gchar *dest,
+	   GdkPixbufFormat *format, GError **error)
+{
+	GdkPixbufFormat *src_format;
+	GdkPixbuf *pixbuf, *oriented, *rotated;
+	GdkPixbufRotation rotation;
+	GByteArray *segments;
+	gboolean ret;
+
+	if (!parse_angle (angle, &rotation))
+		return not_supported (error, "angle is not a multiple of 90");
+
+	src_format = gdk_pixbuf_get_file_info (src, NULL, NULL);
+	if (src_format == NULL)
+		return not_supported (error, "unknown image format");
+
+	if (!read_metadata (src, src_format, format, &segments))
+		return not_supported (error, "cannot keep the metadata");
+
+	pixbuf = gdk_pixbuf_new_from_file (src, NULL);
+	if (pixbuf == NULL) {
+		g_clear_pointer (&segments, g_byte_array_unref);
+		return not_supported (error, "cannot load image");
+	}
+
+	/* -auto-orient */
+	oriented = gdk_pixbuf_apply_embedded_orientation (pixbuf);
+	rotated = gdk_pixbuf_rotate_simple (oriented, rotation);
+
+	ret = save_pixbuf (rotated, pixbuf, dest, format, segments, error);
+
+	g_clear_pointer (&segments, g_byte_array_unref);
+
+	g_object_unref (rotated);
+	g_object_unref (oriented);
+	g_object_unref (pixbuf);
+
+	return ret;
+}
+
+/*
+ * Runs argv the way convert would, understands
+ *   convert SRC -resize GEOMETRY DEST
+ *   convert SRC -auto-orient -rotate ANGLE -orient TopLeft DEST
+ * Safe to call from any thread.
+ */
+gboolean
+nemo_image_pixbuf_convert (gchar **argv, GError **error)
+{
+	GdkPixbufFormat *format;
+	guint argc = g_strv_length (argv);
+	const gchar *dest;
+
+	if (argc < 5 || !g_str_has_suffix (argv[0], "convert"))
+		return not_supported (error, "not a convert command line");
+
+	dest = argv[argc - 1];
+	format = find_writable_format (dest);
+	if (format == NULL)
+		return not_supported (error, "cannot write this format");
+
+	if (argc == 5 && strcmp (argv[2], "-resize") == 0)
+		return do_resize (argv[1], argv[3], dest, format, error);
+
+	if (argc == 8 &&
+	    strcmp (argv[2], "-auto-orient") == 0 &&
+	    strcmp (argv[3], "-rotate") == 0 &&
+	    strcmp (argv[5], "-orient") == 0 &&
+	    strcmp (argv[6], "TopLeft") == 0)
+		return do_rotate (argv[1], argv[4], dest, format, error);
+
+	return not_supported (error, "unknown convert options");
+}
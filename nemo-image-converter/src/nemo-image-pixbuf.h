@@ -0,0 +1,31 @@
+/*
+ *  nemo-image-pixbuf.h
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public
+ *  License along with this library; if not, write to the Free
+ *  Software Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+#ifndef NEMO_IMAGE_PIXBUF_H
+#define NEMO_IMAGE_PIXBUF_H
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+gboolean nemo_image_pixbuf_convert (gchar **argv, GError **error);
+
+G_END_DECLS
+
+#endif /* NEMO_IMAGE_PIXBUF_H */
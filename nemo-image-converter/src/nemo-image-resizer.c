@@ -26,6 +26,7 @@
 #endif
 
 #include "nemo-image-resizer.h"
+#include "nemo-image-batch.h"
 
 #include <string.h>
 
@@ -42,9 +43,7 @@ struct _NemoImageResizerPrivate {
 	
 	gchar *suffix;
 	
-	int images_resized;
 	int images_total;
-	gboolean cancelled;
 	
 	gchar *size;
 
@@ -60,6 +59,7 @@ struct _NemoImageResizerPrivate {
 	GtkEntry *name_entry;
 	GtkRadioButton *inplace_radiobutton;
 
+	NemoImageBatch *batch;
 	GtkWidget *progress_dialog;
 	GtkWidget *progress_bar;
 	GtkWidget *progress_label;
@@ -153,151 +153,138 @@ nemo_image_resizer_class_init(NemoImageResizerClass *klass)
 	files_param_spec);
 }
 
-static void run_op (NemoImageResizer *resizer);
+static NemoImageJobResponse
+op_failed (NemoImageBatch *batch, GFile *file, const GError *error, gpointer user_data)
+{
+	NemoImageResizer *resizer = NEMO_IMAGE_RESIZER (user_data);
+	NemoImageResizerPrivate *priv = NEMO_IMAGE_RESIZER_GET_PRIVATE (resizer);
+
+	/* resizing failed */
+	char *name = g_file_get_basename (file);
+	char *display_name = g_filename_display_name (name);
+	g_free (name);
+
+	GtkWidget *msg_dialog = gtk_message_dialog_new (GTK_WINDOW (priv->progress_dialog),
+		GTK_DIALOG_DESTROY_WITH_PARENT, GTK_MESSAGE_ERROR,
+		GTK_BUTTONS_NONE,
+		"'%s' cannot be resized. Check whether you have permission to write to this folder.",
+		display_name);
+	g_free (display_name);
+
+	gtk_dialog_add_button (GTK_DIALOG (msg_dialog), _("_Skip"), 1);
+	gtk_dialog_add_button (GTK_DIALOG (msg_dialog), GTK_STOCK_CANCEL, GTK_RESPONSE_CANCEL);
+	gtk_dialog_add_button (GTK_DIALOG (msg_dialog), _("_Retry"), 0);
+	gtk_dialog_set_default_response (GTK_DIALOG (msg_dialog), 0);
+
+	int response_id = gtk_dialog_run (GTK_DIALOG (msg_dialog));
+	gtk_widget_destroy (msg_dialog);
+	if (response_id == 1) {
+		return NEMO_IMAGE_JOB_SKIP;
+	} else if (response_id == GTK_RESPONSE_CANCEL) {
+		return NEMO_IMAGE_JOB_CANCEL;
+	}
+
+	return NEMO_IMAGE_JOB_RETRY;
+}
 
-static GFile *
-nemo_image_resizer_transform_filename (NemoImageResizer *resizer, GFile *orig_file)
+static void
+op_progress (NemoImageBatch *batch, GFile *file, gpointer user_data)
 {
+	NemoImageResizer *resizer = NEMO_IMAGE_RESIZER (user_data);
 	NemoImageResizerPrivate *priv = NEMO_IMAGE_RESIZER_GET_PRIVATE (resizer);
 
-	GFile *parent_file, *new_file;
-	char *basename, *extension, *new_basename;
-	
-	g_return_val_if_fail (G_IS_FILE (orig_file), NULL);
+	int done = nemo_image_batch_get_done (batch);
+	int total = nemo_image_batch_get_total (batch);
+	char *tmp;
 
-	parent_file = g_file_get_parent (orig_file);
+	gtk_progress_bar_set_fraction (GTK_PROGRESS_BAR (priv->progress_bar), (double) done / total);
+	tmp = g_strdup_printf (_("Resizing image: %d of %d"), MIN (done + 1, total), total);
+	gtk_progress_bar_set_text (GTK_PROGRESS_BAR (priv->progress_bar), tmp);
+	g_free (tmp);
 
-	basename = g_strdup (g_file_get_basename (orig_file));
-	
-	extension = g_strdup (strrchr (basename, '.'));
-	if (extension != NULL)
-		basename[strlen (basename) - strlen (extension)] = '\0';
-		
-	new_basename = g_strdup_printf ("%s%s%s", basename,
-		priv->suffix == NULL ? ".tmp" : priv->suffix,
-		extension == NULL ? "" : extension);
-	g_free (basename);
-	g_free (extension);
+	if (file == NULL)
+		return;
+
+	char *name = g_file_get_basename (file);
+	char *display_name = g_filename_display_name (name);
+	g_free (name);
+	tmp = g_markup_printf_escaped (_("<i>Resizing \"%s\"</i>"), display_name);
+	g_free (display_name);
+	gtk_label_set_markup (GTK_LABEL (priv->progress_label), tmp);
+	g_free (tmp);
+}
 
-	new_file = g_file_get_child (parent_file, new_basename);
+static void
+op_finished (NemoImageBatch *batch, gpointer user_data)
+{
+	NemoImageResizer *resizer = NEMO_IMAGE_RESIZER (user_data);
+	NemoImageResizerPrivate *priv = NEMO_IMAGE_RESIZER_GET_PRIVATE (resizer);
 
-	g_object_unref (parent_file);
-	g_free (new_basename);
+	nemo_image_batch_free (priv->batch);
+	priv->batch = NULL;
 
-	return new_file;
+	/* cancel/terminate operation */
+	gtk_widget_destroy (priv->progress_dialog);
+	priv->progress_dialog = NULL;
 }
 
+static const NemoImageBatchFuncs op_funcs = {
+	op_failed,
+	op_progress,
+	op_finished
+};
+
 static void
-op_finished (GPid pid, gint status, gpointer data)
+nemo_image_resizer_progress_response_cb (GtkDialog *dialog, gint response_id, gpointer user_data)
 {
-	NemoImageResizer *resizer = NEMO_IMAGE_RESIZER (data);
+	NemoImageResizer *resizer = NEMO_IMAGE_RESIZER (user_data);
 	NemoImageResizerPrivate *priv = NEMO_IMAGE_RESIZER_GET_PRIVATE (resizer);
-	
-	gboolean retry = TRUE;
-	
-	NemoFileInfo *file = NEMO_FILE_INFO (priv->files->data);
-	
-	if (status != 0) {
-		/* resizing failed */
-		char *name = nemo_file_info_get_name (file);
-
-		GtkWidget *msg_dialog = gtk_message_dialog_new (GTK_WINDOW (priv->progress_dialog),
-			GTK_DIALOG_DESTROY_WITH_PARENT, GTK_MESSAGE_ERROR,
-			GTK_BUTTONS_NONE,
-			"'%s' cannot be resized. Check whether you have permission to write to this folder.",
-			name);
-		g_free (name);
-		
-		gtk_dialog_add_button (GTK_DIALOG (msg_dialog), _("_Skip"), 1);
-		gtk_dialog_add_button (GTK_DIALOG (msg_dialog), GTK_STOCK_CANCEL, GTK_RESPONSE_CANCEL);
-		gtk_dialog_add_button (GTK_DIALOG (msg_dialog), _("_Retry"), 0);
-		gtk_dialog_set_default_response (GTK_DIALOG (msg_dialog), 0);
-		
-		int response_id = gtk_dialog_run (GTK_DIALOG (msg_dialog));
-		gtk_widget_destroy (msg_dialog);
-		if (response_id == 0) {
-			retry = TRUE;
-		} else if (response_id == GTK_RESPONSE_CANCEL) {
-			priv->cancelled = TRUE;
-		} else if (response_id == 1) {
-			retry = FALSE;
-		}
-		
-	} else if (priv->suffix == NULL) {
-		/* resize image in place */
-		GFile *orig_location = nemo_file_info_get_location (file);
-		GFile *new_location = nemo_image_resizer_transform_filename (resizer, orig_location);
-		g_file_move (new_location, orig_location, G_FILE_COPY_OVERWRITE, NULL, NULL, NULL, NULL);
-		g_object_unref (orig_location);
-		g_object_unref (new_location);
-	}
 
-	if (status == 0 || !retry) {
-		/* image has been successfully resized (or skipped) */
-		priv->images_resized++;
-		priv->files = priv->files->next;
-	}
-	
-	if (!priv->cancelled && priv->files != NULL) {
-		/* process next image */
-		run_op (resizer);
-	} else {
-		/* cancel/terminate operation */
-		gtk_widget_destroy (priv->progress_dialog);
-	}
+	/* the children are killed, the dialog goes once they are all gone */
+	if (priv->batch != NULL)
+		nemo_image_batch_cancel (priv->batch);
 }
 
 static void
 run_op (NemoImageResizer *resizer)
 {
 	NemoImageResizerPrivate *priv = NEMO_IMAGE_RESIZER_GET_PRIVATE (resizer);
-	
+
 	g_return_if_fail (priv->files != NULL);
-	
-	NemoFileInfo *file = NEMO_FILE_INFO (priv->files->data);
 
-	GFile *orig_location = nemo_file_info_get_location (file);
-	char *filename = g_file_get_path (orig_location);
-	GFile *new_location = nemo_image_resizer_transform_filename (resizer, orig_location);
-	char *new_filename = g_file_get_path (new_location);
-	g_object_unref (orig_location);
-	g_object_unref (new_location);
+	GtkWidget *content;
+	GList *l;
 
-	/* FIXME: check whether new_uri already exists and provide "Replace _All", "_Skip", and "_Replace" options */
-	
-	gchar *argv[6];
-	argv[0] = "/usr/bin/convert";
-	argv[1] = filename;
-	argv[2] = "-resize";
-	argv[3] = priv->size;
-	argv[4] = new_filename;
-	argv[5] = NULL;
-	
-	pid_t pid;
+	priv->progress_dialog = gtk_dialog_new_with_buttons (_("Resizing images"), NULL, 0,
+		GTK_STOCK_CANCEL, GTK_RESPONSE_CANCEL, NULL);
+	gtk_window_set_default_size (GTK_WINDOW (priv->progress_dialog), 400, -1);
+	content = gtk_dialog_get_content_area (GTK_DIALOG (priv->progress_dialog));
+	gtk_container_set_border_width (GTK_CONTAINER (content), 12);
+	gtk_box_set_spacing (GTK_BOX (content), 6);
 
-	if (!g_spawn_async (NULL, argv, NULL, G_SPAWN_DO_NOT_REAP_CHILD, NULL, NULL, &pid, NULL)) {
-		// FIXME: error handling
-		return;
+	priv->progress_label = gtk_label_new (NULL);
+	gtk_label_set_ellipsize (GTK_LABEL (priv->progress_label), PANGO_ELLIPSIZE_MIDDLE);
+	gtk_box_pack_start (GTK_BOX (content), priv->progress_label, FALSE, FALSE, 0);
+
+	priv->progress_bar = gtk_progress_bar_new ();
+	gtk_progress_bar_set_show_text (GTK_PROGRESS_BAR (priv->progress_bar), TRUE);
+	gtk_box_pack_start (GTK_BOX (content), priv->progress_bar, FALSE, FALSE, 0);
+
+	g_signal_connect (G_OBJECT (priv->progress_dialog), "response",
+			  (GCallback) nemo_image_resizer_progress_response_cb,
+			  resizer);
+	gtk_widget_show_all (priv->progress_dialog);
+
+	priv->batch = nemo_image_batch_new (NEMO_IMAGE_BATCH_RESIZE, priv->size, priv->suffix);
+	for (l = priv->files; l != NULL; l = l->next) {
+		GFile *location = nemo_file_info_get_location (NEMO_FILE_INFO (l->data));
+		nemo_image_batch_add_file (priv->batch, location);
+		g_object_unref (location);
 	}
-	
-	g_free (filename);
-	g_free (new_filename);
-	
-	g_child_watch_add (pid, op_finished, resizer);
-	
-	char *tmp;
 
-	gtk_progress_bar_set_fraction (GTK_PROGRESS_BAR (priv->progress_bar), (double) (priv->images_resized + 1) / priv->images_total);
-	tmp = g_strdup_printf (_("Resizing image: %d of %d"), priv->images_resized + 1, priv->images_total);
-	gtk_progress_bar_set_text (GTK_PROGRESS_BAR (priv->progress_bar), tmp);
-	g_free (tmp);
-	
-	char *name = nemo_file_info_get_name (file);
-	tmp = g_strdup_printf (_("<i>Resizing \"%s\"</i>"), name);
-	g_free (name);
-	gtk_label_set_markup (GTK_LABEL (priv->progress_label), tmp);
-	g_free (tmp);
-	
+	/* one convert per core, they are all independent */
+	nemo_image_batch_set_funcs (priv->batch, &op_funcs, resizer);
+	nemo_image_batch_start (priv->batch);
 }
 
 static void
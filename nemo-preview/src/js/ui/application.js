@@ -52,6 +52,9 @@ const NemoPreviewIface = '<node> \
 </method> \
 <method name="Close"> \
 </method> \
+<method name="SetNeighbors"> \
+    <arg type="as" direction="in" name="uris" /> \
+</method> \
 </interface> \
 </node>';
 
@@ -106,5 +109,11 @@ var Application = new Lang.Class({
 	}
         this._mainWindow.setParent(xid);
         this._mainWindow.setFile(file);
+    },
+
+    SetNeighbors : function(uris) {
+        this._mainWindow.setNeighbors(uris.map(function(uri) {
+            return Gio.file_new_for_uri(uri);
+        }));
     }
 });
@@ -55,6 +55,7 @@ const Lang = imports.lang;
 const Mainloop = imports.mainloop;
 
 const MimeHandler = imports.ui.mimeHandler;
+const Prefetcher = imports.ui.prefetcher;
 const Constants = imports.util.constants;
 const SpinnerBox = imports.ui.spinnerBox;
 const Utils = imports.ui.utils;
@@ -72,6 +73,7 @@ MainWindow.prototype = {
         this._background = null;
         this._isFullScreen = false;
         this._pendingRenderer = null;
+        this._prefetchEntry = null;
         this._renderer = null;
         this._texture = null;
         this._toolbarActor = null;
@@ -80,6 +82,7 @@ MainWindow.prototype = {
         this._unFullScreenId = 0;
 
         this._mimeHandler = new MimeHandler.MimeHandler();
+        this._prefetcher = new Prefetcher.Prefetcher({ mainWindow: this });
 
         this._application = args.application;
         this._createGtkWindow();
@@ -303,12 +306,38 @@ MainWindow.prototype = {
         }
     },
 
+    _clearRenderer : function() {
+        if (this._renderer.clear)
+            this._renderer.clear();
+
+        /* prefetchable renderers may have been prepared just for this file;
+         * make sure e.g. animations don't keep running in the background */
+        if (this._renderer.canPrefetch && this._renderer.destroy)
+            this._renderer.destroy();
+
+        this._renderer = null;
+    },
+
     _createRenderer : function(file) {
-        if (this._renderer) {
-            if (this._renderer.clear)
-                this._renderer.clear();
+        if (this._renderer)
+            this._clearRenderer();
+
+        if (this._prefetchEntry) {
+            this._prefetcher.release(this._prefetchEntry);
+            this._prefetchEntry = null;
+            this._pendingRenderer = null;
+        }
+
+        let entry = this._prefetcher.take(file);
+        if (entry) {
+            this._fileInfo = entry.info;
+            this.setTitle(this._fileInfo.get_display_name());
+        }
 
-            this._renderer = null;
+        /* the prefetcher already prepared it, show it right away */
+        if (entry && entry.ready) {
+            this._renderer = entry.renderer;
+            return;
         }
 
         /* create a temporary spinner renderer, that will timeout and show itself
@@ -317,6 +346,13 @@ MainWindow.prototype = {
         this._renderer = new SpinnerBox.SpinnerBox();
         this._renderer.startTimeout();
 
+        if (entry) {
+            this._prefetchEntry = entry;
+            this._pendingRenderer = entry.renderer;
+            entry.onReady = Lang.bind(this, this._onRendererPrepared);
+            return;
+        }
+
         file.query_info_async
         (Gio.FILE_ATTRIBUTE_STANDARD_DISPLAY_NAME + ',' +
          Gio.FILE_ATTRIBUTE_STANDARD_CONTENT_TYPE,
@@ -343,6 +379,7 @@ MainWindow.prototype = {
 
         this._renderer = this._pendingRenderer;
         this._pendingRenderer = null;
+        this._prefetchEntry = null;
 
         /* generate the texture and toolbar for the new renderer */
         this._createTexture();
@@ -629,6 +666,13 @@ MainWindow.prototype = {
      **************************************************************************/
 
     _clearAndQuit : function() {
+        if (this._prefetchEntry) {
+            this._prefetcher.release(this._prefetchEntry);
+            this._prefetchEntry = null;
+        }
+
+        this._prefetcher.clear();
+
         if (this._renderer.clear)
             this._renderer.clear();
 
@@ -660,6 +704,13 @@ MainWindow.prototype = {
         this._gtkWindow.show_all();
     },
 
+    setNeighbors : function(files) {
+        this._prefetcher.setFiles(files.filter(Lang.bind(this,
+            function(file) {
+                return !this.file || !this.file.equal(file);
+            })));
+    },
+
     setTitle : function(label) {
         if (this._clientDecorated)
             this._titleLabel.set_label(label);
@@ -78,5 +78,16 @@ MimeHandler.prototype = {
             /* finally, resort to the fallback renderer */
             return this._fallbackRenderer;
         }
+    },
+
+    /* Renderers are registered as shared instances; this returns a new
+     * one of the same kind, for use next to the shared one.
+     */
+    newObject: function(mime) {
+        let obj = this.getObject(mime);
+        let renderer = Object.create(Object.getPrototypeOf(obj));
+
+        renderer._init();
+        return renderer;
     }
 }
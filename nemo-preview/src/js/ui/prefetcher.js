@@ -0,0 +1,231 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301 USA.
+ *
+ * The NemoPreview project hereby grant permission for non-gpl compatible GStreamer
+ * plugins to be used and distributed together with GStreamer and NemoPreview. This
+ * permission is above and beyond the permissions granted by the GPL license
+ * NemoPreview is covered by.
+ *
+ */
+
+const Gio = imports.gi.Gio;
+const GLib = imports.gi.GLib;
+
+const Lang = imports.lang;
+
+const Constants = imports.util.constants;
+const MimeHandler = imports.ui.mimeHandler;
+
+const QUERY_ATTRIBUTES =
+    Gio.FILE_ATTRIBUTE_STANDARD_DISPLAY_NAME + ',' +
+    Gio.FILE_ATTRIBUTE_STANDARD_CONTENT_TYPE + ',' +
+    Gio.FILE_ATTRIBUTE_STANDARD_SIZE;
+
+/* Prepares renderers for the files next to the one being shown, so that
+ * moving to one of them only has to put an already loaded texture on the
+ * stage.
+ *
+ * Only renderers setting canPrefetch are prepared ahead; their memoryCost,
+ * or the file size when they don't report one, counts against
+ * PREFETCH_MEMORY_BUDGET.  Files earlier in the neighbor list win when the
+ * budget runs out.  Other renderers may still look at the file ahead of
+ * time with prefetchMetadata().  Renderers are told when they are being
+ * prepared ahead, and must not prompt the user for anything then.
+ */
+function Prefetcher(args) {
+    this._init(args);
+}
+
+Prefetcher.prototype = {
+    _init : function(args) {
+        this._mainWindow = args.mainWindow;
+        this._mimeHandler = new MimeHandler.MimeHandler();
+
+        this._entries = [];
+    },
+
+    _findEntry : function(file) {
+        for (let idx = 0; idx < this._entries.length; idx++) {
+            if (this._entries[idx].file.equal(file))
+                return idx;
+        }
+
+        return -1;
+    },
+
+    _removeEntry : function(entry) {
+        let idx = this._entries.indexOf(entry);
+        if (idx != -1)
+            this._entries.splice(idx, 1);
+    },
+
+    _getCost : function(entry) {
+        if (entry.ready && entry.renderer.memoryCost)
+            return entry.renderer.memoryCost;
+
+        return entry.info ? entry.info.get_size() : 0;
+    },
+
+    _disposeEntry : function(entry) {
+        entry.cancellable.cancel();
+        entry.dropped = true;
+
+        if (!entry.renderer)
+            return;
+
+        /* this also stops a renderer still preparing: images cancel their
+         * decode, documents give up their place in the conversion queue */
+        if (entry.renderer.clear)
+            entry.renderer.clear();
+        if (entry.renderer.destroy)
+            entry.renderer.destroy();
+
+        entry.renderer = null;
+    },
+
+    _trimToBudget : function() {
+        let used = 0;
+
+        this._entries = this._entries.filter(Lang.bind(this,
+            function(entry) {
+                let cost = this._getCost(entry);
+
+                if (used + cost > Constants.PREFETCH_MEMORY_BUDGET) {
+                    this._disposeEntry(entry);
+                    return false;
+                }
+
+                used += cost;
+                return true;
+            }));
+    },
+
+    _onRendererPrepared : function(entry) {
+        entry.ready = true;
+
+        if (entry.onReady) {
+            entry.onReady();
+            return;
+        }
+
+        if (entry.dropped)
+            return;
+
+        this._trimToBudget();
+    },
+
+    _startEntry : function(entry) {
+        entry.file.query_info_async
+        (QUERY_ATTRIBUTES,
+         Gio.FileQueryInfoFlags.NONE,
+         GLib.PRIORITY_LOW, entry.cancellable,
+         Lang.bind(this,
+                   function(obj, res) {
+                       try {
+                           entry.info = obj.query_info_finish(res);
+                       } catch (e) {
+                           if (!e.matches(Gio.IOErrorEnum, Gio.IOErrorEnum.CANCELLED))
+                               this._removeEntry(entry);
+
+                           return;
+                       }
+
+                       let contentType = entry.info.get_content_type();
+                       let renderer = this._mimeHandler.getObject(contentType);
+                       if (!renderer.canPrefetch ||
+                           (renderer.canPrefetchType && !renderer.canPrefetchType(contentType))) {
+                           if (renderer.prefetchMetadata)
+                               renderer.prefetchMetadata(entry.file);
+
+                           this._removeEntry(entry);
+                           return;
+                       }
+
+                       /* don't let prefetching push out what's already loaded */
+                       this._trimToBudget();
+                       if (this._entries.indexOf(entry) == -1)
+                           return;
+
+                       try {
+                           entry.renderer = this._mimeHandler.newObject(contentType);
+                           entry.renderer.prepare(entry.file, this._mainWindow,
+                                                  Lang.bind(this, function() {
+                                                      this._onRendererPrepared(entry);
+                                                  }), true);
+                       } catch (e) {
+                           logError(e, 'Error calling prepare() on prefetched viewer');
+                           this._removeEntry(entry);
+                       }
+                   }));
+    },
+
+    /* Replaces the set of files to prepare; files no longer in the list
+     * are dropped.
+     */
+    setFiles : function(files) {
+        let entries = [];
+
+        files.slice(0, Constants.PREFETCH_MAX_FILES).forEach(Lang.bind(this,
+            function(file) {
+                let idx = this._findEntry(file);
+
+                if (idx != -1) {
+                    entries.push(this._entries[idx]);
+                    this._entries.splice(idx, 1);
+                    return;
+                }
+
+                let entry = { file: file,
+                              info: null,
+                              renderer: null,
+                              ready: false,
+                              dropped: false,
+                              onReady: null,
+                              cancellable: new Gio.Cancellable() };
+                entries.push(entry);
+                this._startEntry(entry);
+            }));
+
+        this._entries.forEach(Lang.bind(this, this._disposeEntry));
+        this._entries = entries;
+    },
+
+    /* Hands over the entry for file, if any: its info is always set, and
+     * its renderer is either ready or calls entry.onReady once it is.
+     */
+    take : function(file) {
+        let idx = this._findEntry(file);
+        if (idx == -1)
+            return null;
+
+        let entry = this._entries[idx];
+        if (!entry.renderer)
+            return null;
+
+        this._entries.splice(idx, 1);
+        return entry;
+    },
+
+    /* Gives up a taken entry that isn't ready yet. */
+    release : function(entry) {
+        entry.onReady = null;
+        this._disposeEntry(entry);
+    },
+
+    clear : function() {
+        this.setFiles([]);
+    }
+}
@@ -32,3 +32,5 @@ var VIEW_PADDING_X = 2;
 var VIEW_MAX_W = 800;
 var VIEW_MAX_H = 600;
 var TOOLBAR_SPACING = 32;
+var PREFETCH_MAX_FILES = 4;
+var PREFETCH_MEMORY_BUDGET = 128 * 1024 * 1024;
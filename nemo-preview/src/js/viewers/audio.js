@@ -119,6 +119,10 @@ AudioRenderer.prototype = {
                                  Lang.bind(this, this._onCoverArtChanged)));
     },
 
+    prefetchMetadata : function(file) {
+        NemoPreview.SoundPlayer.prefetch(file.get_uri());
+    },
+
     clear : function(file) {
         this._playerNotifies.forEach(Lang.bind(this,
             function(id) {
@@ -191,7 +195,7 @@ AudioRenderer.prototype = {
 
         this._mainWindow.setTitle(windowTitle);
 
-        this._artFetcher = new NemoPreview.CoverArtFetcher();
+        this._artFetcher = new NemoPreview.CoverArtFetcher({ uri: this._player.uri });
         this._artFetcher.connect('notify::cover',
                                  Lang.bind(this, this._onCoverArtChanged));
 
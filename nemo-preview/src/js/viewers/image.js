@@ -27,18 +27,27 @@
 
 imports.gi.versions.Gtk = '3.0';
 const Gtk = imports.gi.Gtk;
+const Gdk = imports.gi.Gdk;
 const GdkPixbuf = imports.gi.GdkPixbuf;
 const GtkClutter = imports.gi.GtkClutter;
-const GLib = imports.gi.GLib;
+const Gio = imports.gi.Gio;
 
 const Gettext = imports.gettext.domain('nemo-extensions');
 const _ = Gettext.gettext;
 const Lang = imports.lang;
 const Mainloop = imports.mainloop;
 
+const NemoPreview = imports.gi.NemoPreview;
+
+const Constants = imports.util.constants;
 const MimeHandler = imports.ui.mimeHandler;
 const Utils = imports.ui.utils;
 
+function getScaleFactor() {
+    let screen = Gdk.Screen.get_default();
+    return Math.max(screen.get_monitor_scale_factor(screen.get_primary_monitor()), 1);
+}
+
 function ImageRenderer(args) {
     this._init(args);
 }
@@ -46,8 +55,11 @@ function ImageRenderer(args) {
 ImageRenderer.prototype = {
     _init : function(args) {
         this._timeoutId = 0;
+        this._cancellable = null;
         this.moveOnClick = true;
         this.canFullScreen = true;
+        this.canPrefetch = true;
+        this.memoryCost = 0;
     },
 
     prepare : function(file, mainWindow, callback) {
@@ -55,6 +67,15 @@ ImageRenderer.prototype = {
         this._file = file;
         this._callback = callback;
 
+        if (this._cancellable)
+            this._cancellable.cancel();
+        this._cancellable = new Gio.Cancellable();
+
+        /* decode at about the size of the window first; the bounds are
+         * square since the image may still get rotated by its orientation */
+        this._decodeSize = Math.max(Constants.VIEW_MAX_W, Constants.VIEW_MAX_H) * getScaleFactor();
+        this._fullSize = [ 0, 0 ];
+
         this._createImageTexture(file);
     },
 
@@ -63,48 +84,68 @@ ImageRenderer.prototype = {
     },
 
     _createImageTexture : function(file) {
-        file.read_async
-        (GLib.PRIORITY_DEFAULT, null,
-         Lang.bind(this,
-                   function(obj, res) {
-                       try {
-                           let stream = obj.read_finish(res);
-                           this._textureFromStream(stream);
-                       } catch (e) {
-                       }
-                   }));
+        this._loadAnimation(Lang.bind(this,
+            function(anim) {
+                this._texture = new GtkClutter.Texture({ keep_aspect_ratio: true });
+                this._setAnimation(anim);
+
+                /* we're ready now */
+                this._callback();
+            }));
     },
 
-    _textureFromStream : function(stream) {
-        GdkPixbuf.PixbufAnimation.new_from_stream_async
-        (stream, null,
+    _loadAnimation : function(callback) {
+        NemoPreview.load_image_async
+        (this._file, this._decodeSize, this._decodeSize, this._cancellable,
          Lang.bind(this, function(obj, res) {
-             let anim = GdkPixbuf.PixbufAnimation.new_from_stream_finish(res);
+             let anim, fullWidth, fullHeight;
+
+             try {
+                 [anim, fullWidth, fullHeight] = NemoPreview.load_image_finish(res);
+             } catch (e) {
+                 if (!e.matches(Gio.IOErrorEnum, Gio.IOErrorEnum.CANCELLED))
+                     log('Unable to load the image ' + e.toString());
+
+                 return;
+             }
+
+             this._fullSize = [ fullWidth, fullHeight ];
+             callback(anim);
+         }));
+    },
+
+    _setAnimation : function(anim) {
+        if (this._timeoutId) {
+            Mainloop.source_remove(this._timeoutId);
+            this._timeoutId = 0;
+        }
 
-             this._iter = anim.get_iter(null);
-             let pix = this._iter.get_pixbuf().apply_embedded_orientation();
+        this._iter = anim.get_iter(null);
+        let pix = this._iter.get_pixbuf().apply_embedded_orientation();
 
-             this._texture = new GtkClutter.Texture({ keep_aspect_ratio: true });
-             this._texture.set_from_pixbuf(pix);
+        this._texture.set_from_pixbuf(pix);
+        this.memoryCost = pix.get_rowstride() * pix.get_height();
 
-             if (!anim.is_static_image())
-                 this._startTimeout();
+        if (!anim.is_static_image())
+            this._startTimeout();
+    },
 
-             /* we're ready now */
-             this._callback();
+    /* Decodes the image again when it's going to be shown larger than it
+     * was decoded at, which only happens in fullscreen.
+     */
+    _ensureDecodeSize : function(size) {
+        if (size <= this._decodeSize ||
+            this._decodeSize >= Math.max(this._fullSize[0], this._fullSize[1]))
+            return;
 
-             stream.close_async(GLib.PRIORITY_DEFAULT,
-                                null, function(object, res) {
-                                    try {
-                                        object.close_finish(res);
-                                    } catch (e) {
-                                        log('Unable to close the stream ' + e.toString());
-                                    }
-                                });
-         }));
+        this._decodeSize = size;
+        this._loadAnimation(Lang.bind(this, this._setAnimation));
     },
 
     getSizeForAllocation : function(allocation, fullScreen) {
+        if (fullScreen)
+            this._ensureDecodeSize(Math.max(allocation[0], allocation[1]) * getScaleFactor());
+
         let baseSize = this._texture.get_base_size();
         return Utils.getScaledSize(baseSize, allocation, fullScreen);
     },
@@ -130,6 +171,11 @@ ImageRenderer.prototype = {
     },
 
     destroy : function () {
+        if (this._cancellable) {
+            this._cancellable.cancel();
+            this._cancellable = null;
+        }
+
         /* We should do the check here because it is possible
          * that we never created a source if our image is
          * not animated. */
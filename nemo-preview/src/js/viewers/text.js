@@ -35,6 +35,9 @@ const GtkSource = imports.gi.GtkSource;
 const Gio = imports.gi.Gio;
 const NemoPreview = imports.gi.NemoPreview;
 
+const Gettext = imports.gettext.domain('nemo-extensions');
+const _ = Gettext.gettext;
+
 const MimeHandler = imports.ui.mimeHandler;
 const Utils = imports.ui.utils;
 
@@ -58,6 +61,8 @@ TextRenderer.prototype = {
         this._textLoader = new NemoPreview.TextLoader();
         this._textLoader.connect('loaded',
                                  Lang.bind(this, this._onBufferLoaded));
+        this._textLoader.connect('notify::truncated',
+                                 Lang.bind(this, this._updateTruncatedLabel));
         this._textLoader.uri = file.get_uri();
 
         this._geditScheme = 'tango';
@@ -113,6 +118,19 @@ TextRenderer.prototype = {
         return allocation;
     },
 
+    _updateTruncatedLabel : function() {
+        if (!this._truncatedItem)
+            return;
+
+        if (this._textLoader.truncated) {
+            this._truncatedLabel.set_text(_("Showing the first %s").format(
+                GLib.format_size(this._textLoader.max_size)));
+            this._truncatedItem.show_all();
+        } else {
+            this._truncatedItem.hide();
+        }
+    },
+
     createToolbar : function() {
         this._mainToolbar = new Gtk.Toolbar({ icon_size: Gtk.IconSize.MENU });
         this._mainToolbar.get_style_context().add_class('osd');
@@ -121,6 +139,14 @@ TextRenderer.prototype = {
         this._toolbarRun = Utils.createOpenButton(this._file, this._mainWindow);
         this._mainToolbar.insert(this._toolbarRun, 0);
 
+        /* large files are only loaded up to the loader's max-size */
+        this._truncatedLabel = new Gtk.Label({ margin_left: 10,
+                                               margin_right: 10 });
+        this._truncatedItem = new Gtk.ToolItem();
+        this._truncatedItem.add(this._truncatedLabel);
+        this._mainToolbar.insert(this._truncatedItem, -1);
+        this._updateTruncatedLabel();
+
         this._mainToolbar.show();
 
         this._toolbarActor = new GtkClutter.Actor({ contents: this._mainToolbar });
@@ -26,6 +26,7 @@
  */
 
 imports.gi.versions.Gtk = '3.0';
+const GLib = imports.gi.GLib;
 const Gtk = imports.gi.Gtk;
 const EvDoc = imports.gi.XreaderDocument;
 const EvView = imports.gi.XreaderView;
@@ -49,20 +50,37 @@ XreaderRenderer.prototype = {
         EvDoc.init();
 
         this._pdfLoader = null;
+        this._pdfLoaderIds = [];
         this._document = null;
 
         this.moveOnClick = false;
         this.canFullScreen = true;
+        this.canPrefetch = true;
     },
 
-    prepare : function(file, mainWindow, callback) {
+    /* Office documents are only converted ahead of time when LibreOffice
+     * is there already; installing it is left to a document the user
+     * actually opens.
+     */
+    canPrefetchType : function(contentType) {
+        if (officeTypes.indexOf(contentType) == -1)
+            return true;
+
+        return GLib.find_program_in_path('libreoffice') != null;
+    },
+
+    prepare : function(file, mainWindow, callback, prefetch) {
         this._mainWindow = mainWindow;
         this._file = file;
         this._callback = callback;
 
-        this._pdfLoader = new NemoPreview.PdfLoader();
-        this._pdfLoader.connect('notify::document',
-                                Lang.bind(this, this._onDocumentLoaded));
+        this._pdfLoader = new NemoPreview.PdfLoader({ allow_install: !prefetch });
+        this._pdfLoaderIds = [
+            this._pdfLoader.connect('notify::document',
+                                    Lang.bind(this, this._onDocumentLoaded)),
+            this._pdfLoader.connect('error',
+                                    Lang.bind(this, this._onLoadError))
+        ];
         this._pdfLoader.uri = file.get_uri();
     },
 
@@ -111,6 +129,17 @@ XreaderRenderer.prototype = {
         this._callback();
     },
 
+    _onLoadError : function(loader, message) {
+        let label = new Gtk.Label({ label: message });
+        label.get_style_context().add_class('osd');
+        label.show();
+
+        this._actor = new GtkClutter.Actor({ contents: label });
+        Utils.alphaGtkWidget(this._actor.get_widget());
+
+        this._callback();
+    },
+
     getSizeForAllocation : function(allocation) {
         /* always give the view the maximum possible allocation */
         return allocation;
@@ -129,6 +158,9 @@ XreaderRenderer.prototype = {
     },
 
     createToolbar : function() {
+        if (!this._document)
+            return null;
+
         this._mainToolbar = new Gtk.Toolbar({ icon_size: Gtk.IconSize.MENU });
         this._mainToolbar.get_style_context().add_class('osd');
         this._mainToolbar.set_show_arrow(false);
@@ -172,7 +204,14 @@ XreaderRenderer.prototype = {
     },
 
     clear : function() {
-        this._pdfLoader.cleanup_document();
+        if (this._pdfLoader) {
+            this._pdfLoaderIds.forEach(Lang.bind(this, function(id) {
+                this._pdfLoader.disconnect(id);
+            }));
+            this._pdfLoader.cleanup_document();
+        }
+
+        this._pdfLoaderIds = [];
         this._document = null;
         this._pdfLoader = null;
     }
@@ -26,9 +26,13 @@
  */
 
 #include "nemo-preview-cover-art.h"
+#include "nemo-preview-utils.h"
 
 #include <musicbrainz5/mb5_c.h>
 #include <gdk-pixbuf/gdk-pixbuf.h>
+#include <gio/gio.h>
+#include <glib/gstdio.h>
+#include <string.h>
 
 G_DEFINE_TYPE (NemoPreviewCoverArtFetcher, nemo_preview_cover_art_fetcher, G_TYPE_OBJECT);
 
@@ -38,19 +42,56 @@ G_DEFINE_TYPE (NemoPreviewCoverArtFetcher, nemo_preview_cover_art_fetcher, G_TYP
 enum {
   PROP_COVER = 1,
   PROP_TAGLIST,
+  PROP_URI,
 };
 
 struct _NemoPreviewCoverArtFetcherPrivate {
   GdkPixbuf *cover;
   GstTagList *taglist;
+  gchar *uri;
 
   gchar *asin;
   gboolean tried_cache;
   GInputStream *input_stream;
+
+  guint fetch_serial;
 };
 
 #define AMAZON_IMAGE_FORMAT "http://images.amazon.com/images/P/%s.01.LZZZZZZZ.jpg"
 
+/* Covers found locally or on Amazon are stored in COVER_INDEX_DIR as
+ * thumbnails no larger than COVER_INDEX_SIZE, named after a hash of
+ * (artist, album) and, for local ones, after a hash of the folder they
+ * were found in.  Any track of an album seen before, or from the same
+ * folder, gets its cover from a single read of a small PNG.  The least
+ * recently used ones are removed once the directory grows past
+ * COVER_INDEX_BUDGET.
+ *
+ * A folder's entry records, as PNG text chunks, which file the cover was
+ * read from and the mtimes of that file and of the folder; it is only
+ * used while both are unchanged.
+ */
+#define COVER_INDEX_DIR "covers"
+#define COVER_INDEX_SIZE 256
+#define COVER_INDEX_BUDGET (32 * 1024 * 1024)
+
+#define FOLDER_COVER_NAME_KEY "tEXt::X-Nemo-Preview-Cover"
+#define FOLDER_COVER_MTIME_KEY "tEXt::X-Nemo-Preview-Cover-MTime"
+#define FOLDER_MTIME_KEY "tEXt::X-Nemo-Preview-Folder-MTime"
+
+static const gchar *folder_cover_keys[] = {
+  FOLDER_COVER_NAME_KEY, FOLDER_COVER_MTIME_KEY, FOLDER_MTIME_KEY, NULL
+};
+
+/* in order of preference, matched case-insensitively */
+static const gchar *folder_cover_names[] = {
+  "cover", "folder", "front", "album", "albumart", NULL
+};
+
+static const gchar *folder_cover_extensions[] = {
+  ".jpg", ".jpeg", ".png", NULL
+};
+
 static void nemo_preview_cover_art_fetcher_set_taglist (NemoPreviewCoverArtFetcher *self,
                                                  GstTagList *taglist);
 static void nemo_preview_cover_art_fetcher_get_uri_for_track_async (NemoPreviewCoverArtFetcher *self,
@@ -60,6 +101,8 @@ static void nemo_preview_cover_art_fetcher_get_uri_for_track_async (NemoPreviewC
                                                              gpointer user_data);
 static void try_read_from_file (NemoPreviewCoverArtFetcher *self,
                                 GFile *file);
+static void cover_index_store_async (NemoPreviewCoverArtFetcher *self,
+                                     GdkPixbuf *cover);
 
 static void
 nemo_preview_cover_art_fetcher_dispose (GObject *object)
@@ -68,6 +111,7 @@ nemo_preview_cover_art_fetcher_dispose (GObject *object)
 
   g_clear_object (&priv->cover);
   g_clear_object (&priv->input_stream);
+  g_clear_pointer (&priv->uri, g_free);
 
   if (priv->taglist != NULL) {
     gst_tag_list_free (priv->taglist);
@@ -96,6 +140,9 @@ nemo_preview_cover_art_fetcher_get_property (GObject    *gobject,
   case PROP_TAGLIST:
     g_value_set_boxed (value, priv->taglist);
     break;
+  case PROP_URI:
+    g_value_set_string (value, priv->uri);
+    break;
   default:
     G_OBJECT_WARN_INVALID_PROPERTY_ID (gobject, prop_id, pspec);
     break;
@@ -114,6 +161,10 @@ nemo_preview_cover_art_fetcher_set_property (GObject    *gobject,
   case PROP_TAGLIST:
     nemo_preview_cover_art_fetcher_set_taglist (self, g_value_get_boxed (value));
     break;
+  case PROP_URI:
+    g_free (self->priv->uri);
+    self->priv->uri = g_value_dup_string (value);
+    break;
   default:
     G_OBJECT_WARN_INVALID_PROPERTY_ID (gobject, prop_id, pspec);
     break;
@@ -153,6 +204,15 @@ nemo_preview_cover_art_fetcher_class_init (NemoPreviewCoverArtFetcherClass *klas
                           GST_TYPE_TAG_LIST,
                           G_PARAM_READWRITE));
 
+  g_object_class_install_property
+    (gobject_class,
+     PROP_URI,
+     g_param_spec_string ("uri",
+                          "URI",
+                          "URI of the current file, used to look for covers next to it",
+                          NULL,
+                          G_PARAM_READWRITE));
+
   g_type_class_add_private (klass, sizeof (NemoPreviewCoverArtFetcherPrivate));
 }
 
@@ -426,6 +486,9 @@ pixbuf_from_stream_async_cb (GObject *source,
   priv->cover = pix;
   g_object_notify (G_OBJECT (self), "cover");
 
+  /* next time, don't even ask MusicBrainz */
+  cover_index_store_async (self, pix);
+
   if (self->priv->tried_cache) {
     /* the pixbuf has been loaded. if we didn't hit the cache,
      * save it now.
@@ -678,23 +741,507 @@ totem_gst_tag_list_get_cover (GstTagList *tag_list)
   return NULL;
 }
 /* */
+
+static gchar *
+get_cover_index_path (const gchar *kind,
+                      const gchar *first,
+                      const gchar *second)
+{
+  gchar *str, *checksum, *filename, *retval;
+
+  str = g_strconcat (kind, "\n", first, "\n", second, NULL);
+  checksum = g_compute_checksum_for_string (G_CHECKSUM_SHA1, str, -1);
+  filename = g_strconcat (checksum, ".png", NULL);
+
+  retval = g_build_filename (g_get_user_cache_dir (), "sushi",
+                             COVER_INDEX_DIR, filename, NULL);
+
+  g_free (filename);
+  g_free (checksum);
+  g_free (str);
+
+  return retval;
+}
+
+static gchar *
+get_album_index_path (GstTagList *taglist)
+{
+  gchar *artist = NULL, *album = NULL;
+  gchar *artist_key, *album_key;
+  gchar *retval = NULL;
+
+  if (taglist == NULL)
+    return NULL;
+
+  if (!gst_tag_list_get_string (taglist, GST_TAG_ALBUM_ARTIST, &artist))
+    gst_tag_list_get_string (taglist, GST_TAG_ARTIST, &artist);
+  gst_tag_list_get_string (taglist, GST_TAG_ALBUM, &album);
+
+  if (artist != NULL && album != NULL) {
+    artist_key = g_utf8_casefold (artist, -1);
+    album_key = g_utf8_casefold (album, -1);
+
+    retval = get_cover_index_path ("album", artist_key, album_key);
+
+    g_free (artist_key);
+    g_free (album_key);
+  }
+
+  g_free (artist);
+  g_free (album);
+
+  return retval;
+}
+
+static GFile *
+get_folder_for_uri (const gchar *uri)
+{
+  GFile *file, *retval;
+
+  if (uri == NULL)
+    return NULL;
+
+  file = g_file_new_for_uri (uri);
+  retval = g_file_get_parent (file);
+  g_object_unref (file);
+
+  return retval;
+}
+
+static gchar *
+get_folder_index_path (const gchar *uri)
+{
+  GFile *folder;
+  gchar *folder_uri, *retval;
+
+  folder = get_folder_for_uri (uri);
+  if (folder == NULL)
+    return NULL;
+
+  folder_uri = g_file_get_uri (folder);
+  retval = get_cover_index_path ("folder", folder_uri, "");
+
+  g_free (folder_uri);
+  g_object_unref (folder);
+
+  return retval;
+}
+
+static GdkPixbuf *
+cover_index_lookup (const gchar *path)
+{
+  GdkPixbuf *retval;
+
+  if (path == NULL)
+    return NULL;
+
+  retval = gdk_pixbuf_new_from_file (path, NULL);
+
+  /* mark it as recently used */
+  if (retval != NULL)
+    g_utime (path, NULL);
+
+  return retval;
+}
+
+static guint64
+get_file_mtime (GFile *file)
+{
+  GFileInfo *info;
+  guint64 retval = 0;
+
+  info = g_file_query_info (file, G_FILE_ATTRIBUTE_TIME_MODIFIED,
+                            G_FILE_QUERY_INFO_NONE, NULL, NULL);
+
+  if (info != NULL) {
+    retval = g_file_info_get_attribute_uint64 (info, G_FILE_ATTRIBUTE_TIME_MODIFIED);
+    g_object_unref (info);
+  }
+
+  return retval;
+}
+
+static gboolean
+option_matches_mtime (GdkPixbuf *cover,
+                      const gchar *key,
+                      GFile *file)
+{
+  const gchar *value = gdk_pixbuf_get_option (cover, key);
+
+  return value != NULL &&
+    g_ascii_strtoull (value, NULL, 10) == get_file_mtime (file);
+}
+
+/* whether a folder's entry still matches the folder the track is in */
+static gboolean
+folder_cover_is_current (GdkPixbuf *cover,
+                         const gchar *uri)
+{
+  GFile *folder, *child;
+  const gchar *name;
+  gboolean retval;
+
+  name = gdk_pixbuf_get_option (cover, FOLDER_COVER_NAME_KEY);
+  if (name == NULL)
+    return FALSE;
+
+  folder = get_folder_for_uri (uri);
+  if (folder == NULL)
+    return FALSE;
+
+  child = g_file_get_child (folder, name);
+  retval = option_matches_mtime (cover, FOLDER_MTIME_KEY, folder) &&
+    option_matches_mtime (cover, FOLDER_COVER_MTIME_KEY, child);
+
+  g_object_unref (child);
+  g_object_unref (folder);
+
+  return retval;
+}
+
+/* takes ownership of @cover */
+static GdkPixbuf *
+scale_to_index_size (GdkPixbuf *cover)
+{
+  GdkPixbuf *retval;
+  gint width, height;
+
+  width = gdk_pixbuf_get_width (cover);
+  height = gdk_pixbuf_get_height (cover);
+
+  if (width <= COVER_INDEX_SIZE && height <= COVER_INDEX_SIZE)
+    return cover;
+
+  if (width > height) {
+    height = MAX (height * COVER_INDEX_SIZE / width, 1);
+    width = COVER_INDEX_SIZE;
+  } else {
+    width = MAX (width * COVER_INDEX_SIZE / height, 1);
+    height = COVER_INDEX_SIZE;
+  }
+
+  retval = gdk_pixbuf_scale_simple (cover, width, height, GDK_INTERP_BILINEAR);
+  g_object_unref (cover);
+
+  return retval;
+}
+
+static void
+cover_index_store (GdkPixbuf *cover,
+                   const gchar *album_path,
+                   const gchar *folder_path)
+{
+  gchar *keys[G_N_ELEMENTS (folder_cover_keys)];
+  gchar *values[G_N_ELEMENTS (folder_cover_keys)];
+  gchar *buffer, *dir;
+  gsize size;
+  GError *error = NULL;
+  guint i, n_keys = 0;
+
+  if (album_path == NULL && folder_path == NULL)
+    return;
+
+  /* set by find_folder_cover */
+  for (i = 0; folder_cover_keys[i] != NULL; i++) {
+    const gchar *value = gdk_pixbuf_get_option (cover, folder_cover_keys[i]);
+
+    if (value != NULL) {
+      keys[n_keys] = (gchar *) folder_cover_keys[i];
+      values[n_keys] = (gchar *) value;
+      n_keys++;
+    }
+  }
+
+  keys[n_keys] = values[n_keys] = NULL;
+
+  if (!gdk_pixbuf_save_to_bufferv (cover, &buffer, &size, "png",
+                                   keys, values, &error)) {
+    g_warning ("Can't save the cover art image in the cache: %s", error->message);
+    g_error_free (error);
+
+    return;
+  }
+
+  dir = g_build_filename (g_get_user_cache_dir (), "sushi", COVER_INDEX_DIR, NULL);
+  g_mkdir_with_parents (dir, 0700);
+
+  if (album_path != NULL)
+    g_file_set_contents (album_path, buffer, size, NULL);
+  if (folder_path != NULL)
+    g_file_set_contents (folder_path, buffer, size, NULL);
+
+  nemo_preview_prune_cache_dir (dir, ".png", COVER_INDEX_BUDGET);
+
+  g_free (dir);
+  g_free (buffer);
+}
+
+static guint
+get_folder_cover_rank (const gchar *name)
+{
+  gchar *lower;
+  guint rank = G_MAXUINT;
+  guint i, j;
+
+  lower = g_ascii_strdown (name, -1);
+
+  for (i = 0; folder_cover_names[i] != NULL && rank == G_MAXUINT; i++) {
+    gsize len = strlen (folder_cover_names[i]);
+
+    if (strncmp (lower, folder_cover_names[i], len) != 0)
+      continue;
+
+    for (j = 0; folder_cover_extensions[j] != NULL; j++) {
+      if (strcmp (lower + len, folder_cover_extensions[j]) == 0) {
+        rank = i * G_N_ELEMENTS (folder_cover_extensions) + j;
+        break;
+      }
+    }
+  }
+
+  g_free (lower);
+
+  return rank;
+}
+
+static GdkPixbuf *
+find_folder_cover (const gchar *uri,
+                   GCancellable *cancellable)
+{
+  GFile *folder, *child;
+  GFileEnumerator *enumerator;
+  GFileInfo *info;
+  GInputStream *stream;
+  GdkPixbuf *retval = NULL;
+  gchar *best_name = NULL;
+  guint best_rank = G_MAXUINT;
+
+  folder = get_folder_for_uri (uri);
+  if (folder == NULL)
+    return NULL;
+
+  enumerator = g_file_enumerate_children (folder,
+                                          G_FILE_ATTRIBUTE_STANDARD_NAME,
+                                          G_FILE_QUERY_INFO_NONE,
+                                          cancellable, NULL);
+
+  while (enumerator != NULL &&
+         (info = g_file_enumerator_next_file (enumerator, cancellable, NULL)) != NULL) {
+    guint rank = get_folder_cover_rank (g_file_info_get_name (info));
+
+    if (rank < best_rank) {
+      best_rank = rank;
+      g_free (best_name);
+      best_name = g_strdup (g_file_info_get_name (info));
+    }
+
+    g_object_unref (info);
+  }
+
+  g_clear_object (&enumerator);
+
+  if (best_name != NULL) {
+    child = g_file_get_child (folder, best_name);
+    stream = G_INPUT_STREAM (g_file_read (child, cancellable, NULL));
+
+    if (stream != NULL) {
+      retval = gdk_pixbuf_new_from_stream_at_scale (stream,
+                                                    COVER_INDEX_SIZE, COVER_INDEX_SIZE,
+                                                    TRUE, cancellable, NULL);
+      g_object_unref (stream);
+    }
+
+    /* for folder_cover_is_current, once the cover is in the index */
+    if (retval != NULL) {
+      gchar *mtime;
+
+      gdk_pixbuf_set_option (retval, FOLDER_COVER_NAME_KEY, best_name);
+
+      mtime = g_strdup_printf ("%" G_GUINT64_FORMAT, get_file_mtime (child));
+      gdk_pixbuf_set_option (retval, FOLDER_COVER_MTIME_KEY, mtime);
+      g_free (mtime);
+
+      mtime = g_strdup_printf ("%" G_GUINT64_FORMAT, get_file_mtime (folder));
+      gdk_pixbuf_set_option (retval, FOLDER_MTIME_KEY, mtime);
+      g_free (mtime);
+    }
+
+    g_object_unref (child);
+    g_free (best_name);
+  }
+
+  g_object_unref (folder);
+
+  return retval;
+}
+
+typedef struct {
+  GstTagList *taglist;
+  gchar *uri;
+  guint serial;
+
+  gchar *album_path;
+  gchar *folder_path;
+} LocalCoverJob;
+
+static void
+local_cover_job_free (LocalCoverJob *job)
+{
+  if (job->taglist != NULL)
+    gst_tag_list_free (job->taglist);
+
+  g_free (job->uri);
+  g_free (job->album_path);
+  g_free (job->folder_path);
+
+  g_slice_free (LocalCoverJob, job);
+}
+
+/* Art embedded in the track wins over art found next to it; the index is
+ * only consulted by folder when the track has no art of its own.
+ */
+static void
+local_cover_job (GTask *task,
+                 gpointer source_object,
+                 gpointer task_data,
+                 GCancellable *cancellable)
+{
+  LocalCoverJob *job = task_data;
+  GdkPixbuf *cover;
+
+  cover = cover_index_lookup (job->album_path);
+
+  if (cover == NULL) {
+    cover = totem_gst_tag_list_get_cover (job->taglist);
+
+    if (cover != NULL) {
+      cover = scale_to_index_size (cover);
+      cover_index_store (cover, job->album_path, NULL);
+    }
+  }
+
+  if (cover == NULL) {
+    cover = cover_index_lookup (job->folder_path);
+
+    if (cover != NULL && !folder_cover_is_current (cover, job->uri))
+      g_clear_object (&cover);
+  }
+
+  if (cover == NULL) {
+    cover = find_folder_cover (job->uri, cancellable);
+
+    if (cover != NULL)
+      cover_index_store (cover, job->album_path, job->folder_path);
+  }
+
+  if (cover == NULL)
+    g_task_return_new_error (task, G_IO_ERROR, G_IO_ERROR_NOT_FOUND,
+                             "No local cover art");
+  else
+    g_task_return_pointer (task, cover, g_object_unref);
+}
+
+static void
+local_cover_ready_cb (GObject *source,
+                      GAsyncResult *res,
+                      gpointer user_data)
+{
+  NemoPreviewCoverArtFetcher *self = NEMO_PREVIEW_COVER_ART_FETCHER (source);
+  LocalCoverJob *job = g_task_get_task_data (G_TASK (res));
+  GdkPixbuf *cover;
+
+  cover = g_task_propagate_pointer (G_TASK (res), NULL);
+
+  /* the taglist changed in the meantime */
+  if (job->serial != self->priv->fetch_serial) {
+    g_clear_object (&cover);
+    return;
+  }
+
+  if (cover == NULL) {
+    try_fetch_from_amazon (self);
+    return;
+  }
+
+  g_clear_object (&self->priv->cover);
+  self->priv->cover = cover;
+  g_object_notify (G_OBJECT (self), "cover");
+}
+
 static void
 try_fetch_from_tags (NemoPreviewCoverArtFetcher *self)
 {
   NemoPreviewCoverArtFetcherPrivate *priv = NEMO_PREVIEW_COVER_ART_FETCHER_GET_PRIVATE (self);
+  LocalCoverJob *job;
+  GTask *task;
 
   if (priv->taglist == NULL)
     return;
 
-  if (priv->cover != NULL)
-    g_clear_object (&priv->cover);
+  job = g_slice_new0 (LocalCoverJob);
+  job->taglist = gst_tag_list_copy (priv->taglist);
+  job->uri = g_strdup (priv->uri);
+  job->serial = ++priv->fetch_serial;
+  job->album_path = get_album_index_path (priv->taglist);
+  job->folder_path = get_folder_index_path (priv->uri);
+
+  task = g_task_new (self, NULL, local_cover_ready_cb, NULL);
+  g_task_set_task_data (task, job, (GDestroyNotify) local_cover_job_free);
+  g_task_run_in_thread (task, local_cover_job);
+  g_object_unref (task);
+}
 
-  priv->cover = totem_gst_tag_list_get_cover (priv->taglist);
+typedef struct {
+  GdkPixbuf *cover;
+  gchar *album_path;
+} StoreCoverJob;
 
-  if (priv->cover != NULL)
-    g_object_notify (G_OBJECT (self), "cover");
-  else
-    try_fetch_from_amazon (self);
+static void
+store_cover_job_free (StoreCoverJob *job)
+{
+  g_clear_object (&job->cover);
+  g_free (job->album_path);
+
+  g_slice_free (StoreCoverJob, job);
+}
+
+static void
+store_cover_job (GTask *task,
+                 gpointer source_object,
+                 gpointer task_data,
+                 GCancellable *cancellable)
+{
+  StoreCoverJob *job = task_data;
+  GdkPixbuf *cover;
+
+  cover = scale_to_index_size (g_object_ref (job->cover));
+  cover_index_store (cover, job->album_path, NULL);
+  g_object_unref (cover);
+
+  g_task_return_boolean (task, TRUE);
+}
+
+static void
+cover_index_store_async (NemoPreviewCoverArtFetcher *self,
+                         GdkPixbuf *cover)
+{
+  StoreCoverJob *job;
+  GTask *task;
+
+  job = g_slice_new0 (StoreCoverJob);
+  job->album_path = get_album_index_path (self->priv->taglist);
+
+  if (job->album_path == NULL) {
+    store_cover_job_free (job);
+    return;
+  }
+
+  job->cover = g_object_ref (cover);
+
+  task = g_task_new (NULL, NULL, NULL, NULL);
+  g_task_set_task_data (task, job, (GDestroyNotify) store_cover_job_free);
+  g_task_run_in_thread (task, store_cover_job);
+  g_object_unref (task);
 }
 
 static void
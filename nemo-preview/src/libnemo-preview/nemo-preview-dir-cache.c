@@ -0,0 +1,586 @@
+/*
+ * nemo-preview-dir-cache.c: persistent per-directory size cache
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301 USA.
+ *
+ * The NemoPreview project hereby grant permission for non-gpl compatible GStreamer
+ * plugins to be used and distributed together with GStreamer and NemoPreview. This
+ * permission is above and beyond the permissions granted by the GPL license
+ * NemoPreview is covered by.
+ *
+ */
+
+#include "nemo-preview-dir-cache.h"
+
+#include <string.h>
+
+/* The cache maps a directory's (device, inode) to what was found in it the
+ * last time it was enumerated, together with the directory's mtime at that
+ * point.  Adding, removing or renaming an entry bumps the mtime, so a
+ * single stat is enough to tell whether the listing can be reused.  Files
+ * rewritten in place do not touch their directory, so their new size is
+ * only picked up once something else in that directory changes.
+ *
+ * The whole table is read in a thread before the first count, see
+ * nemo_preview_dir_cache_load_async(), and written back, asynchronously,
+ * after a count that changed it.
+ */
+
+#define CACHE_FILE_NAME "dir-sizes.cache"
+#define CACHE_MAGIC "NPDC"
+#define CACHE_VERSION 1
+
+/* Bounds the memory used by the table; the least recently used entries
+ * are dropped first.
+ */
+#define CACHE_MAX_ENTRIES 100000
+
+static GHashTable *cache;
+static gboolean cache_dirty;
+static gboolean cache_saving;
+
+/* whether the table was read from disk, and the tasks waiting for that */
+static gboolean cache_loaded;
+static GList *load_waiters;
+
+static guint
+dir_key_hash (gconstpointer v)
+{
+  const NemoPreviewDirKey *key = v;
+  guint64 h;
+
+  h = (key->ino ^ (key->dev << 32 | key->dev >> 32)) * G_GUINT64_CONSTANT (0x9E3779B97F4A7C15);
+
+  return (guint) (h ^ (h >> 32));
+}
+
+static gboolean
+dir_key_equal (gconstpointer a,
+               gconstpointer b)
+{
+  const NemoPreviewDirKey *ka = a;
+  const NemoPreviewDirKey *kb = b;
+
+  return ka->ino == kb->ino && ka->dev == kb->dev;
+}
+
+static guint32
+today (void)
+{
+  return (guint32) (g_get_real_time () / G_USEC_PER_SEC / (24 * 60 * 60));
+}
+
+static gchar *
+get_cache_path (void)
+{
+  return g_build_filename (g_get_user_cache_dir (), "sushi",
+                           CACHE_FILE_NAME, NULL);
+}
+
+gboolean
+nemo_preview_dir_key_from_info (GFileInfo *info,
+                                NemoPreviewDirKey *key)
+{
+  if (!g_file_info_has_attribute (info, G_FILE_ATTRIBUTE_UNIX_INODE) ||
+      !g_file_info_has_attribute (info, G_FILE_ATTRIBUTE_TIME_MODIFIED))
+    return FALSE;
+
+  key->dev = g_file_info_get_attribute_uint32 (info, G_FILE_ATTRIBUTE_UNIX_DEVICE);
+  key->ino = g_file_info_get_attribute_uint64 (info, G_FILE_ATTRIBUTE_UNIX_INODE);
+  key->mtime =
+    (gint64) g_file_info_get_attribute_uint64 (info, G_FILE_ATTRIBUTE_TIME_MODIFIED) * G_USEC_PER_SEC +
+    g_file_info_get_attribute_uint32 (info, G_FILE_ATTRIBUTE_TIME_MODIFIED_USEC);
+
+  return key->ino != 0;
+}
+
+NemoPreviewDirCacheEntry *
+nemo_preview_dir_cache_entry_new (const NemoPreviewDirKey *key)
+{
+  NemoPreviewDirCacheEntry *entry;
+
+  entry = g_slice_new0 (NemoPreviewDirCacheEntry);
+  entry->key = *key;
+  entry->last_used = today ();
+  entry->children = g_ptr_array_new_with_free_func (g_free);
+  entry->links = g_array_new (FALSE, FALSE, sizeof (NemoPreviewDirLink));
+
+  return entry;
+}
+
+void
+nemo_preview_dir_cache_entry_free (NemoPreviewDirCacheEntry *entry)
+{
+  g_ptr_array_unref (entry->children);
+  g_array_unref (entry->links);
+  g_slice_free (NemoPreviewDirCacheEntry, entry);
+}
+
+/* On-disk format, in host byte order:
+ *
+ *   "NPDC" version:u32 n_entries:u32
+ *   n_entries times:
+ *     dev:u64 ino:u64 mtime:i64 size:u64
+ *     last_used:u32 file_items:u32 n_links:u32 n_children:u32
+ *     n_links times: dev:u64 ino:u64 size:u64
+ *     n_children times: len:u32 name[len]
+ */
+
+typedef struct {
+  const guint8 *data;
+  gsize left;
+} Reader;
+
+static gboolean
+read_bytes (Reader *reader,
+            gpointer dest,
+            gsize len)
+{
+  if (reader->left < len)
+    return FALSE;
+
+  memcpy (dest, reader->data, len);
+  reader->data += len;
+  reader->left -= len;
+
+  return TRUE;
+}
+
+static gboolean
+read_u32 (Reader *reader,
+          guint32 *value)
+{
+  return read_bytes (reader, value, sizeof (guint32));
+}
+
+static gboolean
+read_u64 (Reader *reader,
+          guint64 *value)
+{
+  return read_bytes (reader, value, sizeof (guint64));
+}
+
+static NemoPreviewDirCacheEntry *
+read_entry (Reader *reader)
+{
+  NemoPreviewDirCacheEntry *entry;
+  NemoPreviewDirKey key;
+  guint32 n_links, n_children, i;
+  guint64 mtime;
+
+  if (!read_u64 (reader, &key.dev) ||
+      !read_u64 (reader, &key.ino) ||
+      !read_u64 (reader, &mtime))
+    return NULL;
+
+  key.mtime = (gint64) mtime;
+  entry = nemo_preview_dir_cache_entry_new (&key);
+
+  if (!read_u64 (reader, &entry->size) ||
+      !read_u32 (reader, &entry->last_used) ||
+      !read_u32 (reader, &entry->file_items) ||
+      !read_u32 (reader, &n_links) ||
+      !read_u32 (reader, &n_children))
+    goto fail;
+
+  if (n_links > reader->left / sizeof (NemoPreviewDirLink))
+    goto fail;
+
+  g_array_set_size (entry->links, n_links);
+  for (i = 0; i < n_links; i++) {
+    NemoPreviewDirLink *link = &g_array_index (entry->links, NemoPreviewDirLink, i);
+
+    if (!read_u64 (reader, &link->dev) ||
+        !read_u64 (reader, &link->ino) ||
+        !read_u64 (reader, &link->size))
+      goto fail;
+  }
+
+  for (i = 0; i < n_children; i++) {
+    guint32 len;
+    gchar *name;
+
+    if (!read_u32 (reader, &len) || len == 0 || len > reader->left)
+      goto fail;
+
+    name = g_strndup ((const gchar *) reader->data, len);
+    reader->data += len;
+    reader->left -= len;
+
+    if (strlen (name) != len) {
+      g_free (name);
+      goto fail;
+    }
+
+    g_ptr_array_add (entry->children, name);
+  }
+
+  return entry;
+
+ fail:
+  nemo_preview_dir_cache_entry_free (entry);
+  return NULL;
+}
+
+static GHashTable *
+new_cache_table (void)
+{
+  return g_hash_table_new_full (dir_key_hash, dir_key_equal, NULL,
+                                (GDestroyNotify) nemo_preview_dir_cache_entry_free);
+}
+
+/* Runs in a worker thread; only touches the table it returns. */
+static GHashTable *
+read_cache (void)
+{
+  GHashTable *table;
+  gchar *path, *contents;
+  gsize length;
+  Reader reader;
+  gchar magic[4];
+  guint32 version, n_entries, i;
+
+  table = new_cache_table ();
+
+  path = get_cache_path ();
+  if (!g_file_get_contents (path, &contents, &length, NULL)) {
+    g_free (path);
+    return table;
+  }
+
+  reader.data = (const guint8 *) contents;
+  reader.left = length;
+
+  if (!read_bytes (&reader, magic, sizeof (magic)) ||
+      memcmp (magic, CACHE_MAGIC, sizeof (magic)) != 0 ||
+      !read_u32 (&reader, &version) ||
+      version != CACHE_VERSION ||
+      !read_u32 (&reader, &n_entries))
+    goto out;
+
+  for (i = 0; i < n_entries; i++) {
+    NemoPreviewDirCacheEntry *entry;
+
+    entry = read_entry (&reader);
+    if (entry == NULL) {
+      /* a truncated or corrupt file is worthless, start over */
+      g_debug ("Discarding corrupt directory size cache %s", path);
+      g_hash_table_remove_all (table);
+      break;
+    }
+
+    g_hash_table_replace (table, &entry->key, entry);
+  }
+
+ out:
+  g_free (contents);
+  g_free (path);
+
+  return table;
+}
+
+static void
+read_cache_thread (GTask *task,
+                   gpointer source_object,
+                   gpointer task_data,
+                   GCancellable *cancellable)
+{
+  g_task_return_pointer (task, read_cache (), (GDestroyNotify) g_hash_table_unref);
+}
+
+static void
+read_cache_ready_cb (GObject *source,
+                     GAsyncResult *res,
+                     gpointer user_data)
+{
+  GHashTable *table;
+  GHashTableIter iter;
+  gpointer value;
+  GList *waiters, *l;
+
+  table = g_task_propagate_pointer (G_TASK (res), NULL);
+
+  if (cache == NULL) {
+    cache = table;
+  } else {
+    /* listings added meanwhile are newer than the ones on disk */
+    g_hash_table_iter_init (&iter, table);
+    while (g_hash_table_iter_next (&iter, NULL, &value)) {
+      NemoPreviewDirCacheEntry *entry = value;
+
+      if (!g_hash_table_contains (cache, &entry->key)) {
+        g_hash_table_iter_steal (&iter);
+        g_hash_table_replace (cache, &entry->key, entry);
+      }
+    }
+
+    g_hash_table_unref (table);
+  }
+
+  cache_loaded = TRUE;
+  waiters = load_waiters;
+  load_waiters = NULL;
+
+  for (l = waiters; l != NULL; l = l->next) {
+    g_task_return_boolean (l->data, TRUE);
+    g_object_unref (l->data);
+  }
+
+  g_list_free (waiters);
+}
+
+/* Reads the cache from disk in a worker thread, unless that already
+ * happened; lookups before it completes find nothing.
+ */
+void
+nemo_preview_dir_cache_load_async (GCancellable *cancellable,
+                                   GAsyncReadyCallback callback,
+                                   gpointer user_data)
+{
+  GTask *task;
+
+  task = g_task_new (NULL, cancellable, callback, user_data);
+  g_task_set_source_tag (task, nemo_preview_dir_cache_load_async);
+
+  if (cache_loaded) {
+    g_task_return_boolean (task, TRUE);
+    g_object_unref (task);
+    return;
+  }
+
+  load_waiters = g_list_prepend (load_waiters, task);
+
+  /* one read serves everybody waiting */
+  if (load_waiters->next == NULL) {
+    task = g_task_new (NULL, NULL, read_cache_ready_cb, NULL);
+    g_task_run_in_thread (task, read_cache_thread);
+    g_object_unref (task);
+  }
+}
+
+gboolean
+nemo_preview_dir_cache_load_finish (GAsyncResult *res,
+                                    GError **error)
+{
+  return g_task_propagate_boolean (G_TASK (res), error);
+}
+
+static GHashTable *
+get_cache (void)
+{
+  if (cache == NULL)
+    cache = new_cache_table ();
+
+  return cache;
+}
+
+static gint
+compare_last_used (gconstpointer a,
+                   gconstpointer b)
+{
+  const NemoPreviewDirCacheEntry *ea = *(NemoPreviewDirCacheEntry * const *) a;
+  const NemoPreviewDirCacheEntry *eb = *(NemoPreviewDirCacheEntry * const *) b;
+
+  if (ea->last_used != eb->last_used)
+    return ea->last_used < eb->last_used ? -1 : 1;
+
+  return 0;
+}
+
+static void
+prune_cache (guint max_entries)
+{
+  GPtrArray *entries;
+  GHashTableIter iter;
+  gpointer value;
+  guint i, excess;
+
+  if (g_hash_table_size (cache) <= max_entries)
+    return;
+
+  excess = g_hash_table_size (cache) - max_entries;
+  entries = g_ptr_array_sized_new (g_hash_table_size (cache));
+
+  g_hash_table_iter_init (&iter, cache);
+  while (g_hash_table_iter_next (&iter, NULL, &value))
+    g_ptr_array_add (entries, value);
+
+  g_ptr_array_sort (entries, compare_last_used);
+
+  for (i = 0; i < excess; i++) {
+    NemoPreviewDirCacheEntry *entry = g_ptr_array_index (entries, i);
+    g_hash_table_remove (cache, &entry->key);
+  }
+
+  g_ptr_array_unref (entries);
+  cache_dirty = TRUE;
+}
+
+/* Returns the cached listing for the directory identified by @key, or %NULL
+ * if there is none or the directory changed since.  The entry stays owned
+ * by the cache.
+ */
+NemoPreviewDirCacheEntry *
+nemo_preview_dir_cache_lookup (const NemoPreviewDirKey *key)
+{
+  NemoPreviewDirCacheEntry *entry;
+  guint32 now;
+
+  if (cache == NULL)
+    return NULL;
+
+  entry = g_hash_table_lookup (cache, key);
+  if (entry == NULL || entry->key.mtime != key->mtime)
+    return NULL;
+
+  now = today ();
+  if (entry->last_used != now) {
+    entry->last_used = now;
+    cache_dirty = TRUE;
+  }
+
+  return entry;
+}
+
+/* Adds @entry to the cache, replacing any older listing of the same
+ * directory.  The cache takes ownership of @entry.
+ */
+void
+nemo_preview_dir_cache_insert (NemoPreviewDirCacheEntry *entry)
+{
+  GHashTable *table;
+
+  table = get_cache ();
+  g_hash_table_replace (table, &entry->key, entry);
+  cache_dirty = TRUE;
+
+  /* prune in batches, so that huge trees don't sort on every insert */
+  if (g_hash_table_size (table) > CACHE_MAX_ENTRIES + CACHE_MAX_ENTRIES / 4)
+    prune_cache (CACHE_MAX_ENTRIES);
+}
+
+static void
+append_u32 (GByteArray *buf,
+            guint32 value)
+{
+  g_byte_array_append (buf, (const guint8 *) &value, sizeof (value));
+}
+
+static void
+append_u64 (GByteArray *buf,
+            guint64 value)
+{
+  g_byte_array_append (buf, (const guint8 *) &value, sizeof (value));
+}
+
+static GByteArray *
+serialize_cache (void)
+{
+  GByteArray *buf;
+  GHashTableIter iter;
+  gpointer value;
+  guint i;
+
+  buf = g_byte_array_new ();
+  g_byte_array_append (buf, (const guint8 *) CACHE_MAGIC, 4);
+  append_u32 (buf, CACHE_VERSION);
+  append_u32 (buf, g_hash_table_size (cache));
+
+  g_hash_table_iter_init (&iter, cache);
+  while (g_hash_table_iter_next (&iter, NULL, &value)) {
+    NemoPreviewDirCacheEntry *entry = value;
+
+    append_u64 (buf, entry->key.dev);
+    append_u64 (buf, entry->key.ino);
+    append_u64 (buf, (guint64) entry->key.mtime);
+    append_u64 (buf, entry->size);
+    append_u32 (buf, entry->last_used);
+    append_u32 (buf, entry->file_items);
+    append_u32 (buf, entry->links->len);
+    append_u32 (buf, entry->children->len);
+
+    g_byte_array_append (buf, (const guint8 *) entry->links->data,
+                         entry->links->len * sizeof (NemoPreviewDirLink));
+
+    for (i = 0; i < entry->children->len; i++) {
+      const gchar *name = g_ptr_array_index (entry->children, i);
+      guint32 len = strlen (name);
+
+      append_u32 (buf, len);
+      g_byte_array_append (buf, (const guint8 *) name, len);
+    }
+  }
+
+  return buf;
+}
+
+static void
+save_ready_cb (GObject *source,
+               GAsyncResult *res,
+               gpointer user_data)
+{
+  GByteArray *buf = user_data;
+  GError *error = NULL;
+
+  if (!g_file_replace_contents_finish (G_FILE (source), res, NULL, &error)) {
+    g_debug ("Unable to write the directory size cache: %s", error->message);
+    g_error_free (error);
+  }
+
+  g_byte_array_unref (buf);
+  cache_saving = FALSE;
+
+  /* something changed while we were writing */
+  if (cache_dirty)
+    nemo_preview_dir_cache_save ();
+}
+
+/* Writes the cache back to disk in the background, if it changed.
+ */
+void
+nemo_preview_dir_cache_save (void)
+{
+  GByteArray *buf;
+  GFile *file;
+  gchar *path, *dir;
+
+  /* don't overwrite what's on disk before we've read it */
+  if (cache == NULL || !cache_loaded || !cache_dirty || cache_saving)
+    return;
+
+  prune_cache (CACHE_MAX_ENTRIES);
+
+  cache_dirty = FALSE;
+  cache_saving = TRUE;
+
+  path = get_cache_path ();
+  dir = g_path_get_dirname (path);
+  g_mkdir_with_parents (dir, 0700);
+
+  buf = serialize_cache ();
+  file = g_file_new_for_path (path);
+
+  g_file_replace_contents_async (file,
+                                 (const gchar *) buf->data, buf->len,
+                                 NULL, FALSE,
+                                 G_FILE_CREATE_PRIVATE | G_FILE_CREATE_REPLACE_DESTINATION,
+                                 NULL,
+                                 save_ready_cb, buf);
+
+  g_object_unref (file);
+  g_free (dir);
+  g_free (path);
+}
@@ -0,0 +1,84 @@
+/*
+ * nemo-preview-dir-cache.h: persistent per-directory size cache
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301 USA.
+ *
+ * The NemoPreview project hereby grant permission for non-gpl compatible GStreamer
+ * plugins to be used and distributed together with GStreamer and NemoPreview. This
+ * permission is above and beyond the permissions granted by the GPL license
+ * NemoPreview is covered by.
+ *
+ */
+
+#ifndef __NEMO_PREVIEW_DIR_CACHE_H__
+#define __NEMO_PREVIEW_DIR_CACHE_H__
+
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+/* Private to libnemo-preview; not part of the introspected API. */
+
+#define NEMO_PREVIEW_DIR_KEY_ATTRS            \
+  G_FILE_ATTRIBUTE_UNIX_DEVICE ","            \
+  G_FILE_ATTRIBUTE_UNIX_INODE ","             \
+  G_FILE_ATTRIBUTE_TIME_MODIFIED ","          \
+  G_FILE_ATTRIBUTE_TIME_MODIFIED_USEC
+
+typedef struct {
+  guint64 dev;
+  guint64 ino;
+  gint64 mtime; /* microseconds */
+} NemoPreviewDirKey;
+
+typedef struct {
+  guint64 dev;
+  guint64 ino;
+  guint64 size;
+} NemoPreviewDirLink;
+
+/* What a directory contains directly; subdirectories are only listed by
+ * name, since each of them is validated separately.
+ */
+typedef struct {
+  NemoPreviewDirKey key;
+  guint32 last_used; /* days since the epoch */
+
+  guint64 size;       /* all entries except multiply linked files */
+  guint32 file_items;
+  GPtrArray *children; /* names of the subdirectories */
+  GArray *links;       /* NemoPreviewDirLink, for files with nlink > 1 */
+} NemoPreviewDirCacheEntry;
+
+gboolean nemo_preview_dir_key_from_info (GFileInfo *info,
+                                         NemoPreviewDirKey *key);
+
+NemoPreviewDirCacheEntry *nemo_preview_dir_cache_entry_new (const NemoPreviewDirKey *key);
+void nemo_preview_dir_cache_entry_free (NemoPreviewDirCacheEntry *entry);
+
+void nemo_preview_dir_cache_load_async (GCancellable *cancellable,
+                                        GAsyncReadyCallback callback,
+                                        gpointer user_data);
+gboolean nemo_preview_dir_cache_load_finish (GAsyncResult *res,
+                                             GError **error);
+
+NemoPreviewDirCacheEntry *nemo_preview_dir_cache_lookup (const NemoPreviewDirKey *key);
+void nemo_preview_dir_cache_insert (NemoPreviewDirCacheEntry *entry);
+void nemo_preview_dir_cache_save (void);
+
+G_END_DECLS
+
+#endif /* __NEMO_PREVIEW_DIR_CACHE_H__ */
@@ -26,6 +26,7 @@
  */
 
 #include "nemo-preview-file-loader.h"
+#include "nemo-preview-dir-cache.h"
 
 #include <gtk/gtk.h>
 
@@ -43,8 +44,11 @@
   G_FILE_ATTRIBUTE_STANDARD_SIZE ","          \
   G_FILE_ATTRIBUTE_STANDARD_TYPE ","          \
   G_FILE_ATTRIBUTE_STANDARD_NAME ","          \
-  G_FILE_ATTRIBUTE_STANDARD_CONTENT_TYPE ","  \
-  G_FILE_ATTRIBUTE_UNIX_INODE
+  G_FILE_ATTRIBUTE_UNIX_DEVICE ","            \
+  G_FILE_ATTRIBUTE_UNIX_INODE ","             \
+  G_FILE_ATTRIBUTE_UNIX_NLINK ","             \
+  G_FILE_ATTRIBUTE_TIME_MODIFIED ","          \
+  G_FILE_ATTRIBUTE_TIME_MODIFIED_USEC
 
 #define NOTIFICATION_TIMEOUT 300
 
@@ -63,21 +67,61 @@ enum {
 
 static GParamSpec *properties[NUM_PROPERTIES] = { NULL, };
 
+/* Open-addressed set of (device, inode) pairs, used to count the size of
+ * hard-linked files only once.  Inode 0 marks an empty slot.
+ */
+typedef struct {
+  guint64 dev;
+  guint64 ino;
+} InodeKey;
+
+typedef struct {
+  InodeKey *slots;
+  gsize mask;
+  gsize used;
+} InodeSet;
+
+#define INODE_SET_INITIAL_SIZE 64
+
 typedef struct {
   NemoPreviewFileLoader *self;
+  GCancellable *cancellable;
+
+  /* directories still to be enumerated, deepest first */
+  GQueue pending;
+  guint active;
+
+  InodeSet seen_inodes;
+} DeepCountState;
+
+/* A directory waiting to be counted.  When it was found by enumerating its
+ * parent we already know its cache key; otherwise it needs a stat first.
+ */
+typedef struct {
+  GFile *file;
+  NemoPreviewDirKey key;
+  gboolean has_key;
+} PendingDir;
+
+typedef struct {
+  DeepCountState *state;
 
   GFile *file;
   GFileEnumerator *enumerator;
-  GList *deep_count_subdirectories;
-  GHashTable *seen_deep_count_inodes;
 
-} DeepCountState;
+  NemoPreviewDirKey key;
+  gboolean has_key;
+
+  /* what we found so far, to be stored in the cache */
+  NemoPreviewDirCacheEntry *entry;
+} DeepCountJob;
 
 struct _NemoPreviewFileLoaderPrivate {
   GFile *file;
   GFileInfo *info;
 
   GCancellable *cancellable;
+  DeepCountState *deep_count;
 
   gint file_items;
   gint directory_items;
@@ -92,8 +136,13 @@ struct _NemoPreviewFileLoaderPrivate {
 
 #define DIRECTORY_LOAD_ITEMS_PER_CALLBACK 100
 
+/* How many directories are enumerated at the same time; the enumerations
+ * run in GIO's worker threads, so this also bounds the I/O in flight.
+ */
+#define DEEP_COUNT_MAX_ENUMERATIONS 8
+
 static void deep_count_load (DeepCountState *state,
-                             GFile *file);
+                             PendingDir *pending);
 
 static gboolean
 size_notify_timeout_cb (gpointer user_data)
@@ -118,107 +167,316 @@ queue_size_notify (NemoPreviewFileLoader *self)
                    size_notify_timeout_cb, self);
 }
 
+static inline gsize
+inode_set_hash (guint64 dev,
+                guint64 ino)
+{
+  guint64 h;
+
+  h = (ino ^ (dev << 32 | dev >> 32)) * G_GUINT64_CONSTANT (0x9E3779B97F4A7C15);
+
+  return (gsize) (h ^ (h >> 29));
+}
+
+static void
+inode_set_init (InodeSet *set)
+{
+  set->slots = g_new0 (InodeKey, INODE_SET_INITIAL_SIZE);
+  set->mask = INODE_SET_INITIAL_SIZE - 1;
+  set->used = 0;
+}
+
+static void
+inode_set_clear (InodeSet *set)
+{
+  g_clear_pointer (&set->slots, g_free);
+  set->mask = 0;
+  set->used = 0;
+}
+
+static void
+inode_set_insert_slot (InodeKey *slots,
+                       gsize mask,
+                       guint64 dev,
+                       guint64 ino)
+{
+  gsize i;
+
+  for (i = inode_set_hash (dev, ino) & mask; slots[i].ino != 0; i = (i + 1) & mask)
+    ;
+
+  slots[i].dev = dev;
+  slots[i].ino = ino;
+}
+
+static void
+inode_set_grow (InodeSet *set)
+{
+  InodeKey *old_slots;
+  gsize old_size, new_mask, i;
+
+  old_slots = set->slots;
+  old_size = set->mask + 1;
+  new_mask = old_size * 2 - 1;
+
+  set->slots = g_new0 (InodeKey, new_mask + 1);
+  set->mask = new_mask;
+
+  for (i = 0; i < old_size; i++)
+    if (old_slots[i].ino != 0)
+      inode_set_insert_slot (set->slots, new_mask, old_slots[i].dev, old_slots[i].ino);
+
+  g_free (old_slots);
+}
+
+/* Returns TRUE if the pair was not in the set yet. */
+static gboolean
+inode_set_add (InodeSet *set,
+               guint64 dev,
+               guint64 ino)
+{
+  gsize i;
+
+  g_assert (ino != 0);
+
+  for (i = inode_set_hash (dev, ino) & set->mask;
+       set->slots[i].ino != 0;
+       i = (i + 1) & set->mask) {
+    if (set->slots[i].ino == ino && set->slots[i].dev == dev)
+      return FALSE;
+  }
+
+  set->slots[i].dev = dev;
+  set->slots[i].ino = ino;
+  set->used++;
+
+  /* keep the load factor under 3/4 */
+  if (set->used * 4 > (set->mask + 1) * 3)
+    inode_set_grow (set);
+
+  return TRUE;
+}
+
 /* adapted from nautilus/libnautilus-private/nautilus-directory-async.c */
 
-static inline gboolean
-seen_inode (DeepCountState *state,
-	    GFileInfo *info)
+static PendingDir *
+pending_dir_new (GFile *file,
+                 const NemoPreviewDirKey *key)
 {
-  guint64 inode;
+  PendingDir *pending;
 
-  inode = g_file_info_get_attribute_uint64 (info, G_FILE_ATTRIBUTE_UNIX_INODE);
+  pending = g_slice_new0 (PendingDir);
+  pending->file = file;
 
-  if (inode != 0) {
-    return (g_hash_table_lookup (state->seen_deep_count_inodes, &inode) != NULL);
+  if (key != NULL) {
+    pending->key = *key;
+    pending->has_key = TRUE;
   }
 
-  return FALSE;
+  return pending;
 }
 
-static inline void
-mark_inode_as_seen (DeepCountState *state,
-		    GFileInfo *info)
+static void
+pending_dir_free (PendingDir *pending)
 {
-  guint64 inode;
+  g_object_unref (pending->file);
+  g_slice_free (PendingDir, pending);
+}
 
-  inode = g_file_info_get_attribute_uint64 (info, G_FILE_ATTRIBUTE_UNIX_INODE);
+static void
+deep_count_add_size (NemoPreviewFileLoader *self,
+                     goffset size)
+{
+  if (self->priv->total_size == -1)
+    self->priv->total_size = 0;
 
-  if (inode != 0)
-    g_hash_table_insert (state->seen_deep_count_inodes, &inode, GINT_TO_POINTER (1));
+  self->priv->total_size += size;
 }
 
 static void
-deep_count_one (DeepCountState *state,
+deep_count_one (DeepCountJob *job,
 		GFileInfo *info)
 {
+  NemoPreviewFileLoader *self;
+  NemoPreviewDirCacheEntry *entry;
+  NemoPreviewDirKey key;
   GFile *subdir;
-  gboolean is_seen_inode;
-
-  is_seen_inode = seen_inode (state, info);
+  goffset size;
 
-  if (!is_seen_inode)
-    mark_inode_as_seen (state, info);
+  self = job->state->self;
+  entry = job->entry;
+  size = g_file_info_get_size (info);
 
   if (g_file_info_get_file_type (info) == G_FILE_TYPE_DIRECTORY) {
     /* count the directory */
-    state->self->priv->directory_items += 1;
+    self->priv->directory_items += 1;
 
     /* record the fact that we have to descend into this directory */
-    subdir = g_file_get_child (state->file, g_file_info_get_name (info));
-    state->deep_count_subdirectories =
-      g_list_prepend (state->deep_count_subdirectories, subdir);
+    subdir = g_file_get_child (job->file, g_file_info_get_name (info));
+    g_queue_push_head (&job->state->pending,
+                       pending_dir_new (subdir,
+                                        nemo_preview_dir_key_from_info (info, &key) ? &key : NULL));
+
+    if (entry != NULL)
+      g_ptr_array_add (entry->children, g_strdup (g_file_info_get_name (info)));
   } else {
     /* even non-regular files count as files */
-    state->self->priv->file_items += 1;
+    self->priv->file_items += 1;
+
+    if (entry != NULL)
+      entry->file_items += 1;
+
+    /* only files with more than one name can be met twice; this keeps
+     * the inode set tiny for the common case */
+    if (g_file_info_get_attribute_uint32 (info, G_FILE_ATTRIBUTE_UNIX_NLINK) > 1 &&
+        g_file_info_get_attribute_uint64 (info, G_FILE_ATTRIBUTE_UNIX_INODE) != 0) {
+      NemoPreviewDirLink link;
+
+      link.dev = g_file_info_get_attribute_uint32 (info, G_FILE_ATTRIBUTE_UNIX_DEVICE);
+      link.ino = g_file_info_get_attribute_uint64 (info, G_FILE_ATTRIBUTE_UNIX_INODE);
+      link.size = size;
+
+      if (entry != NULL)
+        g_array_append_val (entry->links, link);
+
+      /* only count the size for the first name we meet */
+      if (inode_set_add (&job->state->seen_inodes, link.dev, link.ino))
+        deep_count_add_size (self, size);
+
+      return;
+    }
   }
 
   /* count the size */
-  if (!is_seen_inode &&
-      g_file_info_has_attribute (info, G_FILE_ATTRIBUTE_STANDARD_SIZE))
-    state->self->priv->total_size += g_file_info_get_size (info);
+  if (g_file_info_has_attribute (info, G_FILE_ATTRIBUTE_STANDARD_SIZE)) {
+    deep_count_add_size (self, size);
+
+    if (entry != NULL)
+      entry->size += size;
+  }
+}
+
+/* Counts a directory from its cached listing, and queues its
+ * subdirectories for validation.
+ */
+static void
+deep_count_cached (DeepCountState *state,
+                   GFile *dir,
+                   NemoPreviewDirCacheEntry *entry)
+{
+  NemoPreviewFileLoader *self;
+  guint i;
+
+  self = state->self;
+
+  self->priv->file_items += entry->file_items;
+  self->priv->directory_items += entry->children->len;
+
+  if (entry->size > 0 || entry->file_items > 0 || entry->children->len > 0)
+    deep_count_add_size (self, entry->size);
+
+  for (i = 0; i < entry->links->len; i++) {
+    NemoPreviewDirLink *link = &g_array_index (entry->links, NemoPreviewDirLink, i);
+
+    if (inode_set_add (&state->seen_inodes, link->dev, link->ino))
+      deep_count_add_size (self, link->size);
+  }
+
+  for (i = 0; i < entry->children->len; i++)
+    g_queue_push_head (&state->pending,
+                       pending_dir_new (g_file_get_child (dir,
+                                                          g_ptr_array_index (entry->children, i)),
+                                        NULL));
 }
 
 static void
 deep_count_state_free (DeepCountState *state)
 {
-  state->self->priv->loading = FALSE;
-  
-  if (state->enumerator) {
-    if (!g_file_enumerator_is_closed (state->enumerator))
-      g_file_enumerator_close_async (state->enumerator,
+  g_queue_foreach (&state->pending, (GFunc) pending_dir_free, NULL);
+  g_queue_clear (&state->pending);
+  inode_set_clear (&state->seen_inodes);
+  g_object_unref (state->cancellable);
+
+  g_free (state);
+}
+
+/* Detaches a running count from its loader; the outstanding enumerations
+ * finish on their own and free the state once they see the cancellation.
+ */
+static void
+deep_count_stop (NemoPreviewFileLoader *self)
+{
+  DeepCountState *state;
+
+  state = self->priv->deep_count;
+  if (state == NULL)
+    return;
+
+  self->priv->deep_count = NULL;
+  self->priv->loading = FALSE;
+
+  state->self = NULL;
+  g_cancellable_cancel (state->cancellable);
+}
+
+static void
+deep_count_job_free (DeepCountJob *job)
+{
+  if (job->enumerator) {
+    if (!g_file_enumerator_is_closed (job->enumerator))
+      g_file_enumerator_close_async (job->enumerator,
                                      0, NULL, NULL, NULL);
 
-    g_object_unref (state->enumerator);
+    g_object_unref (job->enumerator);
   }
 
-  g_cancellable_reset (state->self->priv->cancellable);
-  g_clear_object (&state->file);
+  if (job->entry != NULL)
+    nemo_preview_dir_cache_entry_free (job->entry);
 
-  g_list_free_full (state->deep_count_subdirectories, g_object_unref);
-  g_hash_table_destroy (state->seen_deep_count_inodes);
+  g_clear_object (&job->file);
+  g_free (job);
+}
 
-  g_free (state);
+static void
+deep_count_start_pending (DeepCountState *state)
+{
+  PendingDir *pending;
+
+  while (state->active < DEEP_COUNT_MAX_ENUMERATIONS &&
+         (pending = g_queue_pop_head (&state->pending)) != NULL)
+    deep_count_load (state, pending);
 }
 
+/* Called whenever a directory is done; starts as many pending directories
+ * as the concurrency limit allows, and finishes the count once nothing is
+ * left.
+ */
 static void
-deep_count_next_dir (DeepCountState *state)
+deep_count_job_done (DeepCountJob *job)
 {
-  GFile *new_file;
+  DeepCountState *state;
   NemoPreviewFileLoader *self;
 
+  state = job->state;
+  deep_count_job_free (job);
+  state->active--;
+
   self = state->self;
-  g_clear_object (&state->file);
 
-  if (state->deep_count_subdirectories != NULL) {
-    /* Work on a new directory. */
-    new_file = state->deep_count_subdirectories->data;
-    state->deep_count_subdirectories =
-      g_list_remove (state->deep_count_subdirectories, new_file);
+  if (self == NULL) {
+    if (state->active == 0)
+      deep_count_state_free (state);
+    return;
+  }
 
-    deep_count_load (state, new_file);
-    g_object_unref (new_file);
-  } else {
+  deep_count_start_pending (state);
+
+  if (state->active == 0) {
+    self->priv->deep_count = NULL;
+    self->priv->loading = FALSE;
     deep_count_state_free (state);
+
+    nemo_preview_dir_cache_save ();
   }
 
   /* queue notify */
@@ -230,39 +488,50 @@ deep_count_more_files_callback (GObject *source_object,
 				GAsyncResult *res,
 				gpointer user_data)
 {
-  DeepCountState *state;
+  DeepCountJob *job;
   GList *files, *l;
   GFileInfo *info;
+  GError *error = NULL;
 
-  state = user_data;
+  job = user_data;
 
-  if (g_cancellable_is_cancelled (state->self->priv->cancellable)) {
-    deep_count_state_free (state);
+  files = g_file_enumerator_next_files_finish (job->enumerator,
+                                               res, &error);
+
+  if (g_cancellable_is_cancelled (job->state->cancellable)) {
+    g_clear_error (&error);
+    g_list_free_full (files, g_object_unref);
+    deep_count_job_done (job);
     return;
   }
-	
-  files = g_file_enumerator_next_files_finish (state->enumerator,
-                                               res, NULL);
-  
+
   for (l = files; l != NULL; l = l->next) {
     info = l->data;
-    deep_count_one (state, info);
+    deep_count_one (job, info);
     g_object_unref (info);
   }
 
   if (files == NULL) {
-    g_file_enumerator_close_async (state->enumerator, 0, NULL, NULL, NULL);
-    g_object_unref (state->enumerator);
-    state->enumerator = NULL;
+    /* only a complete listing is worth remembering */
+    if (error == NULL && job->entry != NULL) {
+      nemo_preview_dir_cache_insert (job->entry);
+      job->entry = NULL;
+    }
 
-    deep_count_next_dir (state);
+    g_clear_error (&error);
+    deep_count_job_done (job);
   } else {
-    g_file_enumerator_next_files_async (state->enumerator,
+    /* pick up the subdirectories we just found right away, and let the
+     * UI see the partial totals */
+    deep_count_start_pending (job->state);
+    queue_size_notify (job->state->self);
+
+    g_file_enumerator_next_files_async (job->enumerator,
                                         DIRECTORY_LOAD_ITEMS_PER_CALLBACK,
                                         G_PRIORITY_DEFAULT,
-                                        state->self->priv->cancellable,
+                                        job->state->cancellable,
                                         deep_count_more_files_callback,
-                                        state);
+                                        job);
   }
 
   g_list_free (files);
@@ -273,46 +542,138 @@ deep_count_callback (GObject *source_object,
 		     GAsyncResult *res,
 		     gpointer user_data)
 {
-  DeepCountState *state;
+  DeepCountJob *job;
   GFileEnumerator *enumerator;
 
-  state = user_data;
+  job = user_data;
 
-  if (g_cancellable_is_cancelled (state->self->priv->cancellable)) {
-    deep_count_state_free (state);
+  enumerator = g_file_enumerate_children_finish (G_FILE (source_object),
+                                                 res, NULL);
+
+  if (g_cancellable_is_cancelled (job->state->cancellable)) {
+    g_clear_object (&enumerator);
+    deep_count_job_done (job);
     return;
   }
 
-  enumerator = g_file_enumerate_children_finish (G_FILE (source_object),
-                                                 res, NULL);
-	
   if (enumerator == NULL) {
-    state->self->priv->unreadable_items += 1;	
-    deep_count_next_dir (state);
+    job->state->self->priv->unreadable_items += 1;
+    deep_count_job_done (job);
   } else {
-    state->enumerator = enumerator;
-    g_file_enumerator_next_files_async (state->enumerator,
+    job->enumerator = enumerator;
+    g_file_enumerator_next_files_async (job->enumerator,
                                         DIRECTORY_LOAD_ITEMS_PER_CALLBACK,
                                         G_PRIORITY_LOW,
-                                        state->self->priv->cancellable,
+                                        job->state->cancellable,
                                         deep_count_more_files_callback,
-                                        state);
+                                        job);
   }
 }
 
 static void
-deep_count_load (DeepCountState *state,
-                 GFile *file)
+deep_count_enumerate (DeepCountJob *job)
 {
-  state->file = g_object_ref (file);
+  if (job->has_key)
+    job->entry = nemo_preview_dir_cache_entry_new (&job->key);
 
-  g_file_enumerate_children_async (state->file,
+  g_file_enumerate_children_async (job->file,
                                    DEEP_COUNT_ATTRS,
                                    G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS, /* flags */
                                    G_PRIORITY_LOW, /* prio */
-                                   state->self->priv->cancellable,
+                                   job->state->cancellable,
                                    deep_count_callback,
-                                   state);
+                                   job);
+}
+
+static void
+deep_count_stat_callback (GObject *source_object,
+                          GAsyncResult *res,
+                          gpointer user_data)
+{
+  DeepCountJob *job;
+  NemoPreviewDirCacheEntry *entry;
+  GFileInfo *info;
+
+  job = user_data;
+
+  info = g_file_query_info_finish (G_FILE (source_object), res, NULL);
+
+  if (g_cancellable_is_cancelled (job->state->cancellable)) {
+    g_clear_object (&info);
+    deep_count_job_done (job);
+    return;
+  }
+
+  if (info != NULL) {
+    job->has_key = nemo_preview_dir_key_from_info (info, &job->key);
+    g_object_unref (info);
+  }
+
+  entry = job->has_key ? nemo_preview_dir_cache_lookup (&job->key) : NULL;
+
+  if (entry != NULL) {
+    deep_count_cached (job->state, job->file, entry);
+    deep_count_job_done (job);
+  } else {
+    /* if the stat failed, the enumeration will tell us why */
+    deep_count_enumerate (job);
+  }
+}
+
+static void
+deep_count_load (DeepCountState *state,
+                 PendingDir *pending)
+{
+  NemoPreviewDirCacheEntry *entry;
+  DeepCountJob *job;
+
+  /* an unchanged directory we found while enumerating its parent costs
+   * nothing more */
+  entry = pending->has_key ? nemo_preview_dir_cache_lookup (&pending->key) : NULL;
+  if (entry != NULL) {
+    deep_count_cached (state, pending->file, entry);
+    pending_dir_free (pending);
+    return;
+  }
+
+  job = g_new0 (DeepCountJob, 1);
+  job->state = state;
+  job->file = g_object_ref (pending->file);
+  job->key = pending->key;
+  job->has_key = pending->has_key;
+
+  pending_dir_free (pending);
+  state->active++;
+
+  if (job->has_key)
+    deep_count_enumerate (job);
+  else
+    g_file_query_info_async (job->file,
+                             NEMO_PREVIEW_DIR_KEY_ATTRS,
+                             G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
+                             G_PRIORITY_LOW,
+                             state->cancellable,
+                             deep_count_stat_callback,
+                             job);
+}
+
+static void
+deep_count_cache_loaded_cb (GObject *source,
+                            GAsyncResult *res,
+                            gpointer user_data)
+{
+  DeepCountState *state = user_data;
+
+  nemo_preview_dir_cache_load_finish (res, NULL);
+
+  /* stopped while the cache was read; no job holds the state yet */
+  if (state->self == NULL) {
+    deep_count_state_free (state);
+    return;
+  }
+
+  deep_count_load (state,
+                   pending_dir_new (g_object_ref (state->self->priv->file), NULL));
 }
 
 static void
@@ -320,12 +681,25 @@ deep_count_start (NemoPreviewFileLoader *self)
 {
   DeepCountState *state;
 
+  deep_count_stop (self);
+
   state = g_new0 (DeepCountState, 1);
   state->self = self;
-  state->seen_deep_count_inodes = g_hash_table_new (g_int64_hash,
-                                                    g_int64_equal);
+  state->cancellable = g_cancellable_new ();
+  g_queue_init (&state->pending);
+  inode_set_init (&state->seen_inodes);
 
-  deep_count_load (state, self->priv->file);
+  self->priv->deep_count = state;
+  self->priv->loading = TRUE;
+  self->priv->file_items = 0;
+  self->priv->directory_items = 0;
+  self->priv->unreadable_items = 0;
+  self->priv->total_size = -1;
+
+  /* only reads the cache the first time, without blocking the UI */
+  nemo_preview_dir_cache_load_async (state->cancellable,
+                                     deep_count_cache_loaded_cb,
+                                     state);
 }
 
 static void
@@ -390,6 +764,8 @@ static void
 nemo_preview_file_loader_set_file (NemoPreviewFileLoader *self,
                             GFile *file)
 {
+  deep_count_stop (self);
+
   g_clear_object (&self->priv->file);
   g_clear_object (&self->priv->info);
 
@@ -402,6 +778,8 @@ nemo_preview_file_loader_dispose (GObject *object)
 {
   NemoPreviewFileLoader *self = NEMO_PREVIEW_FILE_LOADER (object);
 
+  deep_count_stop (self);
+
   g_clear_object (&self->priv->file);
   g_clear_object (&self->priv->info);
 
@@ -720,6 +1098,8 @@ nemo_preview_file_loader_get_file_type (NemoPreviewFileLoader *self)
 void
 nemo_preview_file_loader_stop (NemoPreviewFileLoader *self)
 {
+  deep_count_stop (self);
+
   if (self->priv->cancellable == NULL)
     return;
 
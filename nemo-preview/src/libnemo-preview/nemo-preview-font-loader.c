@@ -33,24 +33,55 @@
 
 #include <gio/gio.h>
 
+/* Faces are shared by everything previewing the same file: they live in
+ * one FT_Library, keyed by URI and face index, and are refcounted through
+ * face->generic.data.  A few faces nobody uses any more are kept around
+ * for when the same font is previewed again.
+ *
+ * Local files are opened by path, so FreeType maps them instead of us
+ * copying them to the heap; only remote files are loaded in memory.
+ *
+ * FreeType needs FT_New_Face() and FT_Done_Face() on a shared library to
+ * be serialized, so everything here happens under face_cache_lock.
+ */
+#define FACE_CACHE_MAX_UNUSED 4
+
+#define FACE_KEY_ATTRS                          \
+  G_FILE_ATTRIBUTE_TIME_MODIFIED ","            \
+  G_FILE_ATTRIBUTE_TIME_MODIFIED_USEC ","       \
+  G_FILE_ATTRIBUTE_STANDARD_SIZE
+
+typedef struct {
+  gchar *key;
+  FT_Face face;
+
+  gchar *path;
+  GBytes *contents;
+
+  gint64 mtime; /* microseconds */
+  goffset size;
+
+  gint ref_count;
+  gboolean cached;
+} FontFaceEntry;
+
+static GMutex face_cache_lock;
+static FT_Library face_cache_library = NULL;
+static GHashTable *face_cache = NULL;
+static GQueue unused_faces = G_QUEUE_INIT;
+
 typedef struct {
-  FT_Library library;
   FT_Long face_index;
   GFile *file;
 
-  gchar *face_contents;
-  gsize face_length;
+  FT_Face face;
 } FontLoadJob;
 
 static FontLoadJob *
-font_load_job_new (FT_Library library,
-                   const gchar *uri,
-                   GAsyncReadyCallback callback,
-                   gpointer user_data)
+font_load_job_new (const gchar *uri)
 {
   FontLoadJob *job = g_slice_new0 (FontLoadJob);
 
-  job->library = library;
   job->face_index = 0;
   job->file = g_file_new_for_uri (uri);
 
@@ -62,52 +93,178 @@ font_load_job_free (FontLoadJob *job)
 {
   g_clear_object (&job->file);
 
+  /* the result was never collected */
+  if (job->face != NULL)
+    nemo_preview_ft_face_unref (job->face);
+
   g_slice_free (FontLoadJob, job);
 }
 
+static void
+font_face_entry_free (FontFaceEntry *entry)
+{
+  FT_Done_Face (entry->face);
+
+  if (entry->contents != NULL)
+    g_bytes_unref (entry->contents);
+
+  g_free (entry->path);
+  g_free (entry->key);
+
+  g_slice_free (FontFaceEntry, entry);
+}
+
+/* called with face_cache_lock held */
+static void
+face_cache_remove (FontFaceEntry *entry)
+{
+  if (!entry->cached)
+    return;
+
+  g_hash_table_remove (face_cache, entry->key);
+  g_queue_remove (&unused_faces, entry);
+  entry->cached = FALSE;
+
+  if (entry->ref_count == 0)
+    font_face_entry_free (entry);
+}
+
+/* called with face_cache_lock held */
 static FT_Face
-create_face_from_contents (FontLoadJob *job,
-                           gchar **contents,
-                           GError **error)
+face_cache_ref_entry (FontFaceEntry *entry)
+{
+  if (entry->ref_count++ == 0)
+    g_queue_remove (&unused_faces, entry);
+
+  return entry->face;
+}
+
+/* called with face_cache_lock held */
+static void
+face_cache_ensure (void)
 {
+  if (face_cache != NULL)
+    return;
+
+  if (FT_Init_FreeType (&face_cache_library) != FT_Err_Ok)
+    g_error ("Unable to initialize FreeType");
+
+  face_cache = g_hash_table_new (g_str_hash, g_str_equal);
+}
+
+static FT_Face
+font_load_job_do_load (FontLoadJob *job,
+                       GError **error)
+{
+  FontFaceEntry *entry;
+  GFileInfo *info;
+  GBytes *contents = NULL;
+  gchar *uri, *key, *path;
+  gint64 mtime;
+  goffset size;
   FT_Error ft_error;
-  FT_Face retval;
+  FT_Face face;
+
+  info = g_file_query_info (job->file, FACE_KEY_ATTRS,
+                            G_FILE_QUERY_INFO_NONE,
+                            NULL, error);
+  if (info == NULL)
+    return NULL;
+
+  mtime = g_file_info_get_attribute_uint64 (info, G_FILE_ATTRIBUTE_TIME_MODIFIED) * G_USEC_PER_SEC +
+    g_file_info_get_attribute_uint32 (info, G_FILE_ATTRIBUTE_TIME_MODIFIED_USEC);
+  size = g_file_info_get_size (info);
+  g_object_unref (info);
+
+  uri = g_file_get_uri (job->file);
+  key = g_strdup_printf ("%s\n%ld", uri, (glong) job->face_index);
+
+  g_mutex_lock (&face_cache_lock);
+  face_cache_ensure ();
+
+  entry = g_hash_table_lookup (face_cache, key);
+  if (entry != NULL) {
+    if (entry->mtime == mtime && entry->size == size) {
+      face = face_cache_ref_entry (entry);
+      g_mutex_unlock (&face_cache_lock);
 
-  ft_error = FT_New_Memory_Face (job->library,
-                                 (const FT_Byte *) job->face_contents,
-                                 (FT_Long) job->face_length,
-                                 job->face_index,
-                                 &retval);
+      g_free (key);
+      g_free (uri);
+
+      return face;
+    }
+
+    /* the file changed; whoever still uses the old face keeps it */
+    face_cache_remove (entry);
+  }
+
+  g_mutex_unlock (&face_cache_lock);
+
+  path = g_file_get_path (job->file);
+
+  if (path == NULL) {
+    gchar *data;
+    gsize length;
+
+    if (!g_file_load_contents (job->file, NULL,
+                               &data, &length, NULL, error)) {
+      g_free (key);
+      g_free (uri);
+
+      return NULL;
+    }
+
+    contents = g_bytes_new_take (data, length);
+  }
+
+  g_mutex_lock (&face_cache_lock);
+
+  if (path != NULL)
+    ft_error = FT_New_Face (face_cache_library, path,
+                            job->face_index, &face);
+  else
+    ft_error = FT_New_Memory_Face (face_cache_library,
+                                   g_bytes_get_data (contents, NULL),
+                                   (FT_Long) g_bytes_get_size (contents),
+                                   job->face_index, &face);
 
   if (ft_error != 0) {
-    gchar *uri;
-    uri = g_file_get_uri (job->file);
+    g_mutex_unlock (&face_cache_lock);
+
     g_set_error (error, G_IO_ERROR, 0,
                  "Unable to read the font face file '%s'", uri);
-    retval = NULL;
-    g_free (job->face_contents);
+
+    if (contents != NULL)
+      g_bytes_unref (contents);
+    g_free (path);
+    g_free (key);
     g_free (uri);
-  } else {
-    *contents = job->face_contents;
-  }
 
-  return retval;
-}
+    return NULL;
+  }
 
-static void
-font_load_job_do_load (FontLoadJob *job,
-                       GError **error)
-{
-  gchar *contents;
-  gsize length;
+  entry = g_slice_new0 (FontFaceEntry);
+  entry->key = key;
+  entry->face = face;
+  entry->path = path;
+  entry->contents = contents;
+  entry->mtime = mtime;
+  entry->size = size;
+  entry->ref_count = 1;
 
-  g_file_load_contents (job->file, NULL,
-                        &contents, &length, NULL, error);
+  face->generic.data = entry;
+  face->generic.finalizer = NULL;
 
-  if ((error != NULL) && (*error == NULL)) {
-    job->face_contents = contents;
-    job->face_length = length;
+  /* another job may have loaded the same file meanwhile */
+  if (g_hash_table_lookup (face_cache, key) == NULL) {
+    g_hash_table_insert (face_cache, entry->key, entry);
+    entry->cached = TRUE;
   }
+
+  g_mutex_unlock (&face_cache_lock);
+  g_free (uri);
+
+  return face;
 }
 
 static void
@@ -119,7 +276,7 @@ font_load_job (GTask *task,
   FontLoadJob *job = user_data;
   GError *error = NULL;
 
-  font_load_job_do_load (job, &error);
+  job->face = font_load_job_do_load (job, &error);
 
   if (error != NULL)
     g_task_return_error (task, error);
@@ -130,25 +287,18 @@ font_load_job (GTask *task,
 /**
  * nemo_preview_new_ft_face_from_uri: (skip)
  *
+ * Returns a reference on the face, to be released with
+ * nemo_preview_ft_face_unref().
  */
 FT_Face
-nemo_preview_new_ft_face_from_uri (FT_Library library,
-                            const gchar *uri,
-                            gchar **contents,
-                            GError **error)
+nemo_preview_new_ft_face_from_uri (const gchar *uri,
+                                   GError **error)
 {
   FontLoadJob *job = NULL;
   FT_Face face;
 
-  job = font_load_job_new (library, uri, NULL, NULL);
-  font_load_job_do_load (job, error);
-
-  if ((error != NULL) && (*error != NULL)) {
-    font_load_job_free (job);
-    return NULL;
-  }
-
-  face = create_face_from_contents (job, contents, error);
+  job = font_load_job_new (uri);
+  face = font_load_job_do_load (job, error);
   font_load_job_free (job);
 
   return face;
@@ -159,12 +309,11 @@ nemo_preview_new_ft_face_from_uri (FT_Library library,
  *
  */
 void
-nemo_preview_new_ft_face_from_uri_async (FT_Library library,
-                                  const gchar *uri,
-                                  GAsyncReadyCallback callback,
-                                  gpointer user_data)
+nemo_preview_new_ft_face_from_uri_async (const gchar *uri,
+                                         GAsyncReadyCallback callback,
+                                         gpointer user_data)
 {
-  FontLoadJob *job = font_load_job_new (library, uri, callback, user_data);
+  FontLoadJob *job = font_load_job_new (uri);
   GTask *task;
 
   task = g_task_new (NULL, NULL, callback, user_data);
@@ -176,18 +325,99 @@ nemo_preview_new_ft_face_from_uri_async (FT_Library library,
 /**
  * nemo_preview_new_ft_face_from_uri_finish: (skip)
  *
+ * Returns a reference on the face, to be released with
+ * nemo_preview_ft_face_unref().
  */
 FT_Face
 nemo_preview_new_ft_face_from_uri_finish (GAsyncResult *result,
-                                   gchar **contents,
-                                   GError **error)
+                                          GError **error)
 {
   FontLoadJob *job;
+  FT_Face face;
 
   if (!g_task_propagate_boolean (G_TASK (result), error))
     return NULL;
 
   job = g_task_get_task_data (G_TASK (result));
+  face = job->face;
+  job->face = NULL;
+
+  return face;
+}
+
+/**
+ * nemo_preview_ft_face_ref: (skip)
+ *
+ */
+FT_Face
+nemo_preview_ft_face_ref (FT_Face face)
+{
+  FontFaceEntry *entry = face->generic.data;
+
+  g_mutex_lock (&face_cache_lock);
+  face_cache_ref_entry (entry);
+  g_mutex_unlock (&face_cache_lock);
+
+  return face;
+}
+
+/**
+ * nemo_preview_ft_face_unref: (skip)
+ *
+ */
+void
+nemo_preview_ft_face_unref (FT_Face face)
+{
+  FontFaceEntry *entry = face->generic.data;
+
+  g_mutex_lock (&face_cache_lock);
 
-  return create_face_from_contents (job, contents, error);
+  if (--entry->ref_count > 0)
+    goto out;
+
+  if (!entry->cached) {
+    font_face_entry_free (entry);
+    goto out;
+  }
+
+  g_queue_push_head (&unused_faces, entry);
+
+  if (g_queue_get_length (&unused_faces) > FACE_CACHE_MAX_UNUSED)
+    face_cache_remove (g_queue_peek_tail (&unused_faces));
+
+ out:
+  g_mutex_unlock (&face_cache_lock);
+}
+
+/**
+ * nemo_preview_ft_face_open_private: (skip)
+ *
+ * Opens the file behind a shared @face again in @library, for threads that
+ * can't use the shared face while it's being drawn.
+ */
+FT_Face
+nemo_preview_ft_face_open_private (FT_Library library,
+                                   FT_Face face,
+                                   GError **error)
+{
+  FontFaceEntry *entry = face->generic.data;
+  FT_Error ft_error;
+  FT_Face retval;
+
+  /* the path and contents of an entry never change */
+  if (entry->path != NULL)
+    ft_error = FT_New_Face (library, entry->path, face->face_index, &retval);
+  else
+    ft_error = FT_New_Memory_Face (library,
+                                   g_bytes_get_data (entry->contents, NULL),
+                                   (FT_Long) g_bytes_get_size (entry->contents),
+                                   face->face_index, &retval);
+
+  if (ft_error != 0) {
+    g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                         "Unable to read the font face");
+    return NULL;
+  }
+
+  return retval;
 }
@@ -32,18 +32,22 @@
 #include FT_FREETYPE_H
 #include <gio/gio.h>
 
-FT_Face nemo_preview_new_ft_face_from_uri (FT_Library library,
-                                    const gchar *uri,
-                                    gchar **contents,
-                                    GError **error);
+FT_Face nemo_preview_new_ft_face_from_uri (const gchar *uri,
+                                           GError **error);
 
-void nemo_preview_new_ft_face_from_uri_async (FT_Library library,
-                                       const gchar *uri,
-                                       GAsyncReadyCallback callback,
-                                       gpointer user_data);
+void nemo_preview_new_ft_face_from_uri_async (const gchar *uri,
+                                              GAsyncReadyCallback callback,
+                                              gpointer user_data);
 
 FT_Face nemo_preview_new_ft_face_from_uri_finish (GAsyncResult *result,
-                                           gchar **contents,
+                                                  GError **error);
+
+FT_Face nemo_preview_ft_face_ref (FT_Face face);
+
+void nemo_preview_ft_face_unref (FT_Face face);
+
+FT_Face nemo_preview_ft_face_open_private (FT_Library library,
+                                           FT_Face face,
                                            GError **error);
 
 #endif /* __NEMO_PREVIEW_FONT_LOADER_H__ */
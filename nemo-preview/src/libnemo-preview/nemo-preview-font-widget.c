@@ -29,6 +29,7 @@
 #include "nemo-preview-font-loader.h"
 
 #include <math.h>
+#include <string.h>
 
 enum {
   PROP_URI = 1,
@@ -44,9 +45,7 @@ enum {
 struct _NemoPreviewFontWidgetPrivate {
   gchar *uri;
 
-  FT_Library library;
   FT_Face face;
-  gchar *face_contents;
 
   const gchar *lowercase_text;
   const gchar *uppercase_text;
@@ -55,6 +54,12 @@ struct _NemoPreviewFontWidgetPrivate {
   gchar *sample_string;
 
   gchar *font_name;
+
+  /* what the last size request measured, until the face or style changes */
+  gboolean size_valid;
+  gint width;
+  gint height;
+  gint min_height;
 };
 
 static GParamSpec *properties[NUM_PROPERTIES] = { NULL, };
@@ -70,6 +75,41 @@ static const gchar lowercase_text_stock[] = "abcdefghijklmnopqrstuvwxyz";
 static const gchar uppercase_text_stock[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ";
 static const gchar punctuation_text_stock[] = "0123456789.:,;(*!?')";
 
+#define RANDOM_SAMPLE_CHARS 36
+
+/* Which characters a face maps, stored as the non-empty 256-character pages
+ * of the Unicode range, and cached per font file in
+ * ~/.cache/sushi/font-coverage.  A cache file is only used while the font
+ * file keeps the modification time it was computed for.
+ */
+#define COVERAGE_DIR "font-coverage"
+#define COVERAGE_MAGIC 0x4346504e /* "NPFC" */
+#define COVERAGE_VERSION 1
+#define COVERAGE_PAGE_CHARS 256
+#define COVERAGE_N_PAGES ((0x10ffff + 1) / COVERAGE_PAGE_CHARS)
+
+typedef struct {
+  guint32 page;
+  guint32 bits[COVERAGE_PAGE_CHARS / 32];
+} CoveragePage;
+
+typedef struct {
+  guint32 magic;
+  guint32 version;
+  gint64 mtime; /* microseconds */
+  guint32 face_index;
+  guint32 n_pages;
+} CoverageHeader;
+
+typedef struct {
+  GFile *file;
+  FT_Face face;
+  FT_Long face_index;
+
+  GArray *pages;
+  guint n_chars;
+} CoverageJob;
+
 /* adapted from gnome-utils:font-viewer/font-view.c
  *
  * Copyright (C) 2002-2003  James Henstridge <james@daa.com.au>
@@ -81,6 +121,7 @@ static void
 draw_string (NemoPreviewFontWidget *self,
              cairo_t *cr,
              GtkBorder padding,
+             const GdkRectangle *clip,
 	     const gchar *text,
 	     gint *pos_y)
 {
@@ -91,21 +132,26 @@ draw_string (NemoPreviewFontWidget *self,
 
   text_dir = gtk_widget_get_direction (GTK_WIDGET (self));
 
+  /* cairo only lays text out horizontally, so the line height doesn't
+   * depend on the text, and lines outside the clip are just skipped.
+   */
   cairo_font_extents (cr, &font_extents);
-  cairo_text_extents (cr, text, &extents);
-
-  if (pos_y != NULL)
-    *pos_y += font_extents.ascent + font_extents.descent +
-      extents.y_advance + LINE_SPACING / 2;
-  if (text_dir == GTK_TEXT_DIR_LTR)
-    pos_x = padding.left;
-  else {
-    pos_x = gtk_widget_get_allocated_width (GTK_WIDGET (self)) -
-      extents.x_advance - padding.right;
-  }
+  *pos_y += font_extents.ascent + font_extents.descent + LINE_SPACING / 2;
 
-  cairo_move_to (cr, pos_x, *pos_y);
-  cairo_show_text (cr, text);
+  if (*pos_y - font_extents.ascent < clip->y + clip->height &&
+      *pos_y + font_extents.descent > clip->y) {
+    cairo_text_extents (cr, text, &extents);
+
+    if (text_dir == GTK_TEXT_DIR_LTR)
+      pos_x = padding.left;
+    else {
+      pos_x = gtk_widget_get_allocated_width (GTK_WIDGET (self)) -
+        extents.x_advance - padding.right;
+    }
+
+    cairo_move_to (cr, pos_x, *pos_y);
+    cairo_show_text (cr, text);
+  }
 
   *pos_y += LINE_SPACING / 2;
 }
@@ -145,59 +191,279 @@ check_font_contain_text (FT_Face face,
   return retval;
 }
 
+static guint
+count_bits (guint32 word)
+{
+  guint count = 0;
+
+  while (word != 0) {
+    word &= word - 1;
+    count++;
+  }
+
+  return count;
+}
+
+static gint
+compare_coverage_pages (gconstpointer a,
+                        gconstpointer b)
+{
+  const CoveragePage *page_a = a;
+  const CoveragePage *page_b = b;
+
+  if (page_a->page < page_b->page)
+    return -1;
+
+  return page_a->page > page_b->page;
+}
+
+static void
+coverage_job_free (CoverageJob *job)
+{
+  g_clear_object (&job->file);
+  g_clear_pointer (&job->face, nemo_preview_ft_face_unref);
+
+  if (job->pages != NULL)
+    g_array_unref (job->pages);
+
+  g_slice_free (CoverageJob, job);
+}
+
 static gchar *
-build_charlist_for_face (FT_Face face,
-                         gint *length)
+coverage_job_get_cache_path (CoverageJob *job)
+{
+  gchar *uri, *checksum, *retval;
+
+  uri = g_file_get_uri (job->file);
+  checksum = g_compute_checksum_for_string (G_CHECKSUM_SHA1, uri, -1);
+
+  retval = g_build_filename (g_get_user_cache_dir (), "sushi",
+                             COVERAGE_DIR, checksum, NULL);
+
+  g_free (checksum);
+  g_free (uri);
+
+  return retval;
+}
+
+static gboolean
+coverage_job_load_cache (CoverageJob *job,
+                         const gchar *path,
+                         gint64 mtime)
 {
-  GString *string;
-  gulong c;
-  guint glyph;
-  gint total_chars = 0;
+  CoverageHeader header;
+  gchar *contents;
+  gsize length;
+  guint idx, word;
+
+  if (!g_file_get_contents (path, &contents, &length, NULL))
+    return FALSE;
+
+  if (length < sizeof (CoverageHeader))
+    goto out;
+
+  memcpy (&header, contents, sizeof (CoverageHeader));
+
+  if (header.magic != COVERAGE_MAGIC ||
+      header.version != COVERAGE_VERSION ||
+      header.mtime != mtime ||
+      header.face_index != job->face_index ||
+      header.n_pages > COVERAGE_N_PAGES ||
+      length != sizeof (CoverageHeader) + header.n_pages * sizeof (CoveragePage))
+    goto out;
+
+  job->pages = g_array_sized_new (FALSE, FALSE, sizeof (CoveragePage), header.n_pages);
+  g_array_append_vals (job->pages, contents + sizeof (CoverageHeader), header.n_pages);
+
+  for (idx = 0; idx < job->pages->len; idx++) {
+    CoveragePage *page = &g_array_index (job->pages, CoveragePage, idx);
+
+    for (word = 0; word < G_N_ELEMENTS (page->bits); word++)
+      job->n_chars += count_bits (page->bits[word]);
+  }
+
+ out:
+  g_free (contents);
 
-  string = g_string_new (NULL);
+  return (job->pages != NULL);
+}
+
+static void
+coverage_job_save_cache (CoverageJob *job,
+                         const gchar *path,
+                         gint64 mtime)
+{
+  CoverageHeader header = { 0, };
+  GByteArray *buffer;
+  gchar *dir;
+
+  header.magic = COVERAGE_MAGIC;
+  header.version = COVERAGE_VERSION;
+  header.mtime = mtime;
+  header.face_index = job->face_index;
+  header.n_pages = job->pages->len;
+
+  buffer = g_byte_array_new ();
+  g_byte_array_append (buffer, (const guint8 *) &header, sizeof (CoverageHeader));
+  g_byte_array_append (buffer, (const guint8 *) job->pages->data,
+                       job->pages->len * sizeof (CoveragePage));
+
+  dir = g_path_get_dirname (path);
+  g_mkdir_with_parents (dir, 0700);
+  g_file_set_contents (path, (const gchar *) buffer->data, buffer->len, NULL);
+
+  g_free (dir);
+  g_byte_array_unref (buffer);
+}
+
+static gboolean
+coverage_job_compute (CoverageJob *job,
+                      GError **error)
+{
+  FT_Library library;
+  FT_Face face;
+  FT_ULong c;
+  FT_UInt glyph;
+  gint *slots;
+
+  if (FT_Init_FreeType (&library) != 0) {
+    g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                         "Unable to initialize FreeType");
+    return FALSE;
+  }
+
+  /* the widget keeps the shared face alive while the job runs; a face of
+   * our own keeps this thread away from the one being drawn.
+   */
+  face = nemo_preview_ft_face_open_private (library, job->face, error);
+  if (face == NULL) {
+    FT_Done_FreeType (library);
+    return FALSE;
+  }
+
+  /* symbol fonts may only have a charmap FreeType doesn't pick by itself */
+  if (face->charmap == NULL && face->num_charmaps > 0)
+    FT_Set_Charmap (face, face->charmaps[0]);
+
+  job->pages = g_array_new (FALSE, TRUE, sizeof (CoveragePage));
+  slots = g_new (gint, COVERAGE_N_PAGES);
+  memset (slots, -1, COVERAGE_N_PAGES * sizeof (gint));
 
   c = FT_Get_First_Char (face, &glyph);
 
   while (glyph != 0) {
-    g_string_append_unichar (string, (gunichar) c);
+    if (c <= 0x10ffff) {
+      guint page_no = c / COVERAGE_PAGE_CHARS;
+      guint offset = c % COVERAGE_PAGE_CHARS;
+      CoveragePage *page;
+
+      if (slots[page_no] == -1) {
+        slots[page_no] = job->pages->len;
+        g_array_set_size (job->pages, job->pages->len + 1);
+        g_array_index (job->pages, CoveragePage, slots[page_no]).page = page_no;
+      }
+
+      page = &g_array_index (job->pages, CoveragePage, slots[page_no]);
+      if (!(page->bits[offset / 32] & (1u << (offset % 32)))) {
+        page->bits[offset / 32] |= 1u << (offset % 32);
+        job->n_chars++;
+      }
+    }
+
     c = FT_Get_Next_Char (face, c, &glyph);
-    total_chars++;
   }
 
-  if (length)
-    *length = total_chars;
+  g_array_sort (job->pages, compare_coverage_pages);
+
+  g_free (slots);
+  FT_Done_Face (face);
+  FT_Done_FreeType (library);
 
-  return g_string_free (string, FALSE);
+  return TRUE;
 }
 
-static gchar *
-random_string_from_available_chars (FT_Face face,
-                                    gint n_chars)
+static gunichar
+coverage_job_nth_char (CoverageJob *job,
+                       guint nth)
 {
-  gchar *chars;
-  gint idx, rand, total_chars;
-  GString *retval;
-  gchar *ptr, *end;
+  guint idx, word, count;
 
-  idx = 0;
-  chars = build_charlist_for_face (face, &total_chars);
+  for (idx = 0; idx < job->pages->len; idx++) {
+    CoveragePage *page = &g_array_index (job->pages, CoveragePage, idx);
 
-  if (total_chars == 0)
-    return NULL;
+    for (word = 0; word < G_N_ELEMENTS (page->bits); word++) {
+      guint32 bits = page->bits[word];
 
-  retval = g_string_new (NULL);
+      count = count_bits (bits);
+      if (nth >= count) {
+        nth -= count;
+        continue;
+      }
+
+      while (nth-- > 0)
+        bits &= bits - 1;
+
+      return page->page * COVERAGE_PAGE_CHARS + word * 32 + g_bit_nth_lsf (bits, -1);
+    }
+  }
+
+  g_assert_not_reached ();
+  return 0;
+}
+
+static void
+coverage_job (GTask *task,
+              gpointer source_object,
+              gpointer user_data,
+              GCancellable *cancellable)
+{
+  CoverageJob *job = user_data;
+  GFileInfo *info;
+  GString *retval;
+  GError *error = NULL;
+  gchar *path;
+  gint64 mtime = -1;
+  gint idx;
+
+  info = g_file_query_info (job->file,
+                            G_FILE_ATTRIBUTE_TIME_MODIFIED ","
+                            G_FILE_ATTRIBUTE_TIME_MODIFIED_USEC,
+                            G_FILE_QUERY_INFO_NONE,
+                            cancellable, NULL);
+  if (info != NULL &&
+      g_file_info_has_attribute (info, G_FILE_ATTRIBUTE_TIME_MODIFIED)) {
+    mtime = g_file_info_get_attribute_uint64 (info, G_FILE_ATTRIBUTE_TIME_MODIFIED) * G_USEC_PER_SEC +
+      g_file_info_get_attribute_uint32 (info, G_FILE_ATTRIBUTE_TIME_MODIFIED_USEC);
+  }
+  g_clear_object (&info);
 
-  while (idx < n_chars) {
-    rand = g_random_int_range (0, total_chars);
+  path = coverage_job_get_cache_path (job);
 
-    ptr = g_utf8_offset_to_pointer (chars, rand);
-    end = g_utf8_find_next_char (ptr, NULL);
+  if (mtime == -1 || !coverage_job_load_cache (job, path, mtime)) {
+    if (!coverage_job_compute (job, &error)) {
+      g_task_return_error (task, error);
+      g_free (path);
+      return;
+    }
+
+    if (mtime != -1)
+      coverage_job_save_cache (job, path, mtime);
+  }
 
-    g_string_append_len (retval, ptr, end - ptr);
-    idx++;
+  g_free (path);
+
+  if (job->n_chars == 0) {
+    g_task_return_pointer (task, NULL, NULL);
+    return;
   }
 
-  return g_string_free (retval, FALSE);
+  retval = g_string_new (NULL);
+
+  for (idx = 0; idx < RANDOM_SAMPLE_CHARS; idx++)
+    g_string_append_unichar (retval,
+                             coverage_job_nth_char (job, g_random_int_range (0, job->n_chars)));
+
+  g_task_return_pointer (task, g_string_free (retval, FALSE), g_free);
 }
 
 static gboolean
@@ -245,8 +511,11 @@ build_strings_for_face (NemoPreviewFontWidget *self)
   else
     self->priv->punctuation_text = NULL;
 
-  if (!set_pango_sample_string (self))
-    self->priv->sample_string = random_string_from_available_chars (self->priv->face, 36);
+  /* a random sample needs the coverage of the face; see load_random_sample */
+  if (!set_pango_sample_string (self)) {
+    g_free (self->priv->sample_string);
+    self->priv->sample_string = NULL;
+  }
 
   g_free (self->priv->font_name);
   self->priv->font_name = NULL;
@@ -350,8 +619,10 @@ nemo_preview_font_widget_size_request (GtkWidget *drawing_area,
     return;
   }
 
-  if (min_height != NULL)
-    *min_height = -1;
+  if (priv->size_valid)
+    goto out;
+
+  priv->min_height = -1;
 
   surface = cairo_image_surface_create (CAIRO_FORMAT_ARGB32,
                                         SURFACE_SIZE, SURFACE_SIZE);
@@ -374,8 +645,7 @@ nemo_preview_font_widget_size_request (GtkWidget *drawing_area,
       cairo_set_font_size (cr, title_size);
       cairo_font_extents (cr, &font_extents);
       cairo_text_extents (cr, self->priv->font_name, &extents);
-      pixmap_height += font_extents.ascent + font_extents.descent +
-        extents.y_advance + LINE_SPACING;
+      pixmap_height += font_extents.ascent + font_extents.descent + LINE_SPACING;
       pixmap_width = MAX (pixmap_width, extents.width + padding.left + padding.right);
   }
 
@@ -385,22 +655,19 @@ nemo_preview_font_widget_size_request (GtkWidget *drawing_area,
 
   if (self->priv->lowercase_text != NULL) {
     cairo_text_extents (cr, self->priv->lowercase_text, &extents);
-    pixmap_height += font_extents.ascent + font_extents.descent + 
-      extents.y_advance + LINE_SPACING;
+    pixmap_height += font_extents.ascent + font_extents.descent + LINE_SPACING;
     pixmap_width = MAX (pixmap_width, extents.width + padding.left + padding.right);
   }
 
   if (self->priv->uppercase_text != NULL) {
     cairo_text_extents (cr, self->priv->uppercase_text, &extents);
-    pixmap_height += font_extents.ascent + font_extents.descent +
-      extents.y_advance + LINE_SPACING;
+    pixmap_height += font_extents.ascent + font_extents.descent + LINE_SPACING;
     pixmap_width = MAX (pixmap_width, extents.width + padding.left + padding.right);
   }
 
   if (self->priv->punctuation_text != NULL) {
     cairo_text_extents (cr, self->priv->punctuation_text, &extents);
-    pixmap_height += font_extents.ascent + font_extents.descent +
-      extents.y_advance + LINE_SPACING;
+    pixmap_height += font_extents.ascent + font_extents.descent + LINE_SPACING;
     pixmap_width = MAX (pixmap_width, extents.width + padding.left + padding.right);
   }
 
@@ -410,30 +677,58 @@ nemo_preview_font_widget_size_request (GtkWidget *drawing_area,
     for (i = 0; i < n_sizes; i++) {
       cairo_set_font_size (cr, sizes[i]);
       cairo_font_extents (cr, &font_extents);
-      cairo_text_extents (cr, self->priv->sample_string, &extents);
-      pixmap_height += font_extents.ascent + font_extents.descent +
-        extents.y_advance + LINE_SPACING;
-      pixmap_width = MAX (pixmap_width, extents.width + padding.left + padding.right);
+      pixmap_height += font_extents.ascent + font_extents.descent + LINE_SPACING;
+
+      /* a scalable sample is widest at the largest size, so that's the only
+       * one worth laying out.
+       */
+      if (!FT_IS_SCALABLE (face) || i == n_sizes - 1) {
+        cairo_text_extents (cr, self->priv->sample_string, &extents);
+        pixmap_width = MAX (pixmap_width, extents.width + padding.left + padding.right);
+      }
 
-      if ((i == 7) && (min_height != NULL))
-        *min_height = pixmap_height;
+      if (i == 7)
+        priv->min_height = pixmap_height;
     }
   }
 
   pixmap_height += padding.bottom + SECTION_SPACING;
 
-  if (min_height != NULL && *min_height == -1)
-    *min_height = pixmap_height;
-
-  if (width != NULL)
-    *width = pixmap_width;
+  if (priv->min_height == -1)
+    priv->min_height = pixmap_height;
 
-  if (height != NULL)
-    *height = pixmap_height;
+  priv->width = pixmap_width;
+  priv->height = pixmap_height;
+  priv->size_valid = TRUE;
 
   cairo_destroy (cr);
   cairo_surface_destroy (surface);
   g_free (sizes);
+
+ out:
+  if (min_height != NULL)
+    *min_height = priv->min_height;
+
+  if (width != NULL)
+    *width = priv->width;
+
+  if (height != NULL)
+    *height = priv->height;
+}
+
+static void
+nemo_preview_font_widget_invalidate_size (NemoPreviewFontWidget *self)
+{
+  self->priv->size_valid = FALSE;
+  gtk_widget_queue_resize (GTK_WIDGET (self));
+}
+
+static void
+nemo_preview_font_widget_style_updated (GtkWidget *widget)
+{
+  GTK_WIDGET_CLASS (nemo_preview_font_widget_parent_class)->style_updated (widget);
+
+  nemo_preview_font_widget_invalidate_size (NEMO_PREVIEW_FONT_WIDGET (widget));
 }
 
 static void
@@ -474,11 +769,15 @@ nemo_preview_font_widget_draw (GtkWidget *drawing_area,
   GdkRGBA color;
   GtkBorder padding;
   GtkStateFlags state;
+  GdkRectangle clip;
   gint allocated_width, allocated_height;
 
   if (face == NULL)
     goto end;
 
+  if (!gdk_cairo_get_clip_rectangle (cr, &clip))
+    goto end;
+
   context = gtk_widget_get_style_context (drawing_area);
   state = gtk_style_context_get_state (context);
 
@@ -503,36 +802,39 @@ nemo_preview_font_widget_draw (GtkWidget *drawing_area,
 
   if (self->priv->font_name != NULL) {
     cairo_set_font_size (cr, title_size);
-    draw_string (self, cr, padding, self->priv->font_name, &pos_y);
+    draw_string (self, cr, padding, &clip, self->priv->font_name, &pos_y);
   }
 
-  if (pos_y > allocated_height)
+  if (pos_y > clip.y + clip.height)
     goto end;
 
   pos_y += SECTION_SPACING / 2;
   cairo_set_font_size (cr, alpha_size);
 
   if (self->priv->lowercase_text != NULL)
-    draw_string (self, cr, padding, self->priv->lowercase_text, &pos_y);
-  if (pos_y > allocated_height)
+    draw_string (self, cr, padding, &clip, self->priv->lowercase_text, &pos_y);
+  if (pos_y > clip.y + clip.height)
     goto end;
 
   if (self->priv->uppercase_text != NULL)
-    draw_string (self, cr, padding, self->priv->uppercase_text, &pos_y);
-  if (pos_y > allocated_height)
+    draw_string (self, cr, padding, &clip, self->priv->uppercase_text, &pos_y);
+  if (pos_y > clip.y + clip.height)
     goto end;
 
   if (self->priv->punctuation_text != NULL)
-    draw_string (self, cr, padding, self->priv->punctuation_text, &pos_y);
-  if (pos_y > allocated_height)
+    draw_string (self, cr, padding, &clip, self->priv->punctuation_text, &pos_y);
+  if (pos_y > clip.y + clip.height)
+    goto end;
+
+  if (self->priv->sample_string == NULL)
     goto end;
 
   pos_y += SECTION_SPACING;
 
   for (i = 0; i < n_sizes; i++) {
     cairo_set_font_size (cr, sizes[i]);
-    draw_string (self, cr, padding, self->priv->sample_string, &pos_y);
-    if (pos_y > allocated_height)
+    draw_string (self, cr, padding, &clip, self->priv->sample_string, &pos_y);
+    if (pos_y > clip.y + clip.height)
       break;
   }
 
@@ -542,6 +844,47 @@ nemo_preview_font_widget_draw (GtkWidget *drawing_area,
   return FALSE;
 }
 
+static void
+random_sample_ready_cb (GObject *object,
+                        GAsyncResult *result,
+                        gpointer user_data)
+{
+  NemoPreviewFontWidget *self = NEMO_PREVIEW_FONT_WIDGET (object);
+  GError *error = NULL;
+
+  g_free (self->priv->sample_string);
+  self->priv->sample_string = g_task_propagate_pointer (G_TASK (result), &error);
+
+  if (error != NULL) {
+    g_print ("Can't read the characters of the font face: %s\n", error->message);
+    g_error_free (error);
+  }
+
+  nemo_preview_font_widget_invalidate_size (self);
+  g_signal_emit (self, signals[LOADED], 0);
+}
+
+/* Fonts without the sample text of any language we know, like symbol and
+ * CJK fonts, show random characters they cover instead.  Finding those
+ * means walking the whole charmap, which is done once per font file and
+ * off the main thread.
+ */
+static void
+load_random_sample (NemoPreviewFontWidget *self)
+{
+  CoverageJob *job = g_slice_new0 (CoverageJob);
+  GTask *task;
+
+  job->file = g_file_new_for_uri (self->priv->uri);
+  job->face = nemo_preview_ft_face_ref (self->priv->face);
+  job->face_index = self->priv->face->face_index;
+
+  task = g_task_new (self, NULL, random_sample_ready_cb, NULL);
+  g_task_set_task_data (task, job, (GDestroyNotify) coverage_job_free);
+  g_task_run_in_thread (task, coverage_job);
+  g_object_unref (task);
+}
+
 static void
 font_face_async_ready_cb (GObject *object,
                           GAsyncResult *result,
@@ -549,11 +892,13 @@ font_face_async_ready_cb (GObject *object,
 {
   NemoPreviewFontWidget *self = user_data;
   GError *error = NULL;
+  FT_Face face;
 
-  self->priv->face =
-    nemo_preview_new_ft_face_from_uri_finish (result,
-                                       &self->priv->face_contents,
-                                       &error);
+  face = nemo_preview_new_ft_face_from_uri_finish (result, &error);
+
+  if (self->priv->face != NULL)
+    nemo_preview_ft_face_unref (self->priv->face);
+  self->priv->face = face;
 
   if (error != NULL) {
     g_signal_emit (self, signals[ERROR], 0, error->message);
@@ -565,17 +910,21 @@ font_face_async_ready_cb (GObject *object,
 
   build_strings_for_face (self);
 
-  gtk_widget_queue_resize (GTK_WIDGET (self));
+  if (self->priv->sample_string == NULL) {
+    load_random_sample (self);
+    return;
+  }
+
+  nemo_preview_font_widget_invalidate_size (self);
   g_signal_emit (self, signals[LOADED], 0);
 }
 
 static void
 load_font_face (NemoPreviewFontWidget *self)
 {
-  nemo_preview_new_ft_face_from_uri_async (self->priv->library,
-                                    self->priv->uri,
-                                    font_face_async_ready_cb,
-                                    self);
+  nemo_preview_new_ft_face_from_uri_async (self->priv->uri,
+                                           font_face_async_ready_cb,
+                                           self);
 }
 
 static void
@@ -591,16 +940,10 @@ nemo_preview_font_widget_set_uri (NemoPreviewFontWidget *self,
 static void
 nemo_preview_font_widget_init (NemoPreviewFontWidget *self)
 {
-  FT_Error err;
-
   self->priv = G_TYPE_INSTANCE_GET_PRIVATE (self, NEMO_PREVIEW_TYPE_FONT_WIDGET,
                                             NemoPreviewFontWidgetPrivate);
 
   self->priv->face = NULL;
-  err = FT_Init_FreeType (&self->priv->library);
-
-  if (err != FT_Err_Ok)
-    g_error ("Unable to initialize FreeType");
 
   gtk_style_context_add_class (gtk_widget_get_style_context (GTK_WIDGET (self)),
                                GTK_STYLE_CLASS_VIEW);
@@ -650,18 +993,12 @@ nemo_preview_font_widget_finalize (GObject *object)
   g_free (self->priv->uri);
 
   if (self->priv->face != NULL) {
-    FT_Done_Face (self->priv->face);
+    nemo_preview_ft_face_unref (self->priv->face);
     self->priv->face = NULL;
   }
 
   g_free (self->priv->font_name);
   g_free (self->priv->sample_string);
-  g_free (self->priv->face_contents);
-
-  if (self->priv->library != NULL) {
-    FT_Done_FreeType (self->priv->library);
-    self->priv->library = NULL;
-  }
 
   G_OBJECT_CLASS (nemo_preview_font_widget_parent_class)->finalize (object);
 }
@@ -679,6 +1016,7 @@ nemo_preview_font_widget_class_init (NemoPreviewFontWidgetClass *klass)
   wclass->draw = nemo_preview_font_widget_draw;
   wclass->get_preferred_width = nemo_preview_font_widget_get_preferred_width;
   wclass->get_preferred_height = nemo_preview_font_widget_get_preferred_height;
+  wclass->style_updated = nemo_preview_font_widget_style_updated;
 
   properties[PROP_URI] =
     g_param_spec_string ("uri",
@@ -0,0 +1,203 @@
+/*
+ * nemo-preview-image-loader.c: size-aware image decoding
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301 USA.
+ *
+ * The NemoPreview project hereby grant permission for non-gpl compatible GStreamer
+ * plugins to be used and distributed together with GStreamer and NemoPreview. This
+ * permission is above and beyond the permissions granted by the GPL license
+ * NemoPreview is covered by.
+ *
+ */
+
+#include "nemo-preview-image-loader.h"
+
+/* Images are decoded straight to the size they are going to be shown at:
+ * the loader is told the target size as soon as the header is parsed, so
+ * modules that can decode at a reduced scale (such as JPEG, which decodes
+ * at 1/2, 1/4 or 1/8 of the size) never produce the full resolution
+ * pixels, and the others are scaled down as the image comes in.
+ */
+#define IMAGE_LOAD_CHUNK_SIZE (64 * 1024)
+
+typedef struct {
+  GFile *file;
+  gint max_width;
+  gint max_height;
+
+  gint full_width;
+  gint full_height;
+  GdkPixbufAnimation *animation;
+} ImageLoadJob;
+
+static void
+image_load_job_free (ImageLoadJob *job)
+{
+  g_clear_object (&job->file);
+  g_clear_object (&job->animation);
+
+  g_slice_free (ImageLoadJob, job);
+}
+
+static void
+loader_size_prepared_cb (GdkPixbufLoader *loader,
+                         gint width,
+                         gint height,
+                         gpointer user_data)
+{
+  ImageLoadJob *job = user_data;
+  gdouble scale;
+
+  job->full_width = width;
+  job->full_height = height;
+
+  if (job->max_width <= 0 || job->max_height <= 0)
+    return;
+
+  if (width <= job->max_width && height <= job->max_height)
+    return;
+
+  scale = MIN ((gdouble) job->max_width / width,
+               (gdouble) job->max_height / height);
+
+  gdk_pixbuf_loader_set_size (loader,
+                              MAX ((gint) (width * scale), 1),
+                              MAX ((gint) (height * scale), 1));
+}
+
+static void
+image_load_job (GTask *task,
+                gpointer source_object,
+                gpointer task_data,
+                GCancellable *cancellable)
+{
+  ImageLoadJob *job = task_data;
+  GdkPixbufLoader *loader;
+  GFileInputStream *stream;
+  guchar *buffer;
+  gssize res;
+  GError *error = NULL;
+
+  stream = g_file_read (job->file, cancellable, &error);
+  if (stream == NULL) {
+    g_task_return_error (task, error);
+    return;
+  }
+
+  loader = gdk_pixbuf_loader_new ();
+  g_signal_connect (loader, "size-prepared",
+                    G_CALLBACK (loader_size_prepared_cb), job);
+
+  buffer = g_malloc (IMAGE_LOAD_CHUNK_SIZE);
+
+  while ((res = g_input_stream_read (G_INPUT_STREAM (stream),
+                                     buffer, IMAGE_LOAD_CHUNK_SIZE,
+                                     cancellable, &error)) > 0) {
+    if (!gdk_pixbuf_loader_write (loader, buffer, res, &error))
+      break;
+  }
+
+  /* the loader has to be closed even if we're giving up on it */
+  if (error == NULL)
+    gdk_pixbuf_loader_close (loader, &error);
+  else
+    gdk_pixbuf_loader_close (loader, NULL);
+
+  if (error == NULL) {
+    job->animation = gdk_pixbuf_loader_get_animation (loader);
+
+    if (job->animation != NULL)
+      g_object_ref (job->animation);
+    else
+      g_set_error (&error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_FAILED,
+                   "No image data");
+  }
+
+  if (error != NULL)
+    g_task_return_error (task, error);
+  else
+    g_task_return_boolean (task, TRUE);
+
+  g_free (buffer);
+  g_object_unref (loader);
+  g_input_stream_close (G_INPUT_STREAM (stream), NULL, NULL);
+  g_object_unref (stream);
+}
+
+/**
+ * nemo_preview_load_image_async:
+ * @file: the image to load
+ * @max_width: the maximum width to decode at, or 0 for the full size
+ * @max_height: the maximum height to decode at, or 0 for the full size
+ * @cancellable: (allow-none): a #GCancellable
+ * @callback: (scope async): called when the image is loaded
+ * @user_data: (closure): data for @callback
+ *
+ * Loads @file in a thread, decoding it at the largest size that fits
+ * within @max_width x @max_height while keeping its aspect ratio; images
+ * smaller than that are loaded as they are.
+ */
+void
+nemo_preview_load_image_async (GFile *file,
+                               gint max_width,
+                               gint max_height,
+                               GCancellable *cancellable,
+                               GAsyncReadyCallback callback,
+                               gpointer user_data)
+{
+  ImageLoadJob *job;
+  GTask *task;
+
+  job = g_slice_new0 (ImageLoadJob);
+  job->file = g_object_ref (file);
+  job->max_width = max_width;
+  job->max_height = max_height;
+
+  task = g_task_new (NULL, cancellable, callback, user_data);
+  g_task_set_task_data (task, job, (GDestroyNotify) image_load_job_free);
+  g_task_run_in_thread (task, image_load_job);
+  g_object_unref (task);
+}
+
+/**
+ * nemo_preview_load_image_finish:
+ * @result: a #GAsyncResult
+ * @full_width: (out) (allow-none): the width of the image at full size
+ * @full_height: (out) (allow-none): the height of the image at full size
+ * @error: a #GError
+ *
+ * Returns: (transfer full): the loaded image, possibly downscaled
+ */
+GdkPixbufAnimation *
+nemo_preview_load_image_finish (GAsyncResult *result,
+                                gint *full_width,
+                                gint *full_height,
+                                GError **error)
+{
+  ImageLoadJob *job;
+
+  if (!g_task_propagate_boolean (G_TASK (result), error))
+    return NULL;
+
+  job = g_task_get_task_data (G_TASK (result));
+
+  if (full_width != NULL)
+    *full_width = job->full_width;
+  if (full_height != NULL)
+    *full_height = job->full_height;
+
+  return g_object_ref (job->animation);
+}
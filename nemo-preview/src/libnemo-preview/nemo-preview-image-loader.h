@@ -0,0 +1,48 @@
+/*
+ * nemo-preview-image-loader.h: size-aware image decoding
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301 USA.
+ *
+ * The NemoPreview project hereby grant permission for non-gpl compatible GStreamer
+ * plugins to be used and distributed together with GStreamer and NemoPreview. This
+ * permission is above and beyond the permissions granted by the GPL license
+ * NemoPreview is covered by.
+ *
+ */
+
+#ifndef __NEMO_PREVIEW_IMAGE_LOADER_H__
+#define __NEMO_PREVIEW_IMAGE_LOADER_H__
+
+#include <gdk-pixbuf/gdk-pixbuf.h>
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+void nemo_preview_load_image_async (GFile *file,
+                                    gint max_width,
+                                    gint max_height,
+                                    GCancellable *cancellable,
+                                    GAsyncReadyCallback callback,
+                                    gpointer user_data);
+
+GdkPixbufAnimation *nemo_preview_load_image_finish (GAsyncResult *result,
+                                                    gint *full_width,
+                                                    gint *full_height,
+                                                    GError **error);
+
+G_END_DECLS
+
+#endif /* __NEMO_PREVIEW_IMAGE_LOADER_H__ */
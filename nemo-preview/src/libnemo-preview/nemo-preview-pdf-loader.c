@@ -30,32 +30,97 @@
 #include "nemo-preview-utils.h"
 #include <xreader-document.h>
 #include <xreader-view.h>
+#include <glib/gi18n.h>
 #include <glib/gstdio.h>
 #include <gdk/gdkx.h>
 
+#include <errno.h>
+#include <signal.h>
+#include <string.h>
+
 G_DEFINE_TYPE (NemoPreviewPdfLoader, nemo_preview_pdf_loader, G_TYPE_OBJECT);
 
 enum {
   PROP_DOCUMENT = 1,
-  PROP_URI
+  PROP_URI,
+  PROP_ALLOW_INSTALL
+};
+
+enum {
+  ERROR,
+  NUM_SIGNALS
 };
 
+static guint signals[NUM_SIGNALS] = { 0, };
+
 static void load_libreoffice (NemoPreviewPdfLoader *self);
 
+typedef struct _Conversion Conversion;
+
 struct _NemoPreviewPdfLoaderPrivate {
   EvDocument *document;
   gchar *uri;
   gchar *pdf_path;
+  gchar *cache_key;
+  gboolean allow_install;
+
+  /* cancelled when the document is cleaned up or replaced, so that no
+   * callback runs against a loader that is gone */
+  GCancellable *cancellable;
+  EvJob *load_job;
+  Conversion *conversion;
+};
+
+/* Documents converted by LibreOffice are kept in CACHE_PDF_DIR under a name
+ * derived from the document's URI, size and mtime, so an unchanged document
+ * is only converted once, and documents with the same basename don't
+ * overwrite each other.  The least recently used PDFs are removed once the
+ * directory grows past CACHE_PDF_BUDGET.
+ *
+ * LibreOffice runs with its own profile, one conversion at a time; loaders
+ * asking for a document that is already being converted wait for the same
+ * conversion.
+ */
+#define CACHE_PDF_DIR "pdf"
+#define CACHE_PDF_BUDGET (256 * 1024 * 1024)
+#define CACHE_PDF_ATTRS                       \
+  G_FILE_ATTRIBUTE_STANDARD_CONTENT_TYPE ","  \
+  G_FILE_ATTRIBUTE_STANDARD_SIZE ","          \
+  G_FILE_ATTRIBUTE_TIME_MODIFIED ","          \
+  G_FILE_ATTRIBUTE_TIME_MODIFIED_USEC
+
+struct _Conversion {
+  gchar *key;
+  gchar *doc_path;
+  gchar *pdf_path;
+  gchar *tmp_dir;
 
-  GPid libreoffice_pid;
+  GPid pid;
+  GList *waiters;
+
+  /* killed with nobody waiting; no longer in conversions */
+  gboolean abandoned;
 };
 
+static GHashTable *conversions;
+static GQueue conversion_queue = G_QUEUE_INIT;
+static Conversion *running_conversion;
+
+static void
+report_error (NemoPreviewPdfLoader *self,
+              const gchar *message)
+{
+  g_signal_emit (self, signals[ERROR], 0, message);
+}
+
 static void
 load_job_done (EvJob *job,
                gpointer user_data)
 {
   NemoPreviewPdfLoader *self = user_data;
 
+  self->priv->load_job = NULL;
+
   if (ev_job_is_failed (job)) {
     g_print ("Failed to load document: %s", job->error->message);
     g_object_unref (job);
@@ -78,6 +143,7 @@ load_pdf (NemoPreviewPdfLoader *self,
   job = ev_job_load_new (uri);
   g_signal_connect (job, "finished",
                     G_CALLBACK (load_job_done), self);
+  self->priv->load_job = job;
 
   ev_job_scheduler_push_job (job, EV_JOB_PRIORITY_NONE);
 }
@@ -91,11 +157,19 @@ libreoffice_missing_ready_cb (GObject *source,
   GError *error = NULL;
 
   g_dbus_connection_call_finish (G_DBUS_CONNECTION (source), res, &error);
+  if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+    /* the loader may be gone already */
+    g_error_free (error);
+    return;
+  }
+
   if (error != NULL) {
     /* can't install libreoffice with packagekit - nothing else we can do */
-    /* FIXME: error reporting! */
     g_warning ("libreoffice not found, and PackageKit failed to install it with error %s",
                error->message);
+    g_error_free (error);
+
+    report_error (self, _("LibreOffice is needed to preview this document"));
     return;
   }
 
@@ -113,6 +187,12 @@ libreoffice_missing (NemoPreviewPdfLoader *self)
   GdkWindow *gdk_window;
   const gchar *libreoffice_path[2];
 
+  /* only offer to install LibreOffice for a document the user asked to see */
+  if (!self->priv->allow_install) {
+    report_error (self, _("LibreOffice is needed to preview this document"));
+    return;
+  }
+
   gdk_window = gtk_widget_get_window (widget);
   if (gdk_window != NULL)
     xid = GDK_WINDOW_XID (gdk_window);
@@ -130,98 +210,345 @@ libreoffice_missing (NemoPreviewPdfLoader *self)
                                          libreoffice_path,
                                          "hide-confirm-deps"),
                           NULL, G_DBUS_CALL_FLAGS_NONE,
-                          G_MAXINT, NULL,
+                          G_MAXINT, self->priv->cancellable,
                           libreoffice_missing_ready_cb,
                           self);
 }
 
+static gchar *
+get_pdf_cache_dir (void)
+{
+  return g_build_filename (g_get_user_cache_dir (), "sushi", CACHE_PDF_DIR, NULL);
+}
+
+static gchar *
+get_cache_key (const gchar *uri,
+               GFileInfo *info)
+{
+  gchar *str, *key;
+
+  str = g_strdup_printf ("%s\n%" G_GUINT64_FORMAT "\n%" G_GUINT64_FORMAT ".%06u",
+                         uri,
+                         (guint64) g_file_info_get_size (info),
+                         g_file_info_get_attribute_uint64 (info, G_FILE_ATTRIBUTE_TIME_MODIFIED),
+                         g_file_info_get_attribute_uint32 (info, G_FILE_ATTRIBUTE_TIME_MODIFIED_USEC));
+  key = g_compute_checksum_for_string (G_CHECKSUM_SHA1, str, -1);
+  g_free (str);
+
+  return key;
+}
+
+static void
+remove_tmp_dir (const gchar *path)
+{
+  GDir *dir;
+  const gchar *name;
+
+  dir = g_dir_open (path, 0, NULL);
+  if (dir != NULL) {
+    while ((name = g_dir_read_name (dir)) != NULL) {
+      gchar *child = g_build_filename (path, name, NULL);
+      g_unlink (child);
+      g_free (child);
+    }
+
+    g_dir_close (dir);
+  }
+
+  g_rmdir (path);
+}
+
+/* libreoffice --convert-to names its output after the input, replacing the
+ * extension with .pdf; it is the only file in the temporary directory.
+ */
+static gboolean
+move_converted_pdf (Conversion *conversion)
+{
+  GDir *dir;
+  const gchar *name;
+  gboolean retval = FALSE;
+
+  dir = g_dir_open (conversion->tmp_dir, 0, NULL);
+  if (dir == NULL)
+    return FALSE;
+
+  while ((name = g_dir_read_name (dir)) != NULL) {
+    gchar *path;
+
+    if (!g_str_has_suffix (name, ".pdf"))
+      continue;
+
+    path = g_build_filename (conversion->tmp_dir, name, NULL);
+    retval = (g_rename (path, conversion->pdf_path) == 0);
+    g_free (path);
+
+    break;
+  }
+
+  g_dir_close (dir);
+
+  return retval;
+}
+
+static void
+conversion_free (Conversion *conversion)
+{
+  g_list_free (conversion->waiters);
+  g_free (conversion->key);
+  g_free (conversion->doc_path);
+  g_free (conversion->pdf_path);
+  g_free (conversion->tmp_dir);
+
+  g_slice_free (Conversion, conversion);
+}
+
+static void start_next_conversion (void);
+
 static void
 libreoffice_child_watch_cb (GPid pid,
                             gint status,
                             gpointer user_data)
 {
-  NemoPreviewPdfLoader *self = user_data;
-  GFile *file;
-  gchar *uri;
+  Conversion *conversion = user_data;
+  gboolean success;
+  GList *l;
 
   g_spawn_close_pid (pid);
-  self->priv->libreoffice_pid = -1;
 
-  file = g_file_new_for_path (self->priv->pdf_path);
-  uri = g_file_get_uri (file);
-  load_pdf (self, uri);
+  /* a killed conversion may have left a truncated PDF behind */
+  success = g_spawn_check_wait_status (status, NULL) &&
+    move_converted_pdf (conversion);
+  remove_tmp_dir (conversion->tmp_dir);
 
-  g_object_unref (file);
-  g_free (uri);
+  if (success) {
+    gchar *pdf_dir = get_pdf_cache_dir ();
+    nemo_preview_prune_cache_dir (pdf_dir, ".pdf", CACHE_PDF_BUDGET);
+    g_free (pdf_dir);
+  }
+  else
+    g_warning ("LibreOffice failed to convert %s", conversion->doc_path);
+
+  for (l = conversion->waiters; l != NULL; l = l->next) {
+    NemoPreviewPdfLoader *self = l->data;
+
+    self->priv->conversion = NULL;
+
+    if (success) {
+      GFile *file;
+      gchar *uri;
+
+      file = g_file_new_for_path (conversion->pdf_path);
+      uri = g_file_get_uri (file);
+      load_pdf (self, uri);
+
+      g_object_unref (file);
+      g_free (uri);
+    } else {
+      report_error (self, _("LibreOffice could not convert this document"));
+    }
+  }
+
+  if (!conversion->abandoned)
+    g_hash_table_remove (conversions, conversion->key);
+  conversion_free (conversion);
+
+  running_conversion = NULL;
+  start_next_conversion ();
 }
 
 static void
-load_libreoffice (NemoPreviewPdfLoader *self)
+start_next_conversion (void)
 {
-  gchar *libreoffice_path;
-  GFile *file;
-  gchar *doc_path, *doc_name, *tmp_name, *pdf_dir;
+  Conversion *conversion;
+  gchar *libreoffice_path, *pdf_dir, *profile_dir, *profile_uri, *profile_arg, *tmp_name;
   gboolean res;
-  GPid pid;
   GError *error = NULL;
   const gchar *libreoffice_argv[] = {
     NULL /* to be replaced with binary */,
+    NULL /* to be replaced with the profile */,
+    "--headless",
     "--convert-to", "pdf",
     "--outdir", NULL /* to be replaced with output dir */,
     NULL /* to be replaced with input file */,
     NULL
   };
 
-  libreoffice_path = g_find_program_in_path ("libreoffice");
-  if (libreoffice_path == NULL) {
-    libreoffice_missing (self);
+  if (running_conversion != NULL)
     return;
-  }
 
-  file = g_file_new_for_uri (self->priv->uri);
-  doc_path = g_file_get_path (file);
-  doc_name = g_file_get_basename (file);
-  g_object_unref (file);
-
-  /* libreoffice --convert-to replaces the extension with .pdf */
-  tmp_name = g_strrstr (doc_name, ".");
-  if (tmp_name)
-    *tmp_name = '\0';
-  tmp_name = g_strdup_printf ("%s.pdf", doc_name);
-  g_free (doc_name);
+  conversion = g_queue_pop_head (&conversion_queue);
+  if (conversion == NULL)
+    return;
 
-  pdf_dir = g_build_filename (g_get_user_cache_dir (), "sushi", NULL);
-  self->priv->pdf_path = g_build_filename (pdf_dir, tmp_name, NULL);
-  g_mkdir_with_parents (pdf_dir, 0700);
+  libreoffice_path = g_find_program_in_path ("libreoffice");
+  pdf_dir = get_pdf_cache_dir ();
 
-  g_free (tmp_name);
-  libreoffice_argv[0] = libreoffice_path;
-  libreoffice_argv[4] = pdf_dir;
-  libreoffice_argv[5] = doc_path;
+  /* a profile of our own keeps its first-run setup around between
+   * previews, and keeps us from handing the job to a LibreOffice the user
+   * already has open */
+  profile_dir = g_build_filename (g_get_user_cache_dir (), "sushi", "libreoffice", NULL);
+  profile_uri = g_filename_to_uri (profile_dir, NULL, NULL);
+  profile_arg = g_strconcat ("-env:UserInstallation=", profile_uri, NULL);
 
-  tmp_name = g_strjoinv (" ", (gchar **) libreoffice_argv);
-  g_debug ("Executing LibreOffice command: %s", tmp_name);
-  g_free (tmp_name);
+  conversion->tmp_dir = g_build_filename (pdf_dir, "convert-XXXXXX", NULL);
 
-  res = g_spawn_async (NULL, (gchar **) libreoffice_argv, NULL,
-                       G_SPAWN_DO_NOT_REAP_CHILD,
-                       NULL, NULL,
-                       &pid, &error);
+  if (libreoffice_path == NULL) {
+    res = FALSE;
+    g_set_error (&error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND,
+                 "libreoffice is not installed");
+  } else if (g_mkdtemp (conversion->tmp_dir) == NULL) {
+    res = FALSE;
+    g_set_error (&error, G_IO_ERROR, g_io_error_from_errno (errno),
+                 "can't create a directory to convert %s", conversion->doc_path);
+  } else {
+    libreoffice_argv[0] = libreoffice_path;
+    libreoffice_argv[1] = profile_arg;
+    libreoffice_argv[6] = conversion->tmp_dir;
+    libreoffice_argv[7] = conversion->doc_path;
+
+    tmp_name = g_strjoinv (" ", (gchar **) libreoffice_argv);
+    g_debug ("Executing LibreOffice command: %s", tmp_name);
+    g_free (tmp_name);
+
+    res = g_spawn_async (NULL, (gchar **) libreoffice_argv, NULL,
+                         G_SPAWN_DO_NOT_REAP_CHILD,
+                         NULL, NULL,
+                         &conversion->pid, &error);
+  }
 
+  g_free (profile_arg);
+  g_free (profile_uri);
+  g_free (profile_dir);
   g_free (pdf_dir);
-  g_free (doc_path);
   g_free (libreoffice_path);
 
   if (!res) {
+    GList *l;
+
     g_warning ("Error while spawning libreoffice: %s",
                error->message);
+
+    for (l = conversion->waiters; l != NULL; l = l->next) {
+      NemoPreviewPdfLoader *self = l->data;
+      self->priv->conversion = NULL;
+
+      if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND))
+        report_error (self, _("LibreOffice is needed to preview this document"));
+      else
+        report_error (self, _("LibreOffice could not convert this document"));
+    }
+
     g_error_free (error);
 
+    remove_tmp_dir (conversion->tmp_dir);
+    g_hash_table_remove (conversions, conversion->key);
+    conversion_free (conversion);
+
+    start_next_conversion ();
     return;
   }
 
-  g_child_watch_add (pid, libreoffice_child_watch_cb, self);
-  self->priv->libreoffice_pid = pid;
+  running_conversion = conversion;
+  g_child_watch_add (conversion->pid, libreoffice_child_watch_cb, conversion);
+}
+
+/* Stops waiting for our conversion; the conversion itself is only
+ * abandoned once nobody waits for it anymore.
+ */
+static void
+conversion_remove_waiter (NemoPreviewPdfLoader *self)
+{
+  Conversion *conversion = self->priv->conversion;
+
+  if (conversion == NULL)
+    return;
+
+  self->priv->conversion = NULL;
+  conversion->waiters = g_list_remove (conversion->waiters, self);
+
+  if (conversion->waiters != NULL)
+    return;
+
+  if (conversion == running_conversion) {
+    /* the child watch cleans up; a new request for the same document
+     * starts over instead of joining the killed conversion */
+    kill (conversion->pid, SIGKILL);
+    conversion->abandoned = TRUE;
+    g_hash_table_remove (conversions, conversion->key);
+  } else {
+    g_queue_remove (&conversion_queue, conversion);
+    g_hash_table_remove (conversions, conversion->key);
+    conversion_free (conversion);
+  }
+}
+
+static void
+load_libreoffice (NemoPreviewPdfLoader *self)
+{
+  gchar *libreoffice_path;
+  GFile *file;
+  gchar *pdf_dir, *pdf_name;
+  Conversion *conversion;
+
+  conversion_remove_waiter (self);
+
+  pdf_dir = get_pdf_cache_dir ();
+  g_mkdir_with_parents (pdf_dir, 0700);
+
+  pdf_name = g_strconcat (self->priv->cache_key, ".pdf", NULL);
+  g_free (self->priv->pdf_path);
+  self->priv->pdf_path = g_build_filename (pdf_dir, pdf_name, NULL);
+
+  g_free (pdf_name);
+  g_free (pdf_dir);
+
+  if (g_file_test (self->priv->pdf_path, G_FILE_TEST_IS_REGULAR)) {
+    gchar *uri;
+
+    /* still valid, mark it as recently used */
+    g_utime (self->priv->pdf_path, NULL);
+
+    file = g_file_new_for_path (self->priv->pdf_path);
+    uri = g_file_get_uri (file);
+    load_pdf (self, uri);
+
+    g_object_unref (file);
+    g_free (uri);
+
+    return;
+  }
+
+  libreoffice_path = g_find_program_in_path ("libreoffice");
+  if (libreoffice_path == NULL) {
+    libreoffice_missing (self);
+    return;
+  }
+
+  g_free (libreoffice_path);
+
+  if (conversions == NULL)
+    conversions = g_hash_table_new (g_str_hash, g_str_equal);
+
+  conversion = g_hash_table_lookup (conversions, self->priv->cache_key);
+
+  if (conversion == NULL) {
+    file = g_file_new_for_uri (self->priv->uri);
+
+    conversion = g_slice_new0 (Conversion);
+    conversion->key = g_strdup (self->priv->cache_key);
+    conversion->doc_path = g_file_get_path (file);
+    conversion->pdf_path = g_strdup (self->priv->pdf_path);
+
+    g_object_unref (file);
+
+    g_hash_table_insert (conversions, conversion->key, conversion);
+    g_queue_push_tail (&conversion_queue, conversion);
+  }
+
+  conversion->waiters = g_list_prepend (conversion->waiters, self);
+  self->priv->conversion = conversion;
+
+  start_next_conversion ();
 }
 
 static gboolean
@@ -257,6 +584,12 @@ query_info_ready_cb (GObject *obj,
   info = g_file_query_info_finish (G_FILE (obj),
                                    res, &error);
 
+  if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+    /* the loader may be gone already */
+    g_error_free (error);
+    return;
+  }
+
   if (error != NULL) {
     g_warning ("Unable to query the mimetype of %s: %s",
                self->priv->uri, error->message);
@@ -267,10 +600,14 @@ query_info_ready_cb (GObject *obj,
 
   content_type = g_file_info_get_content_type (info);
 
-  if (content_type_is_native (content_type))
+  if (content_type_is_native (content_type)) {
     load_pdf (self, self->priv->uri);
-  else
+  } else {
+    g_free (self->priv->cache_key);
+    self->priv->cache_key = get_cache_key (self->priv->uri, info);
+
     load_libreoffice (self);
+  }
 
   g_object_unref (info);
 }
@@ -282,39 +619,58 @@ start_loading_document (NemoPreviewPdfLoader *self)
 
   file = g_file_new_for_uri (self->priv->uri);
   g_file_query_info_async (file,
-                           G_FILE_ATTRIBUTE_STANDARD_CONTENT_TYPE,
+                           CACHE_PDF_ATTRS,
                            G_FILE_QUERY_INFO_NONE,
                            G_PRIORITY_DEFAULT,
-                           NULL,
+                           self->priv->cancellable,
                            query_info_ready_cb,
                            self);
 
   g_object_unref (file);
 }
 
+/* Stops whatever is still loading the document; none of its callbacks
+ * run afterwards.
+ */
+static void
+cancel_loading (NemoPreviewPdfLoader *self)
+{
+  if (self->priv->cancellable != NULL) {
+    g_cancellable_cancel (self->priv->cancellable);
+    g_clear_object (&self->priv->cancellable);
+  }
+
+  if (self->priv->load_job != NULL) {
+    g_signal_handlers_disconnect_by_func (self->priv->load_job,
+                                          load_job_done, self);
+    ev_job_cancel (self->priv->load_job);
+    g_clear_object (&self->priv->load_job);
+  }
+
+  conversion_remove_waiter (self);
+}
+
 static void
 nemo_preview_pdf_loader_set_uri (NemoPreviewPdfLoader *self,
                           const gchar *uri)
 {
+  cancel_loading (self);
+
   g_clear_object (&self->priv->document);
   g_free (self->priv->uri);
 
   self->priv->uri = g_strdup (uri);
+  self->priv->cancellable = g_cancellable_new ();
   start_loading_document (self);
 }
 
 void
 nemo_preview_pdf_loader_cleanup_document (NemoPreviewPdfLoader *self)
 {
-  if (self->priv->pdf_path) {
-    g_unlink (self->priv->pdf_path);
-    g_free (self->priv->pdf_path);
-  }
+  /* the converted PDF stays in the cache for the next preview */
+  g_clear_pointer (&self->priv->pdf_path, g_free);
 
-  if (self->priv->libreoffice_pid != -1) {
-    kill (self->priv->libreoffice_pid, SIGKILL);
-    self->priv->libreoffice_pid = -1;
-  }
+  cancel_loading (self);
 }
 
 static void
@@ -325,7 +681,8 @@ nemo_preview_pdf_loader_dispose (GObject *object)
   nemo_preview_pdf_loader_cleanup_document (self);
 
   g_clear_object (&self->priv->document);
-  g_free (self->priv->uri);
+  g_clear_pointer (&self->priv->uri, g_free);
+  g_clear_pointer (&self->priv->cache_key, g_free);
 
   G_OBJECT_CLASS (nemo_preview_pdf_loader_parent_class)->dispose (object);
 }
@@ -345,6 +702,9 @@ nemo_preview_pdf_loader_get_property (GObject *object,
   case PROP_URI:
     g_value_set_string (value, self->priv->uri);
     break;
+  case PROP_ALLOW_INSTALL:
+    g_value_set_boolean (value, self->priv->allow_install);
+    break;
   default:
     G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
     break;
@@ -363,6 +723,9 @@ nemo_preview_pdf_loader_set_property (GObject *object,
   case PROP_URI:
     nemo_preview_pdf_loader_set_uri (self, g_value_get_string (value));
     break;
+  case PROP_ALLOW_INSTALL:
+    self->priv->allow_install = g_value_get_boolean (value);
+    break;
   default:
     G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
     break;
@@ -397,6 +760,23 @@ nemo_preview_pdf_loader_class_init (NemoPreviewPdfLoaderClass *klass)
                             NULL,
                             G_PARAM_READWRITE));
 
+    g_object_class_install_property
+      (oclass,
+       PROP_ALLOW_INSTALL,
+       g_param_spec_boolean ("allow-install",
+                             "Allow install",
+                             "Whether a missing LibreOffice may be installed through PackageKit",
+                             TRUE,
+                             G_PARAM_READWRITE | G_PARAM_CONSTRUCT));
+
+    signals[ERROR] =
+      g_signal_new ("error",
+                    G_TYPE_FROM_CLASS (klass),
+                    G_SIGNAL_RUN_FIRST,
+                    0, NULL, NULL,
+                    g_cclosure_marshal_VOID__STRING,
+                    G_TYPE_NONE, 1, G_TYPE_STRING);
+
     g_type_class_add_private (klass, sizeof (NemoPreviewPdfLoaderPrivate));
 }
 
@@ -407,7 +787,6 @@ nemo_preview_pdf_loader_init (NemoPreviewPdfLoader *self)
     G_TYPE_INSTANCE_GET_PRIVATE (self,
                                  NEMO_PREVIEW_TYPE_PDF_LOADER,
                                  NemoPreviewPdfLoaderPrivate);
-  self->priv->libreoffice_pid = -1;
 }
 
 NemoPreviewPdfLoader *
@@ -41,6 +41,28 @@ G_DEFINE_TYPE (NemoPreviewSoundPlayer, nemo_preview_sound_player, G_TYPE_OBJECT)
 
 #define TICK_TIMEOUT 0.5
 
+/* Stepping through a folder creates a new player for every track, and
+ * setting up playbin and a discoverer is a good part of the time it takes
+ * for one to start playing.  A disposed player parks its pipeline in READY
+ * for the next one to retarget, and all players share one discoverer,
+ * whose results are kept for the last DISCOVERED_CACHE_SIZE URIs so that
+ * tracks can be discovered before they are shown.
+ */
+#define DISCOVERED_CACHE_SIZE 32
+
+typedef struct {
+  GstTagList *taglist;
+  gdouble duration;
+} DiscoveredInfo;
+
+static GstElement *idle_pipeline = NULL;
+
+static GstDiscoverer *shared_discoverer = NULL;
+static GHashTable *discovered_infos = NULL;
+static GQueue discovered_uris = G_QUEUE_INIT;
+static GHashTable *pending_discoveries = NULL;
+static GList *players = NULL;
+
 enum
 {
   PROP_0,
@@ -66,14 +88,15 @@ struct _NemoPreviewSoundPlayerPrivate
   gdouble                duration;
   guint                  tick_timeout_id;
 
-  GstDiscoverer         *discoverer;
   GstTagList            *taglist;
+  guint                  discovered_id;
 
   guint                  in_seek : 1;
 };
 
 static void nemo_preview_sound_player_destroy_pipeline (NemoPreviewSoundPlayer *player);
 static gboolean nemo_preview_sound_player_ensure_pipeline (NemoPreviewSoundPlayer *player);
+static void nemo_preview_sound_player_retarget_pipeline (NemoPreviewSoundPlayer *player);
 
 static void
 nemo_preview_sound_player_set_state (NemoPreviewSoundPlayer      *player,
@@ -95,25 +118,55 @@ nemo_preview_sound_player_set_state (NemoPreviewSoundPlayer      *player,
 
 
 static void
-nemo_preview_sound_player_destroy_discoverer (NemoPreviewSoundPlayer *player)
+discovered_info_free (DiscoveredInfo *info)
+{
+  if (info->taglist != NULL)
+    gst_tag_list_free (info->taglist);
+
+  g_slice_free (DiscoveredInfo, info);
+}
+
+static void
+nemo_preview_sound_player_clear_taglist (NemoPreviewSoundPlayer *player)
 {
   NemoPreviewSoundPlayerPrivate *priv = NEMO_PREVIEW_SOUND_PLAYER_GET_PRIVATE (player);
 
-  if (priv->discoverer == NULL)
-    return;
+  if (priv->discovered_id != 0)
+    {
+      g_source_remove (priv->discovered_id);
+      priv->discovered_id = 0;
+    }
 
-  if (priv->taglist != NULL) {
-    gst_tag_list_free (priv->taglist);
-    priv->taglist = NULL;
-  }
+  if (priv->taglist == NULL)
+    return;
 
-  gst_discoverer_stop (priv->discoverer);
-  gst_object_unref (priv->discoverer);
-  priv->discoverer = NULL;
+  gst_tag_list_free (priv->taglist);
+  priv->taglist = NULL;
 
   g_object_notify (G_OBJECT (player), "taglist");
+}
+
+static void
+nemo_preview_sound_player_apply_discovered (NemoPreviewSoundPlayer *player,
+                                            DiscoveredInfo *info)
+{
+  NemoPreviewSoundPlayerPrivate *priv = NEMO_PREVIEW_SOUND_PLAYER_GET_PRIVATE (player);
+
+  if (info->taglist != NULL)
+    {
+      if (priv->taglist != NULL)
+        gst_tag_list_free (priv->taglist);
 
-  g_clear_object (&priv->taglist);
+      priv->taglist = gst_tag_list_copy (info->taglist);
+      g_object_notify (G_OBJECT (player), "taglist");
+    }
+
+  /* the pipeline knows better once it's prerolled */
+  if (priv->duration == 0.0 && info->duration > 0.0)
+    {
+      priv->duration = info->duration;
+      g_object_notify (G_OBJECT (player), "duration");
+    }
 }
 
 static void
@@ -122,47 +175,134 @@ discoverer_discovered_cb (GstDiscoverer *disco,
                           GError *error,
                           gpointer user_data)
 {
-  NemoPreviewSoundPlayer *player = user_data;
-  NemoPreviewSoundPlayerPrivate *priv;
+  DiscoveredInfo *discovered;
   const GstTagList *taglist;
+  const gchar *uri;
+  GList *l;
 
-  priv = NEMO_PREVIEW_SOUND_PLAYER_GET_PRIVATE (player);
+  uri = gst_discoverer_info_get_uri (info);
+  g_hash_table_remove (pending_discoveries, uri);
 
   if (error != NULL)
     return;
 
+  discovered = g_slice_new0 (DiscoveredInfo);
+  discovered->duration = (gdouble) gst_discoverer_info_get_duration (info) / GST_SECOND;
+
   taglist = gst_discoverer_info_get_tags (info);
+  if (taglist != NULL)
+    discovered->taglist = gst_tag_list_copy (taglist);
+
+  if (!g_hash_table_contains (discovered_infos, uri))
+    g_queue_push_tail (&discovered_uris, g_strdup (uri));
+
+  g_hash_table_insert (discovered_infos, g_strdup (uri), discovered);
 
-  if (taglist)
+  while (g_queue_get_length (&discovered_uris) > DISCOVERED_CACHE_SIZE)
     {
-      priv->taglist = gst_tag_list_copy (taglist);
-      g_object_notify (G_OBJECT (player), "taglist");
+      gchar *oldest = g_queue_pop_head (&discovered_uris);
+
+      g_hash_table_remove (discovered_infos, oldest);
+      g_free (oldest);
+    }
+
+  for (l = players; l != NULL; l = l->next)
+    {
+      NemoPreviewSoundPlayer *player = l->data;
+
+      if (g_strcmp0 (player->priv->uri, uri) == 0)
+        nemo_preview_sound_player_apply_discovered (player, discovered);
     }
 }
 
 static gboolean
-nemo_preview_sound_player_ensure_discoverer (NemoPreviewSoundPlayer *player)
+ensure_shared_discoverer (void)
 {
-  NemoPreviewSoundPlayerPrivate *priv;
-  priv = NEMO_PREVIEW_SOUND_PLAYER_GET_PRIVATE (player);
-
-  if (priv->discoverer)
+  if (shared_discoverer != NULL)
     return TRUE;
 
-  priv->discoverer = gst_discoverer_new (GST_SECOND * 60,
-                                         NULL);
+  shared_discoverer = gst_discoverer_new (GST_SECOND * 60,
+                                          NULL);
 
-  if (priv->discoverer == NULL)
+  if (shared_discoverer == NULL)
     return FALSE;
 
-  g_signal_connect (priv->discoverer, "discovered",
-                    G_CALLBACK (discoverer_discovered_cb), player);
-  gst_discoverer_start (priv->discoverer);
-  gst_discoverer_discover_uri_async (priv->discoverer, priv->uri);
+  discovered_infos = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                            g_free, (GDestroyNotify) discovered_info_free);
+  pending_discoveries = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                               g_free, NULL);
+
+  g_signal_connect (shared_discoverer, "discovered",
+                    G_CALLBACK (discoverer_discovered_cb), NULL);
+  gst_discoverer_start (shared_discoverer);
 
   return TRUE;
 }
 
+static void
+discover_uri (const gchar *uri)
+{
+  if (uri == NULL || !ensure_shared_discoverer ())
+    return;
+
+  if (g_hash_table_contains (discovered_infos, uri) ||
+      g_hash_table_contains (pending_discoveries, uri))
+    return;
+
+  if (gst_discoverer_discover_uri_async (shared_discoverer, uri))
+    g_hash_table_add (pending_discoveries, g_strdup (uri));
+}
+
+static gboolean
+nemo_preview_sound_player_discovered_idle (gpointer user_data)
+{
+  NemoPreviewSoundPlayer *player = user_data;
+  NemoPreviewSoundPlayerPrivate *priv = NEMO_PREVIEW_SOUND_PLAYER_GET_PRIVATE (player);
+  DiscoveredInfo *info;
+
+  priv->discovered_id = 0;
+
+  info = g_hash_table_lookup (discovered_infos, priv->uri);
+  if (info != NULL)
+    nemo_preview_sound_player_apply_discovered (player, info);
+
+  return FALSE;
+}
+
+static void
+nemo_preview_sound_player_ensure_discovered (NemoPreviewSoundPlayer *player)
+{
+  NemoPreviewSoundPlayerPrivate *priv;
+  priv = NEMO_PREVIEW_SOUND_PLAYER_GET_PRIVATE (player);
+
+  if (priv->uri == NULL || !ensure_shared_discoverer ())
+    return;
+
+  /* known already; still report it from the main loop, since this runs
+   * before anyone had a chance to connect to the player */
+  if (g_hash_table_contains (discovered_infos, priv->uri))
+    {
+      priv->discovered_id =
+        g_idle_add (nemo_preview_sound_player_discovered_idle, player);
+      return;
+    }
+
+  discover_uri (priv->uri);
+}
+
+/**
+ * nemo_preview_sound_player_prefetch:
+ * @uri: a sound file that is likely to be played soon
+ *
+ * Discovers the tags and duration of @uri in the background, so that a
+ * player created for it later has them right away.
+ */
+void
+nemo_preview_sound_player_prefetch (const gchar *uri)
+{
+  discover_uri (uri);
+}
+
 static void
 nemo_preview_sound_player_set_uri (NemoPreviewSoundPlayer *player,
                             const char    *uri)
@@ -179,14 +319,19 @@ nemo_preview_sound_player_set_uri (NemoPreviewSoundPlayer *player,
   g_free (priv->uri);
   priv->uri = g_strdup (uri);
 
-  if (priv->pipeline)
-    nemo_preview_sound_player_destroy_pipeline (player);
+  nemo_preview_sound_player_clear_taglist (player);
+
+  if (priv->pipeline != NULL && priv->uri != NULL)
+    nemo_preview_sound_player_retarget_pipeline (player);
+  else
+    {
+      if (priv->pipeline)
+        nemo_preview_sound_player_destroy_pipeline (player);
 
-  if (priv->discoverer)
-    nemo_preview_sound_player_destroy_discoverer (player);
+      nemo_preview_sound_player_ensure_pipeline (player);
+    }
 
-  nemo_preview_sound_player_ensure_pipeline (player);
-  nemo_preview_sound_player_ensure_discoverer (player);
+  nemo_preview_sound_player_ensure_discovered (player);
 
   g_object_notify (G_OBJECT (player), "uri");
 }
@@ -360,6 +505,7 @@ nemo_preview_sound_player_destroy_pipeline (NemoPreviewSoundPlayer *player)
     {
       gst_bus_set_flushing (priv->bus, TRUE);
       gst_bus_remove_signal_watch (priv->bus);
+      g_signal_handlers_disconnect_by_data (priv->bus, player);
 
       gst_object_unref (priv->bus);
       priv->bus = NULL;
@@ -367,12 +513,26 @@ nemo_preview_sound_player_destroy_pipeline (NemoPreviewSoundPlayer *player)
 
   if (priv->pipeline)
     {
-      gst_element_set_state (priv->pipeline, GST_STATE_NULL);
+      /* keep the pipeline around for the next player, unless another
+       * one is already waiting */
+      if (idle_pipeline == NULL &&
+          gst_element_set_state (priv->pipeline, GST_STATE_READY) != GST_STATE_CHANGE_FAILURE &&
+          gst_element_get_state (priv->pipeline, NULL, NULL, GST_SECOND) == GST_STATE_CHANGE_SUCCESS)
+        {
+          idle_pipeline = priv->pipeline;
+        }
+      else
+        {
+          gst_element_set_state (priv->pipeline, GST_STATE_NULL);
+          gst_object_unref (priv->pipeline);
+        }
 
-      gst_object_unref (priv->pipeline);
       priv->pipeline = NULL;
     }
 
+  priv->in_seek = FALSE;
+  priv->duration = 0.0;
+
   if (priv->tick_timeout_id != 0)
     {
       g_source_remove (priv->tick_timeout_id);
@@ -520,34 +680,45 @@ nemo_preview_sound_player_ensure_pipeline (NemoPreviewSoundPlayer *player)
       return FALSE;
     }
 
-  error = NULL;
+  if (idle_pipeline != NULL)
+    {
+      priv->pipeline = idle_pipeline;
+      idle_pipeline = NULL;
 
-  pipeline_desc = g_strdup_printf("playbin uri=\"%s\"",
-                                  priv->uri);
+      g_object_set (priv->pipeline, "uri", priv->uri, NULL);
+    }
+  else
+    {
+      error = NULL;
 
-  priv->pipeline = gst_parse_launch (pipeline_desc, &error);
+      pipeline_desc = g_strdup_printf("playbin uri=\"%s\"",
+                                      priv->uri);
 
-  g_free (pipeline_desc);
+      priv->pipeline = gst_parse_launch (pipeline_desc, &error);
 
-  if (error)
-    {
-      g_error_free (error);
-      priv->pipeline = NULL;
+      g_free (pipeline_desc);
 
-      nemo_preview_sound_player_set_state (player, NEMO_PREVIEW_SOUND_PLAYER_STATE_ERROR);
-      return FALSE;
-    }
+      if (error)
+        {
+          g_error_free (error);
+          priv->pipeline = NULL;
 
-  if (!gst_element_set_state (priv->pipeline, GST_STATE_READY))
-    {
-      g_object_unref (priv->pipeline);
-      priv->pipeline = NULL;
+          nemo_preview_sound_player_set_state (player, NEMO_PREVIEW_SOUND_PLAYER_STATE_ERROR);
+          return FALSE;
+        }
 
-      nemo_preview_sound_player_set_state (player, NEMO_PREVIEW_SOUND_PLAYER_STATE_ERROR);
-      return FALSE;
+      if (!gst_element_set_state (priv->pipeline, GST_STATE_READY))
+        {
+          g_object_unref (priv->pipeline);
+          priv->pipeline = NULL;
+
+          nemo_preview_sound_player_set_state (player, NEMO_PREVIEW_SOUND_PLAYER_STATE_ERROR);
+          return FALSE;
+        }
     }
 
   priv->bus = gst_element_get_bus (priv->pipeline);
+  gst_bus_set_flushing (priv->bus, FALSE);
 
   gst_bus_add_signal_watch (priv->bus);
 
@@ -583,6 +754,50 @@ nemo_preview_sound_player_ensure_pipeline (NemoPreviewSoundPlayer *player)
   return TRUE;
 }
 
+/* Points the pipeline at the new URI, keeping its elements around. */
+static void
+nemo_preview_sound_player_retarget_pipeline (NemoPreviewSoundPlayer *player)
+{
+  NemoPreviewSoundPlayerPrivate *priv;
+  GstMessage *msg;
+
+  priv = NEMO_PREVIEW_SOUND_PLAYER_GET_PRIVATE (player);
+
+  if (gst_element_set_state (priv->pipeline, GST_STATE_READY) == GST_STATE_CHANGE_FAILURE ||
+      gst_element_get_state (priv->pipeline, NULL, NULL, GST_SECOND) != GST_STATE_CHANGE_SUCCESS)
+    {
+      /* still stuck on the previous URI, e.g. a stalled network
+       * source; throw it away instead of blocking the UI on it */
+      gst_element_set_state (priv->pipeline, GST_STATE_NULL);
+      gst_object_unref (priv->pipeline);
+      priv->pipeline = NULL;
+
+      nemo_preview_sound_player_destroy_pipeline (player);
+      nemo_preview_sound_player_ensure_pipeline (player);
+      return;
+    }
+
+  /* drop whatever the previous URI left on the bus */
+  while ((msg = gst_bus_pop (priv->bus)))
+    gst_message_unref (msg);
+
+  if (priv->tick_timeout_id != 0)
+    {
+      g_source_remove (priv->tick_timeout_id);
+      priv->tick_timeout_id = 0;
+    }
+
+  priv->in_seek = FALSE;
+  priv->duration = 0.0;
+
+  g_object_set (priv->pipeline, "uri", priv->uri, NULL);
+
+  g_object_notify (G_OBJECT (player), "duration");
+  g_object_notify (G_OBJECT (player), "progress");
+
+  gst_element_set_state (priv->pipeline, GST_STATE_PAUSED);
+}
+
 void
 nemo_preview_sound_player_set_playing (NemoPreviewSoundPlayer *player,
                              gboolean       playing)
@@ -640,7 +855,9 @@ static void
 nemo_preview_sound_player_dispose (GObject *gobject)
 {
   nemo_preview_sound_player_destroy_pipeline (NEMO_PREVIEW_SOUND_PLAYER (gobject));
-  nemo_preview_sound_player_destroy_discoverer (NEMO_PREVIEW_SOUND_PLAYER (gobject));
+  nemo_preview_sound_player_clear_taglist (NEMO_PREVIEW_SOUND_PLAYER (gobject));
+
+  players = g_list_remove (players, gobject);
 
   G_OBJECT_CLASS (nemo_preview_sound_player_parent_class)->dispose (gobject);
 }
@@ -808,4 +1025,6 @@ nemo_preview_sound_player_init (NemoPreviewSoundPlayer *player)
   player->priv->stacked_progress = 0.0;
   player->priv->duration = 0.0;
   player->priv->tick_timeout_id = 0;
+
+  players = g_list_prepend (players, player);
 }
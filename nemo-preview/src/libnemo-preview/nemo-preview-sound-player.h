@@ -66,6 +66,8 @@ struct _NemoPreviewSoundPlayerClass
 
 GType    nemo_preview_sound_player_get_type     (void) G_GNUC_CONST;
 
+void     nemo_preview_sound_player_prefetch     (const gchar *uri);
+
 G_END_DECLS
 
 #endif /* __NEMO_PREVIEW_SOUND_PLAYER_H__ */
@@ -37,6 +37,8 @@ G_DEFINE_TYPE (NemoPreviewTextLoader, nemo_preview_text_loader, G_TYPE_OBJECT);
 
 enum {
   PROP_URI = 1,
+  PROP_MAX_SIZE,
+  PROP_TRUNCATED,
   NUM_PROPERTIES
 };
 
@@ -48,10 +50,39 @@ enum {
 static GParamSpec* properties[NUM_PROPERTIES] = { NULL, };
 static guint signals[NUM_SIGNALS] = { 0, };
 
+/* The file is read in chunks; the first one is shown as soon as it
+ * arrives, and the rest is appended as it comes in, up to max-size bytes.
+ */
+#define TEXT_LOAD_CHUNK_SIZE (64 * 1024)
+#define TEXT_LOAD_DEFAULT_MAX_SIZE (16 * 1024 * 1024)
+
+#define REPLACEMENT_CHARACTER "\xef\xbf\xbd" /* U+FFFD */
+
+typedef struct {
+  NemoPreviewTextLoader *self;
+  GFile *file;
+  GCancellable *cancellable;
+  GInputStream *stream;
+
+  /* the start of a character split across two chunks */
+  gchar partial[6];
+  gsize partial_len;
+
+  guint64 bytes_read;
+  gboolean loaded;
+  /* max_size bytes are in, the next read only checks for more */
+  gboolean at_max_size;
+} TextLoadState;
+
 struct _NemoPreviewTextLoaderPrivate {
   gchar *uri;
 
   GtkSourceBuffer *buffer;
+
+  guint64 max_size;
+  gboolean truncated;
+
+  TextLoadState *load;
 };
 
 /* code adapted from gtksourceview:tests/test-widget.c
@@ -154,61 +185,292 @@ text_loader_get_buffer_language (NemoPreviewTextLoader *self,
   return language;
 }
 
+/* Appends @len bytes of @data to @out, replacing anything that is not
+ * valid UTF-8, or is a NUL, with U+FFFD.  Unless @eof is set, a truncated
+ * character at the end is left alone; returns the number of bytes used.
+ */
+static gsize
+append_lossy_utf8 (GString *out,
+                   const gchar *data,
+                   gsize len,
+                   gboolean eof)
+{
+  const gchar *p, *end, *valid_end;
+
+  p = data;
+  end = data + len;
+
+  while (p < end) {
+    gunichar c;
+
+    g_utf8_validate (p, end - p, &valid_end);
+    g_string_append_len (out, p, valid_end - p);
+    p = valid_end;
+
+    if (p == end)
+      break;
+
+    /* NUL also comes back as -2, as if it were a truncated character */
+    c = *p == '\0' ? (gunichar) -1 : g_utf8_get_char_validated (p, end - p);
+
+    /* keep a truncated character for the next chunk; it is always
+     * shorter than the longest sequence */
+    if (c == (gunichar) -2 && !eof && end - p < 6)
+      break;
+
+    /* an invalid byte, a NUL, or a character cut short by the end of
+     * the file */
+    g_string_append (out, REPLACEMENT_CHARACTER);
+    p++;
+  }
+
+  return p - data;
+}
+
 static void
-load_contents_async_ready_cb (GObject *source,
-                              GAsyncResult *res,
-                              gpointer user_data)
+text_load_state_free (TextLoadState *state)
 {
-  NemoPreviewTextLoader *self = user_data;
+  g_clear_object (&state->stream);
+  g_clear_object (&state->file);
+  g_object_unref (state->cancellable);
+
+  g_slice_free (TextLoadState, state);
+}
+
+/* Detaches a running load from its loader; the pending read sees the
+ * cancellation and frees the state.
+ */
+static void
+text_load_stop (NemoPreviewTextLoader *self)
+{
+  TextLoadState *state;
+
+  state = self->priv->load;
+  if (state == NULL)
+    return;
+
+  self->priv->load = NULL;
+  state->self = NULL;
+  g_cancellable_cancel (state->cancellable);
+}
+
+static void
+text_load_emit_loaded (TextLoadState *state)
+{
+  NemoPreviewTextLoader *self = state->self;
+
+  if (!state->loaded) {
+    GtkSourceLanguage *language;
+
+    language = text_loader_get_buffer_language (self, state->file);
+    gtk_source_buffer_set_language (self->priv->buffer, language);
+
+    state->loaded = TRUE;
+    g_signal_emit (self, signals[LOADED], 0, self->priv->buffer);
+  }
+}
+
+static void
+text_load_append (TextLoadState *state,
+                  const gchar *data,
+                  gsize len,
+                  gboolean eof)
+{
+  GtkTextBuffer *buffer;
+  GtkTextIter end;
+  GString *text;
+  const gchar *src;
+  gchar *joined = NULL;
+  gsize src_len, used;
+
+  src = data;
+  src_len = len;
+
+  if (state->partial_len > 0) {
+    joined = g_malloc (state->partial_len + len);
+    memcpy (joined, state->partial, state->partial_len);
+    memcpy (joined + state->partial_len, data, len);
+
+    src = joined;
+    src_len = state->partial_len + len;
+  }
+
+  text = g_string_sized_new (src_len + 16);
+  used = append_lossy_utf8 (text, src, src_len, eof);
+
+  state->partial_len = src_len - used;
+  g_assert (state->partial_len < sizeof (state->partial));
+  memcpy (state->partial, src + used, state->partial_len);
+
+  if (text->len > 0) {
+    buffer = GTK_TEXT_BUFFER (state->self->priv->buffer);
+
+    gtk_source_buffer_begin_not_undoable_action (state->self->priv->buffer);
+    gtk_text_buffer_get_end_iter (buffer, &end);
+    gtk_text_buffer_insert (buffer, &end, text->str, text->len);
+    gtk_source_buffer_end_not_undoable_action (state->self->priv->buffer);
+  }
+
+  g_string_free (text, TRUE);
+  g_free (joined);
+}
+
+static void text_load_next_chunk (TextLoadState *state);
+
+static void
+read_bytes_async_ready_cb (GObject *source,
+                           GAsyncResult *res,
+                           gpointer user_data)
+{
+  TextLoadState *state = user_data;
+  NemoPreviewTextLoader *self;
   GError *error = NULL;
-  gchar *contents;
-  GtkSourceLanguage *language = NULL;
+  GBytes *bytes;
+  gsize len;
+
+  bytes = g_input_stream_read_bytes_finish (G_INPUT_STREAM (source), res, &error);
 
-  g_file_load_contents_finish (G_FILE (source), res,
-                               &contents, NULL, NULL,
-                               &error);
+  self = state->self;
+  if (self == NULL) {
+    g_clear_error (&error);
+    if (bytes != NULL)
+      g_bytes_unref (bytes);
+
+    text_load_state_free (state);
+    return;
+  }
 
   if (error != NULL) {
     /* FIXME: we need to report the error */
     g_print ("Can't load the text file: %s\n", error->message);
     g_error_free (error);
 
+    /* show whatever we got so far */
+    if (state->bytes_read > 0)
+      text_load_emit_loaded (state);
+
+    self->priv->load = NULL;
+    text_load_state_free (state);
     return;
   }
 
-  if (!g_utf8_validate (contents, -1, NULL)) {
-    /* FIXME: we need to report the error */
-    g_print ("Can't load the text file as it has invalid characters");
-    g_free (contents);
+  len = g_bytes_get_size (bytes);
+
+  if (state->at_max_size) {
+    g_bytes_unref (bytes);
 
+    if (len > 0) {
+      self->priv->truncated = TRUE;
+      g_object_notify_by_pspec (G_OBJECT (self), properties[PROP_TRUNCATED]);
+    } else {
+      /* the file is exactly max_size long */
+      text_load_append (state, "", 0, TRUE);
+    }
+
+    self->priv->load = NULL;
+    text_load_state_free (state);
     return;
   }
 
-  gtk_source_buffer_begin_not_undoable_action (self->priv->buffer);
-  gtk_text_buffer_set_text (GTK_TEXT_BUFFER (self->priv->buffer), contents, -1);
-  gtk_source_buffer_end_not_undoable_action (self->priv->buffer);
+  state->bytes_read += len;
+
+  text_load_append (state, g_bytes_get_data (bytes, NULL), len, len == 0);
+  g_bytes_unref (bytes);
+
+  /* the first chunk is enough to fill the view and guess the language */
+  text_load_emit_loaded (state);
+
+  if (len > 0 &&
+      self->priv->max_size > 0 &&
+      state->bytes_read >= self->priv->max_size)
+    state->at_max_size = TRUE;
+
+  if (len == 0) {
+    self->priv->load = NULL;
+    text_load_state_free (state);
+  } else {
+    text_load_next_chunk (state);
+  }
+}
+
+static void
+text_load_next_chunk (TextLoadState *state)
+{
+  gsize size = TEXT_LOAD_CHUNK_SIZE;
+
+  if (state->at_max_size)
+    size = 1;
+  else if (state->self->priv->max_size > state->bytes_read)
+    size = MIN (size, state->self->priv->max_size - state->bytes_read);
+
+  /* once something is on screen, don't get in the way of the UI */
+  g_input_stream_read_bytes_async (state->stream,
+                                   size,
+                                   state->loaded ? G_PRIORITY_LOW : G_PRIORITY_DEFAULT,
+                                   state->cancellable,
+                                   read_bytes_async_ready_cb,
+                                   state);
+}
+
+static void
+read_async_ready_cb (GObject *source,
+                     GAsyncResult *res,
+                     gpointer user_data)
+{
+  TextLoadState *state = user_data;
+  GFileInputStream *stream;
+  GError *error = NULL;
+
+  stream = g_file_read_finish (G_FILE (source), res, &error);
+
+  if (state->self == NULL) {
+    g_clear_error (&error);
+    g_clear_object (&stream);
+
+    text_load_state_free (state);
+    return;
+  }
 
-  language = text_loader_get_buffer_language (self, G_FILE (source));
-  gtk_source_buffer_set_language (self->priv->buffer, language);
+  if (error != NULL) {
+    /* FIXME: we need to report the error */
+    g_print ("Can't load the text file: %s\n", error->message);
+    g_error_free (error);
 
-  g_signal_emit (self, signals[LOADED], 0, self->priv->buffer);
+    state->self->priv->load = NULL;
+    text_load_state_free (state);
+    return;
+  }
 
-  g_free (contents);
+  state->stream = G_INPUT_STREAM (stream);
+  text_load_next_chunk (state);
 }
 
 static void
 start_loading_buffer (NemoPreviewTextLoader *self)
 {
-  GFile *file;
+  TextLoadState *state;
+
+  text_load_stop (self);
 
   self->priv->buffer = gtk_source_buffer_new (NULL);
+  gtk_source_buffer_set_max_undo_levels (self->priv->buffer, 0);
 
-  file = g_file_new_for_uri (self->priv->uri);
-  g_file_load_contents_async (file, NULL,
-                              load_contents_async_ready_cb,
-                              self);
+  if (self->priv->truncated) {
+    self->priv->truncated = FALSE;
+    g_object_notify_by_pspec (G_OBJECT (self), properties[PROP_TRUNCATED]);
+  }
 
-  g_object_unref (file);
+  state = g_slice_new0 (TextLoadState);
+  state->self = self;
+  state->file = g_file_new_for_uri (self->priv->uri);
+  state->cancellable = g_cancellable_new ();
+  self->priv->load = state;
+
+  g_file_read_async (state->file,
+                     G_PRIORITY_DEFAULT,
+                     state->cancellable,
+                     read_async_ready_cb,
+                     state);
 }
 
 static void
@@ -232,7 +494,10 @@ nemo_preview_text_loader_dispose (GObject *object)
 {
   NemoPreviewTextLoader *self = NEMO_PREVIEW_TEXT_LOADER (object);
 
+  text_load_stop (self);
+
   g_free (self->priv->uri);
+  self->priv->uri = NULL;
 
   G_OBJECT_CLASS (nemo_preview_text_loader_parent_class)->dispose (object);
 }
@@ -249,6 +514,12 @@ nemo_preview_text_loader_get_property (GObject *object,
   case PROP_URI:
     g_value_set_string (value, self->priv->uri);
     break;
+  case PROP_MAX_SIZE:
+    g_value_set_uint64 (value, self->priv->max_size);
+    break;
+  case PROP_TRUNCATED:
+    g_value_set_boolean (value, self->priv->truncated);
+    break;
   default:
     G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
     break;
@@ -267,6 +538,9 @@ nemo_preview_text_loader_set_property (GObject *object,
   case PROP_URI:
     nemo_preview_text_loader_set_uri (self, g_value_get_string (value));
     break;
+  case PROP_MAX_SIZE:
+    self->priv->max_size = g_value_get_uint64 (value);
+    break;
   default:
     G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
     break;
@@ -289,6 +563,19 @@ nemo_preview_text_loader_class_init (NemoPreviewTextLoaderClass *klass)
                          "The URI to load",
                          NULL,
                          G_PARAM_READWRITE);
+  properties[PROP_MAX_SIZE] =
+    g_param_spec_uint64 ("max-size",
+                         "Max Size",
+                         "The maximum number of bytes to load, or 0 for no limit",
+                         0, G_MAXUINT64,
+                         TEXT_LOAD_DEFAULT_MAX_SIZE,
+                         G_PARAM_READWRITE | G_PARAM_CONSTRUCT);
+  properties[PROP_TRUNCATED] =
+    g_param_spec_boolean ("truncated",
+                          "Truncated",
+                          "Whether the file was larger than max-size",
+                          FALSE,
+                          G_PARAM_READABLE);
 
   signals[LOADED] =
     g_signal_new ("loaded",
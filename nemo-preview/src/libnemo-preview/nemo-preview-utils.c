@@ -28,6 +28,7 @@
 #include "nemo-preview-utils.h"
 
 #include <gdk/gdkx.h>
+#include <glib/gstdio.h>
 
 static void
 _cairo_round_rectangle (cairo_t *cr,
@@ -139,3 +140,85 @@ nemo_preview_query_supported_document_types (void)
 
   return retval;
 }
+
+typedef struct {
+  gchar *path;
+  goffset size;
+  guint64 mtime;
+} CachedFile;
+
+static gint
+compare_cached_file (gconstpointer a,
+                     gconstpointer b)
+{
+  const CachedFile *fa = a;
+  const CachedFile *fb = b;
+
+  if (fa->mtime != fb->mtime)
+    return fa->mtime < fb->mtime ? -1 : 1;
+
+  return 0;
+}
+
+/**
+ * nemo_preview_prune_cache_dir: (skip)
+ * @path: a cache directory
+ * @suffix: the suffix of the files to consider
+ * @budget: how many bytes they may take
+ *
+ * Removes the least recently used files ending in @suffix from @path
+ * until the rest fit in @budget; callers mark a file as used by bumping
+ * its mtime.
+ */
+void
+nemo_preview_prune_cache_dir (const gchar *path,
+                              const gchar *suffix,
+                              goffset budget)
+{
+  GDir *dir;
+  const gchar *name;
+  GArray *files;
+  goffset total = 0;
+  guint i;
+
+  dir = g_dir_open (path, 0, NULL);
+  if (dir == NULL)
+    return;
+
+  files = g_array_new (FALSE, FALSE, sizeof (CachedFile));
+
+  while ((name = g_dir_read_name (dir)) != NULL) {
+    GStatBuf buf;
+    CachedFile file;
+
+    if (!g_str_has_suffix (name, suffix))
+      continue;
+
+    file.path = g_build_filename (path, name, NULL);
+    if (g_stat (file.path, &buf) != 0) {
+      g_free (file.path);
+      continue;
+    }
+
+    file.size = buf.st_size;
+    file.mtime = buf.st_mtime;
+    total += file.size;
+
+    g_array_append_val (files, file);
+  }
+
+  g_dir_close (dir);
+
+  g_array_sort (files, compare_cached_file);
+
+  for (i = 0; i < files->len; i++) {
+    CachedFile *file = &g_array_index (files, CachedFile, i);
+
+    if (total > budget && g_unlink (file->path) == 0)
+      total -= file->size;
+
+    g_free (file->path);
+  }
+
+  g_array_unref (files);
+}
@@ -37,6 +37,9 @@ G_BEGIN_DECLS
 ClutterActor * nemo_preview_create_rounded_background (void);
 GdkWindow *    nemo_preview_create_foreign_window (guint xid);
 gchar **       nemo_preview_query_supported_document_types (void);
+void           nemo_preview_prune_cache_dir (const gchar *path,
+                                             const gchar *suffix,
+                                             goffset      budget);
 
 G_END_DECLS
 
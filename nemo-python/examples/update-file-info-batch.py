@@ -0,0 +1,30 @@
+import os
+import urllib.parse
+
+from gi.repository import GObject, Nemo
+
+class BatchedColumnExtension(GObject.GObject, Nemo.ColumnProvider, Nemo.InfoProvider):
+    def __init__(self):
+        pass
+
+    def get_columns(self):
+        return Nemo.Column(name="NemoPython::link_count_column",
+                           attribute="link_count",
+                           label="Links",
+                           description="Number of hard links"),
+
+    def update_file_info_batch(self, provider, batch):
+        # anything expensive to set up (a database, a subprocess...) only
+        # has to be done once here for all the files in the batch
+        for handle, closure, file in batch:
+            if file.get_uri_scheme() != 'file':
+                continue
+
+            filename = urllib.parse.unquote(file.get_uri()[7:])
+
+            try:
+                file.add_string_attribute('link_count', str(os.stat(filename).st_nlink))
+            except OSError:
+                pass
+
+        return Nemo.OperationResult.COMPLETE
@@ -0,0 +1,214 @@
+/* -*- Mode: C; indent-tabs-mode: t; c-basic-offset: 4; tab-width: 4 -*- */
+/*
+ *  Copyright (C) 2004,2005 Johan Dahlin
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2, or (at your option)
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#include <Python.h>
+
+#include <glib.h>
+
+/* Times the per-call overhead of calling into an extension the way
+ * nemo-python used to, PyObject_HasAttrString then PyObject_CallMethod
+ * with a format string, against the bound method cached when the
+ * instance is created and called with PyObject_Vectorcall:
+ *
+ *   nemo-python-call-benchmark [CALLS]
+ *
+ * The extension's methods do nothing, so what is left is the cost of
+ * getting there.  Its class has a few bases, like a real extension
+ * deriving from GObject.GObject and the Nemo provider interfaces.
+ * Built with -Dbenchmarks=true, not installed.
+ */
+
+#define DEFAULT_CALLS 1000000
+
+static const char extension_source[] =
+	"class Object: pass\n"
+	"class InfoProvider: pass\n"
+	"class MenuProvider: pass\n"
+	"class ColumnProvider: pass\n"
+	"class Extension(Object, InfoProvider, MenuProvider, ColumnProvider):\n"
+	"    def update_file_info(self, provider, handle, closure, file):\n"
+	"        return 0\n"
+	"    def get_file_items(self, window, files):\n"
+	"        return None\n"
+	"extension = Extension()\n";
+
+typedef struct {
+	const char *name;
+	Py_ssize_t nargs;
+} Method;
+
+static const Method methods[] = {
+	{ "update_file_info", 4 },
+	{ "get_file_items", 2 },
+};
+
+/* the argument wrappers already exist, pygobject_new only adds a
+ * reference to them */
+static PyObject *args[4];
+
+/* nanoseconds per call, or a negative value if a call failed */
+static gdouble
+time_lookup (PyObject *instance, const Method *method, guint64 calls)
+{
+	gint64 start = g_get_monotonic_time ();
+	guint64 i;
+
+	for (i = 0; i < calls; i++)
+	{
+		PyObject *ret;
+		Py_ssize_t j;
+
+		if (!PyObject_HasAttrString(instance, method->name))
+			return -1;
+
+		for (j = 0; j < method->nargs; j++)
+			Py_INCREF(args[j]);
+
+		if (method->nargs == 4)
+			ret = PyObject_CallMethod(instance, method->name, "(NNNN)",
+									  args[0], args[1], args[2], args[3]);
+		else
+			ret = PyObject_CallMethod(instance, method->name, "(NN)",
+									  args[0], args[1]);
+
+		if (ret == NULL)
+			return -1;
+		Py_DECREF(ret);
+	}
+
+	return (g_get_monotonic_time () - start) * 1000.0 / calls;
+}
+
+static gdouble
+time_cached (PyObject *instance, const Method *method, guint64 calls)
+{
+	PyObject *bound;
+	gint64 start;
+	guint64 i;
+
+	bound = PyObject_GetAttrString(instance, method->name);
+	if (bound == NULL)
+		return -1;
+
+	start = g_get_monotonic_time ();
+
+	for (i = 0; i < calls; i++)
+	{
+		PyObject *ret;
+		Py_ssize_t j;
+
+		for (j = 0; j < method->nargs; j++)
+			Py_INCREF(args[j]);
+
+#if PY_VERSION_HEX >= 0x03090000
+		ret = PyObject_Vectorcall(bound, args, method->nargs, NULL);
+
+		for (j = 0; j < method->nargs; j++)
+			Py_DECREF(args[j]);
+#else
+		{
+			/* what nemo_python_object_call falls back to */
+			PyObject *py_args = PyTuple_New(method->nargs);
+
+			for (j = 0; j < method->nargs; j++)
+				PyTuple_SET_ITEM(py_args, j, args[j]);
+
+			ret = PyObject_Call(bound, py_args, NULL);
+			Py_DECREF(py_args);
+		}
+#endif
+
+		if (ret == NULL)
+		{
+			Py_DECREF(bound);
+			return -1;
+		}
+		Py_DECREF(ret);
+	}
+
+	Py_DECREF(bound);
+
+	return (g_get_monotonic_time () - start) * 1000.0 / calls;
+}
+
+int
+main (int argc, char *argv[])
+{
+	PyObject *module, *globals, *result, *instance;
+	guint64 calls = DEFAULT_CALLS;
+	guint i;
+
+	if (argc > 2 ||
+		(argc == 2 && !g_ascii_string_to_unsigned (argv[1], 10, 1, G_MAXUINT64,
+												   &calls, NULL)))
+	{
+		g_printerr ("usage: %s [CALLS]\n", argv[0]);
+		return 2;
+	}
+
+	Py_Initialize();
+
+	module = PyImport_AddModule("__main__");
+	globals = PyModule_GetDict(module);
+	result = PyRun_String(extension_source, Py_file_input, globals, globals);
+	if (result == NULL)
+	{
+		PyErr_Print();
+		return 1;
+	}
+	Py_DECREF(result);
+
+	instance = PyDict_GetItemString(globals, "extension");
+
+	args[0] = PyUnicode_FromString("provider");
+	args[1] = PyUnicode_FromString("handle");
+	args[2] = PyUnicode_FromString("closure");
+	args[3] = PyUnicode_FromString("file");
+
+	g_print ("%" G_GUINT64_FORMAT " calls, Python %s\n", calls, PY_VERSION);
+	g_print ("%-18s %10s %10s %8s\n", "method", "lookup ns", "cached ns", "speedup");
+
+	for (i = 0; i < G_N_ELEMENTS (methods); i++)
+	{
+		gdouble lookup, cached;
+
+		/* warm the type's attribute cache up for both */
+		time_lookup (instance, &methods[i], calls / 10 + 1);
+		time_cached (instance, &methods[i], calls / 10 + 1);
+
+		lookup = time_lookup (instance, &methods[i], calls);
+		cached = time_cached (instance, &methods[i], calls);
+
+		if (lookup < 0 || cached < 0)
+		{
+			PyErr_Print();
+			return 1;
+		}
+
+		g_print ("%-18s %10.1f %10.1f %7.2fx\n",
+				 methods[i].name, lookup, cached, lookup / cached);
+	}
+
+	for (i = 0; i < G_N_ELEMENTS (args); i++)
+		Py_DECREF(args[i]);
+
+	Py_Finalize();
+
+	return 0;
+}
@@ -21,6 +21,7 @@
 
 #include "nemo-python-object.h"
 #include "nemo-python.h"
+#include "nemo-python-stats.h"
 
 #include <libnemo-extension/nemo-extension-types.h>
 
@@ -39,8 +40,6 @@
 
 #include <string.h>
 
-#define METHOD_PREFIX ""
-
 static GObjectClass *parent_class;
 
 /* These macros assumes the following things:
@@ -49,10 +48,19 @@ static GObjectClass *parent_class;
  *   the return value is called ret
  */
 
-#define CHECK_METHOD_NAME(self)                                        \
-	if (!PyObject_HasAttrString(self, METHOD_NAME))                    \
+#define CHECK_METHOD(object, method)                                   \
+	if (object->methods[method] == NULL)                               \
 		goto beach;
 
+/* Calls a cached entry point with the new references passed, which it
+ * consumes like the N format of PyObject_CallMethod does.
+ */
+#define CALL_METHOD(object, method, ...)                               \
+	nemo_python_object_call (object, method,                           \
+							 (PyObject *[]) { __VA_ARGS__ },           \
+							 sizeof ((PyObject *[]) { __VA_ARGS__ }) / \
+							 sizeof (PyObject *))
+
 #define CHECK_OBJECT(object)										   \
   	if (object->instance == NULL)									   \
   	{																   \
@@ -129,6 +137,101 @@ free_pygobject_data_list(GList *list)
 	g_list_foreach(list, (GFunc)free_pygobject_data, NULL);
 }
 
+static const char *method_names[NEMO_PYTHON_N_METHODS] = {
+	[NEMO_PYTHON_METHOD_GET_NAME_AND_DESC] = "get_name_and_desc",
+	[NEMO_PYTHON_METHOD_GET_PROPERTY_PAGES] = "get_property_pages",
+	[NEMO_PYTHON_METHOD_GET_WIDGET] = "get_widget",
+	[NEMO_PYTHON_METHOD_GET_FILE_ITEMS] = "get_file_items",
+	[NEMO_PYTHON_METHOD_GET_FILE_ITEMS_FULL] = "get_file_items_full",
+	[NEMO_PYTHON_METHOD_GET_BACKGROUND_ITEMS] = "get_background_items",
+	[NEMO_PYTHON_METHOD_GET_BACKGROUND_ITEMS_FULL] = "get_background_items_full",
+	[NEMO_PYTHON_METHOD_GET_COLUMNS] = "get_columns",
+	[NEMO_PYTHON_METHOD_CANCEL_UPDATE] = "cancel_update",
+	[NEMO_PYTHON_METHOD_UPDATE_FILE_INFO] = "update_file_info",
+	[NEMO_PYTHON_METHOD_UPDATE_FILE_INFO_FULL] = "update_file_info_full",
+	[NEMO_PYTHON_METHOD_UPDATE_FILE_INFO_BATCH] = "update_file_info_batch",
+};
+
+const gchar *
+nemo_python_object_method_name (NemoPythonMethod method)
+{
+	return method_names[method];
+}
+
+static NemoPythonClassInfo *
+nemo_python_object_get_info (NemoPythonObject *object)
+{
+	return ((NemoPythonObjectClass*)(((GTypeInstance*)object)->g_class))->info;
+}
+
+/* pyg_gil_state_ensure(), accounting the wait to the extension */
+static PyGILState_STATE
+nemo_python_object_gil_ensure (NemoPythonObject *object)
+{
+	NemoPythonStats *stats = nemo_python_object_get_info (object)->stats;
+	PyGILState_STATE state;
+	gint64 start;
+
+	if (stats == NULL)
+		return pyg_gil_state_ensure();
+
+	start = g_get_monotonic_time ();
+	state = pyg_gil_state_ensure();
+	nemo_python_stats_add_gil_wait (stats, start);
+
+	return state;
+}
+
+/* called with the GIL held */
+static PyObject *
+nemo_python_object_call (NemoPythonObject *object,
+						 NemoPythonMethod  method,
+						 PyObject        **args,
+						 size_t            nargs)
+{
+	NemoPythonStats *stats = nemo_python_object_get_info (object)->stats;
+	PyObject *ret = NULL;
+	gint64 start;
+	size_t i;
+
+	for (i = 0; i < nargs; i++)
+	{
+		if (args[i] == NULL)
+		{
+			if (!PyErr_Occurred())
+				PyErr_SetString(PyExc_RuntimeError, "could not convert the arguments");
+			goto out;
+		}
+	}
+
+	start = nemo_python_stats_begin (stats, method);
+
+#if PY_VERSION_HEX >= 0x03090000
+	ret = PyObject_Vectorcall(object->methods[method], args, nargs, NULL);
+#else
+	{
+		PyObject *py_args = PyTuple_New(nargs);
+
+		for (i = 0; i < nargs; i++)
+		{
+			Py_INCREF(args[i]);
+			PyTuple_SET_ITEM(py_args, i, args[i]);
+		}
+
+		ret = PyObject_Call(object->methods[method], py_args, NULL);
+		Py_DECREF(py_args);
+	}
+#endif
+
+	nemo_python_stats_end (stats, method, start);
+
+ out:
+	for (i = 0; i < nargs; i++)
+		Py_XDECREF(args[i]);
+
+	return ret;
+}
+
 static PyObject *
 nemo_python_boxed_new (PyTypeObject *type, gpointer boxed, gboolean free_on_dealloc)
 {
@@ -140,6 +243,73 @@ nemo_python_boxed_new (PyTypeObject *type, gpointer boxed, gboolean free_on_deal
 	return (PyObject *) self;
 }
 
+/* Imports the extension if it was registered from the manifest, and
+ * creates its instance; called before taking the GIL.
+ */
+static gboolean
+nemo_python_object_ensure_instance (NemoPythonObject *object)
+{
+	NemoPythonClassInfo *info;
+	PyObject *py_threaded;
+	PyGILState_STATE state;
+	guint i;
+
+	if (object->instance != NULL)
+		return TRUE;
+
+	info = nemo_python_object_get_info (object);
+	if (info->load_failed)
+		return FALSE;
+
+  	debug_enter_args("type=%s", info->type_name);
+
+	if (!nemo_python_init_python())
+	{
+		info->load_failed = TRUE;
+		return FALSE;
+	}
+
+	state = pyg_gil_state_ensure();
+
+	if (info->type == NULL)
+		info->type = nemo_python_import_class(info->dirname,
+											  info->module_name,
+											  info->class_name);
+
+	if (info->type != NULL)
+		object->instance = PyObject_CallObject(info->type, NULL);
+
+	if (object->instance == NULL)
+	{
+		if (PyErr_Occurred())
+			PyErr_Print();
+		info->load_failed = TRUE;
+		goto beach;
+	}
+
+	/* entry points are looked up once; extensions are never reloaded */
+	for (i = 0; i < NEMO_PYTHON_N_METHODS; i++)
+	{
+		object->methods[i] = PyObject_GetAttrString(object->instance, method_names[i]);
+		if (object->methods[i] != NULL && !PyCallable_Check(object->methods[i]))
+			Py_CLEAR(object->methods[i]);
+		PyErr_Clear();
+	}
+
+	py_threaded = PyObject_GetAttrString(object->instance, "update_file_info_in_thread");
+	if (py_threaded != NULL)
+	{
+		object->update_in_thread = PyObject_IsTrue(py_threaded) == 1;
+		Py_DECREF(py_threaded);
+	}
+	PyErr_Clear();
+
+ beach:
+	pyg_gil_state_release(state);
+
+	return object->instance != NULL;
+}
+
 #define METHOD_NAME "get_name_and_desc"
 static GList *
 nemo_python_object_get_name_and_desc (NemoNameAndDescProvider *provider)
@@ -147,14 +317,19 @@ nemo_python_object_get_name_and_desc (NemoNameAndDescProvider *provider)
     NemoPythonObject *object = (NemoPythonObject*)provider;
     PyObject *py_ret = NULL;
     GList *ret = NULL;
-    PyGILState_STATE state = pyg_gil_state_ensure();
+    PyGILState_STATE state;
+
+    if (!nemo_python_object_ensure_instance (object))
+        return NULL;
+
+    state = nemo_python_object_gil_ensure(object);
     
     debug_enter();
 
     CHECK_OBJECT(object);
-    CHECK_METHOD_NAME(object->instance);
+    CHECK_METHOD(object, NEMO_PYTHON_METHOD_GET_NAME_AND_DESC);
 
-    py_ret = PyObject_CallMethod(object->instance, METHOD_PREFIX METHOD_NAME, NULL);
+    py_ret = nemo_python_object_call(object, NEMO_PYTHON_METHOD_GET_NAME_AND_DESC, NULL, 0);
     HANDLE_RETVAL(py_ret);
 
     int i;
@@ -193,17 +368,21 @@ nemo_python_object_get_property_pages (NemoPropertyPageProvider *provider,
 	NemoPythonObject *object = (NemoPythonObject*)provider;
     PyObject *py_files, *py_ret = NULL;
     GList *ret = NULL;
-	PyGILState_STATE state = pyg_gil_state_ensure();
+	PyGILState_STATE state;
+
+	if (!nemo_python_object_ensure_instance (object))
+		return NULL;
+
+	state = nemo_python_object_gil_ensure(object);
 	
   	debug_enter();
 
 	CHECK_OBJECT(object);
-	CHECK_METHOD_NAME(object->instance);
+	CHECK_METHOD(object, NEMO_PYTHON_METHOD_GET_PROPERTY_PAGES);
 
 	CONVERT_LIST(py_files, files);
 	
-    py_ret = PyObject_CallMethod(object->instance, METHOD_PREFIX METHOD_NAME,
-								 "(N)", py_files);
+    py_ret = CALL_METHOD(object, NEMO_PYTHON_METHOD_GET_PROPERTY_PAGES, py_files);
 	HANDLE_RETVAL(py_ret);
 
 	HANDLE_LIST(py_ret, NemoPropertyPage, "Nemo.PropertyPage");
@@ -234,18 +413,23 @@ nemo_python_object_get_widget (NemoLocationWidgetProvider *provider,
 	PyObject *py_ret = NULL;
 	PyGObject *py_ret_gobj;
 	PyObject *py_uri = NULL;
-	PyGILState_STATE state = pyg_gil_state_ensure();
+	PyGILState_STATE state;
+
+	if (!nemo_python_object_ensure_instance (object))
+		return NULL;
+
+	state = nemo_python_object_gil_ensure(object);
 
 	debug_enter();
 
 	CHECK_OBJECT(object);
-	CHECK_METHOD_NAME(object->instance);
+	CHECK_METHOD(object, NEMO_PYTHON_METHOD_GET_WIDGET);
 
 	py_uri = PyUnicode_FromString(uri);
 
-	py_ret = PyObject_CallMethod(object->instance, METHOD_PREFIX METHOD_NAME,
-								 "(NN)", py_uri,
-								 pygobject_new((GObject *)window));
+	py_ret = CALL_METHOD(object, NEMO_PYTHON_METHOD_GET_WIDGET,
+						 py_uri,
+						 pygobject_new((GObject *)window));
 	HANDLE_RETVAL(py_ret);
 
 	py_ret_gobj = (PyGObject *)py_ret;
@@ -279,28 +463,31 @@ nemo_python_object_get_file_items (NemoMenuProvider *provider,
 	NemoPythonObject *object = (NemoPythonObject*)provider;
     GList *ret = NULL;
     PyObject *py_ret = NULL, *py_files;
-	PyGILState_STATE state = pyg_gil_state_ensure();
+	PyGILState_STATE state;
+
+	if (!nemo_python_object_ensure_instance (object))
+		return NULL;
+
+	state = nemo_python_object_gil_ensure(object);
 	
   	debug_enter();
 
 	CHECK_OBJECT(object);	
 
-	if (PyObject_HasAttrString(object->instance, "get_file_items_full"))
+	if (object->methods[NEMO_PYTHON_METHOD_GET_FILE_ITEMS_FULL] != NULL)
 	{
 		CONVERT_LIST(py_files, files);
-		py_ret = PyObject_CallMethod(object->instance, METHOD_PREFIX "get_file_items_full",
-									 "(NNN)",
-									 pygobject_new((GObject *)provider), 
-									 pygobject_new((GObject *)window), 
-									 py_files);
+		py_ret = CALL_METHOD(object, NEMO_PYTHON_METHOD_GET_FILE_ITEMS_FULL,
+							 pygobject_new((GObject *)provider),
+							 pygobject_new((GObject *)window),
+							 py_files);
 	}
-	else if (PyObject_HasAttrString(object->instance, "get_file_items"))
+	else if (object->methods[NEMO_PYTHON_METHOD_GET_FILE_ITEMS] != NULL)
 	{
 		CONVERT_LIST(py_files, files);
-		py_ret = PyObject_CallMethod(object->instance, METHOD_PREFIX METHOD_NAME,
-									 "(NN)", 
-									 pygobject_new((GObject *)window), 
-									 py_files);
+		py_ret = CALL_METHOD(object, NEMO_PYTHON_METHOD_GET_FILE_ITEMS,
+							 pygobject_new((GObject *)window),
+							 py_files);
 	}
 	else
 	{
@@ -328,26 +515,29 @@ nemo_python_object_get_background_items (NemoMenuProvider *provider,
 	NemoPythonObject *object = (NemoPythonObject*)provider;
     GList *ret = NULL;
     PyObject *py_ret = NULL;
-	PyGILState_STATE state = pyg_gil_state_ensure();
+	PyGILState_STATE state;
+
+	if (!nemo_python_object_ensure_instance (object))
+		return NULL;
+
+	state = nemo_python_object_gil_ensure(object);
 	
   	debug_enter();
 
 	CHECK_OBJECT(object);
 
-	if (PyObject_HasAttrString(object->instance, "get_background_items_full"))
+	if (object->methods[NEMO_PYTHON_METHOD_GET_BACKGROUND_ITEMS_FULL] != NULL)
 	{
-		py_ret = PyObject_CallMethod(object->instance, METHOD_PREFIX "get_background_items_full",
-									 "(NNN)",
-									 pygobject_new((GObject *)provider),
-									 pygobject_new((GObject *)window),
-									 pygobject_new((GObject *)file));
+		py_ret = CALL_METHOD(object, NEMO_PYTHON_METHOD_GET_BACKGROUND_ITEMS_FULL,
+							 pygobject_new((GObject *)provider),
+							 pygobject_new((GObject *)window),
+							 pygobject_new((GObject *)file));
 	}
-	else if (PyObject_HasAttrString(object->instance, "get_background_items"))
+	else if (object->methods[NEMO_PYTHON_METHOD_GET_BACKGROUND_ITEMS] != NULL)
 	{
-		py_ret = PyObject_CallMethod(object->instance, METHOD_PREFIX METHOD_NAME,
-									 "(NN)",
-									 pygobject_new((GObject *)window),
-									 pygobject_new((GObject *)file));
+		py_ret = CALL_METHOD(object, NEMO_PYTHON_METHOD_GET_BACKGROUND_ITEMS,
+							 pygobject_new((GObject *)window),
+							 pygobject_new((GObject *)file));
 	}
 	else
 	{
@@ -380,15 +570,19 @@ nemo_python_object_get_columns (NemoColumnProvider *provider)
 	NemoPythonObject *object = (NemoPythonObject*)provider;
     GList *ret = NULL;
     PyObject *py_ret = NULL;
-	PyGILState_STATE state = pyg_gil_state_ensure();                                    \
+	PyGILState_STATE state;
+
+	if (!nemo_python_object_ensure_instance (object))
+		return NULL;
+
+	state = nemo_python_object_gil_ensure(object);
 
 	debug_enter();
 		
 	CHECK_OBJECT(object);
-	CHECK_METHOD_NAME(object->instance);
+	CHECK_METHOD(object, NEMO_PYTHON_METHOD_GET_COLUMNS);
 
-    py_ret = PyObject_CallMethod(object->instance, METHOD_PREFIX METHOD_NAME,
-								 NULL);
+    py_ret = nemo_python_object_call(object, NEMO_PYTHON_METHOD_GET_COLUMNS, NULL, 0);
 
 	HANDLE_RETVAL(py_ret);
 
@@ -409,6 +603,475 @@ nemo_python_object_column_provider_iface_init (NemoColumnProviderIface *iface)
 }
 
 
+/* Extensions setting update_file_info_in_thread get their update_file_info()
+ * calls run by a pool of worker threads, so slow I/O in them doesn't hold up
+ * the window.  Since NemoFile is not thread safe, they are handed a
+ * DeferredFileInfo instead of the file: its getters answer from a snapshot
+ * taken on the main thread, and the changes made to it are applied to the
+ * file back on the main loop, right before update_complete is invoked.
+ */
+#define UPDATE_THREADS_MAX 4
+
+static const char deferred_file_info_source[] =
+	"from gi.repository import Gio\n"
+	"\n"
+	"class DeferredFileInfo(object):\n"
+	"    _getters = ('get_name', 'get_uri', 'get_parent_uri', 'get_uri_scheme',\n"
+	"                'get_mime_type', 'get_activation_uri', 'get_location',\n"
+	"                'get_parent_location', 'get_file_type', 'is_directory',\n"
+	"                'is_gone', 'can_write')\n"
+	"\n"
+	"    def __init__(self, file):\n"
+	"        self._values = dict((name, getattr(file, name)())\n"
+	"                            for name in self._getters if hasattr(file, name))\n"
+	"        self._changes = []\n"
+	"\n"
+	"    def __getattr__(self, name):\n"
+	"        if name.startswith('_') or name not in self._values:\n"
+	"            raise AttributeError('%s is not available to update_file_info '\n"
+	"                                 'in a thread' % name)\n"
+	"        value = self._values[name]\n"
+	"        return lambda: value\n"
+	"\n"
+	"    def is_mime_type(self, mime_type):\n"
+	"        return Gio.content_type_is_a(self._values['get_mime_type'], mime_type)\n"
+	"\n"
+	"    def add_emblem(self, emblem_name):\n"
+	"        self._changes.append(('add_emblem', (emblem_name,)))\n"
+	"\n"
+	"    def add_string_attribute(self, attribute_name, value):\n"
+	"        self._changes.append(('add_string_attribute', (attribute_name, value)))\n"
+	"\n"
+	"    def invalidate_extension_info(self):\n"
+	"        self._changes.append(('invalidate_extension_info', ()))\n"
+	"\n"
+	"    def _apply(self, file):\n"
+	"        for name, args in self._changes:\n"
+	"            getattr(file, name)(*args)\n";
+
+typedef struct {
+	NemoPythonObject *object;
+	NemoFileInfo *file;
+	GClosure *update_complete;
+	NemoOperationHandle *handle;
+
+	PyObject *py_file;
+	NemoOperationResult result;
+	gint cancelled;
+} UpdateJob;
+
+static GThreadPool *update_pool = NULL;
+static PyObject *deferred_file_info_class = NULL;
+
+/* jobs the pool is done with, waiting for the main loop to complete them */
+static GMutex finished_updates_lock;
+static GSList *finished_updates = NULL;
+static guint finished_updates_idle = 0;
+static gint update_shutdown = FALSE;
+
+/* NemoOperationHandle -> UpdateJob, only touched on the main thread */
+static GHashTable *pending_updates = NULL;
+
+/* called with the GIL held */
+static PyObject *
+get_deferred_file_info_class (void)
+{
+	PyObject *code, *module;
+
+	if (deferred_file_info_class != NULL)
+		return deferred_file_info_class;
+
+	code = Py_CompileString (deferred_file_info_source,
+							 "nemo-python-deferred-file-info", Py_file_input);
+	if (code == NULL)
+		return NULL;
+
+	module = PyImport_ExecCodeModule ("_nemo_python_deferred", code);
+	Py_DECREF(code);
+	if (module == NULL)
+		return NULL;
+
+	deferred_file_info_class = PyObject_GetAttrString (module, "DeferredFileInfo");
+	Py_DECREF(module);
+
+	return deferred_file_info_class;
+}
+
+/* called with the GIL held */
+static void
+update_job_free (UpdateJob *job)
+{
+	Py_XDECREF(job->py_file);
+
+	g_closure_unref (job->update_complete);
+	g_object_unref (job->file);
+	g_object_unref (job->object);
+	g_free (job->handle);
+
+	g_slice_free (UpdateJob, job);
+}
+
+/* called on the main thread, with the GIL held */
+static void
+update_job_complete (UpdateJob *job)
+{
+	if (g_atomic_int_get (&job->cancelled))
+	{
+		update_job_free (job);
+		return;
+	}
+
+	g_hash_table_remove (pending_updates, job->handle);
+
+	if (job->result == NEMO_OPERATION_COMPLETE)
+	{
+		PyObject *py_ret;
+
+		py_ret = PyObject_CallMethod(job->py_file, "_apply", "(N)",
+									 pygobject_new((GObject*)job->file));
+		if (py_ret == NULL)
+			PyErr_Print();
+		Py_XDECREF(py_ret);
+
+		free_pygobject_data(job->file, NULL);
+	}
+
+	nemo_info_provider_update_complete_invoke (job->update_complete,
+											   NEMO_INFO_PROVIDER (job->object),
+											   job->handle,
+											   job->result);
+
+	update_job_free (job);
+}
+
+static gboolean
+update_jobs_complete_idle (gpointer user_data)
+{
+	PyGILState_STATE state;
+	GSList *jobs, *l;
+
+	/* nemo_python_object_shutdown() frees whatever is left */
+	if (g_atomic_int_get (&update_shutdown))
+		return FALSE;
+
+	g_mutex_lock (&finished_updates_lock);
+	jobs = g_slist_reverse (finished_updates);
+	finished_updates = NULL;
+	finished_updates_idle = 0;
+	g_mutex_unlock (&finished_updates_lock);
+
+	state = pyg_gil_state_ensure();
+	for (l = jobs; l != NULL; l = l->next)
+		update_job_complete (l->data);
+	pyg_gil_state_release(state);
+
+	g_slist_free (jobs);
+
+	return FALSE;
+}
+
+static void
+update_job_run (gpointer data,
+				gpointer user_data)
+{
+	UpdateJob *job = data;
+	PyObject *py_ret;
+	PyGILState_STATE state;
+
+	if (g_atomic_int_get (&job->cancelled) ||
+		g_atomic_int_get (&update_shutdown))
+		goto out;
+
+	state = nemo_python_object_gil_ensure(job->object);
+
+	Py_INCREF(job->py_file);
+	py_ret = CALL_METHOD(job->object, NEMO_PYTHON_METHOD_UPDATE_FILE_INFO,
+						 job->py_file);
+
+	/* there is no closure to complete a threaded call later, so anything
+	 * but a failure means the call is done.
+	 */
+	if (py_ret == NULL)
+	{
+		PyErr_Print();
+		job->result = NEMO_OPERATION_FAILED;
+	}
+	else if (PyLong_Check(py_ret) && PyLong_AsLong(py_ret) == NEMO_OPERATION_FAILED)
+	{
+		job->result = NEMO_OPERATION_FAILED;
+	}
+
+	Py_XDECREF(py_ret);
+	pyg_gil_state_release(state);
+
+ out:
+	g_mutex_lock (&finished_updates_lock);
+	finished_updates = g_slist_prepend (finished_updates, job);
+	if (finished_updates_idle == 0 && !g_atomic_int_get (&update_shutdown))
+		finished_updates_idle = g_idle_add (update_jobs_complete_idle, NULL);
+	g_mutex_unlock (&finished_updates_lock);
+}
+
+/* called on the main thread, with the GIL held */
+static NemoOperationResult
+nemo_python_object_queue_update (NemoPythonObject    *object,
+								 NemoFileInfo        *file,
+								 GClosure            *update_complete,
+								 NemoOperationHandle *handle)
+{
+	PyObject *klass;
+	UpdateJob *job;
+
+	klass = get_deferred_file_info_class ();
+	if (klass == NULL)
+	{
+		PyErr_Print();
+		g_free (handle);
+		return NEMO_OPERATION_FAILED;
+	}
+
+	if (update_pool == NULL)
+	{
+		update_pool = g_thread_pool_new (update_job_run, NULL,
+										 MIN (g_get_num_processors (), UPDATE_THREADS_MAX),
+										 FALSE, NULL);
+		pending_updates = g_hash_table_new (NULL, NULL);
+	}
+
+	job = g_slice_new0 (UpdateJob);
+	job->object = g_object_ref (object);
+	job->file = g_object_ref (file);
+	job->update_complete = g_closure_ref (update_complete);
+	job->handle = handle;
+	job->result = NEMO_OPERATION_COMPLETE;
+
+	job->py_file = PyObject_CallFunction(klass, "(N)", pygobject_new((GObject*)file));
+	free_pygobject_data(file, NULL);
+
+	if (job->py_file == NULL)
+	{
+		PyErr_Print();
+		/* the handle goes with the job, and nemo drops it on failure */
+		update_job_free (job);
+		return NEMO_OPERATION_FAILED;
+	}
+
+	g_hash_table_insert (pending_updates, handle, job);
+	g_thread_pool_push (update_pool, job, NULL);
+
+	return NEMO_OPERATION_IN_PROGRESS;
+}
+
+void
+nemo_python_object_shutdown (void)
+{
+	debug_enter();
+
+	/* queued jobs go through update_job_run() without calling into
+	 * Python, running ones need the GIL to finish.  Nothing completes
+	 * them after this, so the finished ones are freed here rather than
+	 * by an idle running after Py_Finalize().
+	 */
+	if (update_pool != NULL)
+	{
+		GSList *jobs;
+
+		g_atomic_int_set (&update_shutdown, TRUE);
+
+		Py_BEGIN_ALLOW_THREADS
+		g_thread_pool_free (update_pool, FALSE, TRUE);
+		Py_END_ALLOW_THREADS
+		update_pool = NULL;
+
+		g_mutex_lock (&finished_updates_lock);
+		if (finished_updates_idle != 0)
+			g_source_remove (finished_updates_idle);
+		finished_updates_idle = 0;
+		jobs = finished_updates;
+		finished_updates = NULL;
+		g_mutex_unlock (&finished_updates_lock);
+
+		g_slist_free_full (jobs, (GDestroyNotify) update_job_free);
+		g_clear_pointer (&pending_updates, g_hash_table_destroy);
+	}
+
+	Py_CLEAR(deferred_file_info_class);
+}
+
+/* Extensions defining update_file_info_batch get the files Nemo asks
+ * about during a main loop iteration in one call, as a list of
+ * (handle, closure, file) tuples, so that they can share whatever setup
+ * the files need.  Returning None or a result other than IN_PROGRESS
+ * completes every file in the batch with that result; an extension
+ * returning IN_PROGRESS invokes update_complete for each file itself.
+ */
+typedef struct {
+	NemoFileInfo *file;
+	GClosure *update_complete;
+	NemoOperationHandle *handle;
+} BatchEntry;
+
+static void
+batch_entry_free (BatchEntry *entry)
+{
+	g_object_unref (entry->file);
+	g_closure_unref (entry->update_complete);
+
+	g_slice_free (BatchEntry, entry);
+}
+
+/* files handed to update_file_info_batch in a single call; the rest
+ * wait for the next main loop iteration, so that opening a large
+ * folder doesn't hold the main loop up in one long call */
+#define BATCH_MAX_FILES 256
+
+#define METHOD_NAME "update_file_info_batch"
+static gboolean
+nemo_python_object_flush_batch (gpointer user_data)
+{
+	NemoPythonObject *object = user_data;
+	NemoOperationResult ret = NEMO_OPERATION_COMPLETE;
+	PyObject *py_batch, *py_ret = NULL;
+	GPtrArray *batch;
+	guint i;
+	PyGILState_STATE state = nemo_python_object_gil_ensure(object);
+
+	batch = object->batch;
+	object->batch = NULL;
+	object->batch_idle_id = 0;
+
+	if (batch->len > BATCH_MAX_FILES)
+	{
+		object->batch = g_ptr_array_new_with_free_func ((GDestroyNotify) batch_entry_free);
+		for (i = BATCH_MAX_FILES; i < batch->len; i++)
+			g_ptr_array_add (object->batch, g_ptr_array_index (batch, i));
+
+		/* the entries moved over belong to object->batch now */
+		g_ptr_array_set_free_func (batch, NULL);
+		g_ptr_array_set_size (batch, BATCH_MAX_FILES);
+		g_ptr_array_set_free_func (batch, (GDestroyNotify) batch_entry_free);
+	}
+
+	debug_enter_args("files=%u", batch->len);
+
+	py_batch = PyList_New(batch->len);
+	for (i = 0; i < batch->len; i++)
+	{
+		BatchEntry *entry = g_ptr_array_index (batch, i);
+
+		PyList_SET_ITEM(py_batch, i,
+						Py_BuildValue("(NNN)",
+									  nemo_python_boxed_new (_PyNemoOperationHandle_Type, entry->handle, TRUE),
+									  pyg_boxed_new(G_TYPE_CLOSURE, entry->update_complete, TRUE, TRUE),
+									  pygobject_new((GObject*)entry->file)));
+	}
+
+	Py_INCREF(py_batch);
+	py_ret = CALL_METHOD(object, NEMO_PYTHON_METHOD_UPDATE_FILE_INFO_BATCH,
+						 pygobject_new((GObject*)object),
+						 py_batch);
+
+	if (py_ret == NULL)
+	{
+		PyErr_Print();
+		ret = NEMO_OPERATION_FAILED;
+	}
+	else if (py_ret != Py_None)
+	{
+		if (PyLong_Check(py_ret))
+		{
+			ret = PyLong_AsLong(py_ret);
+		}
+		else
+		{
+			PyErr_SetString(PyExc_TypeError,
+							METHOD_NAME " must return None or a int");
+			PyErr_Print();
+			ret = NEMO_OPERATION_FAILED;
+		}
+	}
+
+	/* the handles belong to py_batch, so it has to outlive the completions */
+	for (i = 0; i < batch->len; i++)
+	{
+		BatchEntry *entry = g_ptr_array_index (batch, i);
+
+		if (ret != NEMO_OPERATION_IN_PROGRESS)
+			nemo_info_provider_update_complete_invoke (entry->update_complete,
+													   NEMO_INFO_PROVIDER (object),
+													   entry->handle,
+													   ret);
+
+		free_pygobject_data (entry->file, NULL);
+	}
+
+	Py_XDECREF(py_ret);
+	Py_DECREF(py_batch);
+	pyg_gil_state_release(state);
+
+	g_ptr_array_unref (batch);
+
+	if (object->batch != NULL && object->batch_idle_id == 0)
+		object->batch_idle_id = g_idle_add_full (G_PRIORITY_DEFAULT_IDLE,
+												 nemo_python_object_flush_batch,
+												 g_object_ref (object),
+												 g_object_unref);
+
+	return FALSE;
+}
+#undef METHOD_NAME
+
+static NemoOperationResult
+nemo_python_object_queue_batch (NemoPythonObject    *object,
+								NemoFileInfo        *file,
+								GClosure            *update_complete,
+								NemoOperationHandle *handle)
+{
+	BatchEntry *entry;
+
+	if (object->batch == NULL)
+		object->batch = g_ptr_array_new_with_free_func ((GDestroyNotify) batch_entry_free);
+
+	entry = g_slice_new0 (BatchEntry);
+	entry->file = g_object_ref (file);
+	entry->update_complete = g_closure_ref (update_complete);
+	entry->handle = handle;
+	g_ptr_array_add (object->batch, entry);
+
+	if (object->batch_idle_id == 0)
+		object->batch_idle_id = g_idle_add_full (G_PRIORITY_DEFAULT_IDLE,
+												 nemo_python_object_flush_batch,
+												 g_object_ref (object),
+												 g_object_unref);
+
+	return NEMO_OPERATION_IN_PROGRESS;
+}
+
+/* called with the GIL held */
+static gboolean
+nemo_python_object_cancel_batched (NemoPythonObject    *object,
+								   NemoOperationHandle *handle)
+{
+	guint i;
+
+	if (object->batch == NULL)
+		return FALSE;
+
+	for (i = 0; i < object->batch->len; i++)
+	{
+		BatchEntry *entry = g_ptr_array_index (object->batch, i);
+
+		if (entry->handle == handle)
+		{
+			g_ptr_array_remove_index (object->batch, i);
+			g_free (handle);
+			return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
 #define METHOD_NAME "cancel_update"
 static void
 nemo_python_object_cancel_update (NemoInfoProvider 		*provider,
@@ -416,19 +1079,41 @@ nemo_python_object_cancel_update (NemoInfoProvider 		*provider,
 {
 	NemoPythonObject *object = (NemoPythonObject*)provider;
     PyObject *py_ret = NULL;
+	UpdateJob *job;
+	PyGILState_STATE state;
+	PyObject *py_handle;
+
+	/* nothing can be pending for an extension that was never imported */
+	if (object->instance == NULL)
+		return;
 
-	PyGILState_STATE state = pyg_gil_state_ensure();
-	PyObject *py_handle = nemo_python_boxed_new (_PyNemoOperationHandle_Type, handle, FALSE);
+	state = nemo_python_object_gil_ensure(object);
+	py_handle = nemo_python_boxed_new (_PyNemoOperationHandle_Type, handle, FALSE);
 
   	debug_enter();
 
+	/* the extension never saw a file still waiting for its batch */
+	if (nemo_python_object_cancel_batched (object, handle))
+	{
+		Py_DECREF(py_handle);
+		pyg_gil_state_release(state);
+		return;
+	}
+
+	/* a threaded call is left to finish, but its result is dropped */
+	if (pending_updates != NULL &&
+		(job = g_hash_table_lookup (pending_updates, handle)) != NULL)
+	{
+		g_atomic_int_set (&job->cancelled, TRUE);
+		g_hash_table_remove (pending_updates, handle);
+	}
+
 	CHECK_OBJECT(object);
-	CHECK_METHOD_NAME(object->instance);
+	CHECK_METHOD(object, NEMO_PYTHON_METHOD_CANCEL_UPDATE);
 
-    py_ret = PyObject_CallMethod(object->instance,
-								 METHOD_PREFIX METHOD_NAME, "(NN)",
-								 pygobject_new((GObject*)provider),
-								 py_handle);
+    py_ret = CALL_METHOD(object, NEMO_PYTHON_METHOD_CANCEL_UPDATE,
+						 pygobject_new((GObject*)provider),
+						 py_handle);
 
     HANDLE_RETVAL(py_ret);
 
@@ -452,7 +1137,7 @@ nemo_python_object_update_file_info (NemoInfoProvider 		*provider,
 	NemoPythonObject *object = (NemoPythonObject*)provider;
     NemoOperationResult ret = NEMO_OPERATION_COMPLETE;
     PyObject *py_ret = NULL;
-	PyGILState_STATE state = pyg_gil_state_ensure();
+	PyGILState_STATE state;
 
     /* For python extensions, we can't do assignment on the handle within python itself,
      * so we make a dummy struct to fill it.  Nemo relies on the handle pointer for
@@ -463,26 +1148,44 @@ nemo_python_object_update_file_info (NemoInfoProvider 		*provider,
 
     *handle = (NemoOperationHandle *) g_new0(DummyStruct, 1);
 
-    PyObject *py_handle = nemo_python_boxed_new (_PyNemoOperationHandle_Type, *handle, TRUE);
+	if (!nemo_python_object_ensure_instance (object))
+		return ret;
+
+	state = nemo_python_object_gil_ensure(object);
 
     debug_enter();
 
 	CHECK_OBJECT(object);
 
-	if (PyObject_HasAttrString(object->instance, "update_file_info_full"))
+	if (object->methods[NEMO_PYTHON_METHOD_UPDATE_FILE_INFO_BATCH] != NULL)
 	{
-		py_ret = PyObject_CallMethod(object->instance,
-									 METHOD_PREFIX "update_file_info_full", "(NNNN)",
-									 pygobject_new((GObject*)provider),
-									 py_handle,
-									 pyg_boxed_new(G_TYPE_CLOSURE, update_complete, TRUE, TRUE),
-									 pygobject_new((GObject*)file));
+		ret = nemo_python_object_queue_batch (object, NEMO_FILE_INFO (file),
+											  update_complete, *handle);
+		pyg_gil_state_release(state);
+		return ret;
 	}
-	else if (PyObject_HasAttrString(object->instance, "update_file_info"))
+
+	if (object->update_in_thread &&
+		object->methods[NEMO_PYTHON_METHOD_UPDATE_FILE_INFO] != NULL)
+	{
+		ret = nemo_python_object_queue_update (object, NEMO_FILE_INFO (file),
+											   update_complete, *handle);
+		pyg_gil_state_release(state);
+		return ret;
+	}
+
+	if (object->methods[NEMO_PYTHON_METHOD_UPDATE_FILE_INFO_FULL] != NULL)
 	{
-		py_ret = PyObject_CallMethod(object->instance,
-									 METHOD_PREFIX METHOD_NAME, "(N)",
-									 pygobject_new((GObject*)file));
+		py_ret = CALL_METHOD(object, NEMO_PYTHON_METHOD_UPDATE_FILE_INFO_FULL,
+							 pygobject_new((GObject*)provider),
+							 nemo_python_boxed_new (_PyNemoOperationHandle_Type, *handle, TRUE),
+							 pyg_boxed_new(G_TYPE_CLOSURE, update_complete, TRUE, TRUE),
+							 pygobject_new((GObject*)file));
+	}
+	else if (object->methods[NEMO_PYTHON_METHOD_UPDATE_FILE_INFO] != NULL)
+	{
+		py_ret = CALL_METHOD(object, NEMO_PYTHON_METHOD_UPDATE_FILE_INFO,
+							 pygobject_new((GObject*)file));
 	}
 	else
 	{
@@ -518,23 +1221,29 @@ nemo_python_object_info_provider_iface_init (NemoInfoProviderIface *iface)
 static void 
 nemo_python_object_instance_init (NemoPythonObject *object)
 {
-	NemoPythonObjectClass *class;
   	debug_enter();
 
-	class = (NemoPythonObjectClass*)(((GTypeInstance*)object)->g_class);
-
-	object->instance = PyObject_CallObject(class->type, NULL);
-	if (object->instance == NULL)
-		PyErr_Print();
+	/* the extension is imported and instantiated on first use, see
+	 * nemo_python_object_ensure_instance()
+	 */
 }
 
 static void
 nemo_python_object_finalize (GObject *object)
 {
+	PyGILState_STATE state;
+	guint i;
+
   	debug_enter();
 
 	if (((NemoPythonObject *)object)->instance != NULL)
+	{
+		state = pyg_gil_state_ensure();
+		for (i = 0; i < NEMO_PYTHON_N_METHODS; i++)
+			Py_XDECREF(((NemoPythonObject *)object)->methods[i]);
 		Py_DECREF(((NemoPythonObject *)object)->instance);
+		pyg_gil_state_release(state);
+	}
 }
 
 static void
@@ -545,18 +1254,70 @@ nemo_python_object_class_init (NemoPythonObjectClass *class,
 
 	parent_class = g_type_class_peek_parent (class);
 	
-	class->type = (PyObject*)class_data;
+	class->info = (NemoPythonClassInfo*)class_data;
 	
 	G_OBJECT_CLASS (class)->finalize = nemo_python_object_finalize;
 }
 
+NemoPythonClassInfo *
+nemo_python_class_info_new (const gchar *dirname,
+							const gchar *module_name,
+							const gchar *class_name,
+							PyObject    *type)
+{
+	NemoPythonClassInfo *info = g_new0 (NemoPythonClassInfo, 1);
+	PyObject *name_str;
+
+	info->dirname = g_strdup (dirname);
+	info->module_name = g_strdup (module_name);
+	info->class_name = g_strdup (class_name);
+
+	if (type != NULL)
+	{
+		info->type = type;
+		Py_INCREF(type);
+
+		name_str = PyObject_GetAttrString(type, "__name__");
+		info->type_name = g_strdup_printf("%s+NemoPython",
+										  PyUnicode_AsUTF8(name_str));
+		Py_XDECREF(name_str);
+	}
+	else
+	{
+		info->type_name = g_strdup_printf("%s+NemoPython", class_name);
+	}
+
+	return info;
+}
+
+guint
+nemo_python_object_get_providers (PyObject *type)
+{
+	guint providers = 0;
+
+	if (PyObject_IsSubclass(type, (PyObject*)&PyNemoPropertyPageProvider_Type))
+		providers |= NEMO_PYTHON_PROVIDER_PROPERTY_PAGE;
+	if (PyObject_IsSubclass(type, (PyObject*)&PyNemoLocationWidgetProvider_Type))
+		providers |= NEMO_PYTHON_PROVIDER_LOCATION_WIDGET;
+	if (PyObject_IsSubclass(type, (PyObject*)&PyNemoMenuProvider_Type))
+		providers |= NEMO_PYTHON_PROVIDER_MENU;
+	if (PyObject_IsSubclass(type, (PyObject*)&PyNemoColumnProvider_Type))
+		providers |= NEMO_PYTHON_PROVIDER_COLUMN;
+	if (PyObject_IsSubclass(type, (PyObject*)&PyNemoInfoProvider_Type))
+		providers |= NEMO_PYTHON_PROVIDER_INFO;
+	if (PyObject_IsSubclass(type, (PyObject*)&PyNemoNameAndDescProvider_Type))
+		providers |= NEMO_PYTHON_PROVIDER_NAME_AND_DESC;
+
+	return providers;
+}
+
+/* Takes ownership of info. */
 GType 
-nemo_python_object_get_type (GTypeModule *module, 
-								 PyObject 	*type)
+nemo_python_object_register_type (GTypeModule         *module, 
+								  NemoPythonClassInfo *info,
+								  guint                providers)
 {
-    PyObject *name_str = NULL;
-	GTypeInfo *info;
-	gchar *type_name;
+	GTypeInfo *type_info;
 	GType gtype;
 	  
 	static const GInterfaceInfo property_page_provider_iface_info = {
@@ -595,68 +1356,60 @@ nemo_python_object_get_type (GTypeModule *module,
         NULL
     };
 
-    name_str = PyObject_GetAttrString(type, "__name__");
-
-	debug_enter_args("type=%s", PyUnicode_AsUTF8(name_str));
-	info = g_new0 (GTypeInfo, 1);
+	debug_enter_args("type=%s", info->type_name);
+	type_info = g_new0 (GTypeInfo, 1);
 	
-	info->class_size = sizeof (NemoPythonObjectClass);
-	info->class_init = (GClassInitFunc)nemo_python_object_class_init;
-	info->instance_size = sizeof (NemoPythonObject);
-	info->instance_init = (GInstanceInitFunc)nemo_python_object_instance_init;
-
-	info->class_data = type;
-	Py_INCREF(type);
+	type_info->class_size = sizeof (NemoPythonObjectClass);
+	type_info->class_init = (GClassInitFunc)nemo_python_object_class_init;
+	type_info->instance_size = sizeof (NemoPythonObject);
+	type_info->instance_init = (GInstanceInitFunc)nemo_python_object_instance_init;
 
-	type_name = g_strdup_printf("%s+NemoPython",
-								PyUnicode_AsUTF8(name_str));
-
-    Py_XDECREF(name_str);
+	type_info->class_data = info;
+	info->stats = nemo_python_stats_new (info->type_name);
 		
 	gtype = g_type_module_register_type (module, 
 										 G_TYPE_OBJECT,
-										 type_name,
-										 info, 0);
+										 info->type_name,
+										 type_info, 0);
 
-    g_free (info);
-    g_free (type_name);
+    g_free (type_info);
 
-	if (PyObject_IsSubclass(type, (PyObject*)&PyNemoPropertyPageProvider_Type))
+	if (providers & NEMO_PYTHON_PROVIDER_PROPERTY_PAGE)
 	{
 		g_type_module_add_interface (module, gtype, 
 									 NEMO_TYPE_PROPERTY_PAGE_PROVIDER,
 									 &property_page_provider_iface_info);
 	}
 
-	if (PyObject_IsSubclass(type, (PyObject*)&PyNemoLocationWidgetProvider_Type))
+	if (providers & NEMO_PYTHON_PROVIDER_LOCATION_WIDGET)
 	{
 		g_type_module_add_interface (module, gtype,
 									 NEMO_TYPE_LOCATION_WIDGET_PROVIDER,
 									 &location_widget_provider_iface_info);
 	}
 	
-	if (PyObject_IsSubclass(type, (PyObject*)&PyNemoMenuProvider_Type))
+	if (providers & NEMO_PYTHON_PROVIDER_MENU)
 	{
 		g_type_module_add_interface (module, gtype, 
 									 NEMO_TYPE_MENU_PROVIDER,
 									 &menu_provider_iface_info);
 	}
 
-	if (PyObject_IsSubclass(type, (PyObject*)&PyNemoColumnProvider_Type))
+	if (providers & NEMO_PYTHON_PROVIDER_COLUMN)
 	{
 		g_type_module_add_interface (module, gtype, 
 									 NEMO_TYPE_COLUMN_PROVIDER,
 									 &column_provider_iface_info);
 	}
 
-	if (PyObject_IsSubclass(type, (PyObject*)&PyNemoInfoProvider_Type))
+	if (providers & NEMO_PYTHON_PROVIDER_INFO)
 	{
 		g_type_module_add_interface (module, gtype, 
 									 NEMO_TYPE_INFO_PROVIDER,
 									 &info_provider_iface_info);
 	}
 
-    if (PyObject_IsSubclass(type, (PyObject*)&PyNemoNameAndDescProvider_Type))
+    if (providers & NEMO_PYTHON_PROVIDER_NAME_AND_DESC)
     {
         g_type_module_add_interface (module, gtype, 
                                      NEMO_TYPE_NAME_AND_DESC_PROVIDER,
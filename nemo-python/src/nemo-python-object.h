@@ -25,20 +25,85 @@
 
 G_BEGIN_DECLS
 
+/* The provider entry points an extension may define */
+typedef enum {
+  NEMO_PYTHON_METHOD_GET_NAME_AND_DESC,
+  NEMO_PYTHON_METHOD_GET_PROPERTY_PAGES,
+  NEMO_PYTHON_METHOD_GET_WIDGET,
+  NEMO_PYTHON_METHOD_GET_FILE_ITEMS,
+  NEMO_PYTHON_METHOD_GET_FILE_ITEMS_FULL,
+  NEMO_PYTHON_METHOD_GET_BACKGROUND_ITEMS,
+  NEMO_PYTHON_METHOD_GET_BACKGROUND_ITEMS_FULL,
+  NEMO_PYTHON_METHOD_GET_COLUMNS,
+  NEMO_PYTHON_METHOD_CANCEL_UPDATE,
+  NEMO_PYTHON_METHOD_UPDATE_FILE_INFO,
+  NEMO_PYTHON_METHOD_UPDATE_FILE_INFO_FULL,
+  NEMO_PYTHON_METHOD_UPDATE_FILE_INFO_BATCH,
+  NEMO_PYTHON_N_METHODS
+} NemoPythonMethod;
+
+/* The provider interfaces a class implements, as kept in the manifest */
+typedef enum {
+  NEMO_PYTHON_PROVIDER_PROPERTY_PAGE    = 1 << 0,
+  NEMO_PYTHON_PROVIDER_LOCATION_WIDGET  = 1 << 1,
+  NEMO_PYTHON_PROVIDER_MENU             = 1 << 2,
+  NEMO_PYTHON_PROVIDER_COLUMN           = 1 << 3,
+  NEMO_PYTHON_PROVIDER_INFO             = 1 << 4,
+  NEMO_PYTHON_PROVIDER_NAME_AND_DESC    = 1 << 5
+} NemoPythonProviders;
+
+typedef struct _NemoPythonStats NemoPythonStats;
+
+/* Where the Python class behind a registered type comes from; type stays
+ * NULL until the extension is imported.
+ */
+typedef struct {
+  PyObject *type;
+  gchar *type_name;
+  gchar *dirname;
+  gchar *module_name;
+  gchar *class_name;
+  gboolean load_failed;
+
+  /* NULL unless NEMO_PYTHON_DEBUG=stats or trace */
+  NemoPythonStats *stats;
+} NemoPythonClassInfo;
+
 typedef struct _NemoPythonObject       NemoPythonObject;
 typedef struct _NemoPythonObjectClass  NemoPythonObjectClass;
 
 struct _NemoPythonObject {
   GObject parent_slot;
   PyObject *instance;
+  gboolean update_in_thread;
+
+  /* bound methods of instance, or NULL for those it doesn't define */
+  PyObject *methods[NEMO_PYTHON_N_METHODS];
+
+  /* update_file_info calls waiting for update_file_info_batch */
+  GPtrArray *batch;
+  guint batch_idle_id;
 };
 
 struct _NemoPythonObjectClass {
     GObjectClass parent_slot;
-    PyObject *type;
+    NemoPythonClassInfo *info;
 };
 
-GType nemo_python_object_get_type (GTypeModule *module, PyObject *type);
+NemoPythonClassInfo *nemo_python_class_info_new (const gchar *dirname,
+                                                 const gchar *module_name,
+                                                 const gchar *class_name,
+                                                 PyObject    *type);
+
+const gchar *nemo_python_object_method_name (NemoPythonMethod method);
+
+guint nemo_python_object_get_providers (PyObject *type);
+
+GType nemo_python_object_register_type (GTypeModule         *module,
+                                        NemoPythonClassInfo *info,
+                                        guint                providers);
+
+void nemo_python_object_shutdown (void);
 
 G_END_DECLS
 
@@ -0,0 +1,368 @@
+/* -*- Mode: C; indent-tabs-mode: t; c-basic-offset: 4; tab-width: 4 -*- */
+/*
+ *  Copyright (C) 2004,2005 Johan Dahlin
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2, or (at your option)
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#include <config.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "nemo-python.h"
+#include "nemo-python-stats.h"
+
+/* Per extension and per method call statistics, enabled with
+ * NEMO_PYTHON_DEBUG=stats.  They are written as JSON to
+ * $XDG_RUNTIME_DIR/nemo-python-stats-<pid>.json every few seconds by a
+ * thread of their own, so that the file keeps being updated, calls still
+ * running included, while an extension blocks the main loop.
+ *
+ * NEMO_PYTHON_DEBUG=trace also writes a mark to the ftrace trace_marker
+ * around each call, for perf or trace-cmd to line them up with the rest
+ * of the system.
+ */
+
+#define DEFAULT_SLOW_CALL_MS 200
+#define WRITE_INTERVAL (5 * G_TIME_SPAN_SECOND)
+
+static GMutex stats_lock;
+static GPtrArray *all_stats = NULL;
+static gint64 slow_call_us;
+static gboolean stats_dirty = FALSE;
+
+static gchar *stats_path = NULL;
+static GThread *writer_thread = NULL;
+static GCond writer_cond;
+static gboolean writer_quit = FALSE;
+
+static int trace_fd = -1;
+
+static void
+nemo_python_stats_trace (const char *format, ...) G_GNUC_PRINTF (1, 2);
+
+static void
+nemo_python_stats_trace (const char *format, ...)
+{
+	gchar buf[256];
+	va_list args;
+	int len;
+
+	va_start (args, format);
+	len = g_vsnprintf (buf, sizeof (buf), format, args);
+	va_end (args);
+
+	if (write (trace_fd, buf, MIN (len, (int) sizeof (buf) - 1)) < 0)
+		return;
+}
+
+static void
+nemo_python_histogram_add (NemoPythonHistogram *histogram,
+						   gint64               elapsed)
+{
+	guint bucket;
+
+	/* g_bit_storage (0) is 1 */
+	bucket = elapsed < 1000 ? 0 : MIN (g_bit_storage (elapsed / 1000),
+									   NEMO_PYTHON_STATS_N_BUCKETS - 1);
+
+	histogram->count++;
+	histogram->total_us += elapsed;
+	histogram->max_us = MAX (histogram->max_us, (guint64) elapsed);
+	histogram->buckets[bucket]++;
+}
+
+static void
+nemo_python_histogram_to_json (GString                   *json,
+							   const NemoPythonHistogram *histogram)
+{
+	guint i;
+
+	g_string_append_printf (json,
+							"\"count\": %" G_GUINT64_FORMAT ", "
+							"\"total_us\": %" G_GUINT64_FORMAT ", "
+							"\"max_us\": %" G_GUINT64_FORMAT ", "
+							"\"buckets\": [",
+							histogram->count, histogram->total_us, histogram->max_us);
+
+	for (i = 0; i < NEMO_PYTHON_STATS_N_BUCKETS; i++)
+		g_string_append_printf (json, "%s%" G_GUINT64_FORMAT,
+								i > 0 ? ", " : "", histogram->buckets[i]);
+
+	g_string_append_c (json, ']');
+}
+
+/* called with stats_lock held */
+static gchar *
+nemo_python_stats_to_json (gint64 now)
+{
+	GString *json = g_string_new (NULL);
+	guint i, j;
+
+	g_string_append_printf (json,
+							"{\n  \"pid\": %d,\n  \"slow_call_ms\": %" G_GINT64_FORMAT ",\n"
+							"  \"bucket_upper_ms\": [",
+							getpid (), slow_call_us / 1000);
+
+	for (i = 0; i < NEMO_PYTHON_STATS_N_BUCKETS - 1; i++)
+		g_string_append_printf (json, "%u, ", 1u << i);
+	g_string_append (json, "null],\n  \"extensions\": [");
+
+	for (i = 0; i < all_stats->len; i++)
+	{
+		NemoPythonStats *stats = g_ptr_array_index (all_stats, i);
+		gboolean first = TRUE;
+
+		g_string_append_printf (json, "%s\n    {\n      \"type\": \"%s\",\n      \"gil_wait\": {",
+								i > 0 ? "," : "", stats->type_name);
+		nemo_python_histogram_to_json (json, &stats->gil_wait);
+		g_string_append (json, "},\n      \"methods\": {");
+
+		for (j = 0; j < NEMO_PYTHON_N_METHODS; j++)
+		{
+			NemoPythonMethodStats *method = &stats->methods[j];
+
+			if (method->wall.count == 0 && method->running == 0)
+				continue;
+
+			g_string_append_printf (json, "%s\n        \"%s\": {",
+									first ? "" : ",",
+									nemo_python_object_method_name (j));
+			nemo_python_histogram_to_json (json, &method->wall);
+			g_string_append_printf (json,
+									", \"slow_calls\": %" G_GUINT64_FORMAT
+									", \"running\": %u, \"running_us\": %" G_GINT64_FORMAT "}",
+									method->slow_calls, method->running,
+									method->running > 0 ? now - method->running_since : 0);
+			first = FALSE;
+		}
+
+		g_string_append (json, first ? "}\n    }" : "\n      }\n    }");
+	}
+
+	g_string_append (json, "\n  ]\n}\n");
+
+	return g_string_free (json, FALSE);
+}
+
+static void
+nemo_python_stats_write (void)
+{
+	gchar *data = NULL;
+	gint64 now = g_get_monotonic_time ();
+	guint i, j;
+
+	g_mutex_lock (&stats_lock);
+
+	/* keep rewriting while a call is running, so a stuck one shows */
+	for (i = 0; i < all_stats->len && !stats_dirty; i++)
+	{
+		NemoPythonStats *stats = g_ptr_array_index (all_stats, i);
+
+		for (j = 0; j < NEMO_PYTHON_N_METHODS; j++)
+			stats_dirty |= stats->methods[j].running > 0;
+	}
+
+	if (stats_dirty)
+		data = nemo_python_stats_to_json (now);
+	stats_dirty = FALSE;
+
+	g_mutex_unlock (&stats_lock);
+
+	if (data != NULL)
+		g_file_set_contents (stats_path, data, -1, NULL);
+
+	g_free (data);
+}
+
+static gpointer
+nemo_python_stats_writer (gpointer data)
+{
+	gboolean quit = FALSE;
+
+	while (!quit)
+	{
+		gint64 end_time = g_get_monotonic_time () + WRITE_INTERVAL;
+
+		g_mutex_lock (&stats_lock);
+		while (!writer_quit && g_cond_wait_until (&writer_cond, &stats_lock, end_time))
+			;
+		quit = writer_quit;
+		g_mutex_unlock (&stats_lock);
+
+		nemo_python_stats_write ();
+	}
+
+	return NULL;
+}
+
+void
+nemo_python_stats_init (void)
+{
+	const gchar *env_string;
+
+	if (!(nemo_python_debug & (NEMO_PYTHON_DEBUG_STATS | NEMO_PYTHON_DEBUG_TRACE)))
+		return;
+
+	env_string = g_getenv ("NEMO_PYTHON_SLOW_CALL_MS");
+	slow_call_us = (env_string != NULL ? g_ascii_strtoll (env_string, NULL, 10)
+										: DEFAULT_SLOW_CALL_MS) * 1000;
+
+	all_stats = g_ptr_array_new ();
+
+	if (nemo_python_debug & NEMO_PYTHON_DEBUG_TRACE)
+	{
+		trace_fd = open ("/sys/kernel/tracing/trace_marker", O_WRONLY | O_CLOEXEC);
+		if (trace_fd < 0)
+			trace_fd = open ("/sys/kernel/debug/tracing/trace_marker", O_WRONLY | O_CLOEXEC);
+		if (trace_fd < 0)
+			g_warning ("nemo-python: could not open the ftrace trace_marker, calls are not traced");
+	}
+
+	if (nemo_python_debug & NEMO_PYTHON_DEBUG_STATS)
+	{
+		gchar *filename = g_strdup_printf ("nemo-python-stats-%d.json", getpid ());
+
+		stats_path = g_build_filename (g_get_user_runtime_dir (), filename, NULL);
+		writer_thread = g_thread_new ("nemo-python-stats", nemo_python_stats_writer, NULL);
+
+		debug_args ("writing call statistics to %s", stats_path);
+
+		g_free (filename);
+	}
+}
+
+void
+nemo_python_stats_shutdown (void)
+{
+	if (writer_thread != NULL)
+	{
+		g_mutex_lock (&stats_lock);
+		writer_quit = TRUE;
+		g_cond_signal (&writer_cond);
+		g_mutex_unlock (&stats_lock);
+
+		g_thread_join (writer_thread);
+		writer_thread = NULL;
+	}
+
+	if (trace_fd >= 0)
+	{
+		close (trace_fd);
+		trace_fd = -1;
+	}
+
+	g_clear_pointer (&stats_path, g_free);
+}
+
+/* Returns NULL unless statistics or tracing are enabled.  Stats live as
+ * long as the type they were made for, that is for the whole session.
+ */
+NemoPythonStats *
+nemo_python_stats_new (const gchar *type_name)
+{
+	NemoPythonStats *stats;
+
+	if (all_stats == NULL)
+		return NULL;
+
+	stats = g_new0 (NemoPythonStats, 1);
+	stats->type_name = g_strdup (type_name);
+
+	g_mutex_lock (&stats_lock);
+	g_ptr_array_add (all_stats, stats);
+	g_mutex_unlock (&stats_lock);
+
+	return stats;
+}
+
+gint64
+nemo_python_stats_begin (NemoPythonStats  *stats,
+						 NemoPythonMethod  method)
+{
+	NemoPythonMethodStats *method_stats;
+	gint64 start;
+
+	if (stats == NULL)
+		return 0;
+
+	start = g_get_monotonic_time ();
+	method_stats = &stats->methods[method];
+
+	g_mutex_lock (&stats_lock);
+	if (method_stats->running++ == 0)
+		method_stats->running_since = start;
+	g_mutex_unlock (&stats_lock);
+
+	if (trace_fd >= 0)
+		nemo_python_stats_trace ("nemo-python: begin %s.%s", stats->type_name,
+								 nemo_python_object_method_name (method));
+
+	return start;
+}
+
+void
+nemo_python_stats_end (NemoPythonStats  *stats,
+					   NemoPythonMethod  method,
+					   gint64            start)
+{
+	NemoPythonMethodStats *method_stats;
+	gint64 elapsed;
+	gboolean slow;
+
+	if (stats == NULL)
+		return;
+
+	elapsed = g_get_monotonic_time () - start;
+	method_stats = &stats->methods[method];
+	slow = elapsed >= slow_call_us;
+
+	g_mutex_lock (&stats_lock);
+	nemo_python_histogram_add (&method_stats->wall, elapsed);
+	method_stats->running--;
+	if (slow)
+		method_stats->slow_calls++;
+	stats_dirty = TRUE;
+	g_mutex_unlock (&stats_lock);
+
+	if (trace_fd >= 0)
+		nemo_python_stats_trace ("nemo-python: end %s.%s %" G_GINT64_FORMAT " us",
+								 stats->type_name,
+								 nemo_python_object_method_name (method),
+								 elapsed);
+
+	if (slow)
+		g_message ("nemo-python: %s.%s took %" G_GINT64_FORMAT " ms",
+				   stats->type_name, nemo_python_object_method_name (method),
+				   elapsed / 1000);
+}
+
+void
+nemo_python_stats_add_gil_wait (NemoPythonStats *stats,
+								gint64           start)
+{
+	gint64 elapsed;
+
+	if (stats == NULL)
+		return;
+
+	elapsed = g_get_monotonic_time () - start;
+
+	g_mutex_lock (&stats_lock);
+	nemo_python_histogram_add (&stats->gil_wait, elapsed);
+	stats_dirty = TRUE;
+	g_mutex_unlock (&stats_lock);
+}
@@ -0,0 +1,76 @@
+/* -*- Mode: C; indent-tabs-mode: t; c-basic-offset: 4; tab-width: 4 -*- */
+/*
+ *  Copyright (C) 2004,2005 Johan Dahlin
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2, or (at your option)
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#ifndef NEMO_PYTHON_STATS_H
+#define NEMO_PYTHON_STATS_H
+
+#include <glib.h>
+
+#include "nemo-python-object.h"
+
+G_BEGIN_DECLS
+
+/* bucket i counts calls of [2^(i-1), 2^i) ms, the first one those under
+ * 1 ms and the last one everything from 1 s up.
+ */
+#define NEMO_PYTHON_STATS_N_BUCKETS 12
+
+typedef struct {
+  guint64 count;
+  guint64 total_us;
+  guint64 max_us;
+  guint64 buckets[NEMO_PYTHON_STATS_N_BUCKETS];
+} NemoPythonHistogram;
+
+typedef struct {
+  NemoPythonHistogram wall;
+  guint64 slow_calls;
+
+  /* calls that haven't returned yet, and since when the oldest of them
+   * has been running
+   */
+  guint running;
+  gint64 running_since;
+} NemoPythonMethodStats;
+
+struct _NemoPythonStats {
+  gchar *type_name;
+  NemoPythonMethodStats methods[NEMO_PYTHON_N_METHODS];
+
+  /* how long calls into the extension waited for the GIL */
+  NemoPythonHistogram gil_wait;
+};
+
+void nemo_python_stats_init (void);
+void nemo_python_stats_shutdown (void);
+
+NemoPythonStats *nemo_python_stats_new (const gchar *type_name);
+
+gint64 nemo_python_stats_begin (NemoPythonStats  *stats,
+                                NemoPythonMethod  method);
+void nemo_python_stats_end (NemoPythonStats  *stats,
+                            NemoPythonMethod  method,
+                            gint64            start);
+
+void nemo_python_stats_add_gil_wait (NemoPythonStats *stats,
+                                     gint64           start);
+
+G_END_DECLS
+
+#endif /* NEMO_PYTHON_STATS_H */
@@ -26,9 +26,12 @@
 
 #include "nemo-python.h"
 #include "nemo-python-object.h"
+#include "nemo-python-stats.h"
 
 #include <libnemo-extension/nemo-extension-types.h>
 
+#include <glib/gstdio.h>
+
 PyTypeObject *_PyGtkWidget_Type;
 PyTypeObject *_PyNemoColumn_Type;
 PyTypeObject *_PyNemoColumnProvider_Type;
@@ -44,14 +47,32 @@ PyTypeObject *_PyNemoOperationHandle_Type;
 
 static const GDebugKey nemo_python_debug_keys[] = {
 	{"misc", NEMO_PYTHON_DEBUG_MISC},
+	{"stats", NEMO_PYTHON_DEBUG_STATS},
+	{"trace", NEMO_PYTHON_DEBUG_TRACE},
 };
 static const guint nemo_python_ndebug_keys = sizeof (nemo_python_debug_keys) / sizeof (GDebugKey);
 NemoPythonDebug nemo_python_debug;
 
-static gboolean nemo_python_init_python(void);
-
 static GArray *all_types = NULL;
 
+/* the main thread only holds the GIL while calling into an extension, so
+ * that threaded update_file_info calls can run meanwhile.
+ */
+static PyThreadState *main_thread_state = NULL;
+static gboolean python_initialized = FALSE;
+static gboolean python_init_failed = FALSE;
+
+/* Which classes of each extension file are providers, so that the next
+ * startup can register them without starting Python: an extension is then
+ * only imported the first time Nemo calls one of its providers.  A file is
+ * imported at startup again when its mtime or size changes.
+ */
+#define MANIFEST_GROUP "Manifest"
+#define MANIFEST_VERSION 1
+
+static GKeyFile *old_manifest = NULL;
+static GKeyFile *manifest = NULL;
+
 
 static inline gboolean 
 np_init_pygobject(void)
@@ -67,12 +88,30 @@ np_init_pygobject(void)
 }
 
 static void
+nemo_python_add_to_sys_path (const char *dirname)
+{
+	PyObject *sys_path, *py_path;
+
+	/* sys.path.insert(0, dirname) */
+	sys_path = PySys_GetObject("path");
+	py_path = PyUnicode_FromString(dirname);
+	if (PySequence_Contains(sys_path, py_path) == 0)
+		PyList_Insert(sys_path, 0, py_path);
+	Py_DECREF(py_path);
+}
+
+static gboolean
 nemo_python_load_file(GTypeModule *type_module, 
-						  const gchar *filename)
+					  const gchar *dirname,
+					  const gchar *filename,
+					  const gchar *path)
 {
 	PyObject *main_module, *main_locals, *locals, *key, *value;
 	PyObject *module;
+	NemoPythonClassInfo *info;
+	GPtrArray *classes;
 	GType gtype;
+	guint providers;
 	Py_ssize_t pos = 0;
 	
 	debug_enter_args("filename=%s", filename);
@@ -81,7 +120,7 @@ nemo_python_load_file(GTypeModule *type_module,
 	if (main_module == NULL)
 	{
 		g_warning("Could not get __main__.");
-		return;
+		return FALSE;
 	}
 	
 	main_locals = PyModule_GetDict(main_module);
@@ -89,14 +128,15 @@ nemo_python_load_file(GTypeModule *type_module,
 	if (!module)
 	{
 		PyErr_Print();
-		return;
+		return FALSE;
 	}
 	
 	locals = PyModule_GetDict(module);
+	classes = g_ptr_array_new ();
 	
 	while (PyDict_Next(locals, &pos, &key, &value))
 	{
-		if (!PyType_Check(value))
+		if (!PyType_Check(value) || !PyUnicode_Check(key))
 			continue;
 
 		if (PyObject_IsSubclass(value, (PyObject*)&PyNemoColumnProvider_Type) ||
@@ -105,12 +145,105 @@ nemo_python_load_file(GTypeModule *type_module,
 			PyObject_IsSubclass(value, (PyObject*)&PyNemoMenuProvider_Type) ||
 			PyObject_IsSubclass(value, (PyObject*)&PyNemoPropertyPageProvider_Type))
 		{
-			gtype = nemo_python_object_get_type(type_module, value);
+			gchar *providers_key, *name_key;
+
+			info = nemo_python_class_info_new (dirname, filename,
+											   PyUnicode_AsUTF8(key), value);
+			providers = nemo_python_object_get_providers (value);
+
+			gtype = nemo_python_object_register_type(type_module, info, providers);
 			g_array_append_val(all_types, gtype);
+
+			providers_key = g_strconcat (info->class_name, ".providers", NULL);
+			name_key = g_strconcat (info->class_name, ".type-name", NULL);
+			g_key_file_set_integer (manifest, path, providers_key, providers);
+			g_key_file_set_string (manifest, path, name_key, info->type_name);
+			g_ptr_array_add (classes, info->class_name);
+
+			g_free (providers_key);
+			g_free (name_key);
 		}
 	}
+
+	g_key_file_set_string_list (manifest, path, "classes",
+								(const gchar * const *) classes->pdata, classes->len);
+	g_ptr_array_free (classes, TRUE);
+	Py_DECREF(module);
 	
 	debug("Loaded python modules");
+
+	return TRUE;
+}
+
+/* Registers the classes the manifest lists for path, if it still matches
+ * the file.
+ */
+static gboolean
+nemo_python_load_manifest_entry (GTypeModule *type_module,
+								 const gchar *dirname,
+								 const gchar *filename,
+								 const gchar *path)
+{
+	gchar **classes, **keys;
+	gsize n_classes, i;
+
+	if (!g_key_file_has_group (old_manifest, path))
+		return FALSE;
+
+	classes = g_key_file_get_string_list (old_manifest, path, "classes", &n_classes, NULL);
+	if (classes == NULL)
+		return FALSE;
+
+	for (i = 0; i < n_classes; i++)
+	{
+		NemoPythonClassInfo *info;
+		gchar *providers_key, *name_key, *type_name;
+		GType gtype;
+		gint providers;
+
+		providers_key = g_strconcat (classes[i], ".providers", NULL);
+		name_key = g_strconcat (classes[i], ".type-name", NULL);
+		providers = g_key_file_get_integer (old_manifest, path, providers_key, NULL);
+		type_name = g_key_file_get_string (old_manifest, path, name_key, NULL);
+
+		if (type_name != NULL)
+		{
+			info = nemo_python_class_info_new (dirname, filename, classes[i], NULL);
+			g_free (info->type_name);
+			info->type_name = type_name;
+
+			gtype = nemo_python_object_register_type(type_module, info, providers);
+			g_array_append_val(all_types, gtype);
+		}
+
+		g_free (providers_key);
+		g_free (name_key);
+	}
+
+	/* carry the entry over as it is */
+	keys = g_key_file_get_keys (old_manifest, path, NULL, NULL);
+	for (i = 0; keys != NULL && keys[i] != NULL; i++)
+	{
+		gchar *value = g_key_file_get_value (old_manifest, path, keys[i], NULL);
+		g_key_file_set_value (manifest, path, keys[i], value);
+		g_free (value);
+	}
+
+	g_strfreev (keys);
+	g_strfreev (classes);
+
+	debug_enter_args("registered %s from the manifest", filename);
+
+	return TRUE;
+}
+
+static gboolean
+nemo_python_manifest_entry_is_valid (const gchar *path,
+									 GStatBuf    *buf)
+{
+	return g_key_file_has_group (old_manifest, path) &&
+		g_key_file_get_int64 (old_manifest, path, "mtime", NULL) == (gint64) buf->st_mtime &&
+		g_key_file_get_int64 (old_manifest, path, "size", NULL) == (gint64) buf->st_size;
 }
 
 static void
@@ -119,7 +252,6 @@ nemo_python_load_dir (GTypeModule *module,
 {
 	GDir *dir;
 	const char *name;
-	gboolean initialized = FALSE;
 
 	debug_enter_args("dirname=%s", dirname);
 	
@@ -131,33 +263,53 @@ nemo_python_load_dir (GTypeModule *module,
 	{
 		if (g_str_has_suffix(name, ".py"))
 		{
-			char *modulename;
+			char *modulename, *path;
+			PyGILState_STATE state;
+			GStatBuf buf;
 			int len;
 
 			len = strlen(name) - 3;
 			modulename = g_new0(char, len + 1 );
 			strncpy(modulename, name, len);
 
-			if (!initialized)
+			path = g_build_filename(dirname, name, NULL);
+
+			if (g_stat(path, &buf) == 0 &&
+				nemo_python_manifest_entry_is_valid(path, &buf) &&
+				nemo_python_load_manifest_entry(module, dirname, modulename, path))
+			{
+				g_free (path);
+				g_free (modulename);
+				continue;
+			}
+
+			/* n-p python part is initialized on demand (or not
+			* at all if no extensions are found) */
+			if (!nemo_python_init_python())
+			{
+				g_warning("nemo_python_init_python failed");
+				g_free (path);
+				g_free (modulename);
+				break;
+			}
+
+			state = pyg_gil_state_ensure();
+			nemo_python_add_to_sys_path(dirname);
+
+			/* an extension failing to load is tried again next time */
+			if (nemo_python_load_file(module, dirname, modulename, path))
+			{
+				g_key_file_set_int64 (manifest, path, "mtime", buf.st_mtime);
+				g_key_file_set_int64 (manifest, path, "size", buf.st_size);
+			}
+			else
 			{
-				PyObject *sys_path, *py_path;
-				
-				/* n-p python part is initialized on demand (or not
-				* at all if no extensions are found) */
-				if (!nemo_python_init_python())
-				{
-					g_warning("nemo_python_init_python failed");
-					break;
-				}
-				
-				/* sys.path.insert(0, dirname) */
-				sys_path = PySys_GetObject("path");
-				py_path = PyUnicode_FromString(dirname);
-				PyList_Insert(sys_path, 0, py_path);
-				Py_DECREF(py_path);
+				g_key_file_remove_group (manifest, path, NULL);
 			}
-			nemo_python_load_file(module, modulename);
 
+			pyg_gil_state_release(state);
+
+            g_free (path);
             g_free (modulename);
 		}
 	}
@@ -165,16 +317,20 @@ nemo_python_load_dir (GTypeModule *module,
     g_dir_close (dir);
 }
 
-static gboolean
+gboolean
 nemo_python_init_python (void)
 {
 	PyObject *nemo;
 	GModule *libpython;
     wchar_t *argv[] = { L"nemo", NULL };
 
-	if (Py_IsInitialized())
+	if (python_initialized)
 		return TRUE;
 
+	/* a half initialized interpreter is not tried again */
+	if (python_init_failed)
+		return FALSE;
+
   	debug("g_module_open " PYTHON_LIBPATH);
 	libpython = g_module_open(PYTHON_LIBPATH, 0);
 	if (!libpython)
@@ -185,7 +341,7 @@ nemo_python_init_python (void)
 	if (PyErr_Occurred())
 	{
 		PyErr_Print();
-		return FALSE;
+		goto failed;
 	}
 	
 	debug("PySys_SetArgv");
@@ -193,7 +349,7 @@ nemo_python_init_python (void)
 	if (PyErr_Occurred())
 	{
 		PyErr_Print();
-		return FALSE;
+		goto failed;
 	}
 	
 	debug("Sanitize the python search path");
@@ -201,7 +357,7 @@ nemo_python_init_python (void)
 	if (PyErr_Occurred())
 	{
 		PyErr_Print();
-		return FALSE;
+		goto failed;
 	}
 
 	/* import gobject */
@@ -209,7 +365,7 @@ nemo_python_init_python (void)
 	if (!np_init_pygobject())
 	{
 		g_warning("pygobject initialization failed");
-		return FALSE;
+		goto failed;
 	}
 	
 	/* import nemo */
@@ -220,7 +376,7 @@ nemo_python_init_python (void)
 	if (!nemo)
 	{
 		PyErr_Print();
-		return FALSE;
+		goto failed;
 	}
 
 	_PyGtkWidget_Type = pygobject_lookup_class(GTK_TYPE_WIDGET);
@@ -230,7 +386,7 @@ nemo_python_init_python (void)
     _PyNemo##x##_Type = (PyTypeObject *)PyObject_GetAttrString(nemo, y); \
 	if (_PyNemo##x##_Type == NULL) { \
 		PyErr_Print(); \
-		return FALSE; \
+		goto failed; \
 	}
 
 	IMPORT(Column, "Column");
@@ -246,8 +402,113 @@ nemo_python_init_python (void)
 	IMPORT(OperationHandle, "OperationHandle");
 
 #undef IMPORT
-	
+
+	python_initialized = TRUE;
+	main_thread_state = PyEval_SaveThread();
+
 	return TRUE;
+
+ failed:
+	python_init_failed = TRUE;
+
+	/* Py_Finalize() still needs it at shutdown, but nothing else may use
+	 * it; let go of the GIL like the success path does */
+	if (Py_IsInitialized())
+		main_thread_state = PyEval_SaveThread();
+
+	return FALSE;
+}
+
+/* Imports an extension registered from the manifest; called with the GIL
+ * held.
+ */
+PyObject *
+nemo_python_import_class (const gchar *dirname,
+						  const gchar *module_name,
+						  const gchar *class_name)
+{
+	PyObject *main_module, *main_locals, *module, *type;
+	gint64 start = g_get_monotonic_time ();
+
+	debug_enter_args("module=%s", module_name);
+
+	nemo_python_add_to_sys_path(dirname);
+
+	main_module = PyImport_AddModule("__main__");
+	if (main_module == NULL)
+		return NULL;
+
+	main_locals = PyModule_GetDict(main_module);
+	module = PyImport_ImportModuleEx((char *) module_name, main_locals, main_locals, NULL);
+	if (module == NULL)
+		return NULL;
+
+	type = PyObject_GetAttrString(module, class_name);
+	Py_DECREF(module);
+
+	if (type != NULL && !PyType_Check(type))
+	{
+		PyErr_Format(PyExc_TypeError, "%s.%s is not a class", module_name, class_name);
+		Py_CLEAR(type);
+	}
+
+	debug_args("imported %s in %" G_GINT64_FORMAT " us", module_name,
+			   g_get_monotonic_time () - start);
+
+	return type;
+}
+
+static gchar *
+nemo_python_get_manifest_path (void)
+{
+	return g_build_filename(g_get_user_cache_dir(), "nemo-python", "manifest", NULL);
+}
+
+static void
+nemo_python_read_manifest (void)
+{
+	gchar *path = nemo_python_get_manifest_path ();
+
+	old_manifest = g_key_file_new ();
+	manifest = g_key_file_new ();
+
+	if (!g_key_file_load_from_file (old_manifest, path, G_KEY_FILE_NONE, NULL) ||
+		g_key_file_get_integer (old_manifest, MANIFEST_GROUP, "version", NULL) != MANIFEST_VERSION)
+	{
+		g_key_file_free (old_manifest);
+		old_manifest = g_key_file_new ();
+	}
+
+	g_key_file_set_integer (manifest, MANIFEST_GROUP, "version", MANIFEST_VERSION);
+
+	g_free (path);
+}
+
+static void
+nemo_python_write_manifest (void)
+{
+	gchar *path, *dir, *old_data, *data;
+
+	old_data = g_key_file_to_data (old_manifest, NULL, NULL);
+	data = g_key_file_to_data (manifest, NULL, NULL);
+
+	if (g_strcmp0 (old_data, data) != 0)
+	{
+		path = nemo_python_get_manifest_path ();
+		dir = g_path_get_dirname (path);
+
+		g_mkdir_with_parents (dir, 0700);
+		g_file_set_contents (path, data, -1, NULL);
+
+		g_free (dir);
+		g_free (path);
+	}
+
+	g_free (old_data);
+	g_free (data);
+
+	g_clear_pointer (&old_manifest, g_key_file_free);
+	g_clear_pointer (&manifest, g_key_file_free);
 }
 
 void
@@ -255,6 +516,7 @@ nemo_module_initialize(GTypeModule *module)
 {
 	gchar *user_extensions_dir;
 	const gchar *env_string;
+	gint64 start = g_get_monotonic_time ();
 
 	env_string = g_getenv("NEMO_PYTHON_DEBUG");
 	if (env_string != NULL)
@@ -267,8 +529,12 @@ nemo_module_initialize(GTypeModule *module)
 	
 	debug_enter();
 
+	nemo_python_stats_init();
+
 	all_types = g_array_new(FALSE, FALSE, sizeof(GType));
 
+	nemo_python_read_manifest();
+
 	// Look in the new global path, $DATADIR/nemo-python/extensions
 	nemo_python_load_dir(module, PYTHON_EXTENSION_DIR);
 
@@ -278,6 +544,12 @@ nemo_module_initialize(GTypeModule *module)
 	nemo_python_load_dir(module, user_extensions_dir);
 
     g_free (user_extensions_dir);
+
+	nemo_python_write_manifest();
+
+	debug_args("registered %u extension types in %" G_GINT64_FORMAT " us, python %s",
+			   all_types->len, g_get_monotonic_time () - start,
+			   python_initialized ? "started" : "not started");
 }
  
 void
@@ -285,8 +557,15 @@ nemo_module_shutdown(void)
 {
 	debug_enter();
 
-	if (Py_IsInitialized())
+	/* set whenever Python was started, even if that failed halfway */
+	if (main_thread_state != NULL)
+	{
+		PyEval_RestoreThread(main_thread_state);
+		nemo_python_object_shutdown();
 		Py_Finalize();
+	}
+
+	nemo_python_stats_shutdown();
 
 	g_array_free(all_types, TRUE);
 }
@@ -26,6 +26,8 @@
 
 typedef enum {
     NEMO_PYTHON_DEBUG_MISC = 1 << 0,
+    NEMO_PYTHON_DEBUG_STATS = 1 << 1,
+    NEMO_PYTHON_DEBUG_TRACE = 1 << 2,
 } NemoPythonDebug;
 
 extern NemoPythonDebug nemo_python_debug;
@@ -36,6 +38,8 @@ extern NemoPythonDebug nemo_python_debug;
                              g_printf("%s: entered\n", __FUNCTION__); }
 #define debug_enter_args(x, y) { if (nemo_python_debug & NEMO_PYTHON_DEBUG_MISC) \
                                      g_printf("%s: entered " x "\n", __FUNCTION__, y); }
+#define debug_args(x, ...) { if (nemo_python_debug & NEMO_PYTHON_DEBUG_MISC) \
+                                 g_printf("nemo-python: " x "\n", __VA_ARGS__); }
 
 extern PyTypeObject *_PyGtkWidget_Type;
 #define PyGtkWidget_Type (*_PyGtkWidget_Type)
@@ -73,4 +77,10 @@ extern PyTypeObject *_PyNemoPropertyPageProvider_Type;
 extern PyTypeObject *_PyNemoOperationHandle_Type;
 #define PyNemoOperationHandle_Type (*_PyNemoOperationHandle_Type)
 
+gboolean nemo_python_init_python (void);
+
+PyObject *nemo_python_import_class (const gchar *dirname,
+                                    const gchar *module_name,
+                                    const gchar *class_name);
+
 #endif /* NEMO_PYTHON_H */
@@ -1095,6 +1095,47 @@ nemo_share_update_file_info (NemoInfoProvider *provider,
 }
 
 
+/* Called when a refresh of the share list, e.g. after another program or the
+ * "Sharing Options" dialog changed the usershares, finds shares that changed.
+ * The share status was answered from the previous snapshot, so ask Nemo to
+ * query the affected folders again.
+ */
+static void
+shares_changed_cb (GSList *changed_shares, gpointer user_data)
+{
+  GSList *l;
+
+  for (l = changed_shares; l; l = l->next)
+    {
+      ShareInfo *info;
+      GFile *location;
+      NemoFileInfo *file;
+      char *uri;
+
+      info = l->data;
+
+      location = g_file_new_for_path (info->path);
+      file = nemo_file_info_lookup (location);
+      g_object_unref (location);
+
+      if (file)
+	{
+	  nemo_file_info_invalidate_extension_info (file);
+	  g_object_unref (file);
+	}
+
+      uri = g_strconcat (NETWORK_SHARE_PREFIX, info->share_name, NULL);
+      file = nemo_file_info_lookup_for_uri (uri);
+      g_free (uri);
+
+      if (file)
+	{
+	  nemo_file_info_invalidate_extension_info (file);
+	  g_object_unref (file);
+	}
+    }
+}
+
 static void
 nemo_share_cancel_update (NemoInfoProvider *provider,
 			      NemoOperationHandle *handle)
@@ -1395,6 +1436,8 @@ nemo_module_initialize (GTypeModule  *module)
   bind_textdomain_codeset("nemo-extensions", "UTF-8");
 
   nemo_share_register_type (module);
+
+  shares_set_changed_func (shares_changed_cb, NULL);
 }
 
 /* Perform module-specific shutdown. */
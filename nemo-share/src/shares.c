@@ -4,6 +4,7 @@
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <glib/gi18n-lib.h>
+#include <gio/gio.h>
 #include "shares.h"
 
 #undef DEBUG_SHARES
@@ -16,10 +17,27 @@
 static GHashTable *path_share_info_hash;
 static GHashTable *share_name_share_info_hash;
 
-#define NUM_CALLS_BETWEEN_TIMESTAMP_UPDATES 100
+/* The hashes above are the last good snapshot of "net usershare info".
+ * Queries are always answered from it; when the usershare directory changes
+ * it is marked stale and a single asynchronous refresh is started, with any
+ * further requests coalesced into one follow-up run.  Without a directory
+ * monitor we fall back to refreshing after TIMESTAMP_THRESHOLD seconds.
+ */
 #define TIMESTAMP_THRESHOLD 10	/* seconds */
-static int refresh_timestamp_update_counter;
+#define DEFAULT_USERSHARE_PATH "/var/lib/samba/usershares"
 static time_t refresh_timestamp;
+static gboolean snapshot_valid;
+static gboolean snapshot_stale = TRUE;
+static guint snapshot_serial;
+static guint refresh_serial;
+static gboolean refresh_in_flight;
+static gboolean refresh_queued;
+static GError *last_refresh_error;
+static gboolean monitor_started;
+static GFileMonitor *usershare_monitor;
+
+static SharesChangedFunc changed_func;
+static gpointer changed_func_data;
 
 #define KEY_PATH "path"
 #define KEY_COMMENT "comment"
@@ -38,28 +56,15 @@ static gboolean throw_error_on_remove;
 
 /* Interface to "net usershare" */
 
-static gboolean
-net_usershare_run (int argc, char **argv, GKeyFile **ret_key_file, GError **error)
+static char **
+net_usershare_build_argv (int argc, char **argv)
 {
 	int real_argc;
 	int i;
 	char **real_argv;
-	gboolean retval;
-	char *stdout_contents;
-	char *stderr_contents;
-	int exit_status;
-	int exit_code;
-	GKeyFile *key_file;
-	GError *real_error;
 
 	g_assert (argc > 0);
 	g_assert (argv != NULL);
-	g_assert (error == NULL || *error == NULL);
-
-	if (ret_key_file)
-		*ret_key_file = NULL;
-
-	/* Build command line */
 
 	real_argc = 2 + argc + 1; /* "net" "usershare" [argv] NULL */
 	real_argv = g_new (char *, real_argc);
@@ -74,44 +79,29 @@ net_usershare_run (int argc, char **argv, GKeyFile **ret_key_file, GError **erro
 
 	real_argv[real_argc - 1] = NULL;
 
-	/* Launch */
-
-	stdout_contents = NULL;
-	stderr_contents = NULL;
-	/*
-	{
-		char **p;
-
-		g_message ("------------------------------------------");
-
-		for (p = real_argv; *p; p++)
-			g_message ("spawn arg \"%s\"", *p);
-
-		g_message ("end of spawn args; SPAWNING\n");
-	}
-	*/
-	real_error = NULL;
-	retval = g_spawn_sync (NULL,			/* cwd */
-			       real_argv,
-			       NULL, 			/* envp */
-			       G_SPAWN_SEARCH_PATH,
-			       NULL, 			/* GSpawnChildSetupFunc */
-			       NULL,			/* user_data */
-			       &stdout_contents,
-			       &stderr_contents,
-			       &exit_status,
-			       &real_error);
+	return real_argv;
+}
 
-	/* g_message ("returned from spawn: %s: %s", retval ? "SUCCESS" : "FAIL", retval ? "" : real_error->message); */
+/* Interprets the wait status and output of a finished "net usershare"
+ * process; shared by the synchronous and the asynchronous callers.
+ */
+static gboolean
+net_usershare_parse_result (char **real_argv,
+			    int exit_status,
+			    const char *stdout_contents,
+			    const char *stderr_contents,
+			    GKeyFile **ret_key_file,
+			    GError **error)
+{
+	int exit_code;
+	GKeyFile *key_file;
+	GError *real_error;
 
-	if (!retval) {
-		g_propagate_error (error, real_error);
-		goto out;
-	}
+	if (ret_key_file)
+		*ret_key_file = NULL;
 
 	if (!WIFEXITED (exit_status)) {
 		g_message ("WIFEXITED(%d) was false!", exit_status);
-		retval = FALSE;
 
 		if (WIFSIGNALED (exit_status)) {
 			int signal_num;
@@ -136,7 +126,7 @@ net_usershare_run (int argc, char **argv, GKeyFile **ret_key_file, GError **erro
 				     real_argv[1],
 				     real_argv[2]);
 
-		goto out;
+		return FALSE;
 	}
 
 	exit_code = WEXITSTATUS (exit_status);
@@ -165,49 +155,100 @@ net_usershare_run (int argc, char **argv, GKeyFile **ret_key_file, GError **erro
 
 		g_free (message);
 
-		retval = FALSE;
-		goto out;
+		return FALSE;
 	}
 
-	if (ret_key_file) {
-	  /* g_message ("caller wants GKeyFile"); */
+	if (!ret_key_file)
+		return TRUE;
 
-		*ret_key_file = NULL;
+	/* g_message ("caller wants GKeyFile"); */
 
-		/* FIXME: jeallison@novell.com says the output of "net usershare" is nearly always
-		 * in UTF-8, but that it can be configured in the master smb.conf.  We assume
-		 * UTF-8 for now.
-		 */
+	/* FIXME: jeallison@novell.com says the output of "net usershare" is nearly always
+	 * in UTF-8, but that it can be configured in the master smb.conf.  We assume
+	 * UTF-8 for now.
+	 */
 
-		if (!g_utf8_validate (stdout_contents, -1, NULL)) {
-			g_message ("stdout of net usershare was not in valid UTF-8");
-			g_set_error (error,
-				     G_SPAWN_ERROR,
-				     G_SPAWN_ERROR_FAILED,
-				     _("the output of 'net usershare' is not in valid UTF-8 encoding"));
-			retval = FALSE;
-			goto out;
-		}
+	if (!g_utf8_validate (stdout_contents, -1, NULL)) {
+		g_message ("stdout of net usershare was not in valid UTF-8");
+		g_set_error (error,
+			     G_SPAWN_ERROR,
+			     G_SPAWN_ERROR_FAILED,
+			     _("the output of 'net usershare' is not in valid UTF-8 encoding"));
+		return FALSE;
+	}
 
-		key_file = g_key_file_new ();
+	key_file = g_key_file_new ();
 
-		real_error = NULL;
-		if (!g_key_file_load_from_data (key_file, stdout_contents, -1, 0, &real_error)) {
-			g_message ("Error when parsing key file {\n%s\n}: %s", stdout_contents, real_error->message);
-			g_propagate_error (error, real_error);
-			g_key_file_free (key_file);
-			retval = FALSE;
-			goto out;
-		}
+	real_error = NULL;
+	if (!g_key_file_load_from_data (key_file, stdout_contents, -1, 0, &real_error)) {
+		g_message ("Error when parsing key file {\n%s\n}: %s", stdout_contents, real_error->message);
+		g_propagate_error (error, real_error);
+		g_key_file_free (key_file);
+		return FALSE;
+	}
 
-		retval = TRUE;
-		*ret_key_file = key_file;
-	} else
-		retval = TRUE;
+	*ret_key_file = key_file;
 
 	/* g_message ("success from calling net usershare and parsing its output"); */
 
- out:
+	return TRUE;
+}
+
+static gboolean
+net_usershare_run (int argc, char **argv, GKeyFile **ret_key_file, GError **error)
+{
+	char **real_argv;
+	gboolean retval;
+	char *stdout_contents;
+	char *stderr_contents;
+	int exit_status;
+
+	g_assert (error == NULL || *error == NULL);
+
+	if (ret_key_file)
+		*ret_key_file = NULL;
+
+	/* Build command line */
+
+	real_argv = net_usershare_build_argv (argc, argv);
+
+	/* Launch */
+
+	stdout_contents = NULL;
+	stderr_contents = NULL;
+	/*
+	{
+		char **p;
+
+		g_message ("------------------------------------------");
+
+		for (p = real_argv; *p; p++)
+			g_message ("spawn arg \"%s\"", *p);
+
+		g_message ("end of spawn args; SPAWNING\n");
+	}
+	*/
+	retval = g_spawn_sync (NULL,			/* cwd */
+			       real_argv,
+			       NULL, 			/* envp */
+			       G_SPAWN_SEARCH_PATH,
+			       NULL, 			/* GSpawnChildSetupFunc */
+			       NULL,			/* user_data */
+			       &stdout_contents,
+			       &stderr_contents,
+			       &exit_status,
+			       error);
+
+	/* g_message ("returned from spawn: %s", retval ? "SUCCESS" : "FAIL"); */
+
+	if (retval)
+		retval = net_usershare_parse_result (real_argv,
+						     exit_status,
+						     stdout_contents,
+						     stderr_contents,
+						     ret_key_file,
+						     error);
+
 	g_free (real_argv);
 	g_free (stdout_contents);
 	g_free (stderr_contents);
@@ -217,7 +258,7 @@ net_usershare_run (int argc, char **argv, GKeyFile **ret_key_file, GError **erro
 	return retval;
 }
 
-
+
 
 /* Internals */
 
@@ -286,11 +327,12 @@ remove_from_share_name_hash_cb (gpointer key,
 }
 
 static void
-free_all_shares (void)
+free_share_hashes (GHashTable *path_hash, GHashTable *share_name_hash)
 {
-	ensure_hashes ();
-	g_hash_table_foreach_remove (path_share_info_hash, remove_from_path_hash_cb, NULL);
-	g_hash_table_foreach_remove (share_name_share_info_hash, remove_from_share_name_hash_cb, NULL);
+	g_hash_table_foreach_remove (path_hash, remove_from_path_hash_cb, NULL);
+	g_hash_table_foreach_remove (share_name_hash, remove_from_share_name_hash_cb, NULL);
+	g_hash_table_destroy (path_hash);
+	g_hash_table_destroy (share_name_hash);
 }
 
 static char *
@@ -426,6 +468,84 @@ replace_shares_from_key_file (GKeyFile *key_file)
 	g_strfreev (group_names);
 }
 
+static gboolean
+share_info_equal (ShareInfo *a, ShareInfo *b)
+{
+	return (strcmp (a->share_name, b->share_name) == 0
+		&& g_strcmp0 (a->comment, b->comment) == 0
+		&& a->is_writable == b->is_writable
+		&& a->guest_ok == b->guest_ok);
+}
+
+/* Returns the shares which were added, removed or modified between two
+ * snapshots.  The list does not own its elements.
+ */
+static GSList *
+diff_share_hashes (GHashTable *old_path_hash, GHashTable *new_path_hash)
+{
+	GHashTableIter iter;
+	gpointer value;
+	GSList *changed;
+
+	changed = NULL;
+
+	g_hash_table_iter_init (&iter, new_path_hash);
+	while (g_hash_table_iter_next (&iter, NULL, &value)) {
+		ShareInfo *info;
+		ShareInfo *old_info;
+
+		info = value;
+		old_info = g_hash_table_lookup (old_path_hash, info->path);
+		if (!old_info || !share_info_equal (old_info, info))
+			changed = g_slist_prepend (changed, info);
+	}
+
+	g_hash_table_iter_init (&iter, old_path_hash);
+	while (g_hash_table_iter_next (&iter, NULL, &value)) {
+		ShareInfo *old_info;
+
+		old_info = value;
+		if (!g_hash_table_lookup (new_path_hash, old_info->path))
+			changed = g_slist_prepend (changed, old_info);
+	}
+
+	return changed;
+}
+
+/* Replaces the current snapshot with the shares in @key_file, and tells the
+ * listener which shares changed.  Snapshots are built off to the side, so a
+ * failed refresh never disturbs the last good one.
+ */
+static void
+apply_snapshot (GKeyFile *key_file, guint serial)
+{
+	GHashTable *old_path_hash;
+	GHashTable *old_share_name_hash;
+	GSList *changed;
+
+	ensure_hashes ();
+
+	old_path_hash = path_share_info_hash;
+	old_share_name_hash = share_name_share_info_hash;
+
+	path_share_info_hash = g_hash_table_new (g_str_hash, g_str_equal);
+	share_name_share_info_hash = g_hash_table_new (g_str_hash, g_str_equal);
+
+	replace_shares_from_key_file (key_file);
+
+	snapshot_valid = TRUE;
+	snapshot_serial = serial;
+	refresh_timestamp = time (NULL);
+	g_clear_error (&last_refresh_error);
+
+	changed = diff_share_hashes (old_path_hash, path_share_info_hash);
+	if (changed && changed_func)
+		changed_func (changed, changed_func_data);
+
+	g_slist_free (changed);
+	free_share_hashes (old_path_hash, old_share_name_hash);
+}
+
 static gboolean
 refresh_shares (GError **error)
 {
@@ -433,8 +553,6 @@ refresh_shares (GError **error)
 	char *argv[1];
 	GError *real_error;
 
-	free_all_shares ();
-
 	if (throw_error_on_refresh) {
 		g_set_error (error,
 			     SHARES_ERROR,
@@ -454,36 +572,279 @@ refresh_shares (GError **error)
 
 	g_assert (key_file != NULL);
 
-	replace_shares_from_key_file (key_file);
+	apply_snapshot (key_file, ++refresh_serial);
+	snapshot_stale = FALSE;
 	g_key_file_free (key_file);
 
 	return TRUE;
 }
 
-static gboolean
-refresh_if_needed (GError **error)
+static void start_async_refresh (void);
+
+static void
+async_refresh_finished (void)
 {
-	gboolean retval;
+	refresh_in_flight = FALSE;
 
-	if (refresh_timestamp_update_counter == 0) {
-		time_t new_timestamp;
+	if (refresh_queued) {
+		refresh_queued = FALSE;
+		start_async_refresh ();
+	}
+}
 
-		refresh_timestamp_update_counter = NUM_CALLS_BETWEEN_TIMESTAMP_UPDATES;
+static void
+usershare_info_done_cb (GObject *source, GAsyncResult *result, gpointer user_data)
+{
+	GSubprocess *subprocess;
+	guint serial;
+	GBytes *stdout_bytes;
+	GBytes *stderr_bytes;
+	char *stdout_contents;
+	char *stderr_contents;
+	char *argv[1];
+	char **real_argv;
+	GKeyFile *key_file;
+	GError *error;
 
-		new_timestamp = time (NULL);
-		if (new_timestamp - refresh_timestamp > TIMESTAMP_THRESHOLD) {
-		  /* g_message ("REFRESHING SHARES"); */
-			retval = refresh_shares (error);
-		} else
-			retval = TRUE;
+	subprocess = G_SUBPROCESS (source);
+	serial = GPOINTER_TO_UINT (user_data);
+
+	stdout_contents = NULL;
+	stderr_contents = NULL;
+	key_file = NULL;
+
+	argv[0] = "info";
+	real_argv = net_usershare_build_argv (G_N_ELEMENTS (argv), argv);
 
-		refresh_timestamp = new_timestamp;
+	error = NULL;
+	if (g_subprocess_communicate_finish (subprocess, result, &stdout_bytes, &stderr_bytes, &error)) {
+		stdout_contents = g_strndup (g_bytes_get_data (stdout_bytes, NULL), g_bytes_get_size (stdout_bytes));
+		stderr_contents = g_strndup (g_bytes_get_data (stderr_bytes, NULL), g_bytes_get_size (stderr_bytes));
+		g_bytes_unref (stdout_bytes);
+		g_bytes_unref (stderr_bytes);
+
+		net_usershare_parse_result (real_argv,
+					    g_subprocess_get_status (subprocess),
+					    stdout_contents,
+					    stderr_contents,
+					    &key_file,
+					    &error);
+	}
+
+	if (key_file) {
+		/* A local add/remove, or a synchronous refresh, may have
+		 * landed while we were running; its result is newer than ours.
+		 */
+		if (serial > snapshot_serial) {
+			apply_snapshot (key_file, serial);
+			snapshot_stale = refresh_queued;
+		}
+
+		g_key_file_free (key_file);
 	} else {
-		refresh_timestamp_update_counter--;
-		retval = TRUE;
+		g_message ("Called \"net usershare info\" but it failed: %s", error->message);
+		g_clear_error (&last_refresh_error);
+		last_refresh_error = error;
+
+		/* Keep serving the last good snapshot, but let the next
+		 * query try again.
+		 */
+		snapshot_stale = TRUE;
+		refresh_timestamp = time (NULL);
 	}
 
-	return retval;
+	g_free (real_argv);
+	g_free (stdout_contents);
+	g_free (stderr_contents);
+	g_object_unref (subprocess);
+
+	async_refresh_finished ();
+}
+
+static void
+start_usershare_info (void)
+{
+	char *argv[1];
+	char **real_argv;
+	GSubprocess *subprocess;
+	GError *error;
+
+	if (throw_error_on_refresh) {
+		g_clear_error (&last_refresh_error);
+		g_set_error (&last_refresh_error,
+			     SHARES_ERROR,
+			     SHARES_ERROR_FAILED,
+			     _("Failed"));
+		async_refresh_finished ();
+		return;
+	}
+
+	argv[0] = "info";
+	real_argv = net_usershare_build_argv (G_N_ELEMENTS (argv), argv);
+
+	error = NULL;
+	subprocess = g_subprocess_newv ((const char * const *) real_argv,
+					G_SUBPROCESS_FLAGS_STDOUT_PIPE | G_SUBPROCESS_FLAGS_STDERR_PIPE,
+					&error);
+	g_free (real_argv);
+
+	if (!subprocess) {
+		g_message ("Could not run \"net usershare info\": %s", error->message);
+		g_clear_error (&last_refresh_error);
+		last_refresh_error = error;
+		refresh_timestamp = time (NULL);
+		async_refresh_finished ();
+		return;
+	}
+
+	g_subprocess_communicate_async (subprocess,
+					NULL,
+					NULL,
+					usershare_info_done_cb,
+					GUINT_TO_POINTER (++refresh_serial));
+}
+
+static void
+usershare_dir_changed_cb (GFileMonitor *monitor,
+			  GFile *file,
+			  GFile *other_file,
+			  GFileMonitorEvent event_type,
+			  gpointer user_data)
+{
+	switch (event_type) {
+	case G_FILE_MONITOR_EVENT_CHANGES_DONE_HINT:
+	case G_FILE_MONITOR_EVENT_DELETED:
+	case G_FILE_MONITOR_EVENT_CREATED:
+		/* Refresh eagerly, so that emblems update even if nobody
+		 * asks again.
+		 */
+		snapshot_stale = TRUE;
+		start_async_refresh ();
+		break;
+
+	default:
+		break;
+	}
+}
+
+static void
+usershare_path_done_cb (GObject *source, GAsyncResult *result, gpointer user_data)
+{
+	GSubprocess *subprocess;
+	char *stdout_contents;
+	GFile *dir;
+	GError *error;
+
+	subprocess = G_SUBPROCESS (source);
+	stdout_contents = NULL;
+
+	error = NULL;
+	if (!g_subprocess_communicate_utf8_finish (subprocess, result, &stdout_contents, NULL, &error)) {
+		g_message ("Could not query the usershare path: %s", error->message);
+		g_error_free (error);
+	} else if (!g_subprocess_get_successful (subprocess)) {
+		g_free (stdout_contents);
+		stdout_contents = NULL;
+	}
+
+	if (stdout_contents)
+		g_strstrip (stdout_contents);
+
+	if (!stdout_contents || !stdout_contents[0]) {
+		g_free (stdout_contents);
+		stdout_contents = g_strdup (DEFAULT_USERSHARE_PATH);
+	}
+
+	dir = g_file_new_for_path (stdout_contents);
+
+	error = NULL;
+	usershare_monitor = g_file_monitor_directory (dir, G_FILE_MONITOR_NONE, NULL, &error);
+	if (usershare_monitor)
+		g_signal_connect (usershare_monitor, "changed",
+				  G_CALLBACK (usershare_dir_changed_cb), NULL);
+	else {
+		g_message ("Cannot monitor %s, falling back to periodic refreshes: %s",
+			   stdout_contents, error->message);
+		g_error_free (error);
+	}
+
+	g_object_unref (dir);
+	g_free (stdout_contents);
+	g_object_unref (subprocess);
+
+	start_usershare_info ();
+}
+
+static void
+start_async_refresh (void)
+{
+	GSubprocess *subprocess;
+
+	if (refresh_in_flight) {
+		refresh_queued = TRUE;
+		return;
+	}
+
+	refresh_in_flight = TRUE;
+
+	if (monitor_started) {
+		start_usershare_info ();
+		return;
+	}
+
+	/* The first refresh also finds out where Samba keeps the usershare
+	 * definitions, so that we can watch them instead of polling.
+	 */
+	monitor_started = TRUE;
+
+	subprocess = g_subprocess_new (G_SUBPROCESS_FLAGS_STDOUT_PIPE | G_SUBPROCESS_FLAGS_STDERR_SILENCE,
+				       NULL,
+				       "testparm", "-s", "--parameter-name=usershare path",
+				       NULL);
+	if (subprocess)
+		g_subprocess_communicate_utf8_async (subprocess, NULL, NULL, usershare_path_done_cb, NULL);
+	else
+		start_usershare_info ();
+}
+
+/* Used by the read-only queries: never blocks, it only kicks off a refresh
+ * in the background when the snapshot is out of date.
+ */
+static gboolean
+refresh_if_needed (GError **error)
+{
+	if (!snapshot_stale
+	    && !usershare_monitor
+	    && time (NULL) - refresh_timestamp > TIMESTAMP_THRESHOLD)
+		snapshot_stale = TRUE;
+
+	/* Back off after a failure, e.g. when Samba is not installed */
+	if (snapshot_stale
+	    && !refresh_in_flight
+	    && (!last_refresh_error || time (NULL) - refresh_timestamp > TIMESTAMP_THRESHOLD))
+		start_async_refresh ();
+
+	if (!snapshot_valid && last_refresh_error) {
+		g_propagate_error (error, g_error_copy (last_refresh_error));
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+/* Used before modifying shares, which need an up to date view */
+static gboolean
+refresh_if_stale (GError **error)
+{
+	if (!snapshot_stale
+	    && !usershare_monitor
+	    && time (NULL) - refresh_timestamp > TIMESTAMP_THRESHOLD)
+		snapshot_stale = TRUE;
+
+	if (!snapshot_stale && snapshot_valid)
+		return TRUE;
+
+	return refresh_shares (error);
 }
 
 static ShareInfo *
@@ -649,6 +1010,7 @@ add_share (ShareInfo *info, GError **error)
 
 	copy = copy_share_info (info);
 	add_share_info_to_hashes (copy);
+	snapshot_serial = ++refresh_serial;
 
 	/* g_message ("add_share() end SUCCESS"); */
 
@@ -702,6 +1064,7 @@ remove_share (const char *path, GError **error)
 
 	remove_share_info_from_hashes (old_info);
 	shares_free_share_info (old_info);
+	snapshot_serial = ++refresh_serial;
 
 	/* g_message ("remove_share() end SUCCESS"); */
 
@@ -935,7 +1298,7 @@ shares_modify_share (const char *old_path, ShareInfo *info, GError **error)
 		  || (old_path != NULL && info != NULL));
 	g_assert (error == NULL || *error == NULL);
 
-	if (!refresh_if_needed (error))
+	if (!refresh_if_stale (error))
 		return FALSE;
 
 	if (old_path == NULL)
@@ -984,6 +1347,7 @@ shares_get_share_info_list (GSList **ret_info_list, GError **error)
 	}
 
 	*ret_info_list = NULL;
+	ensure_hashes ();
 	g_hash_table_foreach (path_share_info_hash, copy_to_slist_cb, ret_info_list);
 
 	return TRUE;
@@ -1010,6 +1374,23 @@ shares_free_share_info_list (GSList *list)
 	g_slist_free (list);
 }
 
+/**
+ * shares_set_changed_func:
+ * @func: Function to call when shares change, or %NULL.
+ * @user_data: Data to pass to @func.
+ *
+ * Sets a function which gets called whenever a refresh of the shares finds that
+ * shares were added, removed or modified by somebody else.  It is passed a
+ * list of the affected #ShareInfo structures, which are only valid for the
+ * duration of the call.
+ **/
+void
+shares_set_changed_func (SharesChangedFunc func, gpointer user_data)
+{
+	changed_func = func;
+	changed_func_data = user_data;
+}
+
 void
 shares_set_debug (gboolean error_on_refresh,
 		  gboolean error_on_add,
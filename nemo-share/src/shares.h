@@ -39,6 +39,10 @@ void shares_free_share_info_list (GSList *list);
 gboolean shares_supports_guest_ok (gboolean *supports_guest_ok_ret, 
 				   GError **error);
 
+typedef void (* SharesChangedFunc) (GSList *changed_shares, gpointer user_data);
+
+void shares_set_changed_func (SharesChangedFunc func, gpointer user_data);
+
 void shares_set_debug (gboolean error_on_refresh,
 		       gboolean error_on_add,
 		       gboolean error_on_modify,